@@ -16,13 +16,15 @@ SOURCES += main.cpp\
     databasemagr.cpp \
     mainwindow.cpp \
     loginwidget.cpp \
-    clientsocket.cpp
+    clientsocket.cpp \
+    msglatency.cpp
 
 HEADERS  += \
     databasemagr.h \
     mainwindow.h \
     loginwidget.h \
-    clientsocket.h
+    clientsocket.h \
+    msglatency.h
 
 FORMS    += \
     mainwindow.ui \
@@ -10,11 +10,24 @@
 #include <QDataStream>
 #include <QApplication>
 #include <QDateTime>
+#include <QFileInfo>
+
+#include <string.h>
+
+// 文件上传中断后的重连次数，以及第一次重连的等待时间（之后逐次加长）
+#define FILE_RETRY_MAX      5
+#define FILE_RETRY_MS       2000
+// 不超过该大小的文件直接计算摘要，更大的每次事件循环算这么多
+#define FILE_HASH_TURN      (4 * 1024 * 1024)
+// 摘要缓存的条数上限，超过时清空
+#define FILE_HASH_CACHE     256
 
 ClientSocket::ClientSocket(QObject *parent) :
     QObject(parent)
 {
     m_nId = -1;
+    m_bCbor = false;
+    m_bRelay = false;
 
     m_tcpSocket = new QTcpSocket(this);
     m_heartbeatTimer = new QTimer(this);
@@ -36,6 +49,7 @@ ClientSocket::ClientSocket(QObject *parent) :
 ClientSocket::~ClientSocket()
 {
     SltSendOffline();
+    DumpLatency();
 }
 
 /**
@@ -115,16 +129,45 @@ void ClientSocket::SltSendMessage(const quint8 &type, const QJsonValue &dataVal)
     // 超时1s后还是连接不上，直接返回
     if (!m_tcpSocket->isOpen()) return;
 
-    // 构建 Json 对象
-    QJsonObject json;
-    json.insert("type", type);
-    json.insert("from", m_nId);
-    json.insert("data", dataVal);
+    // 登录时声明客户端支持的扩展能力
+    QJsonValue data = dataVal;
+    if (Login == type && dataVal.isObject()) {
+        QJsonObject dataObj = dataVal.toObject();
+        QJsonArray caps;
+        caps.append(QString(CAP_OFFLINE_BATCH));
+        caps.append(QString(CAP_CBOR));
+        caps.append(QString(CAP_RELAY));
+        dataObj.insert("caps", caps);
+        dataObj.insert("version", MY_VERSION);
+        data = dataObj;
+    }
+
+    MsgCodec::E_FORMAT format = m_bCbor ? MsgCodec::Cbor : MsgCodec::Json;
+
+    // 私聊消息用转发帧：服务器只读固定头，消息体原样转给接收者
+    if (m_bRelay && data.isObject() && (SendMsg == type || SendFile == type || SendPicture == type)) {
+        QJsonObject dataObj = data.toObject();
+        m_tcpSocket->write(FrameCodec::Pack(MsgCodec::PackRelay(type, dataObj.value("to").toInt(),
+                                                                dataObj.value("msgId").toInt(),
+                                                                MsgCodec::EncodeData(dataObj, format))));
+        m_latency.Sent(dataObj.value("msgId").toInt());
+        return;
+    }
 
-    // 构建 Json 文档
-    QJsonDocument document;
-    document.setObject(json);
-    m_tcpSocket->write(document.toJson(QJsonDocument::Compact));
+    m_tcpSocket->write(FrameCodec::Pack(MsgCodec::Encode(type, m_nId, data, format)));
+    // 私聊消息记录发送时间，收到 Ack 时计算耗时
+    if (SendMsg == type || SendFile == type || SendPicture == type) {
+        m_latency.Sent(data.toObject().value("msgId").toInt());
+    }
+}
+
+/**
+ * @brief ClientSocket::DumpLatency
+ */
+void ClientSocket::DumpLatency() const
+{
+    if (0 == m_latency.SampleCount()) return;
+    qDebug() << "session" << m_latency.Summary();
 }
 
 /**
@@ -145,6 +188,10 @@ void ClientSocket::SltSendOnline()
 void ClientSocket::SltDisconnected()
 {
     qDebug() << "has disconnecetd";
+    // 一次连接为一个会话，断开时输出统计
+    DumpLatency();
+    m_latency.Reset();
+    m_throttledQueries.clear();
     m_tcpSocket->abort();
     if (m_heartbeatTimer->isActive()) m_heartbeatTimer->stop();
     m_waitingPong = false;
@@ -163,6 +210,10 @@ void ClientSocket::SltDisconnected()
 void ClientSocket::SltConnected()
 {
     qDebug() << "has connecetd";
+    // 新连接，丢弃上一个连接残留的半帧，重新协商编码
+    m_frameCodec.Reset();
+    m_bCbor = false;
+    m_bRelay = false;
     if (!m_heartbeatTimer->isActive()) m_heartbeatTimer->start();
     // 连接成功后复位重连策略
     if (m_reconnectTimer->isActive()) m_reconnectTimer->stop();
@@ -175,142 +226,172 @@ void ClientSocket::SltConnected()
 
 /**
  * @brief ClientSocket::SltReadyRead
- * 服务器消息处理
+ * 服务器消息处理，一次读取可能包含多个帧
  */
 void ClientSocket::SltReadyRead()
 {
-    // 读取socket数据
-    QByteArray byRead = m_tcpSocket->readAll();
-    QJsonParseError jsonError;
-    // 转化为 JSON 文档
-    QJsonDocument doucment = QJsonDocument::fromJson(byRead, &jsonError);
-    // 解析未发生错误
-    if (!doucment.isNull() && (jsonError.error == QJsonParseError::NoError)) {
-        // JSON 文档为对象
-        if (doucment.isObject()) {
-            // 转化为对象
-            QJsonObject jsonObj = doucment.object();
-            QJsonValue dataVal = jsonObj.value("data");
-
-            int nType = jsonObj.value("type").toInt();
-
-            // 根据消息类型解析服务器消息
-            switch (nType) {
-            case Register:
-            {
-                ParseReister(dataVal);
-            }
-                break;
-            case Login:
-            {
-                ParseLogin(dataVal);
-            }
-                break;
-            case UserOnLine:
-            {
-                qDebug() << "user is oline" << dataVal;
-                Q_EMIT signalMessage(UserOnLine, dataVal);
-            }
-                break;
-            case UserOffLine:
-            {
-                qDebug() << "user is offline" << dataVal;
-                Q_EMIT signalMessage(UserOffLine, dataVal);
-            }
-                break;
-            case Logout:
-            {
-                m_tcpSocket->abort();
-            }
-                break;
-            case UpdateHeadPic:
-            {
-                Q_EMIT signalMessage(UpdateHeadPic, dataVal);
-            }
-                break;
-            case AddFriend:
-            {
-                Q_EMIT signalMessage(AddFriend, dataVal);
-            }
-                break;
-            case AddGroup:
-            {
-                Q_EMIT signalMessage(AddGroup, dataVal);
-            }
-                break;
-            case AddFriendRequist:
-            {
-                Q_EMIT signalMessage(AddFriendRequist, dataVal);
-            }
-                break;
-            case AddGroupRequist:
-            {
-                Q_EMIT signalMessage(AddGroupRequist, dataVal);
-            }
-                break;
-            case CreateGroup:
-            {
-                Q_EMIT signalMessage(CreateGroup, dataVal);
-            }
-                break;
-            case GetMyFriends:
-            {
-                Q_EMIT signalMessage(GetMyFriends, dataVal);
-            }
-                break;
-            case GetMyGroups:
-            {
-                Q_EMIT signalMessage(GetMyGroups, dataVal);
-            }
-                break;
-            case RefreshFriends:
-            {
-                Q_EMIT signalMessage(RefreshFriends, dataVal);
-            }
-                break;
-            case RefreshGroups:
-            {
-                Q_EMIT signalMessage(RefreshGroups, dataVal);
-            }
-                break;
-            case Ack:
-            {
-                Q_EMIT signalMessage(Ack, dataVal);
-            }
-                break;
-            case SendMsg:
-            {
-                Q_EMIT signalMessage(SendMsg, dataVal);
-            }
-                break;
-            case SendGroupMsg:
-            {
-                Q_EMIT signalMessage(SendGroupMsg, dataVal);
-            }
-                break;
-            case SendFile:
-            {
-                Q_EMIT signalMessage(SendFile, dataVal);
-            }
-                break;
-            case SendPicture:
-            {
-                Q_EMIT signalMessage(SendPicture, dataVal);
-            }
-                break;
-            case Pong:
-            {
-                // 心跳回应，保持安静或记录时间
-                qDebug() << "pong" << dataVal;
-                m_waitingPong = false;
-                m_missedPong = 0;
-            }
-                break;
-            default:
-                break;
+    m_frameCodec.Append(m_tcpSocket->readAll());
+
+    QByteArray frame;
+    while (m_frameCodec.TakeFrame(frame)) {
+        ParseFrame(frame);
+        if (!m_tcpSocket->isOpen()) return;
+    }
+
+    if (m_frameCodec.HasError()) {
+        qDebug() << "frame too large, reconnect";
+        m_tcpSocket->abort();
+    }
+}
+
+/**
+ * @brief ClientSocket::s_msgRoutes
+ * 服务器消息的分发表，常量初始化；界面自行处理的消息只校验后转发
+ */
+const ClientSocket::MsgRoute ClientSocket::s_msgRoutes[] = {
+    { Register,         &ClientSocket::Dispatch<RegisterReply,      &ClientSocket::ParseReister> },
+    { Login,            &ClientSocket::Dispatch<LoginReply,         &ClientSocket::ParseLogin> },
+    { Logout,           &ClientSocket::Dispatch<RawMsg,             &ClientSocket::ParseLogout> },
+    { OfflineMsgBatch,  &ClientSocket::Dispatch<OfflineBatchMsg,    &ClientSocket::ParseOfflineBatch> },
+    { Pong,             &ClientSocket::Dispatch<PingMsg,            &ClientSocket::ParsePong> },
+    { Ping,             &ClientSocket::Dispatch<PingMsg,            &ClientSocket::ParsePing> },
+    { UserOnLine,       &ClientSocket::Forward<PresenceMsg> },
+    { UserOffLine,      &ClientSocket::Forward<PresenceMsg> },
+    { UpdateHeadPic,    &ClientSocket::Forward<RawMsg> },
+    { AddFriend,        &ClientSocket::Forward<RawMsg> },
+    { AddGroup,         &ClientSocket::Forward<RawMsg> },
+    { AddFriendRequist, &ClientSocket::Forward<RawMsg> },
+    { AddGroupRequist,  &ClientSocket::Forward<RawMsg> },
+    { CreateGroup,      &ClientSocket::Forward<RawMsg> },
+    { GetMyFriends,     &ClientSocket::Forward<RawMsg> },
+    { GetMyGroups,      &ClientSocket::Forward<RawMsg> },
+    { RefreshFriends,   &ClientSocket::Forward<RawMsg> },
+    { RefreshGroups,    &ClientSocket::Forward<RawMsg> },
+    { Ack,              &ClientSocket::Dispatch<AckMsg,             &ClientSocket::ParseAck> },
+    { Throttled,        &ClientSocket::Dispatch<ThrottleMsg,        &ClientSocket::ParseThrottled> },
+    { SendMsg,          &ClientSocket::Forward<ChatMsg> },
+    { SendGroupMsg,     &ClientSocket::Forward<ChatMsg> },
+    { SendFile,         &ClientSocket::Forward<ChatMsg> },
+    { SendPicture,      &ClientSocket::Forward<ChatMsg> },
+};
+
+/**
+ * @brief ClientSocket::FindRoute
+ * 按类型值直接索引，索引在第一次使用时由分发表生成
+ * @param type
+ * @return
+ */
+ClientSocket::MsgDispatch ClientSocket::FindRoute(const quint8 &type)
+{
+    struct RouteIndex {
+        MsgDispatch table[256];
+
+        RouteIndex() {
+            memset(table, 0, sizeof(table));
+            for (size_t i = 0; i < sizeof(s_msgRoutes) / sizeof(s_msgRoutes[0]); i++) {
+                table[s_msgRoutes[i].type] = s_msgRoutes[i].dispatch;
             }
         }
+    };
+
+    static const RouteIndex index;
+    return index.table[type];
+}
+
+/**
+ * @brief ClientSocket::ParseFrame
+ * 解析服务器下发的一帧消息：查表分发，不合法的消息直接丢弃
+ * @param byRead
+ */
+void ClientSocket::ParseFrame(const QByteArray &byRead)
+{
+    if (MsgCodec::IsRelay(byRead)) {
+        ParseRelay(byRead);
+        return;
+    }
+
+    // JSON 或 CBOR 信封，按首字节识别
+    QJsonObject jsonObj;
+    if (!MsgCodec::Decode(byRead, jsonObj)) return;
+
+    int nType = jsonObj.value(QLatin1String("type")).toInt();
+    MsgDispatch dispatch = (nType > 0 && nType <= 0xff) ? FindRoute(quint8(nType)) : NULL;
+    if (NULL == dispatch) return;
+
+    if (!dispatch(this, quint8(nType), jsonObj.value(QLatin1String("data")))) {
+        qDebug() << "malformed message, drop" << nType;
+    }
+}
+
+/**
+ * @brief ClientSocket::ParseLogout
+ * 服务器要求下线
+ */
+void ClientSocket::ParseLogout(const quint8 &, const RawMsg &)
+{
+    m_tcpSocket->abort();
+}
+
+/**
+ * @brief ClientSocket::ParsePong
+ * 心跳回应
+ */
+void ClientSocket::ParsePong(const quint8 &, const PingMsg &)
+{
+    m_waitingPong = false;
+    m_missedPong = 0;
+}
+
+/**
+ * @brief ClientSocket::ParsePing
+ * 服务器探测连接是否存活，原样带回 ts
+ */
+void ClientSocket::ParsePing(const quint8 &, const PingMsg &msg)
+{
+    PingMsg pong;
+    pong.id = m_nId;
+    pong.ts = msg.ts;
+    SltSendMessage(Pong, pong.Encode());
+}
+
+/**
+ * @brief ClientSocket::ParseAck
+ * 记录发送到 Ack 的耗时，再交给界面更新消息状态
+ */
+void ClientSocket::ParseAck(const quint8 &type, const AckMsg &msg)
+{
+    m_latency.Acked(msg.msgId);
+    Q_EMIT signalMessage(type, msg.Encode());
+}
+
+/**
+ * @brief ClientSocket::ParseThrottled
+ * 请求被服务器限流，私聊消息不再等待 Ack，交给界面标记为发送失败；
+ * 好友/群组列表等查询带回了原请求，等待 retry 后重发
+ */
+void ClientSocket::ParseThrottled(const quint8 &type, const ThrottleMsg &msg)
+{
+    qDebug() << "throttled" << msg.type << "retry" << msg.retry << "ms";
+    if (0 == msg.msgId && !msg.data.isUndefined()) {
+        m_throttledQueries.append(qMakePair(quint8(msg.type), msg.data));
+        QTimer::singleShot(qMax(msg.retry, 1), this, SLOT(SltResendThrottled()));
+        return;
     }
+
+    m_latency.Cancel(msg.msgId);
+    Q_EMIT signalMessage(type, msg.Encode());
+}
+
+/**
+ * @brief ClientSocket::SltResendThrottled
+ * 每次定时到期重发最早的一条，断线时队列已清空
+ */
+void ClientSocket::SltResendThrottled()
+{
+    if (m_throttledQueries.isEmpty()) return;
+
+    QPair<quint8, QJsonValue> query = m_throttledQueries.takeFirst();
+    SltSendMessage(query.first, query.second);
 }
 
 void ClientSocket::SltHeartbeatTimeout()
@@ -353,54 +434,93 @@ void ClientSocket::SltReconnectTimeout()
 }
 
 /**
- * @brief ClientSocket::ParseLogin
- * 解析登录信息
- * @param reply
+ * @brief ClientSocket::ParseRelay
+ * 私聊转发帧，头部的 peer 为服务器填写的发送者，覆盖消息体中的 id
+ * @param byRead
  */
-void ClientSocket::ParseLogin(const QJsonValue &dataVal)
+void ClientSocket::ParseRelay(const QByteArray &byRead)
 {
-    // data 的 value 是对象
-    if (dataVal.isObject()) {
-        QJsonObject dataObj = dataVal.toObject();
-        int code = dataObj.value("code").toInt();
-        QString msg = dataObj.value("msg").toString();
-        QString strHead = dataObj.value("head").toString();
+    quint8 nType = 0;
+    int nFrom = 0;
+    int msgId = 0;
+    QJsonValue dataVal;
+    if (!MsgCodec::ParseRelay(byRead, nType, nFrom, msgId) ||
+            !MsgCodec::DecodeData(byRead.mid(RELAY_HEADER_SIZE), dataVal)) return;
+
+    QJsonObject dataObj = dataVal.toObject();
+    dataObj.insert("id", nFrom);
+
+    if (SendMsg == nType || SendFile == nType || SendPicture == nType) {
+        Q_EMIT signalMessage(nType, dataObj);
+    }
+}
+
+/**
+ * @brief ClientSocket::ParseOfflineBatch
+ * 一页离线消息，逐条按私聊消息处理，处理完回复游标，服务器删除已确认的消息后推送下一页
+ * @param type
+ * @param msg
+ */
+void ClientSocket::ParseOfflineBatch(const quint8 &, const OfflineBatchMsg &msg)
+{
+    for (int i = 0; i < msg.msgs.size(); i++) {
+        Q_EMIT signalMessage(SendMsg, msg.msgs.at(i));
+    }
 
-        if (0 == code && msg == "ok") {
-            m_nId = dataObj.value("id").toInt();
-            // 保存头像
-            MyApp::m_strHeadFile = MyApp::m_strHeadPath + strHead;
+    OfflineAckMsg ack;
+    ack.cursor = msg.cursor;
+    SltSendMessage(OfflineMsgAck, ack.Encode());
+}
 
-            MyApp::m_nId = m_nId;
-            Q_EMIT signalStatus(LoginSuccess);
-        }
-        else if (-1 == code){
-            Q_EMIT signalStatus(LoginPasswdError);
-        }
-        else if (-2 == code) {
-            Q_EMIT signalStatus(LoginRepeat);
-        }
+/**
+ * @brief ClientSocket::ParseLogin
+ * 解析登录信息
+ * @param type
+ * @param msg
+ */
+void ClientSocket::ParseLogin(const quint8 &, const LoginReply &msg)
+{
+    if (0 == msg.code && msg.msg == "ok") {
+        m_nId = msg.id;
+        // 服务器接受 CBOR 后，后续请求改用 CBOR
+        m_bCbor = msg.caps.contains(QString(CAP_CBOR));
+        m_bRelay = msg.caps.contains(QString(CAP_RELAY));
+        // 保存头像
+        MyApp::m_strHeadFile = MyApp::m_strHeadPath + msg.head;
+
+        MyApp::m_nId = m_nId;
+        Q_EMIT signalStatus(LoginSuccess);
+    }
+    else if (-1 == msg.code){
+        Q_EMIT signalStatus(LoginPasswdError);
+    }
+    else if (-2 == msg.code) {
+        Q_EMIT signalStatus(LoginRepeat);
+    }
+    else if (-3 == msg.code) {
+        Q_EMIT signalStatus(LoginBusy);
     }
 }
 
 /**
  * @brief ClientSocket::ParseReister
  * 解析注册信息
- * @param reply
+ * @param type
+ * @param msg
  */
-void ClientSocket::ParseReister(const QJsonValue &dataVal)
+void ClientSocket::ParseReister(const quint8 &, const RegisterReply &msg)
 {
-    // data 的 value 是对象
-    if (dataVal.isObject()) {
-        QJsonObject dataObj = dataVal.toObject();
-        m_nId = dataObj.value("id").toInt();
+    m_nId = msg.id;
 
-        if (-1 != m_nId) {
-            Q_EMIT signalStatus(RegisterOk);
-        }
-        else {
-            Q_EMIT signalStatus(RegisterFailed);
-        }
+    // -3：注册请求被服务器限流
+    if (-3 == m_nId) {
+        Q_EMIT signalStatus(LoginBusy);
+    }
+    else if (-1 != m_nId) {
+        Q_EMIT signalStatus(RegisterOk);
+    }
+    else {
+        Q_EMIT signalStatus(RegisterFailed);
     }
 }
 
@@ -422,10 +542,9 @@ void ClientSocket::SltSendOffline()
 ///////////////////////////////////////////////////////////////
 /// 文件传输类
 ClientFileSocket::ClientFileSocket(QObject *parent) :
-    QObject(parent)
+    QObject(parent),
+    m_hash(QCryptographicHash::Sha256)
 {
-    m_nType = Login;
-qDebug() << "........SltUpdateClientProgress........Login.";
     m_strFilePath = MyApp::m_strRecvPath;
 
     InitSocket();
@@ -433,6 +552,7 @@ qDebug() << "........SltUpdateClientProgress........Login.";
 
 ClientFileSocket::~ClientFileSocket()
 {
+    CloseIncoming();
 }
 
 bool ClientFileSocket::isConneciton()
@@ -440,68 +560,39 @@ bool ClientFileSocket::isConneciton()
     return m_tcpSocket->isOpen();
 }
 
-
+/**
+ * @brief ClientFileSocket::displayError
+ * 连接失败时不会发出 disconnected，未完成的上传在这里安排重试
+ */
 void ClientFileSocket::displayError(QAbstractSocket::SocketError)
 {
+    if (QAbstractSocket::UnconnectedState == m_tcpSocket->state()) {
+        RetrySendLater();
+        return;
+    }
+
     m_tcpSocket->close();
 }
 
 
 /**
  * @brief ClientFileSocket::StartTransferFile
- * 开始传输文件
- * @param id 当前用户id
+ * 开始上传文件，可以和正在进行的上传、下载同时进行；
+ * 没有连接服务器时先连接，连接后在 SltConnected 中发出 Offer
  * @param fileName 文件路径
  */
 void ClientFileSocket::StartTransferFile(QString fileName)
 {
-    if (m_bBusy) return;
-    m_nType = SendFile;
-
-    qDebug() << "........SltUpdateClientProgress........SendFile.3";
-    qDebug() << "MyApp::m_strHostAddr :" << MyApp::m_strHostAddr;
-    qDebug() << "MyApp::m_nFilePort :" << MyApp::m_nFilePort;
-    qDebug() << "m_nWinId:" << m_nWinId;
+    m_nRetries = 0;
+    if (!m_pendingSends.contains(fileName)) m_pendingSends.append(fileName);
 
     // 如果没有连接服务器，重新连接下
-    if (!m_tcpSocket->isOpen()) {
+    if (QAbstractSocket::ConnectedState != m_tcpSocket->state()) {
         ConnectToServer(MyApp::m_strHostAddr, MyApp::m_nFilePort, m_nWinId);
-    }
-
-    // 要发送的文件
-    fileToSend = new QFile(fileName);
-
-    if (!fileToSend->open(QFile::ReadOnly))
-    {
-        qDebug() << "open file error!";
         return;
     }
 
-    // 文件总大小
-    ullSendTotalBytes = fileToSend->size();
-
-    // 文件数据流
-    QDataStream sendOut(&outBlock, QIODevice::WriteOnly);
-    sendOut.setVersion(QDataStream::Qt_4_8);
-
-    // 当前文件名，不包含路径
-    QString currentFileName = fileName.right(fileName.size() - fileName.lastIndexOf('/')-1);
-
-    // 依次写入总大小信息空间，文件名大小信息空间，文件名
-    sendOut << qint64(0) << qint64(0) << currentFileName;
-
-    // 这里的总大小是文件名大小等信息和实际文件大小的总和
-    ullSendTotalBytes += outBlock.size();
-
-    // 返回outBolock的开始，用实际的大小信息代替两个qint64(0)空间
-    sendOut.device()->seek(0);
-    sendOut << ullSendTotalBytes << qint64((outBlock.size() - sizeof(qint64)*2));
-
-    // 发送完头数据后剩余数据的大小
-    bytesToWrite = ullSendTotalBytes - m_tcpSocket->write(outBlock);
-
-    outBlock.resize(0);
-    m_bBusy = true;
+    OfferPending();
 }
 
 /**
@@ -530,19 +621,15 @@ void ClientFileSocket::CloseConnection()
 
 /**
  * @brief ClientFileSocket::FileTransFinished
- * 文件接收或发送完成的数据还原
+ * 放弃所有上传和下载，未完成的下载仍保留供续传
  */
 void ClientFileSocket::FileTransFinished()
 {
-    m_bBusy = false;
-
-    ullSendTotalBytes   = 0;
-    ullRecvTotalBytes   = 0;
-    bytesWritten        = 0;
-    bytesToWrite        = 0;
-    bytesReceived       = 0;
-
-    fileNameSize        = 0;
+    m_sending.Clear();
+    m_pendingSends.clear();
+    m_pendingRecvs.clear();
+    m_hashFile.close();
+    CloseIncoming();
 }
 
 /**
@@ -559,177 +646,458 @@ void ClientFileSocket::SetUserId(const int &id)
  */
 void ClientFileSocket::InitSocket()
 {
-    // 将整个大的文件分成很多小的部分进行发送，每部分为50字节
-    loadSize            = 50 * 1024;
-    ullSendTotalBytes   = 0;
-    ullRecvTotalBytes   = 0;
-    bytesWritten        = 0;
-    bytesToWrite        = 0;
-    bytesReceived       = 0;
+    m_nRetries          = 0;
+    m_bRetryPending     = false;
 
     m_nWinId            = -1;
 
-    fileNameSize        = 0;
-    m_bBusy = false;
-
-    fileToSend = new QFile(this);
-    fileToRecv = new QFile(this);
+    m_codec.SetMaxFrameSize(FILE_FRAME_MAX);
 
     m_tcpSocket = new QTcpSocket(this);
 
-    // 当有数据发送成功时，我们更新进度条
+    // 当有数据发送成功时，继续发送下一块
     connect(m_tcpSocket, SIGNAL(bytesWritten(qint64)),
             this, SLOT(SltUpdateClientProgress(qint64)));
     // 当有数据接收成功时，我们更新进度条
     connect(m_tcpSocket, SIGNAL(readyRead()), this, SLOT(SltReadyRead()));
     connect(m_tcpSocket, SIGNAL(connected()), this, SLOT(SltConnected()));
     connect(m_tcpSocket, SIGNAL(disconnected()), this, SLOT(SltDisConnected()));
+    connect(m_tcpSocket, SIGNAL(error(QAbstractSocket::SocketError)),
+            this, SLOT(displayError(QAbstractSocket::SocketError)));
 }
 
+/**
+ * @brief ClientFileSocket::OfferPending
+ * 同时上传的文件不超过 FILE_MAX_TRANSFERS，其余的等有上传结束再发 Offer；
+ * 队首的文件还在计算摘要时先停下，算完后在 SltHashTurn 中继续
+ */
+void ClientFileSocket::OfferPending()
+{
+    while (!m_pendingSends.isEmpty() && m_sending.Count() < FILE_MAX_TRANSFERS) {
+        if (!HashReady(m_pendingSends.first())) return;
+        OfferFile(m_pendingSends.takeFirst());
+    }
+}
+
+QString ClientFileSocket::HashKey(const QString &filePath)
+{
+    QFileInfo info(filePath);
+    return QString("%1|%2|%3").arg(filePath).arg(info.size()).arg(info.lastModified().toMSecsSinceEpoch());
+}
 
 /**
- * @brief ClientFileSocket::SltUpdateClientProgress
- * 更新文件的上传、下载进度
- * @param numBytes
+ * @brief ClientFileSocket::HashReady
+ * 打不开的文件返回 true，由 OfferFile 报错并跳过
+ * @param filePath
+ * @return
  */
-void ClientFileSocket::SltUpdateClientProgress(qint64 numBytes)
+bool ClientFileSocket::HashReady(const QString &filePath)
 {
-    // 开始的时候，不记录流程
-    if (Login == m_nType) {
-        m_nType = Unknow;
-        qDebug() << "........SltUpdateClientProgress........Unknow.";
-        return;
+    QString strKey = HashKey(filePath);
+    if (m_shaCache.contains(strKey)) return true;
+
+    // 正在计算
+    if (m_hashFile.isOpen() && strKey == m_strHashKey) return false;
+
+    m_hashFile.close();
+    m_hashFile.setFileName(filePath);
+    if (!m_hashFile.open(QFile::ReadOnly)) return true;
+
+    if (m_shaCache.size() >= FILE_HASH_CACHE) m_shaCache.clear();
+
+    m_hash.reset();
+    m_strHashKey = strKey;
+    if (m_hashFile.size() <= FILE_HASH_TURN) {
+        m_hash.addData(&m_hashFile);
+        m_shaCache.insert(strKey, m_hash.result());
+        m_hashFile.close();
+        return true;
     }
 
-    // 已经发送数据的大小
-    bytesWritten += (int)numBytes;
-    if (bytesToWrite > 0) //如果已经发送了数据
-    {
-        // 每次发送loadSize大小的数据，这里设置为4KB，如果剩余的数据不足4KB，就发送剩余数据的大小
-        outBlock = fileToSend->read(qMin(bytesToWrite, loadSize));
+    QTimer::singleShot(0, this, SLOT(SltHashTurn()));
+    return false;
+}
 
-        // 发送完一次数据后还剩余数据的大小
-        bytesToWrite -= (int)m_tcpSocket->write(outBlock);
+/**
+ * @brief ClientFileSocket::SltHashTurn
+ * 算完后缓存结果，已连上服务器时接着发 Offer，否则等 SltConnected
+ */
+void ClientFileSocket::SltHashTurn()
+{
+    if (!m_hashFile.isOpen()) return;
 
-        // 清空发送缓冲区
-        outBlock.resize(0);
+    QByteArray data = m_hashFile.read(FILE_HASH_TURN);
+    m_hash.addData(data);
+    if (!data.isEmpty() && !m_hashFile.atEnd()) {
+        QTimer::singleShot(0, this, SLOT(SltHashTurn()));
+        return;
     }
-    else
+
+    m_shaCache.insert(m_strHashKey, m_hash.result());
+    m_hashFile.close();
+
+    if (QAbstractSocket::ConnectedState == m_tcpSocket->state()) OfferPending();
+}
+
+/**
+ * @brief ClientFileSocket::OfferFile
+ * 传输id 由文件名、大小、修改时间决定，同一文件重传时服务器能找到上次未完成的部分；
+ * 带上内容摘要，服务器已有时直接回复 Done
+ * @param filePath
+ */
+void ClientFileSocket::OfferFile(const QString &filePath)
+{
+    FileSendTask *task = new FileSendTask;
+    task->path = filePath;
+    task->file.setFileName(filePath);
+    if (!task->file.open(QFile::ReadOnly))
     {
-        // 如果没有发送任何数据，则关闭文件
-        if (fileToSend->isOpen())
-            fileToSend->close();
+        qDebug() << "open file error!" << filePath;
+        delete task;
+        return;
     }
 
-    // 发送进度信息
-    Q_EMIT signalUpdateProgress(bytesWritten, ullSendTotalBytes);
+    QFileInfo info(filePath);
+    task->size = quint64(task->file.size());
+    task->id = FileTransfer::TransferId(info.fileName(), task->size, info.lastModified().toMSecsSinceEpoch(), FILE_CHUNK_SIZE);
+    task->avail = task->size;
+    // 等服务器回复 Resume 后再发数据
+    task->offset = -1;
+    task->rewind = -1;
+
+    // 同一个文件已经在上传
+    if (NULL != m_sending.Find(task->id)) {
+        delete task;
+        return;
+    }
 
-    // 发送完毕
-    if (bytesWritten >= ullSendTotalBytes)
-    {
-        if (fileToSend->isOpen())
-            fileToSend->close();
+    m_sending.Add(task);
+    m_tcpSocket->write(FileTransfer::PackOffer(task->id, task->size, FILE_CHUNK_SIZE, info.fileName(),
+                                               m_shaCache.value(HashKey(filePath))));
+}
 
-        bytesWritten = 0;
-        ullSendTotalBytes = 0;
-        bytesToWrite = 0;
-        // 文件发送完成，复位相关信息
-        Q_EMIT signalSendFinished();
+/**
+ * @brief ClientFileSocket::ParseResume
+ * 第一次是服务器已有的偏移，此时服务器已登记这次上传，对端可以开始下载；
+ * 之后是校验失败要求回退
+ * @param frame
+ */
+void ClientFileSocket::ParseResume(const FileFrame &frame)
+{
+    FileSendTask *task = m_sending.Find(frame.id);
+    if (NULL == task) return;
 
-        FileTransFinished();
+    if (frame.offset > task->size || 0 != frame.offset % FILE_CHUNK_SIZE) {
+        qDebug() << "bad resume offset" << frame.offset << task->path;
+        m_tcpSocket->write(FileTransfer::PackError(frame.id, FileErrProtocol));
+        DropSend(frame.id);
+        return;
     }
+
+    // 服务器有回应，重连次数重新计算
+    m_nRetries = 0;
+    bool bStarted = (task->offset < 0 && task->rewind < 0);
+    task->rewind = qint64(frame.offset);
+    if (bStarted) Q_EMIT signalSendStarted(task->path, task->size);
+    SendChunks();
 }
 
-// 更新进度条，实现文件的接收
-void ClientFileSocket::SltReadyRead()
+/**
+ * @brief ClientFileSocket::SendChunks
+ * socket 缓冲中积压不超过 FILE_SEND_WINDOW，之后在 bytesWritten 中继续；
+ * 每次由调度器挑一个文件发一块，回退在这个文件的下一块生效，之前已在途的块服务器会忽略
+ */
+void ClientFileSocket::SendChunks()
 {
-    QDataStream in(m_tcpSocket);
-    in.setVersion(QDataStream::Qt_4_8);
-
-    // 如果接收到的数据小于等于20个字节，那么是刚开始接收数据，我们保存为头文件信息
-    if (bytesReceived <= (sizeof(qint64)*2))
-    {
-        int nlen = sizeof(qint64) * 2;
-        // 接收数据总大小信息和文件名大小信息
-        if ((m_tcpSocket->bytesAvailable() >= nlen) && (fileNameSize == 0))
-        {
-            in >> ullRecvTotalBytes >> fileNameSize;
-            if (0 != ullRecvTotalBytes) bytesReceived += nlen;
+    while (m_tcpSocket->bytesToWrite() < FILE_SEND_WINDOW) {
+        FileSendTask *task = m_sending.Next();
+        if (NULL == task) return;
+
+        qint64 nLen = qMin(qint64(FILE_CHUNK_SIZE), qint64(task->size) - task->offset);
+        QByteArray data;
+        if (task->file.seek(task->offset)) data = task->file.read(nLen);
+        if (data.size() != nLen) {
+            qDebug() << "read file error" << task->path << task->offset;
+            m_tcpSocket->write(FileTransfer::PackError(task->id, FileErrIo));
+            DropSend(task->id);
+            continue;
         }
 
-        // 接收文件名，并建立文件
-        if((m_tcpSocket->bytesAvailable() >= (qint64)fileNameSize) &&
-                ((qint64)fileNameSize != 0) &&
-                (0 != ullRecvTotalBytes))
-        {
-            in >> fileReadName;
-            fileReadName = (-2 == m_nWinId ? MyApp::m_strHeadPath : MyApp::m_strRecvPath) + fileReadName;
-            bytesReceived += fileNameSize;
-
-            fileToRecv->setFileName(fileReadName);
-
-            if (!fileToRecv->open(QFile::WriteOnly | QIODevice::Truncate))
-            {
-                qDebug() << "recv file open failed" << fileReadName;
-                return;
-            }
+        m_tcpSocket->write(FileTransfer::PackChunk(task->id, quint64(task->offset), data));
+        task->offset += nLen;
 
-            qDebug() << "Begin to recv file" << m_nWinId << fileReadName;
+        // 发送进度信息
+        Q_EMIT signalUpdateProgress(task->path, quint64(task->offset), task->size);
+    }
+}
+
+/**
+ * @brief ClientFileSocket::DropSend
+ * 上传结束（成功或放弃），排队的文件接着上传
+ * @param id
+ */
+void ClientFileSocket::DropSend(const quint64 &id)
+{
+    m_sending.Remove(id);
+    OfferPending();
+}
+
+/**
+ * @brief ClientFileSocket::RetrySendLater
+ * 未完成的上传回到待 Offer 队列，重连后从服务器已校验的位置继续；
+ * 未完成的下载在重连后重新请求（SltConnected），从 .part 中已校验的位置继续；
+ * 间隔逐次加长，超过 FILE_RETRY_MAX 次放弃。
+ * 放弃时连接已断开，无法给服务器发 Error，服务器在续传宽限期后让等待中的下载失败；
+ * 已开始的上传由界面标记为发送失败
+ */
+void ClientFileSocket::RetrySendLater()
+{
+    QStringList interrupted;
+    foreach (FileSendTask *task, m_sending.Tasks()) {
+        interrupted.append(task->path);
+    }
+    m_sending.Clear();
+    m_pendingSends = interrupted + m_pendingSends;
+
+    if ((m_pendingSends.isEmpty() && m_pendingRecvs.isEmpty()) || m_bRetryPending) return;
+
+    if (m_nRetries >= FILE_RETRY_MAX) {
+        qDebug() << "transfer given up" << m_pendingSends << m_pendingRecvs;
+        m_pendingRecvs.clear();
+        QStringList failed = m_pendingSends;
+        m_pendingSends.clear();
+        foreach (QString filePath, failed) {
+            Q_EMIT signalSendFailed(filePath);
         }
+        return;
     }
 
-    // 如果接收的数据小于总数据，那么写入文件
-    if (bytesReceived < ullRecvTotalBytes)
-    {
-        bytesReceived += m_tcpSocket->bytesAvailable();
-        inBlock = m_tcpSocket->readAll();
+    m_nRetries++;
+    m_bRetryPending = true;
+    QTimer::singleShot(FILE_RETRY_MS * m_nRetries, this, SLOT(SltRetrySend()));
+}
+
+void ClientFileSocket::SltRetrySend()
+{
+    m_bRetryPending = false;
+    if (m_pendingSends.isEmpty() && m_pendingRecvs.isEmpty()) return;
+
+    ConnectToServer(MyApp::m_strHostAddr, MyApp::m_nFilePort, m_nWinId);
+}
+
+/**
+ * @brief ClientFileSocket::SltUpdateClientProgress
+ * 缓冲有空间后继续发送
+ * @param numBytes
+ */
+void ClientFileSocket::SltUpdateClientProgress(qint64)
+{
+    if (m_sending.Count() > 0) SendChunks();
+}
 
-        if (fileToRecv->isOpen())
-            fileToRecv->write(inBlock);
+/**
+ * @brief ClientFileSocket::ParseOffer
+ * 服务器开始下发文件：有同一个传输id 的未完成文件时回复已校验的偏移
+ * @param frame
+ */
+void ClientFileSocket::ParseOffer(const FileFrame &frame)
+{
+    // 同一个文件已经在接收
+    if (m_incoming.contains(frame.id)) return;
 
-        inBlock.resize(0);
+    if (m_incoming.size() >= FILE_MAX_TRANSFERS) {
+        m_tcpSocket->write(FileTransfer::PackError(frame.id, FileErrBusy));
+        return;
     }
 
-    // 更新进度条
-    Q_EMIT signalUpdateProgress(bytesReceived, ullRecvTotalBytes);
+    // 只取最后一段文件名，不能写到接收目录之外
+    QString strName = QFileInfo(frame.name).fileName();
+    if (strName.isEmpty()) {
+        m_tcpSocket->write(FileTransfer::PackError(frame.id, FileErrProtocol));
+        return;
+    }
 
-    // 接收数据完成时
-    if ((bytesReceived >= ullRecvTotalBytes) && (0 != ullRecvTotalBytes))
-    {
-        fileToRecv->close();
-        bytesReceived = 0; // clear for next receive
-        ullRecvTotalBytes = 0;
-        fileNameSize = 0;
+    // 服务器有回应，重新请求的下载不再等待，重连次数重新计算
+    if (m_pendingRecvs.removeAll(strName) > 0) m_nRetries = 0;
+
+    QString strTarget = (-2 == m_nWinId ? MyApp::m_strHeadPath : MyApp::m_strRecvPath) + strName;
+    PartFile *part = new PartFile;
+    qint64 nOffset = part->Open(strTarget, frame.id, frame.size, frame.chunkSize, false);
+    if (nOffset < 0) {
+        qDebug() << "recv file open failed" << strTarget;
+        delete part;
+        m_tcpSocket->write(FileTransfer::PackError(frame.id, FileErrIo));
+        return;
+    }
+
+    m_incoming.insert(frame.id, part);
+    qDebug() << "Begin to recv file" << m_nWinId << strTarget << nOffset;
+    Q_EMIT signalUpdateProgress(strTarget, quint64(nOffset), frame.size);
+
+    // 上次已全部收到但没来得及改名，或者是空文件
+    if (part->IsComplete()) {
+        FinishRecv(part);
+        return;
+    }
+
+    m_tcpSocket->write(FileTransfer::PackResume(frame.id, quint64(nOffset)));
+}
+
+/**
+ * @brief ClientFileSocket::ParseChunk
+ * 校验失败时让服务器从已校验的位置重发，同一位置连续失败超过 FILE_CRC_RETRY 次放弃
+ * @param frame
+ */
+void ClientFileSocket::ParseChunk(const FileFrame &frame)
+{
+    PartFile *part = m_incoming.value(frame.id, NULL);
+    if (NULL == part) return;
+
+    switch (part->Write(frame.offset, frame.crc, frame.data)) {
+    case PartOk:
+        // 更新进度条
+        Q_EMIT signalUpdateProgress(part->Target(), part->Verified(), part->Size());
+        if (part->IsComplete()) FinishRecv(part);
+        break;
+    case PartBadCrc:
+        m_tcpSocket->write(FileTransfer::PackResume(frame.id, part->Verified()));
+        break;
+    case PartGiveUp:
+        qDebug() << "chunk checksum keeps failing, give up" << part->Target() << frame.offset;
+        DropRecv(frame.id);
+        m_tcpSocket->write(FileTransfer::PackError(frame.id, FileErrChecksum));
+        break;
+    case PartIoError:
+        qDebug() << "write recv file failed" << part->Target();
+        DropRecv(frame.id);
+        m_tcpSocket->write(FileTransfer::PackError(frame.id, FileErrIo));
+        break;
+    default:
+        // 回退之前已经在途的块
+        break;
+    }
+}
 
-        Q_EMIT signamFileRecvOk(Text, fileToRecv->fileName());
-        qDebug() << "File recv ok" << fileToRecv->fileName();
-        // 数据接受完成
-        FileTransFinished();
+void ClientFileSocket::FinishRecv(PartFile *part)
+{
+    quint64 nId = part->Id();
+    QString strTarget = part->Target();
+    if (!part->Commit()) {
+        qDebug() << "recv file commit failed" << strTarget;
+        DropRecv(nId);
+        m_tcpSocket->write(FileTransfer::PackError(nId, FileErrIo));
+        return;
     }
+
+    delete m_incoming.take(nId);
+    m_tcpSocket->write(FileTransfer::PackDone(nId));
+    Q_EMIT signamFileRecvOk(Text, strTarget);
+    qDebug() << "File recv ok" << strTarget;
+}
+
+/**
+ * @brief ClientFileSocket::DropRecv
+ * 放弃一个下载，未完成文件保留供续传
+ * @param id
+ */
+void ClientFileSocket::DropRecv(const quint64 &id)
+{
+    delete m_incoming.take(id);
+}
+
+void ClientFileSocket::CloseIncoming()
+{
+    qDeleteAll(m_incoming);
+    m_incoming.clear();
+}
+
+/**
+ * @brief ClientFileSocket::SltReadyRead
+ * 上传和下载的帧都在这里分发，按传输id 对应到各自的文件
+ */
+void ClientFileSocket::SltReadyRead()
+{
+    m_codec.Append(m_tcpSocket->readAll());
+
+    QByteArray payload;
+    while (m_codec.TakeFrame(payload)) {
+        FileFrame frame;
+        if (!FileTransfer::Parse(payload, frame)) {
+            qDebug() << "bad file frame";
+            m_tcpSocket->abort();
+            return;
+        }
+
+        switch (frame.op) {
+        case FileOffer:
+            ParseOffer(frame);
+            break;
+        case FileChunk:
+            ParseChunk(frame);
+            break;
+        case FileResume:
+            ParseResume(frame);
+            break;
+        case FileDone:
+            // 服务器已校验并落盘，文件传输完成
+            if (FileSendTask *task = m_sending.Find(frame.id)) {
+                QString strPath = task->path;
+                // 服务器已有相同内容，没有回复 Resume 就完成了
+                if (task->offset < 0 && task->rewind < 0) {
+                    Q_EMIT signalSendStarted(strPath, task->size);
+                    Q_EMIT signalUpdateProgress(strPath, task->size, task->size);
+                }
+                DropSend(frame.id);
+                Q_EMIT signalSendFinished(strPath);
+            }
+            break;
+        case FileError:
+            qDebug() << "file transfer failed" << frame.id << frame.code;
+            DropSend(frame.id);
+            DropRecv(frame.id);
+            break;
+        default:
+            break;
+        }
+    }
+
+    if (m_codec.HasError()) m_tcpSocket->abort();
 }
 
 /**
  * @brief ClientFileSocket::SltConnected
- * 连接后，发送本机ID至服务器
+ * 连接后，发送本机ID至服务器；待上传和断线前未完成的上传重新 Offer
  */
 void ClientFileSocket::SltConnected()
 {
-    m_nType = Login;
-
-    QDataStream sendOut(&outBlock, QIODevice::WriteOnly);
-    sendOut.setVersion(QDataStream::Qt_4_8);
+    m_codec.Reset();
 
     // 给服务器socket上报自己的id，方便下次查询
-    sendOut << qint32(MyApp::m_nId) << qint32(m_nWinId);
+    m_tcpSocket->write(FileTransfer::PackHello(MyApp::m_nId, m_nWinId));
 
-    // 发送完头数据后剩余数据的大小
-    m_tcpSocket->write(outBlock);
+    OfferPending();
+
+    // 断线前没收完的下载重新请求，服务器重发 Offer 后回复 .part 中已校验的偏移
+    foreach (QString fileName, m_pendingRecvs) {
+        Q_EMIT signalResumeRecv(fileName);
+    }
 
     // 发送连接上的信号
     Q_EMIT signalConnectd();
 }
 
+/**
+ * @brief ClientFileSocket::SltDisConnected
+ * 未完成的下载保留在 .part 中，上传和下载都稍后重连续传
+ */
 void ClientFileSocket::SltDisConnected()
 {
     if (m_tcpSocket->isOpen()) m_tcpSocket->close();
+
+    foreach (PartFile *part, m_incoming) {
+        QString strName = QFileInfo(part->Target()).fileName();
+        if (!m_pendingRecvs.contains(strName)) m_pendingRecvs.append(strName);
+    }
+    CloseIncoming();
+    RetrySendLater();
 }
@@ -5,6 +5,17 @@
 #include <QTcpSocket>
 #include <QFile>
 #include <QTimer>
+#include <QHash>
+#include <QStringList>
+#include <QCryptographicHash>
+#include <QList>
+#include <QPair>
+
+#include "framecodec.h"
+#include "msgcodec.h"
+#include "protocol.h"
+#include "msglatency.h"
+#include "filetransfer.h"
 
 /////////////////////////////////////////////////////////////////////////
 /// \brief The ClientSocket class
@@ -26,6 +37,9 @@ public:
     // 连接服务器
     void ConnectToHost(const QString &host, const int &port);
     void ConnectToHost(const QHostAddress &host, const int &port);
+
+    // 输出本次会话私聊消息发送到 Ack 的耗时统计
+    void DumpLatency() const;
 signals:
     void signalMessage(const quint8 &type, const QJsonValue &dataVal);
     void signalStatus(const quint8 &state);
@@ -45,6 +59,16 @@ private:
     bool m_waitingPong;
     int m_missedPong;
     int m_reconnectDelayMs;
+    // 分帧缓冲
+    FrameCodec m_frameCodec;
+    // 服务器在登录应答中接受了 CBOR，之后的请求用 CBOR 编码
+    bool m_bCbor;
+    // 服务器接受私聊转发帧
+    bool m_bRelay;
+    // 私聊消息发送到 Ack 的耗时
+    MsgLatency m_latency;
+    // 被限流的查询请求，等待服务器建议的时间后重发
+    QList<QPair<quint8, QJsonValue> > m_throttledQueries;
 private slots:
     // 与服务器断开链接
     void SltDisconnected();
@@ -56,12 +80,53 @@ private slots:
     void SltHeartbeatTimeout();
     // 重连定时器
     void SltReconnectTimeout();
+    // 重发一条被限流的查询请求
+    void SltResendThrottled();
 
 private:
+    // 解析一个完整帧
+    void ParseFrame(const QByteArray &byRead);
+    // 解析私聊转发帧
+    void ParseRelay(const QByteArray &byRead);
+
+    // 消息分发表：每项把 data 解码为对应的消息结构，成功才调用处理函数
+    typedef bool (*MsgDispatch)(ClientSocket *client, const quint8 &type, const QJsonValue &dataVal);
+    struct MsgRoute {
+        quint8      type;
+        MsgDispatch dispatch;
+    };
+    static const MsgRoute s_msgRoutes[];
+    static MsgDispatch FindRoute(const quint8 &type);
+
+    template <typename T, void (ClientSocket::*Handler)(const quint8 &, const T &)>
+    static bool Dispatch(ClientSocket *client, const quint8 &type, const QJsonValue &dataVal)
+    {
+        T msg;
+        if (!msg.Decode(dataVal)) return false;
+        (client->*Handler)(type, msg);
+        return true;
+    }
+
+    // 校验后原样交给界面处理
+    template <typename T>
+    static bool Forward(ClientSocket *client, const quint8 &type, const QJsonValue &dataVal)
+    {
+        T msg;
+        if (!msg.Decode(dataVal)) return false;
+        Q_EMIT client->signalMessage(type, dataVal);
+        return true;
+    }
+
     // 解析登陆返回信息
-    void ParseLogin(const QJsonValue &dataVal);
+    void ParseLogin(const quint8 &type, const LoginReply &msg);
+    void ParseLogout(const quint8 &type, const RawMsg &msg);
+    void ParseOfflineBatch(const quint8 &type, const OfflineBatchMsg &msg);
+    void ParsePong(const quint8 &type, const PingMsg &msg);
+    void ParsePing(const quint8 &type, const PingMsg &msg);
+    void ParseAck(const quint8 &type, const AckMsg &msg);
+    void ParseThrottled(const quint8 &type, const ThrottleMsg &msg);
     // 解析注册返回信息
-    void ParseReister(const QJsonValue &dataVal);
+    void ParseReister(const quint8 &type, const RegisterReply &msg);
 };
 
 
@@ -91,41 +156,66 @@ public:
     // 设置当前socket的id
     void SetUserId(const int &id);
 signals:
-    void signalSendFinished();
+    // 服务器已接受上传（边传边下时对端此时即可下载）
+    void signalSendStarted(const QString &filePath, quint64 total);
+    void signalSendFinished(const QString &filePath);
+    // 重连多次仍失败，放弃上传
+    void signalSendFailed(const QString &filePath);
+    // 断线中断的下载，重连后需要再发一次 GetFile（消息连接上），服务器重发 Offer 后从 .part 续传
+    void signalResumeRecv(const QString &fileName);
     void signamFileRecvOk(const quint8 &type, const QString &filePath);
-    void signalUpdateProgress(quint64 currSize, quint64 total);
+    // 同一连接上可能同时有多个传输，用文件路径区分
+    void signalUpdateProgress(const QString &filePath, quint64 currSize, quint64 total);
     void signalConnectd();
 private:
-    quint64         loadSize;   //每次发送数据的大小
-
     /************* Receive file *******************/
-    quint64         bytesReceived;  //已收到数据的大小
-    quint64         fileNameSize;  //文件名的大小信息
-    QString         fileReadName;   //存放文件名
-    QByteArray      inBlock;   //数据缓冲区
-    quint64         ullRecvTotalBytes;  //数据总大小
-    QFile           *fileToRecv;  //要发送的文件
+    // 接收中的文件，按传输id；中断后保留在 .part 中，下次服务器再发同一文件时续传
+    QHash<quint64, PartFile *> m_incoming;
+    // 断线中断、等重连后再请求的下载（文件名），收到服务器的 Offer 后移除
+    QStringList     m_pendingRecvs;
 
     /************* Send file **********************/
-    quint16         blockSize;  //存放接收到的信息大小
-    QFile           *fileToSend;  //要发送的文件
-    quint64         ullSendTotalBytes;  //数据总大小
-    quint64         bytesWritten;  //已经发送数据大小
-    quint64         bytesToWrite;   //剩余数据大小
-    QByteArray      outBlock;  //数据缓冲区，即存放每次要发送的数据
+    // 上传中的文件，按块轮流发送
+    SendScheduler   m_sending;
+    // 待 Offer 的文件：超过并发上限、还没连上服务器、或断线时未完成的
+    QStringList     m_pendingSends;
+    int             m_nRetries;
+    bool            m_bRetryPending;
+
+    // Offer 前计算内容摘要，服务器已有相同内容时不必上传；
+    // 大文件分段计算，不阻塞界面，结果按 "路径|大小|修改时间" 缓存
+    QHash<QString, QByteArray>  m_shaCache;
+    QFile                       m_hashFile;
+    QCryptographicHash          m_hash;
+    QString                     m_strHashKey;
 
     // 用户目录
     QString         m_strFilePath;
 
     // 通信类
     QTcpSocket      *m_tcpSocket;
+    FrameCodec      m_codec;
 
-    bool            m_bBusy;
     int             m_nWinId;
-    quint8          m_nType;
 private:
     // socket 初始化
     void InitSocket();
+    void OfferPending();
+    // 摘要已算好（或无法计算）时返回 true，大文件开始或继续在后台计算时返回 false
+    bool HashReady(const QString &filePath);
+    static QString HashKey(const QString &filePath);
+    void OfferFile(const QString &filePath);
+    void SendChunks();
+    void ParseOffer(const FileFrame &frame);
+    void ParseChunk(const FileFrame &frame);
+    void ParseResume(const FileFrame &frame);
+    void FinishRecv(PartFile *part);
+    void DropRecv(const quint64 &id);
+    void CloseIncoming();
+    // 上传结束（成功或放弃），不再重试
+    void DropSend(const quint64 &id);
+    // 上传中断，稍后重连续传
+    void RetrySendLater();
 public slots:
 
 private slots:
@@ -138,5 +228,9 @@ private slots:
     void SltReadyRead();
     void SltConnected();
     void SltDisConnected();
+    // 上传中断后重连
+    void SltRetrySend();
+    // 计算一段摘要
+    void SltHashTurn();
 };
 #endif // TCPCLIENT_H
@@ -7,12 +7,19 @@ HEADERS += \
     $$PWD/myapp.h \
     $$PWD/unit.h \
     $$PWD/qqcell.h \
-    $$PWD/iteminfo.h
+    $$PWD/iteminfo.h \
+    $$PWD/framecodec.h \
+    $$PWD/msgcodec.h \
+    $$PWD/filetransfer.h \
+    $$PWD/protocol.h
 
 SOURCES += \
     $$PWD/myapp.cpp \
     $$PWD/qqcell.cpp \
-    $$PWD/iteminfo.cpp
+    $$PWD/iteminfo.cpp \
+    $$PWD/framecodec.cpp \
+    $$PWD/msgcodec.cpp \
+    $$PWD/filetransfer.cpp
 
 
 INCLUDEPATH     += $$PWD
@@ -0,0 +1,52 @@
+#ifndef MSGCODEC_H
+#define MSGCODEC_H
+
+#include <QByteArray>
+#include <QJsonObject>
+#include <QJsonValue>
+#include <QCborMap>
+
+// 转发帧负载：[0x01][quint8 type][qint32 peer][qint32 msgId][data 原始编码]，整数大端。
+// 客户端发出时 peer 为接收者，服务器转出时 peer 改写为发送者，data 原样转发
+#define RELAY_MARKER        0x01
+#define RELAY_HEADER_SIZE   10
+
+/////////////////////////////////////////////////////////////////
+/// \brief The MsgCodec class
+/// 消息信封 {type, from, data} 的编解码（只处理负载，不含帧头）。
+/// 支持紧凑 JSON 和 CBOR 两种编码，登录时协商；
+/// 接收端按首字节识别：'{' 为 JSON，其余按 CBOR 解析，因此切换编码前后的帧都能正确解析。
+/// CBOR 与 QJsonValue 之间用流式读写直接转换，不经过中间的 QCborValue 树；
+/// 协议结构可以直接编码为 QCborMap（见 protocol.h）
+class MsgCodec
+{
+public:
+    typedef enum {
+        Json = 0,
+        Cbor,
+    } E_FORMAT;
+
+    // 编码信封
+    static QByteArray Encode(const quint8 &type, const int &from, const QJsonValue &data, const E_FORMAT &format = Json);
+    // 协议结构的 CBOR 编码
+    static QByteArray Encode(const quint8 &type, const int &from, const QCborMap &data);
+    // 解码信封，负载不是合法对象时返回 false
+    static bool Decode(const QByteArray &payload, QJsonObject &envelope);
+    // CBOR 负载解码为 QCborMap，data 直接交给协议结构解码
+    static bool Decode(const QByteArray &payload, QCborMap &envelope);
+    // 负载的编码格式
+    static E_FORMAT Detect(const QByteArray &payload);
+
+    // 单独编解码 data 部分（转发帧的消息体）
+    static QByteArray EncodeData(const QJsonValue &data, const E_FORMAT &format = Json);
+    static bool DecodeData(const QByteArray &body, QJsonValue &data);
+
+    // 转发帧：只读写固定头，消息体不解析
+    static bool IsRelay(const QByteArray &payload);
+    static QByteArray PackRelay(const quint8 &type, const int &peer, const int &msgId, const QByteArray &body);
+    static bool ParseRelay(const QByteArray &payload, quint8 &type, int &peer, int &msgId);
+    // 原地改写 peer，offset 为转发负载在 data 中的起始位置
+    static void SetRelayPeer(QByteArray &data, const int &peer, const int &offset = 0);
+};
+
+#endif // MSGCODEC_H
@@ -147,6 +147,11 @@ void LoginWidget::SltTcpStatus(const quint8 &state)
         CMessageBox::Infomation(this, "登录失败，该账户已登录！");
     }
         break;
+    case LoginBusy:
+    {
+        CMessageBox::Infomation(this, "服务器繁忙，请稍后再试！");
+    }
+        break;
 
     case RegisterOk:
     {
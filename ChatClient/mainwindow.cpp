@@ -650,6 +650,11 @@ void MainWindow::SltTcpReply(const quint8 &type, const QJsonValue &dataVal)
         ParseAckReply(dataVal);
     }
         break;
+    case Throttled:
+    {
+        ParseThrottledReply(dataVal);
+    }
+        break;
     default:
         break;
     }
@@ -1291,3 +1296,24 @@ void MainWindow::ParseAckReply(const QJsonValue &dataVal)
         }
     }
 }
+
+/**
+ * @brief MainWindow::ParseThrottledReply
+ * 发送过快被服务器拒绝，私聊消息标记为发送失败，可以稍后重发
+ * @param dataVal
+ */
+void MainWindow::ParseThrottledReply(const QJsonValue &dataVal)
+{
+    if (!dataVal.isObject()) return;
+    QJsonObject obj = dataVal.toObject();
+    int toId = obj.value("to").toInt();
+    int msgId = obj.value("msgId").toInt();
+    if (0 == msgId) return;
+
+    foreach (ChatWindow *window, m_chatFriendWindows) {
+        if (window->GetUserId() == toId) {
+            window->UpdateMessageStatus(msgId, MsgFailed);
+            break;
+        }
+    }
+}
@@ -109,6 +109,7 @@ private:
     void ParseFriendMessageReply(const QJsonValue &dataVal);
     void ParseGroupMessageReply(const QJsonValue &dataVal);
     void ParseAckReply(const QJsonValue &dataVal);
+    void ParseThrottledReply(const QJsonValue &dataVal);
 
     void AddMyGroups(const QJsonValue &dataVal);
     void UpdateFriendStatus(const quint8 &nStatus, const QJsonValue &dataVal);
@@ -0,0 +1,77 @@
+#include "msglatency.h"
+
+#include <algorithm>
+
+// 未确认消息的上限，超过后丢弃（多为断线期间发出、再也收不到 Ack 的消息）
+#define LATENCY_MAX_PENDING     4096
+// 单次会话保留的样本数上限
+#define LATENCY_MAX_SAMPLES     65536
+
+MsgLatency::MsgLatency()
+{
+    m_clock.start();
+}
+
+void MsgLatency::Sent(const int &msgId)
+{
+    if (0 == msgId) return;
+    if (m_pending.size() >= LATENCY_MAX_PENDING) m_pending.clear();
+
+    m_pending.insert(msgId, m_clock.nsecsElapsed());
+}
+
+void MsgLatency::Acked(const int &msgId)
+{
+    QHash<int, qint64>::iterator it = m_pending.find(msgId);
+    if (it == m_pending.end()) return;
+
+    qint64 nUs = (m_clock.nsecsElapsed() - it.value()) / 1000;
+    m_pending.erase(it);
+
+    if (m_samples.size() < LATENCY_MAX_SAMPLES) m_samples.append(nUs);
+}
+
+void MsgLatency::Cancel(const int &msgId)
+{
+    m_pending.remove(msgId);
+}
+
+int MsgLatency::SampleCount() const
+{
+    return m_samples.size();
+}
+
+/**
+ * @brief MsgLatency::Percentile
+ * 最近秩法，对样本副本做部分排序
+ * @param p
+ * @return
+ */
+qint64 MsgLatency::Percentile(const double &p) const
+{
+    if (m_samples.isEmpty()) return -1;
+
+    QVector<qint64> samples = m_samples;
+    int nIndex = qBound(0, int(p * samples.size() + 0.999999) - 1, samples.size() - 1);
+    std::nth_element(samples.begin(), samples.begin() + nIndex, samples.end());
+    return samples.at(nIndex);
+}
+
+QString MsgLatency::Summary() const
+{
+    if (m_samples.isEmpty()) return QString("send-to-ack count 0, pending %1").arg(m_pending.size());
+
+    qint64 nMax = *std::max_element(m_samples.constBegin(), m_samples.constEnd());
+    return QString("send-to-ack count %1, p50 %2 ms, p99 %3 ms, max %4 ms, pending %5")
+            .arg(m_samples.size())
+            .arg(double(Percentile(0.50)) / 1000, 0, 'f', 1)
+            .arg(double(Percentile(0.99)) / 1000, 0, 'f', 1)
+            .arg(double(nMax) / 1000, 0, 'f', 1)
+            .arg(m_pending.size());
+}
+
+void MsgLatency::Reset()
+{
+    m_pending.clear();
+    m_samples.clear();
+}
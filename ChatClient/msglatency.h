@@ -0,0 +1,41 @@
+#ifndef MSGLATENCY_H
+#define MSGLATENCY_H
+
+#include <QHash>
+#include <QVector>
+#include <QString>
+#include <QElapsedTimer>
+
+/////////////////////////////////////////////////////////////////
+/// \brief The MsgLatency class
+/// 客户端私聊消息的发送到 Ack 耗时：发送时按 msgId 记录时间，收到 Ack 时得到一个样本。
+/// 统计范围是一次连接（会话），断开时输出 p50/p99 后清空
+class MsgLatency
+{
+public:
+    MsgLatency();
+
+    // 消息写入 socket
+    void Sent(const int &msgId);
+    // 收到服务器的 Ack
+    void Acked(const int &msgId);
+    // 被服务器拒绝（限流），不计入样本
+    void Cancel(const int &msgId);
+
+    // 本次会话的统计，格式：count p50 p99 max（毫秒）
+    QString Summary() const;
+    void Reset();
+
+    int SampleCount() const;
+    // p 取 0~1，没有样本返回 -1，单位微秒
+    qint64 Percentile(const double &p) const;
+
+private:
+    QElapsedTimer           m_clock;
+    // 已发送、未收到 Ack 的消息
+    QHash < int, qint64 >   m_pending;
+    // 发送到 Ack 的耗时（微秒）
+    QVector < qint64 >      m_samples;
+};
+
+#endif // MSGLATENCY_H
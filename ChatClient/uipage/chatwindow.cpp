@@ -36,6 +36,8 @@ ChatWindow::ChatWindow(QWidget *parent) :
     ui->widgetFileBoard->setVisible(false);
 
     m_nFileType = 0;
+    m_bFileNotified = false;
+    m_nFileMsgId = -1;
 
     m_model = new QStandardItemModel(this);
     m_model->setRowCount(3);
@@ -45,8 +47,14 @@ ChatWindow::ChatWindow(QWidget *parent) :
     m_tcpFileSocket = new ClientFileSocket(this);    
 
     connect(m_tcpFileSocket, SIGNAL(signamFileRecvOk(quint8,QString)), this, SLOT(SltFileRecvFinished(quint8,QString)));
-    connect(m_tcpFileSocket, SIGNAL(signalUpdateProgress(quint64,quint64)),
-            this, SLOT(SltUpdateProgress(quint64,quint64)));
+    connect(m_tcpFileSocket, SIGNAL(signalUpdateProgress(QString,quint64,quint64)),
+            this, SLOT(SltUpdateProgress(QString,quint64,quint64)));
+    connect(m_tcpFileSocket, SIGNAL(signalSendStarted(QString,quint64)),
+            this, SLOT(SltFileSendStarted(QString,quint64)));
+    connect(m_tcpFileSocket, SIGNAL(signalSendFailed(QString)),
+            this, SLOT(SltFileSendFailed(QString)));
+    connect(m_tcpFileSocket, SIGNAL(signalResumeRecv(QString)),
+            this, SLOT(SltResumeDownload(QString)));
 
     // 语音录制器
     m_audioRecorder = new AudioRecorder(this);
@@ -416,12 +424,15 @@ void ChatWindow::UpdateMessageStatus(int msgId, quint8 status)
 
 /**
  * @brief ChatWindow::SltUpdateProgress
+ * 同一连接上可能同时传着图片和其他文件，发送时只跟踪当前选择的文件
+ * @param filePath
  * @param currSize
  * @param total
  */
-void ChatWindow::SltUpdateProgress(quint64 bytes, quint64 total)
+void ChatWindow::SltUpdateProgress(const QString &filePath, quint64 bytes, quint64 total)
 {
     if (SendPicture == m_nFileType) return;
+    if (SendFile == m_nFileType && filePath != m_strFileName) return;
 
     // 总时间
     int nTime = m_updateTime.elapsed();
@@ -437,56 +448,96 @@ void ChatWindow::SltUpdateProgress(quint64 bytes, quint64 total)
    ui->progressBar->setValue(bytes);
 
    ui->widgetFileBoard->setVisible(bytes < total);
+}
 
-   // 文件发送完成，发送消息给服务器，转发至对端
-   if (bytes >= total && SendFile == m_nFileType) {
-       // 生成本地消息ID与时间戳，便于送达匹配
-       int msgId = int(QDateTime::currentMSecsSinceEpoch() % 2147483647);
-
-       // 统一构建并发送 JSON（复用文件协议）
-       QJsonObject json;
-       json.insert("id", MyApp::m_nId);
-       json.insert("to", m_cell->id);
-       json.insert("msg", myHelper::GetFileNameWithExtension(m_strFileName));
-       json.insert("size", "文件大小：" + myHelper::CalcSize(total));
-       json.insert("type", Files);
-       json.insert("msgId", msgId);
-       json.insert("ts", QDateTime::currentMSecsSinceEpoch());
-       Q_EMIT signalSendMessage(SendFile, json);
-
-       // 构建气泡：根据是否为语音决定渲染类型
-       ItemInfo *itemInfo = new ItemInfo();
-       itemInfo->SetName(MyApp::m_strUserName);
-       itemInfo->SetDatetime(DATE_TIME);
-       itemInfo->SetHeadPixmap(MyApp::m_strHeadFile);
-       itemInfo->SetOrientation(Right);
-       itemInfo->SetMsgId(msgId);
-       itemInfo->SetStatus(MsgPending);
-
-       if (m_bSendingVoice) {
-           // 语音消息气泡
-           itemInfo->SetMsgType(Audio);
-           itemInfo->SetText("[语音消息]");
-           itemInfo->SetFilePath(m_strFileName);
-       } else {
-           // 普通文件气泡
-           itemInfo->SetMsgType(Files);
-           itemInfo->SetText(m_strFileName);
-           itemInfo->SetFileSizeString(myHelper::CalcSize(total));
-       }
-
-       // 加入聊天界面
-       ui->widgetBubble->addItem(itemInfo);
-
-       // 保存消息记录到数据库（群组不记录）
-       if (0 == m_nChatType) {
-           DataBaseMagr::Instance()->AddHistoryMsg(m_cell->id, itemInfo);
-           StartAckTimer(msgId);
-       }
-
-       // 复位语音发送标记
-       m_bSendingVoice = false;
+/**
+ * @brief ChatWindow::SltFileSendStarted
+ * 服务器接受上传后就发送消息给服务器，转发至对端，对端不必等上传完成即可开始下载
+ * @param filePath
+ * @param total
+ */
+void ChatWindow::SltFileSendStarted(const QString &filePath, quint64 total)
+{
+   if (SendFile != m_nFileType || filePath != m_strFileName) return;
+   // 断线重连后会再次收到
+   if (m_bFileNotified) return;
+   m_bFileNotified = true;
+
+   // 生成本地消息ID与时间戳，便于送达匹配
+   int msgId = int(QDateTime::currentMSecsSinceEpoch() % 2147483647);
+   m_nFileMsgId = msgId;
+
+   // 统一构建并发送 JSON（复用文件协议）
+   QJsonObject json;
+   json.insert("id", MyApp::m_nId);
+   json.insert("to", m_cell->id);
+   json.insert("msg", myHelper::GetFileNameWithExtension(m_strFileName));
+   json.insert("size", "文件大小：" + myHelper::CalcSize(total));
+   json.insert("type", Files);
+   json.insert("msgId", msgId);
+   json.insert("ts", QDateTime::currentMSecsSinceEpoch());
+   Q_EMIT signalSendMessage(SendFile, json);
+
+   // 构建气泡：根据是否为语音决定渲染类型
+   ItemInfo *itemInfo = new ItemInfo();
+   itemInfo->SetName(MyApp::m_strUserName);
+   itemInfo->SetDatetime(DATE_TIME);
+   itemInfo->SetHeadPixmap(MyApp::m_strHeadFile);
+   itemInfo->SetOrientation(Right);
+   itemInfo->SetMsgId(msgId);
+   itemInfo->SetStatus(MsgPending);
+
+   if (m_bSendingVoice) {
+       // 语音消息气泡
+       itemInfo->SetMsgType(Audio);
+       itemInfo->SetText("[语音消息]");
+       itemInfo->SetFilePath(m_strFileName);
+   } else {
+       // 普通文件气泡
+       itemInfo->SetMsgType(Files);
+       itemInfo->SetText(m_strFileName);
+       itemInfo->SetFileSizeString(myHelper::CalcSize(total));
    }
+
+   // 加入聊天界面
+   ui->widgetBubble->addItem(itemInfo);
+
+   // 保存消息记录到数据库（群组不记录）
+   if (0 == m_nChatType) {
+       DataBaseMagr::Instance()->AddHistoryMsg(m_cell->id, itemInfo);
+       StartAckTimer(msgId);
+   }
+
+   // 复位语音发送标记
+   m_bSendingVoice = false;
+}
+
+/**
+ * @brief ChatWindow::SltFileSendFailed
+ * 上传放弃：已通知对端的文件消息标记为发送失败，对端的下载由服务器通知失败
+ * @param filePath
+ */
+void ChatWindow::SltFileSendFailed(const QString &filePath)
+{
+    if (SendFile != m_nFileType || filePath != m_strFileName) return;
+
+    ui->widgetFileBoard->setVisible(false);
+    if (!m_bFileNotified) {
+        CMessageBox::Infomation(this, tr("文件发送失败！"));
+        return;
+    }
+
+    // 消息本身可能已经收到 Ack，以上传结果为准
+    if (m_ackTimers.contains(m_nFileMsgId)) {
+        QTimer *timer = m_ackTimers.take(m_nFileMsgId);
+        timer->stop();
+        timer->deleteLater();
+    }
+
+    ui->widgetBubble->updateMessageStatus(m_nFileMsgId, MsgFailed);
+    if (0 == m_nChatType) {
+        DataBaseMagr::Instance()->UpdateMsgStatus(m_cell->id, m_nFileMsgId, MsgFailed);
+    }
 }
 
 /**
@@ -562,12 +613,13 @@ void ChatWindow::on_btnSendFile_clicked()
         return;
     }
 
-    // 开始传输文件
-    m_tcpFileSocket->StartTransferFile(strFileName);
-
     // 开始计时
     m_updateTime.restart();
     m_nFileType = SendFile;
+    m_bFileNotified = false;
+
+    // 开始传输文件
+    m_tcpFileSocket->StartTransferFile(strFileName);
 }
 
 // 服务器下载文件
@@ -584,6 +636,21 @@ void ChatWindow::SltDownloadFiles(const QString &fileName)
     Q_EMIT signalSendMessage(GetFile, json);
 }
 
+/**
+ * @brief ChatWindow::SltResumeDownload
+ * 文件连接断开后重连，重新请求中断的下载，文件连接已经连上
+ * @param fileName
+ */
+void ChatWindow::SltResumeDownload(const QString &fileName)
+{
+    QJsonObject json;
+    json.insert("from", MyApp::m_nId);
+    json.insert("id", m_cell->id);
+    json.insert("msg", fileName);
+
+    Q_EMIT signalSendMessage(GetFile, json);
+}
+
 void ChatWindow::on_toolButton_4_clicked()
 {
 
@@ -775,6 +842,7 @@ void ChatWindow::SendVoiceMessage(const QString &voiceFilePath)
     m_strFileName = voiceFilePath;
     m_updateTime.start();
     m_nFileType = SendFile;
+    m_bFileNotified = false;
     m_bSendingVoice = true;
 
     // 启动文件传输
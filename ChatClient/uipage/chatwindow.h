@@ -56,6 +56,10 @@ private:
     QTime            m_updateTime;
 
     quint8          m_nFileType;
+    // 当前文件已通知对端（服务器接受上传后即通知，对端可以边传边下）
+    bool            m_bFileNotified;
+    // 当前文件消息气泡的 msgId，上传放弃时标记为失败
+    int             m_nFileMsgId;
 
     quint8          m_nChatType;        // 聊天类型，群组聊天或私人聊天
 
@@ -73,7 +77,10 @@ private slots:
     void on_toolButton_7_clicked();
     // 文件
     void SltFileRecvFinished(const quint8 &type, const QString &filePath);
-    void SltUpdateProgress(quint64 bytes, quint64 total);
+    void SltUpdateProgress(const QString &filePath, quint64 bytes, quint64 total);
+    void SltFileSendStarted(const QString &filePath, quint64 total);
+    void SltFileSendFailed(const QString &filePath);
+    void SltResumeDownload(const QString &fileName);
 
     void on_toolButton_6_clicked();
 
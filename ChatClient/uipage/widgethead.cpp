@@ -27,7 +27,7 @@ WidgetHead::WidgetHead(QWidget *parent) :
     // 启动的时候就连接服务器，方便头像下载
     headUpLoadSocket->ConnectToServer(MyApp::m_strHostAddr, MyApp::m_nFilePort, -2);
 
-    connect(headUpLoadSocket, SIGNAL(signalSendFinished()), this, SLOT(SltSendFileOk()));
+    connect(headUpLoadSocket, SIGNAL(signalSendFinished(QString)), this, SLOT(SltSendFileOk()));
     connect(headUpLoadSocket, SIGNAL(signalConnectd()), this, SLOT(SltConnectedToServer()));
     connect(headUpLoadSocket, SIGNAL(signamFileRecvOk(quint8,QString)), this, SLOT(SltFileRecvOk(quint8,QString)));
 
@@ -24,26 +24,20 @@ DEFINES += QT_DEPRECATED_WARNINGS
 
 
 SOURCES += main.cpp\
-        mainwindow.cpp \
-    myapp.cpp \
-    databasemagr.cpp \
-    clientsocket.cpp \
-    tcpserver.cpp
+        mainwindow.cpp
 
 HEADERS  += mainwindow.h \
-    myapp.h \
-    databasemagr.h \
-    clientsocket.h \
-    tcpserver.h \
-    unit.h \
     global.h
 
 FORMS    += mainwindow.ui
 
+CONFIG += c++11
+
 RESOURCES += \
     images.qrc
 
 
+include($$PWD/server.pri)
 include($$PWD/basewidget/basewidget.pri)
 
 DESTDIR         = $$PWD/../release/Server
@@ -0,0 +1,21 @@
+#-------------------------------------------------
+#
+# 无界面服务进程，不依赖 QtGui/QtWidgets
+#
+#-------------------------------------------------
+
+QT       = core sql network
+
+TARGET = ChatServerd
+TEMPLATE = app
+
+CONFIG += console c++11
+CONFIG -= app_bundle
+
+DEFINES += QT_DEPRECATED_WARNINGS
+
+SOURCES += maind.cpp
+
+include($$PWD/server.pri)
+
+DESTDIR         = $$PWD/../release/Server
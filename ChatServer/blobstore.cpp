@@ -0,0 +1,110 @@
+#include "blobstore.h"
+#include "databasemagr.h"
+#include "filetransfer.h"
+#include "myapp.h"
+#include "logger.h"
+
+#include <QFile>
+#include <QFileInfo>
+#include <QDir>
+
+BlobStore *BlobStore::self = NULL;
+
+BlobStore::BlobStore()
+{
+}
+
+QString BlobStore::BlobPath(const QString &sha)
+{
+    return MyApp::m_strBlobPath + sha.left(2) + "/" + sha;
+}
+
+/**
+ * @brief BlobStore::Link
+ * 只链接 owner 自己上传过（仍有文件名指向）的内容：摘要是客户端声明的，
+ * 不限定上传者时知道摘要和大小就能取得别人的文件。
+ * 数据库中有记录但文件已被删除时按不存在处理，让客户端重新上传
+ * @param owner 上传者
+ * @param name
+ * @param sha
+ * @param size
+ * @return
+ */
+bool BlobStore::Link(const int &owner, const QString &name, const QByteArray &sha, const quint64 &size)
+{
+    QString strSha = QString::fromLatin1(sha.toHex());
+    if (!DataBaseMagr::Instance()->HasFileBlob(strSha, size, owner)) return false;
+    QFileInfo info(BlobPath(strSha));
+    if (!info.exists() || quint64(info.size()) != size) return false;
+
+    QString strReleased;
+    if (!DataBaseMagr::Instance()->LinkFileBlob(owner, name, strSha, size, strReleased)) return false;
+
+    Release(strReleased);
+    return true;
+}
+
+/**
+ * @brief BlobStore::Adopt
+ * 同一文件系统内改名，正在读原文件的下载不受影响
+ * @param path 上传完成的文件
+ * @param owner
+ * @param name
+ * @param sha
+ * @return
+ */
+QString BlobStore::Adopt(const QString &path, const int &owner, const QString &name, const QByteArray &sha)
+{
+    QString strSha = QString::fromLatin1(sha.toHex());
+    QString strBlob = BlobPath(strSha);
+    quint64 nSize = quint64(QFileInfo(path).size());
+
+    QFileInfo info(strBlob);
+    if (info.exists() && quint64(info.size()) == nSize) {
+        QFile::remove(path);
+        QFile::remove(PartFile::CrcPath(path));
+        LOG_INFO(LogFile) << "blob exists, drop upload" << name << strSha;
+    } else {
+        QDir().mkpath(info.path());
+        QFile::remove(strBlob);
+        QFile::remove(PartFile::CrcPath(strBlob));
+        if (!QFile::rename(path, strBlob)) {
+            LOG_ERROR(LogFile) << "move file into blob store error" << path << strBlob;
+            return QString();
+        }
+        QFile::rename(PartFile::CrcPath(path), PartFile::CrcPath(strBlob));
+    }
+
+    QString strReleased;
+    if (!DataBaseMagr::Instance()->LinkFileBlob(owner, name, strSha, nSize, strReleased)) {
+        LOG_ERROR(LogFile) << "link file blob error" << name << strSha;
+        return QString();
+    }
+
+    Release(strReleased);
+    return strBlob;
+}
+
+QString BlobStore::Resolve(const int &owner, const QString &name) const
+{
+    QString strSha = DataBaseMagr::Instance()->GetFileBlob(owner, name);
+    if (strSha.isEmpty()) return QString();
+
+    QString strBlob = BlobPath(strSha);
+    return QFileInfo::exists(strBlob) ? strBlob : QString();
+}
+
+/**
+ * @brief BlobStore::Release
+ * 内容不再被任何文件名引用，删除文件；正在下载的连接已打开文件，不受影响
+ * @param sha
+ */
+void BlobStore::Release(const QString &sha)
+{
+    if (sha.isEmpty()) return;
+
+    QString strBlob = BlobPath(sha);
+    QFile::remove(strBlob);
+    QFile::remove(PartFile::CrcPath(strBlob));
+    LOG_INFO(LogFile) << "blob released" << sha;
+}
@@ -0,0 +1,49 @@
+#ifndef BLOBSTORE_H
+#define BLOBSTORE_H
+
+#include <QString>
+#include <QByteArray>
+#include <QMutex>
+
+/////////////////////////////////////////////////////////////////
+/// \brief The BlobStore class
+/// 接收文件按内容存放：文件名是内容的 SHA-256（"Blobs/ab/abcd..."），相同内容只存一份，
+/// 数据库记录每份内容的引用数，以及 (上传者, 文件名) 指向哪份内容。
+/// 上传前客户端带上摘要，服务器已有时直接完成，不必再传。
+/// 块校验记录随内容一起改名，下载仍然可以用 sendfile。只在文件服务器线程使用
+class BlobStore
+{
+public:
+    // 单实例
+    static BlobStore *Instance()
+    {
+        static QMutex mutex;
+        if (NULL == self) {
+            QMutexLocker locker(&mutex);
+
+            if (!self) {
+                self = new BlobStore();
+            }
+        }
+
+        return self;
+    }
+
+    // 已有这份内容时让文件名指向它，返回 false 表示需要上传
+    bool Link(const int &owner, const QString &name, const QByteArray &sha, const quint64 &size);
+    // 上传完成的文件移入存储（已有相同内容时删除上传的文件），返回内容文件路径，失败返回空
+    QString Adopt(const QString &path, const int &owner, const QString &name, const QByteArray &sha);
+    // 下载时按文件名找到内容文件，找不到返回空
+    QString Resolve(const int &owner, const QString &name) const;
+
+    static QString BlobPath(const QString &sha);
+
+private:
+    BlobStore();
+
+    static BlobStore *self;
+
+    void Release(const QString &sha);
+};
+
+#endif // BLOBSTORE_H
@@ -1,30 +1,86 @@
 #include "clientsocket.h"
 #include "databasemagr.h"
+#include "presencemagr.h"
+#include "dbworker.h"
 #include "unit.h"
 #include "myapp.h"
+#include "msgcodec.h"
+#include "logger.h"
+#include "metrics.h"
+#include "msgtrace.h"
+#include "timingwheel.h"
+#include "ratelimit.h"
+#include "readscheduler.h"
+#include "filetransfer.h"
+#include "filerelay.h"
+#include "blobstore.h"
 
 #include <QDebug>
 #include <QDataStream>
-#include <QApplication>
+#include <QCoreApplication>
 #include <QFileInfo>
 #include <QDateTime>
 
+#include <QSocketNotifier>
+#include <QtEndian>
+
+#include <string.h>
+
+#ifdef Q_OS_LINUX
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+#include <errno.h>
+#endif
+
+// sendfile 每次最多发送的字节数，发完后回到事件循环，其他连接不会被一个大文件阻塞
+#define SENDFILE_TURN_BYTES     (4 * 1024 * 1024)
+
 ClientSocket::ClientSocket(QObject *parent, QTcpSocket *tcpSocket) :
     QObject(parent)
 {
     m_nId = -1;
+    m_bOfflineBatch = false;
+    m_nOfflineSent = 0;
+    m_nReadNs = 0;
+    m_idleWheel = NULL;
+    m_nActiveMs = 0;
+    m_bProbeSent = false;
+    m_bLoginPending = false;
+    m_bPresence = false;
+    m_bSessionEnded = false;
+    m_readScheduler = NULL;
+    m_bReadQueued = false;
+    m_bCborPending = false;
+    m_bCbor = false;
+    m_bRelayPending = false;
+    m_bRelay = false;
+    m_nOutBytes = 0;
+    m_bFlushPending = false;
+    m_bCongested = false;
 
     if (tcpSocket == NULL) m_tcpSocket = new QTcpSocket(this);
     m_tcpSocket = tcpSocket;
 
+    m_frameCodec.SetMaxFrameSize(MyApp::m_nMaxFrameSize);
+    // 缓冲满后 Qt 暂停从内核读取，由 TCP 流控让发送方慢下来
+    if (MyApp::m_nReadBufferSize > 0) m_tcpSocket->setReadBufferSize(MyApp::m_nReadBufferSize);
+
     connect(m_tcpSocket, SIGNAL(readyRead()), this, SLOT(SltReadyRead()));
     connect(m_tcpSocket, SIGNAL(connected()), this, SLOT(SltConnected()));
     connect(m_tcpSocket, SIGNAL(disconnected()), this, SLOT(SltDisconnected()));
+    connect(m_tcpSocket, SIGNAL(bytesWritten(qint64)), this, SLOT(SltBytesWritten(qint64)));
+
+    Metrics::Add(MetConnAccepted);
+    Metrics::GaugeAdd(MetConnections, 1);
 }
 
 ClientSocket::~ClientSocket()
 {
+    // 校验结果返回前连接已释放，结果回调不会再执行
+    if (m_bLoginPending) RateLimiter::FinishLogin();
 
+    Metrics::Add(MetConnClosed);
+    Metrics::GaugeAdd(MetConnections, -1);
 }
 
 int ClientSocket::GetUserId() const
@@ -32,220 +88,586 @@ int ClientSocket::GetUserId() const
     return m_nId;
 }
 
+QString ClientSocket::GetUserName() const
+{
+    return m_strName;
+}
+
+int ClientSocket::GetQueueDepth() const
+{
+    return m_nQueueDepth.load();
+}
+
+int ClientSocket::GetDroppedCount() const
+{
+    return m_nDropped.load();
+}
+
 void ClientSocket::Close()
 {
     m_tcpSocket->abort();
 }
 
+/**
+ * @brief ClientSocket::WatchIdle
+ * 读数据时只记录时间，不重新布置定时器；到期时按最后活动时间判断是探测、关闭还是顺延
+ * @param wheel
+ */
+void ClientSocket::WatchIdle(TimingWheel *wheel)
+{
+    if (NULL == wheel || MyApp::m_nIdleTimeoutSec <= 0) return;
+
+    m_idleWheel = wheel;
+    m_nActiveMs = TimingWheel::NowMs();
+    m_idleNode.callback = [this]() { CheckIdle(); };
+    m_idleWheel->Arm(&m_idleNode, qint64(MyApp::m_nIdleTimeoutSec) * 1000 / 2);
+}
+
+/**
+ * @brief ClientSocket::CheckIdle
+ * 超时关闭连接，走正常的断开流程（下线、移出路由表、释放对象）；
+ * 过半程仍无数据且已登录时发 Ping，客户端回 Pong 即算活动
+ */
+void ClientSocket::CheckIdle()
+{
+    qint64 nTimeoutMs = qint64(MyApp::m_nIdleTimeoutSec) * 1000;
+    qint64 nIdleMs = TimingWheel::NowMs() - m_nActiveMs;
+
+    if (nIdleMs >= nTimeoutMs) {
+        LOG_INFO(LogNet) << "idle timeout, close" << m_nId << nIdleMs << "ms";
+        Metrics::Add(MetIdleReaped);
+        m_tcpSocket->abort();
+        return;
+    }
+
+    if (nIdleMs >= nTimeoutMs / 2) {
+        if (!m_bProbeSent && m_nId > 0) {
+            m_bProbeSent = true;
+            Metrics::Add(MetIdleProbes);
+
+            PingMsg ping;
+            ping.id = m_nId;
+            ping.ts = QDateTime::currentMSecsSinceEpoch();
+            SendStruct(Ping, ping);
+        }
+        m_idleWheel->Arm(&m_idleNode, nTimeoutMs - nIdleMs);
+    } else {
+        m_idleWheel->Arm(&m_idleNode, nTimeoutMs / 2 - nIdleMs);
+    }
+}
+
 void ClientSocket::SltConnected()
 {
-    qDebug() << "connected";
+    LOG_INFO(LogNet) << "connected";
     //    Q_EMIT signalConnected();
 }
 
 void ClientSocket::SltDisconnected()
 {
-    qDebug() << "disconnected";
-    DataBaseMagr::Instance()->UpdateUserStatus(m_nId, OffLine);
+    LOG_INFO(LogNet) << "disconnected";
+    ClearOutbound();
+    EndSession();
+}
+
+/**
+ * @brief ClientSocket::EndSession
+ * 只释放本连接自己占用的在线状态：同一用户可能已在其他线程用新连接登录，
+ * 旧连接不能清除新会话的在线状态（与 TcpMsgServer::ClientLogout 只移除自己相同）
+ */
+void ClientSocket::EndSession()
+{
+    if (m_bSessionEnded) return;
+    m_bSessionEnded = true;
+
+    if (m_bPresence) {
+        m_bPresence = false;
+        PresenceMagr::Instance()->SetOffline(m_nId);
+    }
     Q_EMIT signalDisConnected();
 }
 
 /**
  * @brief ClientSocket::SltReadyRead
- * 读取socket数据
+ * 读取socket数据，一次读取中可能包含多个帧，也可能只有半帧
  */
 void ClientSocket::SltReadyRead()
 {
-    // 读取socket数据
-    QByteArray reply = m_tcpSocket->readAll();
-    QJsonParseError jsonError;
-    // 转化为 JSON 文档
-    QJsonDocument doucment = QJsonDocument::fromJson(reply, &jsonError);
-    // 解析未发生错误
-    if (!doucment.isNull() && (jsonError.error == QJsonParseError::NoError)) {
-        // JSON 文档为对象
-        if (doucment.isObject()) {
-            // 转化为对象
-            QJsonObject jsonObj = doucment.object();
-            int nType = jsonObj.value("type").toInt();
-            QJsonValue dataVal = jsonObj.value("data");
-
-            switch (nType) {
-            case Register:
-            {
-                ParseReister(dataVal);
-            }
-                break;
-            case Login:
-            {
-                ParseLogin(dataVal);
-            }
-                break;
-            case UserOnLine:
-            {
-                ParseUserOnline(dataVal);
-            }
-                break;
-            case Logout:
-            {
-                ParseLogout(dataVal);
-                Q_EMIT signalDisConnected();
-                m_tcpSocket->abort();
-            }
-                break;
-            case UpdateHeadPic:
-            {
-                ParseUpdateUserHead(dataVal);
-            }
-                break;
-            case AddFriend:
-            {
-                ParseAddFriend(dataVal);
-            }
-                break;
-            case AddGroup:
-            {
-                ParseAddGroup(dataVal);
-            }
-                break;
-            case CreateGroup:
-            {
-                ParseCreateGroup(dataVal);
-            }
-                break;
-            case GetMyFriends:
-            {
-                ParseGetMyFriend(dataVal);
-            }
-                break;
-            case GetMyGroups:
-            {
-                ParseGetMyGroups(dataVal);
-            }
-                break;
+    m_nReadNs = MsgTrace::NowNs();
+    m_nActiveMs = TimingWheel::NowMs();
+    m_bProbeSent = false;
 
-            case RefreshFriends:
-            {
-                ParseRefreshFriend(dataVal);
-            }
-                break;
-            case RefreshGroups:
-            {
-                ParseRefreshGroups(dataVal);
-            }
-                break;
+    // 已在读调度队列中，轮到时再读
+    if (m_bReadQueued) return;
+    ReadTurn();
+}
 
-            case SendMsg:
-            case SendFile:
-            case SendPicture:
-            {
-                ParseFriendMessages(reply);
-            }
-                break;
-            case SendGroupMsg:
-            {
-                ParseGroupMessages(reply);
-            }
-                break;
-            case SendFace:
-            {
-                ParseFaceMessages(reply);
-            }
-                break;
-            case SendFileOk:
-            {
+void ClientSocket::SetReadScheduler(ReadScheduler *scheduler)
+{
+    m_readScheduler = scheduler;
+}
 
-            }
-                break;
-            case GetFile:
-            {
-                Q_EMIT signalDownloadFile(dataVal);
-            }
-                break;
-            case Ping:
-            {
-                // 心跳回应
-                QJsonObject json;
-                json.insert("id", m_nId);
-                json.insert("ts", QDateTime::currentMSecsSinceEpoch());
-                SltSendMessage(Pong, json);
-            }
-                break;
-            default:
-                break;
+/**
+ * @brief ClientSocket::ReadTurn
+ * 先处理缓冲中已经完整的帧，没有完整帧时才继续从 socket 读，
+ * 分帧缓冲最多是一个未完整的帧加一轮的字节数。
+ * 字节或帧数预算用完仍有数据时，排入读调度队列等下一轮
+ */
+void ClientSocket::ReadTurn()
+{
+    m_bReadQueued = false;
+    int nMaxBytes = (NULL != m_readScheduler) ? m_readScheduler->BudgetBytes() : 0;
+    int nMaxFrames = (NULL != m_readScheduler) ? m_readScheduler->BudgetFrames() : 0;
+    int nBytes = 0;
+    int nFrames = 0;
+
+    QByteArray frame;
+    forever {
+        while ((0 == nMaxFrames || nFrames < nMaxFrames) && m_frameCodec.TakeFrame(frame)) {
+            ParseFrame(frame);
+            nFrames++;
+            // 处理过程中连接可能已经被关闭（如注销）
+            if (!m_tcpSocket->isOpen()) return;
+        }
+
+        // 帧长度超过上限，断开连接
+        if (m_frameCodec.HasError()) {
+            LOG_WARN(LogNet) << "frame too large, abort" << m_nId << m_frameCodec.GetMaxFrameSize();
+            m_tcpSocket->abort();
+            return;
+        }
+
+        if (nMaxFrames > 0 && nFrames >= nMaxFrames) break;
+        if (nMaxBytes > 0 && nBytes >= nMaxBytes) break;
+
+        QByteArray data = (nMaxBytes > 0) ? m_tcpSocket->read(nMaxBytes - nBytes) : m_tcpSocket->readAll();
+        if (data.isEmpty()) break;
+        nBytes += data.size();
+        Metrics::Add(MetBytesIn, data.size());
+        m_frameCodec.Append(data);
+    }
+
+    if (NULL == m_readScheduler) return;
+    if (m_tcpSocket->bytesAvailable() > 0 || nFrames >= nMaxFrames) {
+        m_bReadQueued = true;
+        Metrics::Add(MetReadDeferred);
+        m_readScheduler->Schedule(this);
+    }
+}
+
+/**
+ * @brief ClientSocket::s_msgRoutes
+ * 消息类型到处理函数的分发表，常量初始化，不在运行时构造
+ */
+const ClientSocket::MsgRoute ClientSocket::s_msgRoutes[] = {
+    { Register,         &ClientSocket::Dispatch<RegisterMsg,    &ClientSocket::ParseReister> },
+    { Login,            &ClientSocket::Dispatch<LoginMsg,       &ClientSocket::ParseLogin> },
+    { UserOnLine,       &ClientSocket::Dispatch<IdListMsg,      &ClientSocket::ParseUserOnline> },
+    { Logout,           &ClientSocket::Dispatch<LogoutMsg,      &ClientSocket::ParseLogout> },
+    { UpdateHeadPic,    &ClientSocket::Dispatch<UpdateHeadMsg,  &ClientSocket::ParseUpdateUserHead> },
+    { AddFriend,        &ClientSocket::Dispatch<NameMsg,        &ClientSocket::ParseAddFriend> },
+    { AddGroup,         &ClientSocket::Dispatch<NameMsg,        &ClientSocket::ParseAddGroup> },
+    { CreateGroup,      &ClientSocket::Dispatch<NameMsg,        &ClientSocket::ParseCreateGroup> },
+    { GetMyFriends,     &ClientSocket::Dispatch<IdListMsg,      &ClientSocket::ParseGetMyFriend> },
+    { GetMyGroups,      &ClientSocket::Dispatch<IdMsg,          &ClientSocket::ParseGetMyGroups> },
+    { RefreshFriends,   &ClientSocket::Dispatch<IdListMsg,      &ClientSocket::ParseRefreshFriend> },
+    { RefreshGroups,    &ClientSocket::Dispatch<IdMsg,          &ClientSocket::ParseRefreshGroups> },
+    { SendMsg,          &ClientSocket::Dispatch<ChatMsg,        &ClientSocket::ParseFriendMessages> },
+    { SendFile,         &ClientSocket::Dispatch<ChatMsg,        &ClientSocket::ParseFriendMessages> },
+    { SendPicture,      &ClientSocket::Dispatch<ChatMsg,        &ClientSocket::ParseFriendMessages> },
+    { SendGroupMsg,     &ClientSocket::Dispatch<ChatMsg,        &ClientSocket::ParseGroupMessages> },
+    { SendFace,         &ClientSocket::Dispatch<ChatMsg,        &ClientSocket::ParseFaceMessages> },
+    { GetFile,          &ClientSocket::Dispatch<GetFileMsg,     &ClientSocket::ParseGetFile> },
+    { OfflineMsgAck,    &ClientSocket::Dispatch<OfflineAckMsg,  &ClientSocket::ParseOfflineAck> },
+    { Ping,             &ClientSocket::Dispatch<PingMsg,        &ClientSocket::ParsePing> },
+};
+
+/**
+ * @brief ClientSocket::FindRoute
+ * 按类型值直接索引，索引在第一次使用时由分发表生成
+ * @param type
+ * @return
+ */
+ClientSocket::MsgDispatch ClientSocket::FindRoute(const quint8 &type)
+{
+    struct RouteIndex {
+        MsgDispatch table[256];
+
+        RouteIndex() {
+            memset(table, 0, sizeof(table));
+            for (size_t i = 0; i < sizeof(s_msgRoutes) / sizeof(s_msgRoutes[0]); i++) {
+                table[s_msgRoutes[i].type] = s_msgRoutes[i].dispatch;
             }
         }
+    };
+
+    // C++11 局部静态变量的初始化是线程安全的，多个 I/O 线程可以同时调用
+    static const RouteIndex index;
+    return index.table[type];
+}
+
+/**
+ * @brief ClientSocket::ParseFrame
+ * 解析一个完整帧：查表分发，data 在分发时一次解码校验，不合法的消息直接丢弃
+ * @param reply
+ */
+void ClientSocket::ParseFrame(const QByteArray &reply)
+{
+    // 私聊转发帧，不解码消息体
+    if (MsgCodec::IsRelay(reply)) {
+        ParseRelayMessage(reply);
+        return;
+    }
+
+    // JSON 或 CBOR 信封，按首字节识别；CBOR 的 data 不转换为 JSON，直接交给协议结构解码
+    QJsonObject jsonObj;
+    QCborMap cborMap;
+    bool bCbor = (MsgCodec::Cbor == MsgCodec::Detect(reply));
+    if (!(bCbor ? MsgCodec::Decode(reply, cborMap) : MsgCodec::Decode(reply, jsonObj))) {
+        Metrics::Add(MetMalformed);
+        return;
+    }
+
+    QJsonValue jsonData;
+    QCborValue cborData;
+    qint64 nType = 0;
+    if (bCbor) {
+        nType = cborMap.value(QLatin1String("type")).toInteger();
+        cborData = cborMap.value(QLatin1String("data"));
+    } else {
+        nType = jsonObj.value(QLatin1String("type")).toInt();
+        jsonData = jsonObj.value(QLatin1String("data"));
+    }
+
+    MsgDispatch dispatch = (nType > 0 && nType <= 0xff) ? FindRoute(quint8(nType)) : NULL;
+    if (NULL == dispatch) return;
+
+    Metrics::MsgIn(quint8(nType));
+
+    // 限流在解码消息体之前，被拒绝的请求不进入处理函数
+    int nRetryMs = 0;
+    int nRate = m_rateLimiter.Acquire(quint8(nType), nRetryMs);
+    if (RatePass != nRate) {
+        ThrottleFrame(quint8(nType), nRate, nRetryMs, jsonData, cborData);
+        return;
+    }
+
+    if (!dispatch(this, quint8(nType), jsonData, cborData)) {
+        Metrics::Add(MetMalformed);
+        LOG_WARN(LogMsg) << "malformed message, drop" << nType << m_nId;
+    }
+}
+
+/**
+ * @brief ClientSocket::Throttle
+ * 私聊消息每条都回复（相当于一个失败的 Ack），客户端据此把消息标记为发送失败；
+ * 查询类每条都回复并带回原请求，客户端等待后重发，否则列表不会加载；
+ * 登录、注册回复繁忙，登录界面据此提示；
+ * 其他请求连续被拒绝时只回复第一次，避免回复本身被用来放大流量
+ * @param type
+ * @param result    RateThrottled / RateDropped
+ * @param retryMs
+ * @param to
+ * @param msgId
+ * @param query     查询类请求的原 data，回复时带回
+ */
+void ClientSocket::Throttle(const quint8 &type, const int &result, const int &retryMs, const int &to, const int &msgId,
+                            const QJsonValue &query)
+{
+    Metrics::MsgThrottled(type);
+    LOG_DEBUG(LogMsg) << "throttled" << type << m_nId << "retry" << retryMs << "ms";
+
+    if (Login == type) {
+        ReplyLoginBusy(retryMs);
+        return;
+    }
+
+    if (Register == type) {
+        RegisterReply reply;
+        reply.id = -3;
+        SendStruct(Register, reply);
+        return;
+    }
+
+    int nClass = RateLimiter::ClassOf(type);
+    if (RateDropped == result && 0 == msgId && RateQuery != nClass) return;
+
+    ThrottleMsg msg;
+    msg.type = type;
+    msg.to = to;
+    msg.msgId = msgId;
+    msg.retry = retryMs;
+    if (RateQuery == nClass) msg.data = query;
+    SendStruct(Throttled, msg);
+}
+
+/**
+ * @brief ClientSocket::ThrottleFrame
+ * @param type
+ * @param result
+ * @param retryMs
+ * @param jsonVal   JSON 帧的 data
+ * @param cborVal   CBOR 帧的 data
+ */
+void ClientSocket::ThrottleFrame(const quint8 &type, const int &result, const int &retryMs,
+                                 const QJsonValue &jsonVal, const QCborValue &cborVal)
+{
+    bool bQuery = (RateQuery == RateLimiter::ClassOf(type));
+    if (cborVal.isUndefined()) {
+        const QJsonObject dataObj = jsonVal.toObject();
+        Throttle(type, result, retryMs, dataObj.value(QLatin1String("to")).toInt(),
+                 dataObj.value(QLatin1String("msgId")).toInt(), bQuery ? jsonVal : QJsonValue(QJsonValue::Undefined));
+    } else {
+        const QCborMap dataMap = cborVal.toMap();
+        Throttle(type, result, retryMs, int(dataMap.value(QLatin1String("to")).toInteger()),
+                 int(dataMap.value(QLatin1String("msgId")).toInteger()),
+                 bQuery ? cborVal.toJsonValue() : QJsonValue(QJsonValue::Undefined));
     }
 }
 
+/**
+ * @brief ClientSocket::ReplyLoginBusy
+ * @param retryMs
+ */
+void ClientSocket::ReplyLoginBusy(const int &retryMs)
+{
+    LoginReply reply;
+    reply.id = -3;
+    reply.code = -3;
+    reply.msg = "busy";
+    reply.version = MY_VERSION;
+    QJsonObject jsonObj = reply.Encode();
+    jsonObj.insert("retry", retryMs);
+    SltSendMessage(Login, jsonObj);
+}
+
+/**
+ * @brief ClientSocket::ParseGetFile
+ * 到文件服务器下载文件
+ * @param type
+ * @param msg
+ */
+void ClientSocket::ParseGetFile(const quint8 &, const GetFileMsg &msg)
+{
+    Q_EMIT signalDownloadFile(msg.Encode());
+}
+
+/**
+ * @brief ClientSocket::ParsePing
+ * 心跳回应
+ * @param type
+ * @param msg
+ */
+void ClientSocket::ParsePing(const quint8 &, const PingMsg &)
+{
+    PingMsg pong;
+    pong.id = m_nId;
+    pong.ts = QDateTime::currentMSecsSinceEpoch();
+    SendStruct(Pong, pong);
+}
+
 /**
  * @brief ClientSocket::ParseLogin
  * 解析登录信息
- * @param reply
+ * @param type
+ * @param msg
  */
-void ClientSocket::ParseLogin(const QJsonValue &dataVal)
+void ClientSocket::ParseLogin(const quint8 &, const LoginMsg &msg)
 {
-    // data 的 value 是对象
-    if (dataVal.isObject()) {
-        QJsonObject dataObj = dataVal.toObject();
-        QString strName = dataObj.value("name").toString();
-        QString strPwd = dataObj.value("passwd").toString();
-        //数据库中验证
-        QJsonObject jsonObj = DataBaseMagr::Instance()->CheckUserLogin(strName, strPwd);
+    // 上一次登录还在校验，或本连接已经登录（再登录会覆盖 m_nId，占用的在线状态无法释放）
+    if (m_bLoginPending || m_bPresence) return;
+
+    // 登录准入：并发登录数或全局登录速率超限时回复繁忙，不进入数据库队列
+    int nRetryMs = 0;
+    if (!RateLimiter::AdmitLogin(nRetryMs)) {
+        Metrics::Add(MetLoginRejected);
+        LOG_INFO(LogNet) << "login rejected, busy" << msg.name << "retry" << nRetryMs << "ms";
+        ReplyLoginBusy(nRetryMs);
+        return;
+    }
+    m_bLoginPending = true;
+
+    QString strName = msg.name;
+    QString strPwd = msg.passwd;
+    m_bOfflineBatch = msg.caps.contains(QString(CAP_OFFLINE_BATCH));
+    // 双方都支持时，登录应答之后改用 CBOR；旧版未分帧连接只用 JSON
+    m_bCborPending = msg.caps.contains(QString(CAP_CBOR)) && !m_frameCodec.IsLegacy() &&
+            msg.version >= CBOR_MIN_VERSION;
+    m_bRelayPending = msg.caps.contains(QString(CAP_RELAY)) && !m_frameCodec.IsLegacy();
+    //数据库中验证，结果回到本线程继续处理
+    DbWorker::Instance()->Post(0, [strName, strPwd]() -> QVariant {
+        return DataBaseMagr::Instance()->CheckUserLogin(strName, strPwd);
+    }, this, [this, strName](const QVariant &result) {
+        FinishLogin(strName, result.toJsonObject());
+    });
+}
 
-        m_nId = jsonObj.value("id").toInt();
-        qDebug() << "login" << jsonObj;
+/**
+ * @brief ClientSocket::FinishLogin
+ * 数据库校验完成
+ * @param strName
+ * @param jsonObj
+ */
+void ClientSocket::FinishLogin(const QString &strName, QJsonObject jsonObj)
+{
+    m_bLoginPending = false;
+    RateLimiter::FinishLogin();
+
+    // 等待校验期间连接已经断开
+    if (QAbstractSocket::ConnectedState != m_tcpSocket->state()) return;
+
+    m_nId = jsonObj.value("id").toInt();
+    // 占用在线状态，已经在线则为重复登录
+    m_bPresence = (m_nId > 0 && PresenceMagr::Instance()->SetOnline(m_nId));
+    if (m_nId > 0 && !m_bPresence) {
+        m_nId = -2;
+        jsonObj.insert("id", -2);
+        jsonObj.insert("msg", "error");
+        jsonObj.insert("code", -2);
+    }
+    // 回复服务器版本和接受的能力
+    jsonObj.insert("version", MY_VERSION);
+    if (m_nId > 0) {
+        QJsonArray caps;
+        if (m_bCborPending) caps.append(QString(CAP_CBOR));
+        if (m_bRelayPending) caps.append(QString(CAP_RELAY));
+        jsonObj.insert("caps", caps);
+    }
+    LOG_DEBUG(LogMsg) << "login" << jsonObj;
 
-        if (m_nId > 0) Q_EMIT signalConnected();
-        // 发送查询结果至客户端
-        SltSendMessage(Login, jsonObj);
-
-        // 登录成功后，推送离线消息
-        if (m_nId > 0) {
-            QVector<QJsonObject> offline = DataBaseMagr::Instance()->GetOfflineMsgs(m_nId);
-            for (const QJsonObject &msgRow : offline) {
-                int fromId = msgRow.value("from").toInt();
-                int type   = msgRow.value("type").toInt();
-                QString msg = msgRow.value("msg").toString();
-                int rowId  = msgRow.value("id").toInt();
-
-                // 构建与在线转发一致的 data 对象
-                QJsonObject jsonMsg;
-                jsonMsg.insert("id", fromId);
-                jsonMsg.insert("to", m_nId);
-                jsonMsg.insert("msg", msg);
-                jsonMsg.insert("type", type);
-
-                Q_EMIT signalMsgToClient(SendMsg, m_nId, jsonMsg);
-                // 删除已发送的离线消息
-                DataBaseMagr::Instance()->DeleteOfflineMsg(rowId);
-            }
+    if (m_nId > 0) {
+        m_strName = strName;
+        m_strHead = jsonObj.value("head").toString();
+        Q_EMIT signalConnected();
+    }
+    // 发送查询结果至客户端，登录应答本身仍用 JSON
+    SltSendMessage(Login, jsonObj);
+    if (m_nId > 0) {
+        m_bCbor = m_bCborPending;
+        m_bRelay = m_bRelayPending;
+    }
+
+    // 登录成功后，分页推送离线消息
+    if (m_nId > 0) DrainOffline(0);
+}
+
+/**
+ * @brief ClientSocket::DrainOffline
+ * 删除 cursor 及之前已经确认的离线消息，再取下一页，同一个数据库任务完成。
+ * 连接中途断开时未确认的消息仍在队列中，下次登录从头继续
+ * @param cursor
+ */
+void ClientSocket::DrainOffline(const int &cursor)
+{
+    int nId = m_nId;
+    int nLimit = MyApp::m_nOfflineBatchSize;
+    DbWorker::Instance()->Post(nId, [nId, cursor, nLimit]() -> QVariant {
+        if (cursor > 0) DataBaseMagr::Instance()->DeleteOfflineMsgs(nId, cursor);
+
+        QJsonArray jsonArr;
+        QVector<QJsonObject> offline = DataBaseMagr::Instance()->GetOfflineMsgs(nId, cursor, nLimit);
+        for (const QJsonObject &msgRow : offline) jsonArr.append(msgRow);
+        return jsonArr;
+    }, this, [this, nId](const QVariant &result) {
+        PushOfflinePage(nId, result.toJsonArray());
+    });
+}
+
+/**
+ * @brief ClientSocket::PushOfflinePage
+ * 支持分页的客户端一页一帧，收到确认后再推下一页；
+ * 旧客户端逐条推送，写出后直接删除
+ * @param nId
+ * @param offline
+ */
+void ClientSocket::PushOfflinePage(const int &nId, const QJsonArray &offline)
+{
+    if (nId != m_nId || QAbstractSocket::ConnectedState != m_tcpSocket->state()) return;
+
+    m_nOfflineSent = 0;
+    if (offline.isEmpty()) return;
+
+    QJsonArray msgs;
+    int nCursor = 0;
+    for (int i = 0; i < offline.size(); i++) {
+        QJsonObject msgRow = offline.at(i).toObject();
+
+        // 构建与在线转发一致的 data 对象
+        QJsonObject jsonMsg;
+        jsonMsg.insert("id", msgRow.value("from").toInt());
+        jsonMsg.insert("to", m_nId);
+        jsonMsg.insert("msg", msgRow.value("msg").toString());
+        jsonMsg.insert("type", msgRow.value("type").toInt());
+        jsonMsg.insert("msgId", msgRow.value("msgId").toInt());
+
+        if (m_bOfflineBatch) {
+            msgs.append(jsonMsg);
+        } else {
+            SltSendMessage(SendMsg, jsonMsg);
         }
+
+        nCursor = msgRow.value("id").toInt();
+    }
+
+    if (!m_bOfflineBatch) {
+        DrainOffline(nCursor);
+        return;
     }
+
+    m_nOfflineSent = nCursor;
+
+    QJsonObject jsonBatch;
+    jsonBatch.insert("msgs", msgs);
+    jsonBatch.insert("cursor", nCursor);
+    jsonBatch.insert("more", offline.size() >= MyApp::m_nOfflineBatchSize);
+    SltSendMessage(OfflineMsgBatch, jsonBatch);
+}
+
+/**
+ * @brief ClientSocket::ParseOfflineAck
+ * 客户端确认收到当前页
+ * @param type
+ * @param msg
+ */
+void ClientSocket::ParseOfflineAck(const quint8 &, const OfflineAckMsg &msg)
+{
+    // 只接受对当前在途页的确认
+    if (m_nId <= 0 || m_nOfflineSent <= 0 || msg.cursor != m_nOfflineSent) return;
+
+    m_nOfflineSent = 0;
+    DrainOffline(msg.cursor);
+}
+
+/**
+ * @brief ClientSocket::PostQuery
+ * 在数据库线程执行查询，结果以 type 回复给客户端
+ * @param type
+ * @param task
+ */
+void ClientSocket::PostQuery(const quint8 &type, const DbTask &task)
+{
+    DbWorker::Instance()->Post(m_nId, task, this, [this, type](const QVariant &result) {
+        SltSendMessage(type, result.value<QJsonValue>());
+    });
 }
 
 /**
  * @brief ClientSocket::ParseUserOnline
  * 用户上线
- * @param dataVal
- */
-void ClientSocket::ParseUserOnline(const QJsonValue &dataVal)
-{
-    // data 的 value 是数组
-    if (dataVal.isArray()) {
-        QJsonArray jsonArray = dataVal.toArray();
-        int nSize = jsonArray.size();
-        for (int i = 0; i < nSize; ++i) {
-            int nId = jsonArray.at(i).toInt();
-            int nStatus = DataBaseMagr::Instance()->GetUserLineStatus(nId);
-            // 给在线的好友通报一下状态
-            if (OnLine == nStatus) {
-                QJsonObject jsonObj;
-                jsonObj.insert("id", m_nId);
-                jsonObj.insert("text", "online");
-
-                Q_EMIT signalMsgToClient(UserOnLine, nId, jsonObj);
-            }
+ * @param type
+ * @param msg
+ */
+void ClientSocket::ParseUserOnline(const quint8 &, const IdListMsg &msg)
+{
+    PresenceMsg notice;
+    notice.id = m_nId;
+    notice.text = "online";
+    QJsonObject jsonObj = notice.Encode();
+
+    for (int i = 0; i < msg.ids.size(); ++i) {
+        int nId = msg.ids.at(i);
+        // 给在线的好友通报一下状态
+        if (PresenceMagr::Instance()->IsOnline(nId)) {
+            Q_EMIT signalMsgToClient(UserOnLine, nId, jsonObj);
         }
     }
 }
@@ -253,80 +675,74 @@ void ClientSocket::ParseUserOnline(const QJsonValue &dataVal)
 /**
  * @brief ClientSocket::ParseLogin
  * 解析登录信息
- * @param reply
+ * @param type
+ * @param msg
  */
-void ClientSocket::ParseLogout(const QJsonValue &dataVal)
+void ClientSocket::ParseLogout(const quint8 &, const LogoutMsg &msg)
 {
-    // data 的 value 是对象
-    if (dataVal.isObject()) {
-        QJsonObject dataObj = dataVal.toObject();
-
-        QJsonArray array = dataObj.value("friends").toArray();
-        int nId = dataObj.value("id").toInt();
-        int nSize = array.size();
-
-        DataBaseMagr::Instance()->UpdateUserStatus(nId, OffLine);
-
-        for (int i = 0; i < nSize; ++i) {
-            nId = array.at(i).toInt();
-            int nStatus = DataBaseMagr::Instance()->GetUserLineStatus(nId);
-            // 给在线的好友通报一下状态
-            if (OnLine == nStatus) {
-                QJsonObject jsonObj;
-                jsonObj.insert("id", m_nId);
-                jsonObj.insert("text", "offline");
-
-                Q_EMIT signalMsgToClient(UserOffLine, nId, jsonObj);
-            }
+    PresenceMsg notice;
+    notice.id = m_nId;
+    notice.text = "offline";
+    QJsonObject jsonObj = notice.Encode();
+
+    for (int i = 0; i < msg.friends.size(); ++i) {
+        int nId = msg.friends.at(i).toInt();
+        // 给在线的好友通报一下状态
+        if (PresenceMagr::Instance()->IsOnline(nId)) {
+            Q_EMIT signalMsgToClient(UserOffLine, nId, jsonObj);
         }
     }
+
+    // 释放本连接占用的在线状态；abort 触发的 SltDisconnected 不再重复
+    EndSession();
+    m_tcpSocket->abort();
 }
 
 /**
  * @brief ClientSocket::ParseUpdateUserHead
  * 更新用户头像文件
- * @param dataVal
+ * @param type
+ * @param msg
  */
-void ClientSocket::ParseUpdateUserHead(const QJsonValue &dataVal)
+void ClientSocket::ParseUpdateUserHead(const quint8 &, const UpdateHeadMsg &msg)
 {
-    // data 的 value 是对象
-    if (dataVal.isObject()) {
-        QJsonObject dataObj = dataVal.toObject();
-        int nId = dataObj.value("id").toInt();
-        QString strHead = dataObj.value("head").toString();
+    int nId = msg.id;
+    QString strHead = msg.head;
 
-        qDebug() << "nId:" << nId;
-        qDebug() << "strHead:" << strHead;
-        // 更新数据库
+    LOG_DEBUG(LogMsg) << "nId:" << nId;
+    LOG_DEBUG(LogMsg) << "strHead:" << strHead;
+    // 更新数据库，不需要等待结果
+    DbWorker::Instance()->Post(nId, [nId, strHead]() -> QVariant {
         DataBaseMagr::Instance()->UpdateUserHead(nId, strHead);
+        return QVariant();
+    });
+    if (nId == m_nId) m_strHead = strHead;
 
-        // 通知其他在线好友，说我已经修改了头像
-        QJsonArray jsonFriends =  dataObj.value("friends").toArray();
-        QJsonObject jsonObj;
-        // 是我在更新，我要去下载我的头像
-        jsonObj.insert("id", nId);
-        jsonObj.insert("head", strHead);
+    // 通知其他在线好友，说我已经修改了头像
+    QJsonObject jsonObj;
+    // 是我在更新，我要去下载我的头像
+    jsonObj.insert("id", nId);
+    jsonObj.insert("head", strHead);
 
-        for (int i = 0; i < jsonFriends.size(); i++) {
-            nId = jsonFriends.at(i).toInt();
-            Q_EMIT signalMsgToClient(UpdateHeadPic, nId, jsonObj);
-        }
+    for (int i = 0; i < msg.friends.size(); i++) {
+        Q_EMIT signalMsgToClient(UpdateHeadPic, msg.friends.at(i).toInt(), jsonObj);
     }
 }
 
 /**
  * @brief ClientSocket::ParseReister
  * 解析注册信息
- * @param reply
+ * @param type
+ * @param msg
  */
-void ClientSocket::ParseReister(const QJsonValue &dataVal)
+void ClientSocket::ParseReister(const quint8 &, const RegisterMsg &msg)
 {
-    // data 的 value 是对象
-    if (dataVal.isObject()) {
-        QJsonObject dataObj = dataVal.toObject();
-        QString strName = dataObj.value("name").toString();
-        QString strPwd = dataObj.value("passwd").toString();
-        m_nId = DataBaseMagr::Instance()->RegisterUser(strName, strPwd);
+    QString strName = msg.name;
+    QString strPwd = msg.passwd;
+    DbWorker::Instance()->Post(0, [strName, strPwd]() -> QVariant {
+        return DataBaseMagr::Instance()->RegisterUser(strName, strPwd);
+    }, this, [this, strName, strPwd](const QVariant &result) {
+        m_nId = result.toInt();
 
         // 返回客户端
         QJsonObject json;
@@ -335,23 +751,23 @@ void ClientSocket::ParseReister(const QJsonValue &dataVal)
         json.insert("passwd", strPwd);
 
         // 发送查询结果至客户端
-        SltSendMessage(Register, json);;
-    }
+        SltSendMessage(Register, json);
+    });
 }
 
 /**
  * @brief ClientSocket::ParseAddFriend
  * 添加好友
- * @param reply
+ * @param type
+ * @param msg
  */
-void ClientSocket::ParseAddFriend(const QJsonValue &dataVal)
+void ClientSocket::ParseAddFriend(const quint8 &, const NameMsg &msg)
 {
-    // data 的 value 是对象
-    if (dataVal.isObject()) {
-
-        QJsonObject dataObj = dataVal.toObject();
-        QString strName = dataObj.value("name").toString();
-        QJsonObject jsonFriend = DataBaseMagr::Instance()->AddFriend(strName);
+    QString strName = msg.name;
+    DbWorker::Instance()->Post(m_nId, [strName]() -> QVariant {
+        return DataBaseMagr::Instance()->AddFriend(strName);
+    }, this, [this](const QVariant &result) {
+        QJsonObject jsonFriend = result.toJsonObject();
         int nId = jsonFriend.value("id").toInt();
         QString strMsg = jsonFriend.value("msg").toString();
 
@@ -360,265 +776,285 @@ void ClientSocket::ParseAddFriend(const QJsonValue &dataVal)
 
         if (nId < 0) return;
 
-        // 给对方ID发送add请求
-        QJsonObject jsonQuery = DataBaseMagr::Instance()->GetUserInfo(m_nId);
+        // 给对方ID发送add请求，本人资料登录时已缓存
         QJsonObject jsonRequest;
         jsonRequest.insert("id", m_nId);
-        jsonRequest.insert("name", jsonQuery.value("name").toString());
-        jsonRequest.insert("head", jsonQuery.value("head").toString());
+        jsonRequest.insert("name", m_strName);
+        jsonRequest.insert("head", m_strHead);
         jsonRequest.insert("msg", strMsg.isEmpty() ? "附加消息： 你好！" : strMsg);
 
         Q_EMIT signalMsgToClient(AddFriendRequist, nId, jsonRequest);
-    }
+    });
 }
 
 /**
  * @brief ClientSocket::ParseAddGroup
  * 添加群组
- * @param dataVal
+ * @param type
+ * @param msg
  */
-void ClientSocket::ParseAddGroup(const QJsonValue &dataVal)
+void ClientSocket::ParseAddGroup(const quint8 &, const NameMsg &msg)
 {
-    // data 的 value 是对象
-    if (dataVal.isObject()) {
-        QJsonObject dataObj = dataVal.toObject();
-        int nId = dataObj.value("id").toInt();
-        QString strName = dataObj.value("name").toString();
-        QJsonObject json = DataBaseMagr::Instance()->AddGroup(nId, strName);
-
-        // 发送查询结果至客户端
-        SltSendMessage(AddGroup, json);
-    }
+    int nId = msg.id;
+    QString strName = msg.name;
+    PostQuery(AddGroup, [nId, strName]() -> QVariant {
+        return QJsonValue(DataBaseMagr::Instance()->AddGroup(nId, strName));
+    });
 }
 
 /**
  * @brief ClientSocket::ParseCreateGroup
  * 创建群组
- * @param dataVal
+ * @param type
+ * @param msg
  */
-void ClientSocket::ParseCreateGroup(const QJsonValue &dataVal)
+void ClientSocket::ParseCreateGroup(const quint8 &, const NameMsg &msg)
 {
-    // data 的 value 是对象
-    if (dataVal.isObject()) {
-        QJsonObject dataObj = dataVal.toObject();
-        int nId = dataObj.value("id").toInt();
-        QString strName = dataObj.value("name").toString();
-        QJsonObject json = DataBaseMagr::Instance()->CreateGroup(nId, strName);
-
-        // 发送查询结果至客户端
-        SltSendMessage(CreateGroup, json);
-    }
+    int nId = msg.id;
+    QString strName = msg.name;
+    PostQuery(CreateGroup, [nId, strName]() -> QVariant {
+        return QJsonValue(DataBaseMagr::Instance()->CreateGroup(nId, strName));
+    });
 }
 
 /**
  * @brief ClientSocket::ParseGetMyFriend
  * 上线的时候获取我的好友
- * @param dataVal
- */
-void ClientSocket::ParseGetMyFriend(const QJsonValue &dataVal)
-{
-    QJsonArray jsonArray;
-    // data 的 value 是数组
-    if (dataVal.isArray()) {
-        QJsonArray array = dataVal.toArray();
-        int nSize = array.size();
-        // 先添加在线好友，在添加离线好友
-        for (int i = 0; i < nSize; ++i) {
-            int nId = array.at(i).toInt();
-            jsonArray.append(DataBaseMagr::Instance()->GetUserStatus(nId));
+ * @param type
+ * @param msg
+ */
+void ClientSocket::ParseGetMyFriend(const quint8 &, const IdListMsg &msg)
+{
+    QVector<int> ids = msg.ids;
+    PostQuery(GetMyFriends, [ids]() -> QVariant {
+        QJsonArray jsonArray;
+        for (int i = 0; i < ids.size(); ++i) {
+            jsonArray.append(DataBaseMagr::Instance()->GetUserStatus(ids.at(i)));
         }
-    }
-
-    this->SltSendMessage(GetMyFriends, jsonArray);
+        return QJsonValue(jsonArray);
+    });
 }
 
 /**
  * @brief ClientSocket::ParseGetMyGroups
  * 上线的时候获取我的群组
- * @param dataVal
+ * @param type
+ * @param msg
  */
-void ClientSocket::ParseGetMyGroups(const QJsonValue &dataVal)
+void ClientSocket::ParseGetMyGroups(const quint8 &, const IdMsg &msg)
 {
-    QJsonArray jsonArray;
-    // data 的 value 是数组
-    if (dataVal.isObject()) {
-        QJsonObject jsonObj = dataVal.toObject();
-        // 群组ID
-        int nId = jsonObj.value("id").toInt();
-        jsonArray = DataBaseMagr::Instance()->GetGroupUsers(nId);
-    }
-
-    this->SltSendMessage(GetMyGroups, jsonArray);
+    // 群组ID
+    int nId = msg.id;
+    PostQuery(GetMyGroups, [nId]() -> QVariant {
+        return QJsonValue(DataBaseMagr::Instance()->GetGroupUsers(nId));
+    });
 }
 
 /**
  * @brief ClientSocket::ParseRefreshFriend
- * @param dataVal
- */
-void ClientSocket::ParseRefreshFriend(const QJsonValue &dataVal)
-{
-    QJsonArray jsonArray;
-    // data 的 value 是数组
-    if (dataVal.isArray()) {
-        QJsonArray array = dataVal.toArray();
-        int nSize = array.size();
-        for (int i = 0; i < nSize; ++i) {
-            int nId = array.at(i).toInt();
-            jsonArray.append(DataBaseMagr::Instance()->GetUserStatus(nId));
+ * @param type
+ * @param msg
+ */
+void ClientSocket::ParseRefreshFriend(const quint8 &, const IdListMsg &msg)
+{
+    QVector<int> ids = msg.ids;
+    PostQuery(RefreshFriends, [ids]() -> QVariant {
+        QJsonArray jsonArray;
+        for (int i = 0; i < ids.size(); ++i) {
+            jsonArray.append(DataBaseMagr::Instance()->GetUserStatus(ids.at(i)));
         }
-    }
-
-    this->SltSendMessage(RefreshFriends, jsonArray);
+        return QJsonValue(jsonArray);
+    });
 }
 
 /**
  * @brief ClientSocket::ParseRefreshGroups
  * 刷新当前群组里面的好友信息
- * @param dataVal
+ * @param type
+ * @param msg
  */
-void ClientSocket::ParseRefreshGroups(const QJsonValue &dataVal)
+void ClientSocket::ParseRefreshGroups(const quint8 &, const IdMsg &msg)
 {
-    QJsonArray jsonArray;
-    // data 的 value 是数组
-    if (dataVal.isObject()) {
-        QJsonObject jsonObj = dataVal.toObject();
-        // 群组ID
-        int nId = jsonObj.value("id").toInt();
-        jsonArray = DataBaseMagr::Instance()->GetGroupUsers(nId);
-    }
-
-    this->SltSendMessage(RefreshGroups, jsonArray);
+    // 群组ID
+    int nId = msg.id;
+    PostQuery(RefreshGroups, [nId]() -> QVariant {
+        return QJsonValue(DataBaseMagr::Instance()->GetGroupUsers(nId));
+    });
 }
 
 /**
  * @brief ClientSocket::ParseMessages
  * 解析消息类，包括文字、图片、文件等
+ * @param nType
+ * @param msg
+ */
+void ClientSocket::ParseFriendMessages(const quint8 &nType, const ChatMsg &msg)
+{
+    int nId = msg.to;
+    MsgTrace::Begin(m_nId, msg.msgId, m_nReadNs, msg.ts);
+    // 判断接收者在线状态，在线则直接转发；离线入队
+    bool bOnline = PresenceMagr::Instance()->IsOnline(nId);
+    MsgTrace::Mark(m_nId, msg.msgId, TraceRouted);
+    if (bOnline) {
+        Q_EMIT signalMsgToClient(nType, nId, msg.raw);
+        // 发送ACK：已转发
+        SendAck(nId, nType, 0, msg.msg, msg.msgId);
+    } else {
+        QueueOfflineMessage(nType, msg);
+    }
+}
+
+/**
+ * @brief ClientSocket::ParseRelayMessage
+ * 私聊快速转发：只读取固定头路由，消息体原样转给在线的接收者，
+ * 服务器不解码也不重新编码；接收者离线时才解码消息体写入离线队列
  * @param reply
  */
-void ClientSocket::ParseFriendMessages(const QByteArray &reply)
-{
-    // 重新组装数据
-    QJsonParseError jsonError;
-    // 转化为 JSON 文档
-    QJsonDocument doucment = QJsonDocument::fromJson(reply, &jsonError);
-    // 解析未发生错误
-    if (!doucment.isNull() && (jsonError.error == QJsonParseError::NoError)) {
-        // JSON 文档为对象
-        if (doucment.isObject()) {
-            // 转化为对象
-            QJsonObject jsonObj = doucment.object();
-            int nType = jsonObj.value("type").toInt();
-            QJsonValue dataVal = jsonObj.value("data");
-
-            QJsonObject dataObj = dataVal.toObject();
-            int nId = dataObj.value("to").toInt();
-            int msgId = dataObj.value("msgId").toInt();
-            // 判断接收者在线状态，在线则直接转发；离线入队
-            int lineStatus = DataBaseMagr::Instance()->GetUserLineStatus(nId);
-            if (OnLine == lineStatus) {
-                Q_EMIT signalMsgToClient(nType, nId, dataObj);
-                // 发送ACK：已转发
-                QJsonObject ack;
-                ack.insert("to", nId);
-                ack.insert("type", nType);
-                ack.insert("queued", 0);
-                ack.insert("msg", dataObj.value("msg").toString());
-                ack.insert("msgId", msgId);
-                SltSendMessage(Ack, ack);
-            } else {
-                // 离线消息入队
-                int rowId = DataBaseMagr::Instance()->AddOfflineMsg(m_nId, nId, dataObj.value("type").toInt(), dataObj.value("msg").toString(), msgId);
-                // 发送ACK：已入队
-                QJsonObject ack;
-                ack.insert("to", nId);
-                ack.insert("type", nType);
-                ack.insert("queued", 1);
-                ack.insert("msg", dataObj.value("msg").toString());
-                ack.insert("msgId", msgId);
-                SltSendMessage(Ack, ack);
-            }
-        }
+void ClientSocket::ParseRelayMessage(const QByteArray &reply)
+{
+    quint8 nType = 0;
+    int nId = 0;
+    int msgId = 0;
+    if (m_nId <= 0 || !MsgCodec::ParseRelay(reply, nType, nId, msgId)) return;
+    if (SendMsg != nType && SendFile != nType && SendPicture != nType) return;
+    Metrics::MsgIn(nType);
+
+    int nRetryMs = 0;
+    int nRate = m_rateLimiter.Acquire(nType, nRetryMs);
+    if (RatePass != nRate) {
+        Throttle(nType, nRate, nRetryMs, nId, msgId);
+        return;
+    }
+    MsgTrace::Begin(m_nId, msgId, m_nReadNs, 0);
+
+    bool bOnline = PresenceMagr::Instance()->IsOnline(nId);
+    MsgTrace::Mark(m_nId, msgId, TraceRouted);
+    if (bOnline) {
+        // 头部的 peer 改写为发送者
+        QByteArray frame = FrameCodec::Pack(reply);
+        MsgCodec::SetRelayPeer(frame, m_nId, FRAME_HEADER_SIZE);
+        Q_EMIT signalFrameToClients(QVector<int>() << nId, frame, QByteArray());
+        // 发送ACK：已转发，不回传消息内容
+        SendAck(nId, nType, 0, QString(), msgId);
+    } else {
+        QJsonValue dataVal;
+        ChatMsg msg;
+        if (!MsgCodec::DecodeData(reply.mid(RELAY_HEADER_SIZE), dataVal) || !msg.Decode(dataVal)) return;
+        // 路由以固定头为准
+        msg.to = nId;
+        msg.msgId = msgId;
+        QueueOfflineMessage(nType, msg);
     }
 }
 
+/**
+ * @brief ClientSocket::QueueOfflineMessage
+ * 离线消息入队，写入完成后再确认
+ * @param nType
+ * @param msg
+ */
+void ClientSocket::QueueOfflineMessage(const quint8 &nType, const ChatMsg &msg)
+{
+    int nFrom = m_nId;
+    int nId = msg.to;
+    int msgId = msg.msgId;
+    int nMsgType = msg.type;
+    QString strMsg = msg.msg;
+    DbWorker::Instance()->Post(nId, [nFrom, nId, nMsgType, strMsg, msgId]() -> QVariant {
+        return DataBaseMagr::Instance()->AddOfflineMsg(nFrom, nId, nMsgType, strMsg, msgId);
+    }, this, [this, nId, nType, strMsg, msgId](const QVariant &) {
+        // 发送ACK：已入队
+        SendAck(nId, nType, 1, strMsg, msgId);
+    });
+}
+
+/**
+ * @brief ClientSocket::SendAck
+ * @param nId
+ * @param nType
+ * @param queued
+ * @param strMsg
+ * @param msgId
+ */
+void ClientSocket::SendAck(const int &nId, const int &nType, const int &queued, const QString &strMsg, const int &msgId)
+{
+    AckMsg ack;
+    ack.to = nId;
+    ack.type = nType;
+    ack.queued = queued;
+    ack.msg = strMsg;
+    ack.msgId = msgId;
+    SendStruct(Ack, ack);
+    MsgTrace::Mark(m_nId, msgId, TraceAcked);
+}
+
 /**
  * @brief ClientSocket::ParseGroupMessages
- * 处理群组消息转发
- * @param reply
+ * 处理群组消息转发：成员列表一次查询，消息只编码一次，
+ * 所有在线成员共享同一个帧缓冲区
+ * @param nType
+ * @param msg
  */
-void ClientSocket::ParseGroupMessages(const QByteArray &reply)
-{
-    // 重新组装数据
-    QJsonParseError jsonError;
-    // 转化为 JSON 文档
-    QJsonDocument doucment = QJsonDocument::fromJson(reply, &jsonError);
-    // 解析未发生错误
-    if (!doucment.isNull() && (jsonError.error == QJsonParseError::NoError)) {
-        // JSON 文档为对象
-        if (doucment.isObject()) {
-            // 转化为对象
-            QJsonObject jsonObj = doucment.object();
-            int nType = jsonObj.value("type").toInt();
-            QJsonValue dataVal = jsonObj.value("data");
-
-            QJsonObject dataObj = dataVal.toObject();
-            // 转发的群组id
-            int nGroupId = dataObj.value("to").toInt();
-            QString strMsg = dataObj.value("msg").toString();
-            // 查询该群组下面的用户，一一转发消息
-            QString name = DataBaseMagr::Instance()->GetUserName(m_nId);
-
-            // 查询该群组里面的在线好友
-            QJsonArray jsonArr = DataBaseMagr::Instance()->GetGroupUsers(nGroupId);
-            if (jsonArr.size() < 2) return;
-            for (int i = 1; i < jsonArr.size(); i++) {
-                QJsonObject json = jsonArr.at(i).toObject();
-                int nStatus = json.value("status").toInt();
-                int nUserId = json.value("id").toInt();
-
-                // 只给在线的好友转发消息
-                if (OnLine == nStatus && m_nId != nUserId) {
-                    // 重组消息
-                    QJsonObject jsonMsg;
-                    jsonMsg.insert("group", nGroupId);
-                    jsonMsg.insert("id", m_nId);
-                    jsonMsg.insert("name", name);
-                    jsonMsg.insert("to", nUserId);
-                    jsonMsg.insert("msg", strMsg);
-                    jsonMsg.insert("head", DataBaseMagr::Instance()->GetUserHead(m_nId));
-
-                    Q_EMIT signalMsgToClient(nType, nUserId, jsonMsg);
-                }
-            }
+void ClientSocket::ParseGroupMessages(const quint8 &nType, const ChatMsg &msg)
+{
+    // 转发的群组id
+    int nGroupId = msg.to;
+    QString strMsg = msg.msg;
+
+    // 查询该群组的成员
+    DbWorker::Instance()->Post(m_nId, [nGroupId]() -> QVariant {
+        return QVariant::fromValue(DataBaseMagr::Instance()->GetGroupMemberIds(nGroupId));
+    }, this, [this, nType, nGroupId, strMsg](const QVariant &result) {
+        FanOutGroupMessage(nType, nGroupId, strMsg, result.value< QVector<int> >());
+    });
+}
+
+/**
+ * @brief ClientSocket::FanOutGroupMessage
+ * 给在线的群成员转发
+ * @param type
+ * @param nGroupId
+ * @param strMsg
+ * @param members
+ */
+void ClientSocket::FanOutGroupMessage(const quint8 &type, const int &nGroupId, const QString &strMsg, const QVector<int> &members)
+{
+    QVector<int> targets;
+    targets.reserve(members.size());
+    for (int i = 0; i < members.size(); i++) {
+        // 只给在线的好友转发消息
+        int nUserId = members.at(i);
+        if (m_nId != nUserId && PresenceMagr::Instance()->IsOnline(nUserId)) {
+            targets.append(nUserId);
         }
     }
+
+    if (targets.isEmpty()) return;
+
+    // 重组消息，所有成员收到的内容相同，to 为群组id
+    QJsonObject jsonMsg;
+    jsonMsg.insert("group", nGroupId);
+    jsonMsg.insert("id", m_nId);
+    jsonMsg.insert("name", m_strName);
+    jsonMsg.insert("to", nGroupId);
+    jsonMsg.insert("msg", strMsg);
+    jsonMsg.insert("head", m_strHead);
+
+    // 两种编码各生成一次，按接收者协商结果选择
+    for (int i = 0; i < targets.size(); i++) Metrics::MsgOut(type);
+    Q_EMIT signalFrameToClients(targets, PackMessage(type, m_nId, jsonMsg),
+                                PackMessage(type, m_nId, jsonMsg, MsgCodec::Cbor));
 }
 
 /**
  * @brief ClientSocket::ParseFaceMessages
  * 处理表情消息转发
- * @param reply
+ * @param nType
+ * @param msg
  */
-void ClientSocket::ParseFaceMessages(const QByteArray &reply)
-{
-    // 重新组装数据
-    QJsonParseError jsonError;
-    // 转化为 JSON 文档
-    QJsonDocument doucment = QJsonDocument::fromJson(reply, &jsonError);
-    // 解析未发生错误
-    if (!doucment.isNull() && (jsonError.error == QJsonParseError::NoError)) {
-        // JSON 文档为对象
-        if (doucment.isObject()) {
-            // 转化为对象
-            QJsonObject jsonObj = doucment.object();
-            int nType = jsonObj.value("type").toInt();
-            QJsonValue dataVal = jsonObj.value("data");
-
-            QJsonObject dataObj = dataVal.toObject();
-            int nId = dataObj.value("to").toInt();
-            Q_EMIT signalMsgToClient(nType, nId, dataObj);
-        }
-    }
+void ClientSocket::ParseFaceMessages(const quint8 &nType, const ChatMsg &msg)
+{
+    Q_EMIT signalMsgToClient(nType, msg.to, msg.raw);
 }
 
 /**
@@ -630,19 +1066,195 @@ void ClientSocket::SltSendMessage(const quint8 &type, const QJsonValue &jsonVal)
 {
     if (!m_tcpSocket->isOpen()) return;
 
-    // 构建 Json 对象
-    QJsonObject jsonObj;
-    jsonObj.insert("type", type);
-    jsonObj.insert("from", m_nId);
-    jsonObj.insert("data", jsonVal);
+    QByteArray frame = PackMessage(type, m_nId, jsonVal, m_bCbor ? MsgCodec::Cbor : MsgCodec::Json);
+    LOG_DEBUG(LogNet) << "m_tcpSocket->write:" << type << (m_bCbor ? "cbor" : "json") << frame.size();
+    Metrics::MsgOut(type);
+
+    // 好友上下线通知可以丢弃，客户端刷新好友列表时会重新获取
+    SendFrame(frame, (UserOnLine == type || UserOffLine == type));
+
+    // 转发给接收者的私聊消息，id 为发送者
+    if (SendMsg == type || SendFile == type || SendPicture == type) {
+        QJsonObject dataObj = jsonVal.toObject();
+        MsgTrace::Mark(dataObj.value(QLatin1String("id")).toInt(), dataObj.value(QLatin1String("msgId")).toInt(), TraceWritten);
+    }
+}
+
+/**
+ * @brief ClientSocket::SendCbor
+ * 协议结构的 CBOR 回发，只用于协商了 CBOR 的连接
+ * @param type
+ * @param data
+ */
+void ClientSocket::SendCbor(const quint8 &type, const QCborMap &data)
+{
+    if (!m_tcpSocket->isOpen()) return;
+
+    QByteArray frame = FrameCodec::Pack(MsgCodec::Encode(type, m_nId, data));
+    LOG_DEBUG(LogNet) << "m_tcpSocket->write:" << type << "cbor" << frame.size();
+    Metrics::MsgOut(type);
+    SendFrame(frame);
+}
+
+/**
+ * @brief ClientSocket::PackMessage
+ * @param type
+ * @param from
+ * @param json
+ * @param format
+ * @return
+ */
+QByteArray ClientSocket::PackMessage(const quint8 &type, const int &from, const QJsonValue &json, const MsgCodec::E_FORMAT &format)
+{
+    return FrameCodec::Pack(MsgCodec::Encode(type, from, json, format));
+}
+
+/**
+ * @brief ClientSocket::SendPacked
+ * 同一条消息的 JSON/CBOR 两个帧，按本连接的协商结果发送其中之一；
+ * 转发帧只有一种编码，放在 jsonFrame 中
+ * @param jsonFrame
+ * @param cborFrame
+ */
+void ClientSocket::SendPacked(const QByteArray &jsonFrame, const QByteArray &cborFrame)
+{
+    bool bRelayFrame = jsonFrame.size() >= FRAME_HEADER_SIZE + RELAY_HEADER_SIZE && RELAY_MARKER == quint8(jsonFrame.at(FRAME_HEADER_SIZE));
+    // 转发帧：接收方不支持时解码消息体，按普通私聊消息发送
+    if (!m_bRelay && bRelayFrame) {
+        quint8 nType = 0;
+        int nFrom = 0;
+        int msgId = 0;
+        QByteArray payload = jsonFrame.mid(FRAME_HEADER_SIZE);
+        QJsonValue dataVal;
+        if (!MsgCodec::ParseRelay(payload, nType, nFrom, msgId) ||
+                !MsgCodec::DecodeData(payload.mid(RELAY_HEADER_SIZE), dataVal)) return;
+
+        QJsonObject dataObj = dataVal.toObject();
+        dataObj.insert("id", nFrom);
+        SltSendMessage(nType, dataObj);
+        return;
+    }
+
+    SendFrame((m_bCbor && !cborFrame.isEmpty()) ? cborFrame : jsonFrame);
+
+    // 群消息在扇出时已按接收人数计数，转发帧在这里计数，头部的 peer 为发送者
+    if (bRelayFrame) {
+        quint8 nType = 0;
+        int nFrom = 0;
+        int msgId = 0;
+        QByteArray header = QByteArray::fromRawData(jsonFrame.constData() + FRAME_HEADER_SIZE, RELAY_HEADER_SIZE);
+        if (MsgCodec::ParseRelay(header, nType, nFrom, msgId)) {
+            Metrics::MsgOut(nType);
+            MsgTrace::Mark(nFrom, msgId, TraceWritten);
+        }
+    }
+}
+
+/**
+ * @brief ClientSocket::SendFrame
+ * 放入发送队列，本轮事件循环结束后合并成一次写入。
+ * 待发送数据超过高水位后丢弃可丢弃的帧，超过高水位两倍断开连接
+ * @param frame
+ * @param bDroppable
+ */
+void ClientSocket::SendFrame(const QByteArray &frame, const bool &bDroppable)
+{
+    if (!m_tcpSocket->isOpen()) return;
+
+    qint64 nPending = m_nOutBytes + m_tcpSocket->bytesToWrite();
+    if (nPending >= MyApp::m_nOutboundHighWater) {
+        if (!m_bCongested) {
+            m_bCongested = true;
+            LOG_WARN(LogNet) << "outbound congested" << m_nId << nPending;
+        }
+
+        if (bDroppable) {
+            m_nDropped.ref();
+            Metrics::Add(MetFramesDropped);
+            return;
+        }
+
+        // 对端长时间不读，断开连接
+        if (nPending + frame.size() > 2 * qint64(MyApp::m_nOutboundHighWater)) {
+            LOG_WARN(LogNet) << "outbound overflow, disconnect" << m_nId << nPending;
+            m_tcpSocket->abort();
+            ClearOutbound();
+            return;
+        }
+    }
+
+    // 旧版客户端不分帧；QByteArray 隐式共享，多个连接排队同一帧不会复制数据
+    QByteArray data = m_frameCodec.IsLegacy() ? frame.mid(FRAME_HEADER_SIZE) : frame;
+    m_outQueue.append(data);
+    m_nOutBytes += data.size();
+    UpdateQueueDepth();
+    Metrics::Add(MetFramesOut);
+
+    if (!m_bFlushPending) {
+        m_bFlushPending = true;
+        QMetaObject::invokeMethod(this, "SltFlushOutbound", Qt::QueuedConnection);
+    }
+}
+
+/**
+ * @brief ClientSocket::SltFlushOutbound
+ * 一次写入本轮产生的全部数据
+ */
+void ClientSocket::SltFlushOutbound()
+{
+    m_bFlushPending = false;
+    if (m_outQueue.isEmpty()) return;
+
+    if (!m_tcpSocket->isOpen()) {
+        ClearOutbound();
+        return;
+    }
+
+    QByteArray data;
+    if (1 == m_outQueue.size()) {
+        data = m_outQueue.first();
+    } else {
+        data.reserve(int(m_nOutBytes));
+        for (int i = 0; i < m_outQueue.size(); i++) data.append(m_outQueue.at(i));
+    }
 
-    // 构建 Json 文档
-    QJsonDocument document;
-    document.setObject(jsonObj);
+    m_outQueue.clear();
+    m_nOutBytes = 0;
 
-    qDebug() << "m_tcpSocket->write:" << document.toJson(QJsonDocument::Compact);
+    m_tcpSocket->write(data);
+    UpdateQueueDepth();
+}
 
-    m_tcpSocket->write(document.toJson(QJsonDocument::Compact));
+/**
+ * @brief ClientSocket::SltBytesWritten
+ * 降到低水位以下恢复正常发送
+ */
+void ClientSocket::SltBytesWritten(qint64 bytes)
+{
+    Metrics::Add(MetBytesOut, bytes);
+    UpdateQueueDepth();
+
+    if (m_bCongested && m_nQueueDepth.load() <= MyApp::m_nOutboundLowWater) {
+        m_bCongested = false;
+        LOG_INFO(LogNet) << "outbound recovered" << m_nId << "dropped" << m_nDropped.load();
+    }
+}
+
+void ClientSocket::UpdateQueueDepth()
+{
+    m_nQueueDepth.store(int(m_nOutBytes + m_tcpSocket->bytesToWrite()));
+}
+
+/**
+ * @brief ClientSocket::ClearOutbound
+ * abort() 已丢弃 socket 缓冲，不会再有 bytesWritten 把积压计数降下来
+ */
+void ClientSocket::ClearOutbound()
+{
+    m_outQueue.clear();
+    m_nOutBytes = 0;
+    m_nQueueDepth.store(0);
+    m_bCongested = false;
 }
 
 ///////////////////////////////////////////////////////////////
@@ -660,10 +1272,27 @@ ClientFileSocket::ClientFileSocket(QObject *parent, QTcpSocket *tcpSocket) :
 
     fileNameSize        = 0;
     m_bBusy             = false;
+    m_nRelayWaitId      = 0;
 
     m_nUserId           = -1;
     m_nWindowId         = -1;
 
+    m_idleWheel         = NULL;
+    m_nActiveMs         = 0;
+
+    m_bSendfile         = false;
+    m_nFileOffset       = 0;
+    m_writeNotifier     = NULL;
+
+    m_bV2               = false;
+    m_bRawWriter        = false;
+    m_bSendfileOk       = true;
+    m_nRawPos           = 0;
+    m_pChunkTask        = NULL;
+    m_nChunkOffset      = 0;
+    m_nChunkLeft        = 0;
+    m_codec.SetMaxFrameSize(FILE_FRAME_MAX);
+
     // 本地文件存储
     fileToSend = new QFile(this);
     fileToRecv = new QFile(this);
@@ -677,11 +1306,19 @@ ClientFileSocket::ClientFileSocket(QObject *parent, QTcpSocket *tcpSocket) :
     connect(m_tcpSocket, SIGNAL(disconnected()), this, SIGNAL(signalDisConnected()));
     // 当有数据发送成功时，我们更新进度条
     connect(m_tcpSocket, SIGNAL(bytesWritten(qint64)), this, SLOT(SltUpdateClientProgress(qint64)));
+
+    Metrics::Add(MetFileConnAccepted);
+    Metrics::GaugeAdd(MetFileConnections, 1);
 }
 
 ClientFileSocket::~ClientFileSocket()
 {
-
+    // 未完成的上传保留 part 文件，下次续传；正在转发的下载等上传方重连
+    foreach (PartFile *part, m_incoming) {
+        FileRelay::Instance()->End(part->Target(), part->Id(), false);
+    }
+    qDeleteAll(m_incoming);
+    Metrics::GaugeAdd(MetFileConnections, -1);
 }
 
 /**
@@ -693,6 +1330,36 @@ void ClientFileSocket::Close()
     m_tcpSocket->abort();
 }
 
+/**
+ * @brief ClientFileSocket::WatchIdle
+ * 文件连接不探测，超过 FileIdleTimeoutSec 没有收发直接关闭
+ * @param wheel
+ */
+void ClientFileSocket::WatchIdle(TimingWheel *wheel)
+{
+    if (NULL == wheel || MyApp::m_nFileIdleTimeoutSec <= 0) return;
+
+    m_idleWheel = wheel;
+    m_nActiveMs = TimingWheel::NowMs();
+    m_idleNode.callback = [this]() { CheckIdle(); };
+    m_idleWheel->Arm(&m_idleNode, qint64(MyApp::m_nFileIdleTimeoutSec) * 1000);
+}
+
+void ClientFileSocket::CheckIdle()
+{
+    qint64 nTimeoutMs = qint64(MyApp::m_nFileIdleTimeoutSec) * 1000;
+    qint64 nIdleMs = TimingWheel::NowMs() - m_nActiveMs;
+
+    if (nIdleMs >= nTimeoutMs) {
+        LOG_INFO(LogFile) << "file idle timeout, close" << m_nUserId << nIdleMs << "ms";
+        Metrics::Add(MetIdleReaped);
+        m_tcpSocket->abort();
+        return;
+    }
+
+    m_idleWheel->Arm(&m_idleNode, nTimeoutMs - nIdleMs);
+}
+
 /**
  * @brief ClientFileSocket::CheckUserId
  * 用户socket检测，通过此函数进行判断连接的socket
@@ -705,6 +1372,16 @@ bool ClientFileSocket::CheckUserId(const qint32 nId, const qint32 &winId)
     return ((m_nUserId == nId) && (m_nWindowId == winId));
 }
 
+qint32 ClientFileSocket::GetUserId() const
+{
+    return m_nUserId;
+}
+
+qint32 ClientFileSocket::GetWindowId() const
+{
+    return m_nWindowId;
+}
+
 /**
  * @brief ClientFileSocket::startTransferFile
  * 下发文件
@@ -713,18 +1390,38 @@ bool ClientFileSocket::CheckUserId(const qint32 nId, const qint32 &winId)
  */
 void ClientFileSocket::StartTransferFile(QString fileName)
 {
+    if (!m_tcpSocket->isOpen()) {
+        return;
+    }
+
+    // v2 连接上可以同时下发多个文件
+    if (m_bV2) {
+        OfferFile(fileName);
+        KickSend();
+        return;
+    }
+
     if (m_bBusy) return;
 
-    if (!m_tcpSocket->isOpen()) {
+    // v1 只能下发完整文件，文件还在上传时等 FileRelay 通知上传完成，失败则放弃
+    RelayUpload upload;
+    if (FileRelay::Instance()->Find((-2 == m_nWindowId ? MyApp::m_strHeadPath : MyApp::m_strRecvPath) + fileName, upload)) {
+        m_strRelayWait = fileName;
+        m_nRelayWaitId = upload.id;
+        m_bBusy = true;
+        FileRelay::Instance()->Watch(upload.id, this);
+        LOG_INFO(LogFile) << "wait for upload" << fileName << m_nUserId << m_nWindowId;
         return;
     }
 
-    // 要发送的文件
-    fileToSend = new QFile((-2 == m_nWindowId ? MyApp::m_strHeadPath : MyApp::m_strRecvPath) + fileName);
+    // 要发送的文件，v2 上传的文件可能已移入内容存储
+    QString strBlob = (-2 == m_nWindowId) ? QString() : BlobStore::Instance()->Resolve(m_nWindowId, fileName);
+    fileToSend->setFileName(!strBlob.isEmpty() ? strBlob :
+                            (-2 == m_nWindowId ? MyApp::m_strHeadPath : MyApp::m_strRecvPath) + fileName);
 
     if (!fileToSend->open(QFile::ReadOnly))
     {
-        qDebug() << "open file error!";
+        LOG_ERROR(LogFile) << "open file error!";
         return;
     }
 
@@ -750,7 +1447,97 @@ void ClientFileSocket::StartTransferFile(QString fileName)
 
     outBlock.resize(0);
     m_bBusy = true;
-    qDebug() << "Begin to send file" << fileName << m_nUserId << m_nWindowId;
+
+    // 正文在头部写完后的 bytesWritten 中开始发送
+#ifdef Q_OS_LINUX
+    m_bSendfile = MyApp::m_bFileSendfile;
+#endif
+    m_nFileOffset = 0;
+    LOG_INFO(LogFile) << "Begin to send file" << fileName << m_nUserId << m_nWindowId << (m_bSendfile ? "sendfile" : "buffered");
+}
+
+/**
+ * @brief ClientFileSocket::InitWriteNotifier
+ * 直接写描述符时，发送缓冲满后等待可写
+ */
+void ClientFileSocket::InitWriteNotifier()
+{
+    if (NULL != m_writeNotifier) return;
+
+    m_writeNotifier = new QSocketNotifier(m_tcpSocket->socketDescriptor(), QSocketNotifier::Write, this);
+    m_writeNotifier->setEnabled(false);
+    connect(m_writeNotifier, SIGNAL(activated(int)), this, SLOT(SltSendfileWritable()));
+    // 连接关闭后描述符失效，不能再等待
+    connect(m_tcpSocket, &QTcpSocket::disconnected, m_writeNotifier, [this]() {
+        m_writeNotifier->setEnabled(false);
+    });
+}
+
+/**
+ * @brief ClientFileSocket::SendFileBody
+ * socket 是非阻塞的：发送缓冲满（EAGAIN）时启用写通知，可写后继续；
+ * 第一次调用就不支持（EINVAL/ENOSYS）时改走原来的缓冲方式
+ */
+void ClientFileSocket::SendFileBody()
+{
+#ifdef Q_OS_LINUX
+    InitWriteNotifier();
+    m_writeNotifier->setEnabled(false);
+
+    int nSocket = int(m_tcpSocket->socketDescriptor());
+    int nFile = fileToSend->handle();
+    qint64 nTurn = 0;
+    while (bytesToWrite > 0) {
+        if (nTurn >= SENDFILE_TURN_BYTES) {
+            m_writeNotifier->setEnabled(true);
+            return;
+        }
+
+        off_t offset = off_t(m_nFileOffset);
+        ssize_t n = ::sendfile(nSocket, nFile, &offset, size_t(qMin(bytesToWrite, quint64(SENDFILE_TURN_BYTES - nTurn))));
+        if (n > 0) {
+            m_nFileOffset = offset;
+            bytesToWrite -= n;
+            bytesWritten += n;
+            nTurn += n;
+            Metrics::Add(MetFileBytesOut, n);
+            Metrics::Add(MetFileSendfileBytes, n);
+            m_nActiveMs = TimingWheel::NowMs();
+            continue;
+        }
+
+        if (n < 0 && EINTR == errno) continue;
+        if (n < 0 && (EAGAIN == errno || EWOULDBLOCK == errno)) {
+            m_writeNotifier->setEnabled(true);
+            return;
+        }
+        if (n < 0 && 0 == m_nFileOffset && (EINVAL == errno || ENOSYS == errno)) {
+            LOG_INFO(LogFile) << "sendfile not supported, fall back to buffered" << fileToSend->fileName();
+            m_bSendfile = false;
+            SltUpdateClientProgress(0);
+            return;
+        }
+
+        // 文件被截断或连接出错
+        LOG_WARN(LogFile) << "sendfile failed" << fileToSend->fileName() << n << (n < 0 ? errno : 0);
+        m_tcpSocket->abort();
+        return;
+    }
+
+    SendFinished();
+#else
+    m_bSendfile = false;
+    SltUpdateClientProgress(0);
+#endif
+}
+
+void ClientFileSocket::SltSendfileWritable()
+{
+    if (m_bV2) {
+        PumpFrames();
+    } else if (m_bSendfile && bytesToWrite > 0) {
+        SendFileBody();
+    }
 }
 
 /**
@@ -761,6 +1548,20 @@ void ClientFileSocket::SltUpdateClientProgress(qint64 numBytes)
 {
     // 已经发送数据的大小
     bytesWritten += (int)numBytes;
+    Metrics::Add(MetFileBytesOut, numBytes);
+    m_nActiveMs = TimingWheel::NowMs();
+
+    if (m_bV2) {
+        if (!m_bRawWriter) SendChunks();
+        return;
+    }
+
+    // 正文走 sendfile：等头部从 Qt 的发送缓冲全部写出后再开始，保证顺序
+    if (m_bSendfile && bytesToWrite > 0) {
+        if (0 == m_tcpSocket->bytesToWrite()) SendFileBody();
+        return;
+    }
+
     // 如果已经发送了数据
     if (bytesToWrite > 0)
     {
@@ -783,17 +1584,24 @@ void ClientFileSocket::SltUpdateClientProgress(qint64 numBytes)
     // 发送完毕
     if (bytesWritten >= ullSendTotalBytes)
     {
-        if (fileToSend->isOpen())
-            fileToSend->close();
-
-        bytesWritten = 0;  // clear fot next send
-        ullSendTotalBytes = 0;
-        bytesToWrite = 0;
-        qDebug() << "send ok" << fileToSend->fileName();
-        FileTransFinished();
+        SendFinished();
     }
 }
 
+void ClientFileSocket::SendFinished()
+{
+    if (fileToSend->isOpen())
+        fileToSend->close();
+
+    bytesWritten = 0;  // clear fot next send
+    ullSendTotalBytes = 0;
+    bytesToWrite = 0;
+    m_bSendfile = false;
+    LOG_INFO(LogFile) << "send ok" << fileToSend->fileName();
+    Metrics::Add(MetFilesSent);
+    FileTransFinished();
+}
+
 void ClientFileSocket::displayError(QAbstractSocket::SocketError)
 {
     m_tcpSocket->abort();
@@ -814,6 +1622,35 @@ void ClientFileSocket::FileTransFinished()
 // 更新进度条，实现文件的接收
 void ClientFileSocket::SltReadyRead()
 {
+    m_nActiveMs = TimingWheel::NowMs();
+    if (m_bV2) {
+        ReadFrames();
+        return;
+    }
+
+    // v2 握手以魔数开头，旧版握手是 8 字节的用户id、窗口id
+    if (0 == bytesReceived && (-1 == m_nUserId) && (-1 == m_nWindowId)) {
+        if (m_tcpSocket->bytesAvailable() < 4) return;
+
+        if (FileTransfer::IsHelloV2(m_tcpSocket->peek(4))) {
+            if (m_tcpSocket->bytesAvailable() < FILE_V2_HELLO_SIZE) return;
+
+            QByteArray hello = m_tcpSocket->read(FILE_V2_HELLO_SIZE);
+            const uchar *p = reinterpret_cast<const uchar *>(hello.constData());
+            m_nUserId = qFromBigEndian<qint32>(p + 4);
+            m_nWindowId = qFromBigEndian<qint32>(p + 8);
+            m_bV2 = true;
+#ifdef Q_OS_LINUX
+            m_bRawWriter = MyApp::m_bFileSendfile;
+#endif
+            LOG_DEBUG(LogFile) << "File server Get userId" << m_nUserId << m_nWindowId << "v2";
+            Q_EMIT signalConnected();
+
+            if (m_tcpSocket->bytesAvailable() > 0) ReadFrames();
+            return;
+        }
+    }
+
     QDataStream in(m_tcpSocket);
     in.setVersion(QDataStream::Qt_4_8);
 
@@ -823,7 +1660,7 @@ void ClientFileSocket::SltReadyRead()
     {
         // 保存ID，方便发送文件
         in >> m_nUserId >> m_nWindowId;
-        qDebug() << "File server Get userId" << m_nUserId << m_nWindowId;
+        LOG_DEBUG(LogFile) << "File server Get userId" << m_nUserId << m_nWindowId;
         Q_EMIT signalConnected();
         return;
     }
@@ -851,10 +1688,10 @@ void ClientFileSocket::SltReadyRead()
 
             if (!fileToRecv->open(QFile::WriteOnly | QIODevice::Truncate))
             {
-                qDebug() << "open file error" << fileReadName;
+                LOG_ERROR(LogFile) << "open file error" << fileReadName;
                 return;
             }
-            qDebug() << "begin to recv files" << fileReadName;
+            LOG_INFO(LogFile) << "begin to recv files" << fileReadName;
         }
     }
 
@@ -863,6 +1700,7 @@ void ClientFileSocket::SltReadyRead()
     {
         bytesReceived += m_tcpSocket->bytesAvailable();
         inBlock = m_tcpSocket->readAll();
+        Metrics::Add(MetFileBytesIn, inBlock.size());
 
         if (fileToRecv->isOpen())
             fileToRecv->write(inBlock);
@@ -877,8 +1715,571 @@ void ClientFileSocket::SltReadyRead()
         bytesReceived = 0; // clear for next receive
         ullRecvTotalBytes = 0;
         fileNameSize = 0;
-        qDebug() << "recv ok" << fileToRecv->fileName();
+        LOG_INFO(LogFile) << "recv ok" << fileToRecv->fileName();
+        Metrics::Add(MetFilesRecv);
         // 数据接受完成
         FileTransFinished();
     }
 }
+
+/**
+ * @brief ClientFileSocket::ReadFrames
+ * v2 连接上的帧，上传和下载可以同时进行，每个方向也可以同时有多个文件
+ */
+void ClientFileSocket::ReadFrames()
+{
+    QByteArray data = m_tcpSocket->readAll();
+    Metrics::Add(MetFileBytesIn, data.size());
+    m_codec.Append(data);
+
+    QByteArray payload;
+    while (m_codec.TakeFrame(payload)) {
+        FileFrame frame;
+        if (!FileTransfer::Parse(payload, frame)) {
+            LOG_WARN(LogFile) << "bad file frame, close" << m_nUserId << m_nWindowId;
+            m_tcpSocket->abort();
+            return;
+        }
+
+        switch (frame.op) {
+        case FileOffer:
+            ParseOffer(frame);
+            break;
+        case FileChunk:
+            ParseChunk(frame);
+            break;
+        case FileResume:
+            ParseResume(frame);
+            break;
+        case FileDone:
+            FinishSend(frame.id);
+            break;
+        case FileError:
+            LOG_WARN(LogFile) << "peer gave up transfer" << m_nUserId << frame.id << frame.code;
+            DropSend(frame.id, 0);
+            DropRecv(frame.id, 0);
+            break;
+        default:
+            break;
+        }
+    }
+
+    if (m_codec.HasError()) {
+        LOG_WARN(LogFile) << "file frame too large, close" << m_nUserId << m_nWindowId;
+        m_tcpSocket->abort();
+        return;
+    }
+
+    // 回复的 Resume、Done 以及回退后的块
+    KickSend();
+}
+
+/**
+ * @brief ClientFileSocket::ParseOffer
+ * 上传开始：有同一个传输id 的未完成文件时回复已校验的偏移，客户端从这里继续
+ * @param frame
+ */
+void ClientFileSocket::ParseOffer(const FileFrame &frame)
+{
+    // 同一个文件已经在接收
+    if (m_incoming.contains(frame.id)) return;
+
+    if (m_incoming.size() >= FILE_MAX_TRANSFERS) {
+        LOG_WARN(LogFile) << "too many uploads on one connection" << m_nUserId << frame.name;
+        WriteFrame(FileTransfer::PackError(frame.id, FileErrBusy));
+        return;
+    }
+
+    // 只取最后一段文件名，不能写到接收目录之外，也不能覆盖校验记录等隐藏文件
+    QString strName = QFileInfo(frame.name).fileName();
+    if (strName.isEmpty() || strName.startsWith('.')) {
+        LOG_WARN(LogFile) << "bad file name" << frame.name << m_nUserId;
+        WriteFrame(FileTransfer::PackError(frame.id, FileErrProtocol));
+        return;
+    }
+
+    // 该用户上传过相同内容（摘要与大小都一致），不必上传（头像按文件名存放，不参与）；
+    // 摘要由客户端声明，只在本人的文件中查找，不能用来取得别人上传的内容
+    if (MyApp::m_bFileDedup && -2 != m_nWindowId && FILE_SHA_SIZE == frame.sha.size() &&
+            BlobStore::Instance()->Link(m_nUserId, strName, frame.sha, frame.size)) {
+        LOG_INFO(LogFile) << "upload skipped, content exists" << strName << m_nUserId << frame.size;
+        Metrics::Add(MetFileDedupSkips);
+        Metrics::Add(MetFileDedupBytes, frame.size);
+        WriteFrame(FileTransfer::PackDone(frame.id));
+        return;
+    }
+
+    QString strTarget = (-2 == m_nWindowId ? MyApp::m_strHeadPath : MyApp::m_strRecvPath) + strName;
+    PartFile *part = new PartFile;
+    qint64 nOffset = part->Open(strTarget, frame.id, frame.size, frame.chunkSize, true);
+    if (nOffset < 0) {
+        LOG_ERROR(LogFile) << "open part file error" << strTarget;
+        delete part;
+        WriteFrame(FileTransfer::PackError(frame.id, FileErrIo));
+        return;
+    }
+
+    m_incoming.insert(frame.id, part);
+    FileRelay::Instance()->Begin(strTarget, frame.id, frame.size, quint64(nOffset), part->PartPath());
+    if (nOffset > 0) {
+        LOG_INFO(LogFile) << "resume recv" << strTarget << nOffset << frame.size;
+        Metrics::Add(MetFileResumedBytes, nOffset);
+    } else {
+        LOG_INFO(LogFile) << "begin to recv files" << strTarget << frame.size;
+    }
+
+    // 上次已全部收到但没来得及改名，或者是空文件
+    if (part->IsComplete()) {
+        FinishRecv(part);
+        return;
+    }
+
+    WriteFrame(FileTransfer::PackResume(frame.id, quint64(nOffset)));
+}
+
+/**
+ * @brief ClientFileSocket::ParseChunk
+ * 校验失败时让客户端从已校验的位置重发，同一位置连续失败超过 FILE_CRC_RETRY 次放弃
+ * @param frame
+ */
+void ClientFileSocket::ParseChunk(const FileFrame &frame)
+{
+    PartFile *part = m_incoming.value(frame.id, NULL);
+    if (NULL == part) return;
+
+    switch (part->Write(frame.offset, frame.crc, frame.data)) {
+    case PartOk:
+        FileRelay::Instance()->Progress(part->Target(), frame.id, part->Verified());
+        if (part->IsComplete()) FinishRecv(part);
+        break;
+    case PartBadCrc:
+        Metrics::Add(MetFileChunkCrcErrors);
+        LOG_WARN(LogFile) << "chunk checksum error, resend from" << part->Verified() << part->Target();
+        WriteFrame(FileTransfer::PackResume(frame.id, part->Verified()));
+        break;
+    case PartGiveUp:
+        Metrics::Add(MetFileChunkCrcErrors);
+        LOG_WARN(LogFile) << "chunk checksum keeps failing, give up" << part->Target() << frame.offset;
+        DropRecv(frame.id, FileErrChecksum);
+        break;
+    case PartIoError:
+        LOG_ERROR(LogFile) << "write part file error" << part->Target();
+        DropRecv(frame.id, FileErrIo);
+        break;
+    default:
+        // 回退之前已经在途的块
+        break;
+    }
+}
+
+void ClientFileSocket::FinishRecv(PartFile *part)
+{
+    quint64 nId = part->Id();
+    if (!part->Commit()) {
+        LOG_ERROR(LogFile) << "commit file error" << part->Target();
+        DropRecv(nId, FileErrIo);
+        return;
+    }
+
+    // 移入内容存储，失败时文件留在接收目录，下载仍能找到
+    QString strPath = part->Target();
+    QByteArray sha = part->Sha256();
+    if (MyApp::m_bFileDedup && -2 != m_nWindowId && !sha.isEmpty()) {
+        QString strBlob = BlobStore::Instance()->Adopt(strPath, m_nUserId, QFileInfo(strPath).fileName(), sha);
+        if (!strBlob.isEmpty()) strPath = strBlob;
+    }
+
+    LOG_INFO(LogFile) << "recv ok" << part->Target() << strPath;
+    Metrics::Add(MetFilesRecv);
+    FileRelay::Instance()->Commit(part->Target(), nId, strPath);
+    delete m_incoming.take(nId);
+    WriteFrame(FileTransfer::PackDone(nId));
+}
+
+/**
+ * @brief ClientFileSocket::DropRecv
+ * 放弃一个上传，保留未完成文件供下次续传；code 非 0 时通知客户端。
+ * 正在转发这个文件的下载一起放弃
+ * @param id
+ * @param code
+ */
+void ClientFileSocket::DropRecv(const quint64 &id, const quint32 &code)
+{
+    PartFile *part = m_incoming.take(id);
+    if (NULL == part) return;
+
+    FileRelay::Instance()->End(part->Target(), id, true);
+    part->Close();
+    delete part;
+    if (0 != code) WriteFrame(FileTransfer::PackError(id, code));
+}
+
+/**
+ * @brief ClientFileSocket::OfferFile
+ * v2 下发：先发 Offer，收到客户端回复的 Resume（它已有的偏移）后再发数据。
+ * 超过 FILE_MAX_TRANSFERS 的排队，有下发结束时再发。
+ * 文件还在上传时沿用上传的传输id，从 .part 读已校验的部分（FileRelay）；
+ * 否则先在内容存储中按文件名查找，再找接收目录（开启内容存储之前收到的文件）
+ * @param fileName
+ */
+void ClientFileSocket::OfferFile(const QString &fileName)
+{
+    if (m_sending.Count() >= FILE_MAX_TRANSFERS) {
+        if (!m_pendingOffers.contains(fileName)) m_pendingOffers.append(fileName);
+        return;
+    }
+
+    QString strTarget = (-2 == m_nWindowId ? MyApp::m_strHeadPath : MyApp::m_strRecvPath) + fileName;
+    QFileInfo info(strTarget);
+    FileSendTask *task = new FileSendTask;
+    RelayUpload upload;
+    bool bRelay = FileRelay::Instance()->Find(strTarget, upload);
+    if (bRelay) {
+        // 文件在 ReadChunkFrame 中按需打开
+        task->path = upload.partPath;
+        task->size = upload.size;
+        task->id = upload.id;
+        // 关闭边传边下时等上传完成再发
+        task->avail = MyApp::m_bFileRelay ? upload.verified : 0;
+    } else {
+        // 私聊下载连接的窗口id 就是上传者
+        QString strBlob = (-2 == m_nWindowId) ? QString() : BlobStore::Instance()->Resolve(m_nWindowId, fileName);
+        task->path = strBlob.isEmpty() ? strTarget : strBlob;
+        task->file.setFileName(task->path);
+        if (!task->file.open(QFile::ReadOnly)) {
+            LOG_ERROR(LogFile) << "open file error!" << task->path;
+            delete task;
+            return;
+        }
+
+        QFileInfo fileInfo(task->path);
+        task->size = quint64(task->file.size());
+        task->id = FileTransfer::TransferId(info.fileName(), task->size, fileInfo.lastModified().toMSecsSinceEpoch(), FILE_CHUNK_SIZE);
+        task->avail = task->size;
+    }
+    // 收到 Resume 之前没有可发的数据
+    task->offset = -1;
+    task->rewind = -1;
+
+    // 客户端重复请求同一个文件
+    if (NULL != m_sending.Find(task->id)) {
+        delete task;
+        return;
+    }
+
+    // 上传时记录的块校验仍然有效时不必再读文件计算，块数据可以用 sendfile
+    if (m_bRawWriter && !bRelay) PartFile::LoadCrcs(task->path, FILE_CHUNK_SIZE, task->crcs);
+    if (bRelay) FileRelay::Instance()->Watch(task->id, this);
+
+    m_sending.Add(task);
+    WriteFrame(FileTransfer::PackOffer(task->id, task->size, FILE_CHUNK_SIZE, info.fileName()));
+    LOG_INFO(LogFile) << "offer file" << task->path << m_nUserId << m_nWindowId << task->size
+                      << (bRelay ? "relay" : (task->crcs.isEmpty() ? "buffered" : "sendfile"));
+}
+
+/**
+ * @brief ClientFileSocket::RelayUpdate
+ * 转发中的文件上传有进展：path 为之后读取的文件（上传完成后是目标文件），
+ * avail 为可以下发的字节数，-1 表示上传失败
+ * @param id
+ * @param path
+ * @param avail
+ */
+void ClientFileSocket::RelayUpdate(const quint64 &id, const QString &path, const qint64 &avail)
+{
+    // v1 等待中的下载：上传提交后从 FileRelay 中移除，这时按普通文件下发
+    if (!m_strRelayWait.isEmpty() && id == m_nRelayWaitId) {
+        QString strName = m_strRelayWait;
+        RelayUpload upload;
+        if (avail < 0) {
+            LOG_WARN(LogFile) << "relayed upload failed" << strName;
+        } else if (FileRelay::Instance()->Find((-2 == m_nWindowId ? MyApp::m_strHeadPath : MyApp::m_strRecvPath) + strName, upload)) {
+            return;
+        }
+
+        m_strRelayWait.clear();
+        m_bBusy = false;
+        if (avail >= 0) StartTransferFile(strName);
+        return;
+    }
+
+    FileSendTask *task = m_sending.Find(id);
+    if (NULL == task) return;
+
+    if (avail < 0) {
+        LOG_WARN(LogFile) << "relayed upload failed" << task->path;
+        DropSend(id, FileErrIo);
+    } else {
+        if (task->path != path) {
+            task->file.close();
+            task->path = path;
+        }
+        if (MyApp::m_bFileRelay || quint64(avail) >= task->size) task->avail = quint64(avail);
+    }
+
+    KickSend();
+}
+
+/**
+ * @brief ClientFileSocket::ParseResume
+ * 第一次是客户端告知已有的偏移；之后是校验失败要求回退，这个文件的下一块生效
+ * @param frame
+ */
+void ClientFileSocket::ParseResume(const FileFrame &frame)
+{
+    FileSendTask *task = m_sending.Find(frame.id);
+    if (NULL == task) return;
+
+    if (frame.offset > task->size || 0 != frame.offset % FILE_CHUNK_SIZE) {
+        LOG_WARN(LogFile) << "bad resume offset" << frame.offset << task->path;
+        DropSend(frame.id, FileErrProtocol);
+        return;
+    }
+
+    if (task->offset < 0) {
+        if (frame.offset > 0) {
+            LOG_INFO(LogFile) << "resume send" << task->path << frame.offset << task->size;
+            Metrics::Add(MetFileResumedBytes, frame.offset);
+        }
+    } else {
+        LOG_WARN(LogFile) << "peer asks to resend from" << frame.offset << task->path;
+    }
+
+    task->rewind = qint64(frame.offset);
+}
+
+void ClientFileSocket::FinishSend(const quint64 &id)
+{
+    FileSendTask *task = m_sending.Find(id);
+    if (NULL == task) return;
+
+    LOG_INFO(LogFile) << "send ok" << task->path;
+    Metrics::Add(MetFilesSent);
+    RemoveSend(id);
+}
+
+/**
+ * @brief ClientFileSocket::DropSend
+ * 放弃一个下发，code 非 0 时通知客户端
+ * @param id
+ * @param code
+ */
+void ClientFileSocket::DropSend(const quint64 &id, const quint32 &code)
+{
+    FileSendTask *task = m_sending.Find(id);
+    if (NULL == task) return;
+
+    LOG_WARN(LogFile) << "abort send" << task->path << code;
+    if (0 != code) WriteFrame(FileTransfer::PackError(id, code));
+    RemoveSend(id);
+}
+
+/**
+ * @brief ClientFileSocket::RemoveSend
+ * sendfile 正发到这个文件一块的中间时无法再插入其他帧，只能断开连接，客户端重连后续传
+ * @param id
+ */
+void ClientFileSocket::RemoveSend(const quint64 &id)
+{
+    if (NULL != m_pChunkTask && m_pChunkTask->id == id) {
+        if (m_nChunkLeft > 0) {
+            m_tcpSocket->abort();
+            return;
+        }
+        m_pChunkTask = NULL;
+    }
+
+    m_sending.Remove(id);
+
+    // 排队的下发
+    while (!m_pendingOffers.isEmpty() && m_sending.Count() < FILE_MAX_TRANSFERS) {
+        OfferFile(m_pendingOffers.takeFirst());
+    }
+}
+
+/**
+ * @brief ClientFileSocket::ReadChunkFrame
+ * 读出下一块打包成帧，读失败时放弃这个文件并返回空
+ * @param task
+ * @return
+ */
+QByteArray ClientFileSocket::ReadChunkFrame(FileSendTask *task)
+{
+    if (!task->file.isOpen()) {
+        task->file.setFileName(task->path);
+        task->file.open(QFile::ReadOnly);
+    }
+
+    qint64 nLen = qMin(qint64(FILE_CHUNK_SIZE), qint64(task->size) - task->offset);
+    QByteArray data;
+    if (task->file.seek(task->offset)) data = task->file.read(nLen);
+    // 文件还在上传时读完就关闭，上传完成改名时不被占用
+    if (task->avail < task->size) task->file.close();
+    if (data.size() != nLen) {
+        LOG_WARN(LogFile) << "read file error" << task->path << task->offset;
+        DropSend(task->id, FileErrIo);
+        return QByteArray();
+    }
+
+    QByteArray frame = FileTransfer::PackChunk(task->id, quint64(task->offset), data);
+    task->offset += nLen;
+    return frame;
+}
+
+/**
+ * @brief ClientFileSocket::SendChunks
+ * 缓冲方式：socket 缓冲中积压不超过 FILE_SEND_WINDOW，之后在 bytesWritten 中继续；
+ * 每次由调度器挑一个文件发一块
+ */
+void ClientFileSocket::SendChunks()
+{
+    while (m_tcpSocket->bytesToWrite() < FILE_SEND_WINDOW) {
+        FileSendTask *task = m_sending.Next();
+        if (NULL == task) return;
+
+        QByteArray frame = ReadChunkFrame(task);
+        if (!frame.isEmpty()) m_tcpSocket->write(frame);
+    }
+}
+
+/**
+ * @brief ClientFileSocket::PrepareChunk
+ * 直接写描述符时准备下一块：有块校验记录时只写帧头，数据由 sendfile 发送
+ * @return 没有可发的块时返回 false
+ */
+bool ClientFileSocket::PrepareChunk()
+{
+    FileSendTask *task = m_sending.Next();
+    if (NULL == task) return false;
+
+    if (!m_bSendfileOk || task->crcs.isEmpty()) {
+        m_rawOut.append(ReadChunkFrame(task));
+        return true;
+    }
+
+    qint64 nLen = qMin(qint64(FILE_CHUNK_SIZE), qint64(task->size) - task->offset);
+    m_rawOut.append(FileTransfer::PackChunkHead(task->id, quint64(task->offset), quint32(nLen),
+                                                task->crcs.at(int(task->offset / FILE_CHUNK_SIZE))));
+    m_pChunkTask = task;
+    m_nChunkOffset = task->offset;
+    m_nChunkLeft = nLen;
+    task->offset += nLen;
+    return true;
+}
+
+/**
+ * @brief ClientFileSocket::PumpFrames
+ * Linux 下 v2 的输出都不经过 QTcpSocket：帧用 send 写出，有块校验记录的块数据用 sendfile。
+ * 每次最多写 SENDFILE_TURN_BYTES，发送缓冲满时等可写通知
+ */
+void ClientFileSocket::PumpFrames()
+{
+#ifdef Q_OS_LINUX
+    if (m_tcpSocket->socketDescriptor() < 0) return;
+
+    InitWriteNotifier();
+    m_writeNotifier->setEnabled(false);
+
+    int nSocket = int(m_tcpSocket->socketDescriptor());
+    qint64 nTurn = 0;
+    forever {
+        if (nTurn >= SENDFILE_TURN_BYTES) {
+            m_writeNotifier->setEnabled(true);
+            return;
+        }
+
+        ssize_t n = 0;
+        if (m_nRawPos < m_rawOut.size()) {
+            n = ::send(nSocket, m_rawOut.constData() + m_nRawPos, size_t(m_rawOut.size() - m_nRawPos), MSG_NOSIGNAL);
+            if (n > 0) {
+                m_nRawPos += int(n);
+                nTurn += n;
+                Metrics::Add(MetFileBytesOut, n);
+                m_nActiveMs = TimingWheel::NowMs();
+                continue;
+            }
+        } else if (m_nChunkLeft > 0) {
+            off_t offset = off_t(m_nChunkOffset);
+            n = ::sendfile(nSocket, m_pChunkTask->file.handle(), &offset, size_t(qMin(m_nChunkLeft, qint64(SENDFILE_TURN_BYTES) - nTurn)));
+            if (n > 0) {
+                m_nChunkOffset = offset;
+                m_nChunkLeft -= n;
+                nTurn += n;
+                Metrics::Add(MetFileBytesOut, n);
+                Metrics::Add(MetFileSendfileBytes, n);
+                m_nActiveMs = TimingWheel::NowMs();
+                continue;
+            }
+
+            if (n < 0 && (EINVAL == errno || ENOSYS == errno)) {
+                // 帧头已经写出，本块剩余的数据读出来补齐，之后这个连接都读文件发送
+                LOG_INFO(LogFile) << "sendfile not supported, fall back to buffered" << m_pChunkTask->path;
+                m_bSendfileOk = false;
+                QByteArray data;
+                if (m_pChunkTask->file.seek(m_nChunkOffset)) data = m_pChunkTask->file.read(m_nChunkLeft);
+                if (data.size() != m_nChunkLeft) {
+                    m_tcpSocket->abort();
+                    return;
+                }
+                m_rawOut = data + m_ctlOut;
+                m_ctlOut.clear();
+                m_nRawPos = 0;
+                m_nChunkLeft = 0;
+                continue;
+            }
+        } else {
+            // 块边界：先写块中间排队的控制帧，再准备下一块
+            m_rawOut = m_ctlOut;
+            m_ctlOut.clear();
+            m_nRawPos = 0;
+            m_pChunkTask = NULL;
+            if (!PrepareChunk() && m_rawOut.isEmpty()) break;
+            continue;
+        }
+
+        if (n < 0 && EINTR == errno) continue;
+        if (n < 0 && (EAGAIN == errno || EWOULDBLOCK == errno)) {
+            m_writeNotifier->setEnabled(true);
+            return;
+        }
+
+        // 文件被截断或连接出错
+        LOG_WARN(LogFile) << "file send failed" << m_nUserId << n << (n < 0 ? errno : 0);
+        m_tcpSocket->abort();
+        return;
+    }
+#endif
+}
+
+/**
+ * @brief ClientFileSocket::KickSend
+ * 有新的帧或块可发时调用；正在等可写通知时由通知继续
+ */
+void ClientFileSocket::KickSend()
+{
+    if (!m_bRawWriter) {
+        SendChunks();
+        return;
+    }
+
+    if (NULL == m_writeNotifier || !m_writeNotifier->isEnabled()) PumpFrames();
+}
+
+/**
+ * @brief ClientFileSocket::WriteFrame
+ * 直接写描述符时只排队，由 PumpFrames 写出；sendfile 正发到一块中间时排到块边界
+ * @param frame
+ */
+void ClientFileSocket::WriteFrame(const QByteArray &frame)
+{
+    if (!m_bRawWriter) {
+        m_tcpSocket->write(frame);
+        return;
+    }
+
+    if (m_nChunkLeft > 0) {
+        m_ctlOut.append(frame);
+    } else {
+        m_rawOut.append(frame);
+    }
+}
@@ -4,8 +4,25 @@
 #include <QObject>
 #include <QTcpSocket>
 #include <QFile>
-#include <QApplication>
+#include <QCoreApplication>
+#include <QVector>
+#include <QJsonObject>
+#include <QJsonArray>
+#include <QList>
+#include <QAtomicInt>
+#include <QHash>
+#include <QStringList>
 
+#include "framecodec.h"
+#include "msgcodec.h"
+#include "protocol.h"
+#include "dbworker.h"
+#include "timingwheel.h"
+#include "ratelimit.h"
+#include "filetransfer.h"
+
+class ReadScheduler;
+class QSocketNotifier;
 
 ////////////////////////////////////////////////////////////////////////////////
 /// \brief The ClientSocket class
@@ -18,17 +35,81 @@ public:
     ~ClientSocket();
 
     int GetUserId() const;
+    QString GetUserName() const;
     void Close();
+
+    // 待发送字节数（发送队列 + socket 缓冲），可在其他线程读取
+    int GetQueueDepth() const;
+    // 拥塞时丢弃的帧数
+    int GetDroppedCount() const;
+
+    // 编码一条完整消息帧（含长度头），可以直接写给多个连接
+    static QByteArray PackMessage(const quint8 &type, const int &from, const QJsonValue &json,
+                                  const MsgCodec::E_FORMAT &format = MsgCodec::Json);
+    // 发送已经编码好的帧，bDroppable 表示拥塞时可以丢弃
+    void SendFrame(const QByteArray &frame, const bool &bDroppable = false);
+    // 发送同一条消息的两种编码之一
+    void SendPacked(const QByteArray &jsonFrame, const QByteArray &cborFrame);
+    // 在所在线程的时间轮上检测空闲，超时关闭连接
+    void WatchIdle(TimingWheel *wheel);
+    // 按所在线程的读调度预算分轮读取，NULL 表示每次读完全部数据
+    void SetReadScheduler(ReadScheduler *scheduler);
+    // 读取并处理一轮数据，由 readyRead 或读调度调用
+    void ReadTurn();
 signals:
     void signalConnected();
     void signalDisConnected();
     void signalDownloadFile(const QJsonValue &json);
     void signalMsgToClient(const quint8 &type, const int &id, const QJsonValue &dataVal);
+    // 同一帧发给多个用户（群消息扇出）
+    void signalFrameToClients(const QVector<int> &ids, const QByteArray &frame, const QByteArray &cborFrame);
 public slots:
 
 private:
     QTcpSocket *m_tcpSocket;
     int         m_nId;
+    // 登录后缓存的本人资料，群消息扇出时使用
+    QString     m_strName;
+    QString     m_strHead;
+    // 分帧缓冲
+    FrameCodec  m_frameCodec;
+    // 客户端支持离线消息分页推送
+    bool        m_bOfflineBatch;
+    // 已推送、等待确认的离线消息页的最后一条id，0 表示没有在途页
+    int         m_nOfflineSent;
+    // 本次读取 socket 的时间，消息追踪的接收打点
+    qint64      m_nReadNs;
+    // 空闲检测：最后收到数据的时间（TimingWheel::NowMs），半程无数据时发一次 Ping 探测
+    TimingWheel *m_idleWheel;
+    WheelNode   m_idleNode;
+    qint64      m_nActiveMs;
+    bool        m_bProbeSent;
+    // 读调度，预算用完时排队等下一轮
+    ReadScheduler *m_readScheduler;
+    bool        m_bReadQueued;
+    // 各类请求的令牌桶
+    RateLimiter m_rateLimiter;
+    // 已通过登录准入、等待数据库校验
+    bool        m_bLoginPending;
+    // 本连接占用了 m_nId 的在线状态（SetOnline 成功），只由本连接释放一次
+    bool        m_bPresence;
+    // 已发出 signalDisConnected，注销后再断开时不重复通知
+    bool        m_bSessionEnded;
+    // 客户端声明支持 CBOR，登录成功后生效
+    bool        m_bCborPending;
+    bool        m_bCbor;
+    // 客户端支持私聊转发帧，登录成功后生效
+    bool        m_bRelayPending;
+    bool        m_bRelay;
+
+    // 发送队列，每轮事件循环合并写入一次
+    QList < QByteArray >    m_outQueue;
+    qint64                  m_nOutBytes;
+    bool                    m_bFlushPending;
+    // 超过高水位，低于低水位后恢复
+    bool                    m_bCongested;
+    QAtomicInt              m_nQueueDepth;
+    QAtomicInt              m_nDropped;
 
 public slots:
     // 消息回发
@@ -38,28 +119,94 @@ private slots:
     void SltConnected();
     void SltDisconnected();
     void SltReadyRead();
+    void SltFlushOutbound();
+    void SltBytesWritten(qint64);
 
 private:
+    // 单帧消息分发
+    void ParseFrame(const QByteArray &reply);
+    void UpdateQueueDepth();
+    // 发送协议结构，CBOR 连接直接编码结构，不经过 JSON 对象
+    template <typename T>
+    void SendStruct(const quint8 &type, const T &msg)
+    {
+        if (m_bCbor) {
+            SendCbor(type, msg.EncodeCbor());
+        } else {
+            SltSendMessage(type, msg.Encode());
+        }
+    }
+    void SendCbor(const quint8 &type, const QCborMap &data);
+    // 丢弃待发送数据（断开、中止时），积压计数与拥塞状态一起清零
+    void ClearOutbound();
+    void CheckIdle();
+    // 释放本连接占用的在线状态并通知服务器移除连接，注销与断开都会调用，只生效一次
+    void EndSession();
+    // 限流拒绝：计数并按需回复 Throttled（登录、注册回复繁忙）；
+    // to/msgId 为私聊消息的接收者和消息 id，query 为查询类请求的原 data
+    void Throttle(const quint8 &type, const int &result, const int &retryMs, const int &to, const int &msgId,
+                  const QJsonValue &query = QJsonValue(QJsonValue::Undefined));
+    // 从信封帧的 data（JSON 或 CBOR 之一）中取出 to/msgId 后调用 Throttle
+    void ThrottleFrame(const quint8 &type, const int &result, const int &retryMs,
+                       const QJsonValue &jsonVal, const QCborValue &cborVal);
+    // 登录繁忙应答，客户端提示稍后重试
+    void ReplyLoginBusy(const int &retryMs);
+
+    // 消息分发表：每项把 data 解码为对应的消息结构，成功才调用处理函数
+    // JSON 帧传 jsonVal，CBOR 帧传 cborVal（另一个为 undefined），消息体直接按帧的编码解码
+    typedef bool (*MsgDispatch)(ClientSocket *client, const quint8 &type,
+                                const QJsonValue &jsonVal, const QCborValue &cborVal);
+    struct MsgRoute {
+        quint8      type;
+        MsgDispatch dispatch;
+    };
+    static const MsgRoute s_msgRoutes[];
+    static MsgDispatch FindRoute(const quint8 &type);
+
+    template <typename T, void (ClientSocket::*Handler)(const quint8 &, const T &)>
+    static bool Dispatch(ClientSocket *client, const quint8 &type,
+                         const QJsonValue &jsonVal, const QCborValue &cborVal)
+    {
+        T msg;
+        if (!(cborVal.isUndefined() ? msg.Decode(jsonVal) : msg.Decode(cborVal))) return false;
+        (client->*Handler)(type, msg);
+        return true;
+    }
+
     // 消息解析和抓转发处理
-    void ParseLogin(const QJsonValue &dataVal);
-    void ParseUserOnline(const QJsonValue &dataVal);
-    void ParseLogout(const QJsonValue &dataVal);
-    void ParseUpdateUserHead(const QJsonValue &dataVal);
+    void ParseLogin(const quint8 &type, const LoginMsg &msg);
+    void ParseUserOnline(const quint8 &type, const IdListMsg &msg);
+    void ParseLogout(const quint8 &type, const LogoutMsg &msg);
+    void ParseUpdateUserHead(const quint8 &type, const UpdateHeadMsg &msg);
+
+    void ParseReister(const quint8 &type, const RegisterMsg &msg);
+    void ParseAddFriend(const quint8 &type, const NameMsg &msg);
+    void ParseAddGroup(const quint8 &type, const NameMsg &msg);
+    void ParseCreateGroup(const quint8 &type, const NameMsg &msg);
 
-    void ParseReister(const QJsonValue &dataVal);
-    void ParseAddFriend(const QJsonValue &dataVal);
-    void ParseAddGroup(const QJsonValue &dataVal);
-    void ParseCreateGroup(const QJsonValue &dataVal);
+    void ParseGetMyFriend(const quint8 &type, const IdListMsg &msg);
+    void ParseGetMyGroups(const quint8 &type, const IdMsg &msg);
 
-    void ParseGetMyFriend(const QJsonValue &dataVal);
-    void ParseGetMyGroups(const QJsonValue &dataVal);
+    void ParseRefreshFriend(const quint8 &type, const IdListMsg &msg);
+    void ParseRefreshGroups(const quint8 &type, const IdMsg &msg);
 
-    void ParseRefreshFriend(const QJsonValue &dataVal);
-    void ParseRefreshGroups(const QJsonValue &dataVal);
+    void ParseFriendMessages(const quint8 &type, const ChatMsg &msg);
+    void ParseGroupMessages(const quint8 &type, const ChatMsg &msg);
+    void ParseFaceMessages(const quint8 &type, const ChatMsg &msg);
+    void ParseGetFile(const quint8 &type, const GetFileMsg &msg);
+    void ParsePing(const quint8 &type, const PingMsg &msg);
+    void ParseRelayMessage(const QByteArray &reply);
+    void QueueOfflineMessage(const quint8 &nType, const ChatMsg &msg);
+    void SendAck(const int &nId, const int &nType, const int &queued, const QString &strMsg, const int &msgId);
 
-    void ParseFriendMessages(const QByteArray &reply);
-    void ParseGroupMessages(const QByteArray &reply);
-    void ParseFaceMessages(const QByteArray &reply);
+    // 数据库线程返回后的处理
+    void FinishLogin(const QString &strName, QJsonObject jsonObj);
+    void DrainOffline(const int &cursor);
+    void PushOfflinePage(const int &nId, const QJsonArray &offline);
+    void ParseOfflineAck(const quint8 &type, const OfflineAckMsg &msg);
+    void FanOutGroupMessage(const quint8 &type, const int &nGroupId, const QString &strMsg, const QVector<int> &members);
+    // 查询放到数据库线程，结果直接回复
+    void PostQuery(const quint8 &type, const DbTask &task);
 };
 
 /////////////////////////////////////////////////
@@ -74,11 +221,17 @@ public:
 
     void Close();
     bool CheckUserId(const qint32 nId, const qint32 &winId);
+    qint32 GetUserId() const;
+    qint32 GetWindowId() const;
 
     // 文件传输完成
     void FileTransFinished();
+    // 在时间轮上检测空闲，收发都算活动
+    void WatchIdle(TimingWheel *wheel);
 
     void StartTransferFile(QString fileName);
+    // 转发中的文件上传有进展，由 FileRelay 调用
+    void RelayUpdate(const quint64 &id, const QString &path, const qint64 &avail);
 signals:
     void signalConnected();
     void signalDisConnected();
@@ -105,15 +258,77 @@ private:
     quint64 bytesToWrite;   //剩余数据大小
     QByteArray outBlock;  //数据缓冲区，即存放每次要发送的数据
 
+    // Linux 下文件正文用 sendfile 从页缓存直接写入 socket，不经过 outBlock
+    bool m_bSendfile;
+    qint64 m_nFileOffset;
+    // socket 发送缓冲满时等待可写
+    QSocketNotifier *m_writeNotifier;
+
+    /************* v2 *******************/
+    // 连接握手为 v2，之后双向都是 FileTransfer 帧
+    bool m_bV2;
+    FrameCodec m_codec;
+    // 接收中的文件，按传输id
+    QHash<quint64, PartFile *> m_incoming;
+    // 发送中的文件，按块轮流发送
+    SendScheduler m_sending;
+    // 超过并发上限、等待下发的文件
+    QStringList m_pendingOffers;
+    // Linux 下所有输出直接写描述符：帧用 send，有块校验记录的块数据用 sendfile
+    bool m_bRawWriter;
+    // sendfile 不支持时改为读文件发送
+    bool m_bSendfileOk;
+    // 待写出的帧与已写出的字节数
+    QByteArray m_rawOut;
+    int m_nRawPos;
+    // sendfile 正在发送的块
+    FileSendTask *m_pChunkTask;
+    qint64 m_nChunkOffset;
+    qint64 m_nChunkLeft;
+    // 块数据发送期间要发出的控制帧，在块边界插入，不打断块数据
+    QByteArray m_ctlOut;
 
     bool m_bBusy;
+    // v1 下载的文件还在上传（FileRelay），上传完成后再下发
+    QString m_strRelayWait;
+    quint64 m_nRelayWaitId;
 
     // 需要转发的用户id
     qint32 m_nUserId;
     // 当前用户的窗口好友的id
     qint32 m_nWindowId;
+
+    TimingWheel *m_idleWheel;
+    WheelNode   m_idleNode;
+    qint64      m_nActiveMs;
 private:
     void InitSocket();
+    void CheckIdle();
+    void InitWriteNotifier();
+    // sendfile 发送正文，不支持时转为缓冲方式
+    void SendFileBody();
+    void SendFinished();
+
+    // v2
+    void ReadFrames();
+    void ParseOffer(const FileFrame &frame);
+    void ParseChunk(const FileFrame &frame);
+    void ParseResume(const FileFrame &frame);
+    void FinishRecv(PartFile *part);
+    void DropRecv(const quint64 &id, const quint32 &code);
+    void OfferFile(const QString &fileName);
+    void FinishSend(const quint64 &id);
+    // 放弃一个下发，code 非 0 时通知接收方
+    void DropSend(const quint64 &id, const quint32 &code);
+    void RemoveSend(const quint64 &id);
+    QByteArray ReadChunkFrame(FileSendTask *task);
+    // 缓冲方式：按窗口读块、计算校验后写入 socket
+    void SendChunks();
+    // 直接写描述符的方式
+    bool PrepareChunk();
+    void PumpFrames();
+    void KickSend();
+    void WriteFrame(const QByteArray &frame);
 
 public slots:
 
@@ -123,5 +338,6 @@ private slots:
     void SltReadyRead();
     // 发送
     void SltUpdateClientProgress(qint64 numBytes);
+    void SltSendfileWritable();
 };
 #endif // CLIENTSOCKET_H
@@ -1,11 +1,19 @@
 #include "databasemagr.h"
+#include "presencemagr.h"
 #include "unit.h"
+#include "logger.h"
+#include "metrics.h"
 
 #include <QDebug>
 #include <QDateTime>
 #include <QJsonArray>
 #include <QJsonObject>
 #include <QJsonDocument>
+#include <QThread>
+#include <QElapsedTimer>
+#include <QSqlError>
+
+#include <algorithm>
 
 #define DATE_TME_FORMAT     QDateTime::currentDateTime().toString("yyyy/MM/dd hh:mm:ss")
 
@@ -30,30 +38,28 @@ DataBaseMagr::~DataBaseMagr()
  */
 bool DataBaseMagr::OpenDb(const QString &dataName)
 {
+    ClearStatements();
+    m_strDataName = dataName;
     userdb = QSqlDatabase::addDatabase("QSQLITE");
     userdb.setDatabaseName(dataName);
+    userdb.setConnectOptions("QSQLITE_BUSY_TIMEOUT=3000");
     if (!userdb.open()) {
-        qDebug() << "Open sql failed";
+        LOG_ERROR(LogDb) << "Open sql failed";
         return false;
     }
 
-    // 添加数据表
-    QSqlQuery query;
-    query.exec("CREATE TABLE USERINFO (id INT PRIMARY KEY, name varchar(20), "
-               "passwd varchar(20), head varchar(20), status INT, groupId INT, lasttime DATETIME);");
-
-    query.exec("CREATE TABLE GROUPINFO (id INT PRIMARY KEY, groupId INT, name varchar(20), head varchar(20), "
-               "userId INT, identity INT)");
-
-    query.exec("CREATE TABLE USERHEAD (id INT PRIMARY KEY, name varchar(20), data varchar(20))");
+    ApplyPragmas(userdb);
 
-    query.exec("INSERT INTO USERINFO VALUES(1, 'admin', '123456', '2.bmp', 0, 1, '');");
+    // 按版本号依次执行未执行过的迁移
+    if (!Migrate()) {
+        LOG_ERROR(LogDb) << "database migrate failed";
+        return false;
+    }
 
-    // 离线消息队列表（私聊）：自增主键 + 基本内容 + msgId
-    query.exec("CREATE TABLE IF NOT EXISTS MSGQUEUE (id INTEGER PRIMARY KEY AUTOINCREMENT, fromId INT, toId INT, type INT, msg varchar(500), ts DATETIME, msgId INT);");
-    // 迁移：为已有表补充 msgId 列（重复执行无害，失败可忽略）
-    QSqlQuery alterQuery;
-    alterQuery.exec("ALTER TABLE MSGQUEUE ADD COLUMN msgId INT DEFAULT 0;");
+    // 离线队列长度的初始值，之后随入队和删除增减
+    QSqlQuery query("SELECT COUNT(*) FROM MSGQUEUE;", userdb);
+    if (query.next()) Metrics::GaugeSet(MetOfflineDepth, query.value(0).toLongLong());
+    query.finish();
 
     // 更新状态,避免有些客户端异常退出没有更新下线状态
     ChangeAllUserStatus();
@@ -61,15 +67,244 @@ bool DataBaseMagr::OpenDb(const QString &dataName)
     return true;
 }
 
+/**
+ * @brief DataBaseMagr::ApplyPragmas
+ * 连接级别的设置，每个连接打开后都要执行。
+ * WAL 模式下 synchronous=NORMAL 只在检查点时同步，提交不再每次刷盘
+ * @param db
+ */
+void DataBaseMagr::ApplyPragmas(QSqlDatabase db) const
+{
+    QSqlQuery query(db);
+    query.exec("PRAGMA synchronous=NORMAL;");
+}
+
+// 迁移步骤，按版本号顺序执行，已经发布的步骤不能修改，只能追加
+const DataBaseMagr::Migration DataBaseMagr::s_migrations[] = {
+    { 1, "create base tables",          &DataBaseMagr::MigrateBaseTables },
+    { 2, "add MSGQUEUE.msgId",          &DataBaseMagr::MigrateQueueMsgId },
+    { 3, "add hot path indexes",        &DataBaseMagr::MigrateIndexes },
+    { 4, "switch journal to WAL",       &DataBaseMagr::MigrateWal },
+    { 5, "add file blob store",         &DataBaseMagr::MigrateFileBlobs },
+};
+
+/**
+ * @brief DataBaseMagr::Migrate
+ * 每个迁移步骤与版本号更新在同一个事务中提交，失败则回滚并停止
+ * @return
+ */
+bool DataBaseMagr::Migrate()
+{
+    QElapsedTimer total;
+    total.start();
+
+    QSqlQuery query(userdb);
+    query.exec("CREATE TABLE IF NOT EXISTS schema_version (version INT NOT NULL);");
+
+    int nVersion = 0;
+    if (query.exec("SELECT MAX(version) FROM schema_version;") && query.next()) {
+        nVersion = query.value(0).toInt();
+    }
+    query.finish();
+
+    int nCount = int(sizeof(s_migrations) / sizeof(s_migrations[0]));
+    for (int i = 0; i < nCount; i++) {
+        const Migration &step = s_migrations[i];
+        if (step.version <= nVersion) continue;
+
+        QElapsedTimer timer;
+        timer.start();
+
+        // journal_mode 不能在事务中修改
+        bool bTransaction = (&DataBaseMagr::MigrateWal != step.func);
+        if (bTransaction) userdb.transaction();
+
+        bool bOk = (this->*step.func)(userdb);
+        if (bOk) {
+            query.prepare("INSERT INTO schema_version (version) VALUES (?);");
+            query.bindValue(0, step.version);
+            bOk = query.exec();
+        }
+
+        if (bTransaction) {
+            if (bOk) {
+                bOk = userdb.commit();
+            } else {
+                userdb.rollback();
+            }
+        }
+
+        LOG_INFO(LogDb) << "migration" << step.version << step.name
+                 << (bOk ? "ok" : "failed") << timer.elapsed() << "ms";
+        if (!bOk) return false;
+
+        nVersion = step.version;
+    }
+
+    LOG_INFO(LogDb) << "schema version" << nVersion << "migrate" << total.elapsed() << "ms";
+    return true;
+}
+
+/**
+ * @brief DataBaseMagr::MigrateBaseTables
+ * 原有数据表，旧数据库上已经存在时跳过
+ * @param db
+ * @return
+ */
+bool DataBaseMagr::MigrateBaseTables(QSqlDatabase &db)
+{
+    QSqlQuery query(db);
+    bool bOk = query.exec("CREATE TABLE IF NOT EXISTS USERINFO (id INT PRIMARY KEY, name varchar(20), "
+                          "passwd varchar(20), head varchar(20), status INT, groupId INT, lasttime DATETIME);");
+
+    bOk = bOk && query.exec("CREATE TABLE IF NOT EXISTS GROUPINFO (id INT PRIMARY KEY, groupId INT, name varchar(20), "
+                            "head varchar(20), userId INT, identity INT);");
+
+    bOk = bOk && query.exec("CREATE TABLE IF NOT EXISTS USERHEAD (id INT PRIMARY KEY, name varchar(20), data varchar(20));");
+
+    bOk = bOk && query.exec("INSERT OR IGNORE INTO USERINFO VALUES(1, 'admin', '123456', '2.bmp', 0, 1, '');");
+
+    // 离线消息队列表（私聊）：自增主键 + 基本内容
+    bOk = bOk && query.exec("CREATE TABLE IF NOT EXISTS MSGQUEUE (id INTEGER PRIMARY KEY AUTOINCREMENT, fromId INT, "
+                            "toId INT, type INT, msg varchar(500), ts DATETIME);");
+
+    if (!bOk) LOG_WARN(LogDb) << query.lastError().text();
+    return bOk;
+}
+
+/**
+ * @brief DataBaseMagr::MigrateQueueMsgId
+ * 旧版本启动时已经补过该列的数据库直接跳过
+ * @param db
+ * @return
+ */
+bool DataBaseMagr::MigrateQueueMsgId(QSqlDatabase &db)
+{
+    QSqlQuery query(db);
+    if (!query.exec("PRAGMA table_info(MSGQUEUE);")) return false;
+
+    while (query.next()) {
+        if (0 == query.value("name").toString().compare("msgId", Qt::CaseInsensitive)) return true;
+    }
+    query.finish();
+
+    bool bOk = query.exec("ALTER TABLE MSGQUEUE ADD COLUMN msgId INT DEFAULT 0;");
+    if (!bOk) LOG_WARN(LogDb) << query.lastError().text();
+    return bOk;
+}
+
+/**
+ * @brief DataBaseMagr::MigrateIndexes
+ * 离线消息按接收方取出、群成员查询、按名字登录/加好友
+ * @param db
+ * @return
+ */
+bool DataBaseMagr::MigrateIndexes(QSqlDatabase &db)
+{
+    QSqlQuery query(db);
+    bool bOk = query.exec("CREATE INDEX IF NOT EXISTS idx_msgqueue_toid ON MSGQUEUE (toId, id);");
+    bOk = bOk && query.exec("CREATE INDEX IF NOT EXISTS idx_groupinfo_groupid ON GROUPINFO (groupId);");
+    bOk = bOk && query.exec("CREATE INDEX IF NOT EXISTS idx_groupinfo_userid ON GROUPINFO (userId);");
+    bOk = bOk && query.exec("CREATE INDEX IF NOT EXISTS idx_userinfo_name ON USERINFO (name);");
+
+    if (!bOk) LOG_WARN(LogDb) << query.lastError().text();
+    return bOk;
+}
+
+/**
+ * @brief DataBaseMagr::MigrateWal
+ * WAL 写在数据库文件中，只需设置一次；读写互不阻塞，工作线程的读连接不再等待写事务
+ * @param db
+ * @return
+ */
+bool DataBaseMagr::MigrateWal(QSqlDatabase &db)
+{
+    QSqlQuery query(db);
+    if (!query.exec("PRAGMA journal_mode=WAL;") || !query.next()) {
+        LOG_WARN(LogDb) << query.lastError().text();
+        return false;
+    }
+
+    QString strMode = query.value(0).toString();
+    query.finish();
+    LOG_INFO(LogDb) << "journal mode" << strMode;
+
+    // 内存数据库等不支持 WAL 的情况，保持原有模式继续运行
+    return true;
+}
+
+/**
+ * @brief DataBaseMagr::MigrateFileBlobs
+ * 文件内容与引用数、文件名到内容的索引；下载时按文件名查找
+ * @param db
+ * @return
+ */
+bool DataBaseMagr::MigrateFileBlobs(QSqlDatabase &db)
+{
+    QSqlQuery query(db);
+    bool bOk = query.exec("CREATE TABLE IF NOT EXISTS FILEBLOB (sha CHAR(64) PRIMARY KEY, size INTEGER, refs INT);");
+    bOk = bOk && query.exec("CREATE TABLE IF NOT EXISTS FILENAME (owner INT, name varchar(255), sha CHAR(64), "
+                            "ts DATETIME, PRIMARY KEY (owner, name));");
+    bOk = bOk && query.exec("CREATE INDEX IF NOT EXISTS idx_filename_name ON FILENAME (name, ts);");
+
+    if (!bOk) LOG_WARN(LogDb) << query.lastError().text();
+    return bOk;
+}
+
 /**
  * @brief DataBaseMagr::CloseDb
  * 关闭数据库
  */
 void DataBaseMagr::CloseDb()
 {
+    ClearStatements();
     userdb.close();
 }
 
+/**
+ * @brief DataBaseMagr::Database
+ * QSqlDatabase 连接只能在创建它的线程中使用，
+ * 主线程使用默认连接，其他线程按线程名各建一个连接
+ * @return
+ */
+QSqlDatabase DataBaseMagr::Database() const
+{
+    if (QThread::currentThread() == this->thread()) return userdb;
+
+    QString strName = QString("conn_%1").arg(quintptr(QThread::currentThreadId()));
+    if (QSqlDatabase::contains(strName)) return QSqlDatabase::database(strName);
+
+    QSqlDatabase db = QSqlDatabase::addDatabase("QSQLITE", strName);
+    db.setDatabaseName(m_strDataName);
+    db.setConnectOptions("QSQLITE_BUSY_TIMEOUT=3000");
+    if (!db.open()) {
+        LOG_ERROR(LogDb) << "Open sql failed" << strName;
+    } else {
+        ApplyPragmas(db);
+    }
+
+    return db;
+}
+
+/**
+ * @brief DataBaseMagr::ReleaseDatabase
+ * 释放当前线程的连接
+ */
+void DataBaseMagr::ReleaseDatabase()
+{
+    if (QThread::currentThread() == this->thread()) return;
+
+    QString strName = QString("conn_%1").arg(quintptr(QThread::currentThreadId()));
+    if (!QSqlDatabase::contains(strName)) return;
+
+    ClearStatements();
+    {
+        QSqlDatabase db = QSqlDatabase::database(strName, false);
+        db.close();
+    }
+    QSqlDatabase::removeDatabase(strName);
+}
+
 /**
  * @brief DataBaseMagr::UpdateUserStatus
  * 更新当前id的用户状态
@@ -79,17 +314,33 @@ void DataBaseMagr::CloseDb()
  */
 void DataBaseMagr::UpdateUserStatus(const int &id, const quint8 &status)
 {
-    // 组织sql语句
-    QString strSql = "UPDATE USERINFO SET status=";
-    strSql += QString::number(status);
-    strSql += QString(",lasttime='");
-    strSql += DATE_TME_FORMAT;
-    strSql += QString("' WHERE id=");
-    strSql += QString::number(id);
+    QSqlQuery query = Prepare("UPDATE USERINFO SET status=?, lasttime=? WHERE id=?;");
+    query.bindValue(0, status);
+    query.bindValue(1, DATE_TME_FORMAT);
+    query.bindValue(2, id);
+    Exec(query);
+}
 
-    // 执行数据库操作
-    QSqlQuery query(strSql);
-    query.exec();
+/**
+ * @brief DataBaseMagr::UpdateUserLastTimes
+ * 批量更新最后在线时间
+ * @param lastTimes
+ */
+void DataBaseMagr::UpdateUserLastTimes(const QHash<int, qint64> &lastTimes)
+{
+    QSqlDatabase db = Database();
+    db.transaction();
+
+    QSqlQuery query = Prepare("UPDATE USERINFO SET lasttime=? WHERE id=?;");
+
+    QHash<int, qint64>::const_iterator it = lastTimes.constBegin();
+    for (; it != lastTimes.constEnd(); ++it) {
+        query.bindValue(0, QDateTime::fromMSecsSinceEpoch(it.value()).toString("yyyy/MM/dd hh:mm:ss"));
+        query.bindValue(1, it.key());
+        Exec(query);
+    }
+
+    db.commit();
 }
 
 /**
@@ -100,16 +351,13 @@ void DataBaseMagr::UpdateUserStatus(const int &id, const quint8 &status)
  */
 void DataBaseMagr::UpdateUserHead(const int &id, const QString &strHead)
 {
-    // 组织sql语句
-    QString strSql = "UPDATE USERINFO SET head='";
-    strSql += strHead;
-    strSql += QString("' WHERE id=");
-    strSql += QString::number(id);
+    QSqlQuery query = Prepare("UPDATE USERINFO SET head=? WHERE id=?;");
+    query.bindValue(0, strHead);
+    query.bindValue(1, id);
 
     // 执行数据库操作
-    QSqlQuery query(strSql);
-    bool bOk = query.exec();
-    qDebug() << "update head" << bOk << id;
+    bool bOk = Exec(query);
+    LOG_DEBUG(LogDb) << "update head" << bOk << id;
 }
 
 /**
@@ -120,14 +368,13 @@ void DataBaseMagr::UpdateUserHead(const int &id, const QString &strHead)
 void DataBaseMagr::TestHeadPic(const int &id, const QString &name, const QString &strHead)
 {
     // 根据新ID重新创建用户
-    QSqlQuery query;
-    query.prepare("INSERT INTO USERHEAD (id, name, data) VALUES (?, ?, ?);");
+    QSqlQuery query = Prepare("INSERT INTO USERHEAD (id, name, data) VALUES (?, ?, ?);");
     query.bindValue(0, id);
     query.bindValue(1, name);
     query.bindValue(2, strHead);
 
-    bool bOk = query.exec();
-    qDebug() << "ok" << bOk;
+    bool bOk = Exec(query);
+    LOG_DEBUG(LogDb) << "ok" << bOk;
     QueryAll();
 }
 
@@ -137,7 +384,7 @@ void DataBaseMagr::TestHeadPic(const int &id, const QString &name, const QString
  */
 QJsonArray DataBaseMagr::GetAllUsers()
 {
-    QSqlQuery query("SELECT * FROM USERINFO ORDER BY id;");
+    QSqlQuery query("SELECT * FROM USERINFO ORDER BY id;", Database());
     QJsonArray jsonArr;
 
     while (query.next()) {
@@ -146,7 +393,7 @@ QJsonArray DataBaseMagr::GetAllUsers()
         jsonObj.insert("name", query.value("name").toString());
         jsonObj.insert("passwd", query.value("passwd").toString());
         jsonObj.insert("head", query.value("head").toString());
-        jsonObj.insert("status", query.value("status").toInt());
+        jsonObj.insert("status", PresenceMagr::Instance()->GetStatus(query.value("id").toInt()));
         jsonObj.insert("groupId", query.value("groupId").toInt());
         jsonObj.insert("lasttime", query.value("lasttime").toString());
         jsonArr.append(jsonObj);
@@ -163,20 +410,17 @@ QJsonArray DataBaseMagr::GetAllUsers()
 QJsonObject DataBaseMagr::GetUserStatus(const int &id) const
 {
     QJsonObject jsonObj;
-    QString strQuery = "SELECT [name],[status],[head] FROM USERINFO ";
-    strQuery.append("WHERE id=");
-    strQuery.append(QString::number(id));
-
-    int nStatus = 0;
+    int nStatus = PresenceMagr::Instance()->GetStatus(id);
     QString strName = "";
     QString strHead = "0.bmp";
 
-    QSqlQuery query(strQuery);
-    if (query.next()) {
+    QSqlQuery query = Prepare("SELECT [name],[head] FROM USERINFO WHERE id=?;");
+    query.bindValue(0, id);
+    if (Exec(query) && query.next()) {
         strName = query.value(0).toString();
-        nStatus = query.value(1).toInt();
-        strHead = query.value(2).toString();
+        strHead = query.value(1).toString();
     }
+    query.finish();
 
     // 组合数据
     jsonObj.insert("id", id);
@@ -195,16 +439,7 @@ QJsonObject DataBaseMagr::GetUserStatus(const int &id) const
  */
 int DataBaseMagr::GetUserLineStatus(const int &id) const
 {
-    QString strQuery = "SELECT [status] FROM USERINFO ";
-    strQuery.append("WHERE id=");
-    strQuery.append(QString::number(id));
-
-    QSqlQuery query(strQuery);
-    if (query.next()) {
-        return query.value(0).toInt();
-    }
-
-    return -1;
+    return PresenceMagr::Instance()->GetStatus(id);
 }
 
 /**
@@ -216,35 +451,21 @@ int DataBaseMagr::GetUserLineStatus(const int &id) const
  */
 QJsonObject DataBaseMagr::CheckUserLogin(const QString &name, const QString &passwd)
 {
-    QString strQuery = "SELECT [id],[head],[status] FROM USERINFO ";
-    strQuery.append("WHERE name='");
-    strQuery.append(name);
-    strQuery.append("' AND passwd='");
-    strQuery.append(passwd);
-    strQuery.append("';");
-
     QJsonObject jsonObj;
     int nId = -1;
     int code = -1;
     QString strHead = "0.bmp";
 
-    QSqlQuery query(strQuery);
-    if (query.next()) {
-        nId = query.value("id").toInt();
-        int nStatus = query.value("status").toInt();
-        if (OnLine == nStatus)
-        {
-            nId = -2;
-            code = -2;
-        }
-        else
-        {
-            // 更新在线信息
-            UpdateUserStatus(nId, OnLine);
-            code = 0;
-        }
-        strHead = query.value("head").toString();
+    // 重复登录由调用方通过 PresenceMagr 判断
+    QSqlQuery query = Prepare("SELECT [id],[head] FROM USERINFO WHERE name=? AND passwd=?;");
+    query.bindValue(0, name);
+    query.bindValue(1, passwd);
+    if (Exec(query) && query.next()) {
+        nId = query.value(0).toInt();
+        code = 0;
+        strHead = query.value(1).toString();
     }
+    query.finish();
 
     // 组织返回
     jsonObj.insert("id", nId);
@@ -264,28 +485,24 @@ QJsonObject DataBaseMagr::CheckUserLogin(const QString &name, const QString &pas
  */
 int DataBaseMagr::RegisterUser(const QString &name, const QString &passwd)
 {
-    QString strQuery = "SELECT [id] FROM USERINFO ";
-    strQuery.append("WHERE name='");
-    strQuery.append(name);
-    strQuery.append("';");
-
-    QSqlQuery query(strQuery);
-    if (query.next()) {
-        // 查询到有该用户，提示注册失败，并返回id号
-        return -1;
-    }
+    QSqlQuery query = Prepare("SELECT [id] FROM USERINFO WHERE name=?;");
+    query.bindValue(0, name);
+    bool bExists = Exec(query) && query.next();
+    query.finish();
+    // 查询到有该用户，提示注册失败
+    if (bExists) return -1;
 
-    // 查询数据库
-    query = QSqlQuery("SELECT [id] FROM USERINFO ORDER BY id DESC;");
-    int nId = 1;
     // 查询最高ID
-    if (query.next()) {
-        nId = query.value("id").toInt();
+    int nId = 1;
+    query = Prepare("SELECT [id] FROM USERINFO ORDER BY id DESC LIMIT 1;");
+    if (Exec(query) && query.next()) {
+        nId = query.value(0).toInt();
     }
+    query.finish();
 
     // 根据新ID重新创建用户
-    query.prepare("INSERT INTO USERINFO (id, name, passwd, head, status, groupId, lasttime) "
-                  "VALUES (?, ?, ?, ?, ?, ?, ?);");
+    query = Prepare("INSERT INTO USERINFO (id, name, passwd, head, status, groupId, lasttime) "
+                    "VALUES (?, ?, ?, ?, ?, ?, ?);");
     query.bindValue(0, nId + 1);
     query.bindValue(1, name);
     query.bindValue(2, passwd);
@@ -294,7 +511,7 @@ int DataBaseMagr::RegisterUser(const QString &name, const QString &passwd)
     query.bindValue(5, 0);
     query.bindValue(6, DATE_TME_FORMAT);
 
-    query.exec();
+    Exec(query);
 
     return nId + 1;
 }
@@ -307,21 +524,18 @@ int DataBaseMagr::RegisterUser(const QString &name, const QString &passwd)
  */
 QJsonObject DataBaseMagr::AddFriend(const QString &name)
 {
-    QString strQuery = "SELECT [id],[status],[head] FROM USERINFO ";
-    strQuery.append("WHERE name='");
-    strQuery.append(name);
-    strQuery.append("';");
-
     int nId = -1;
     int nStatus = -1;
     QString strHead = "0.bmp";
-    QSqlQuery query(strQuery);
+    QSqlQuery query = Prepare("SELECT [id],[head] FROM USERINFO WHERE name=?;");
+    query.bindValue(0, name);
     // 查询到有该用户
-    if (query.next()) {
-        nId     = query.value("id").toInt();
-        nStatus = query.value("status").toInt();
-        strHead = query.value("head").toString();
+    if (Exec(query) && query.next()) {
+        nId     = query.value(0).toInt();
+        nStatus = PresenceMagr::Instance()->GetStatus(nId);
+        strHead = query.value(1).toString();
     }
+    query.finish();
 
     // 构建 Json 对象
     QJsonObject json;
@@ -352,7 +566,7 @@ QJsonObject DataBaseMagr::AddGroup(const int &userId, const QString &name)
     int nGroupId = -1;
     QString strHead = "1.bmp";
 
-    QSqlQuery query(strQuery);
+    QSqlQuery query(strQuery, Database());
 
     // 查询到有该用户组
     if (query.next()) {
@@ -361,7 +575,7 @@ QJsonObject DataBaseMagr::AddGroup(const int &userId, const QString &name)
     }
     else {
         // 查询数据库
-        query = QSqlQuery("SELECT [id] FROM GROUPINFO ORDER BY id DESC;");
+        query = QSqlQuery("SELECT [id] FROM GROUPINFO ORDER BY id DESC;", Database());
         int nIndex = 0;
         // 查询最高ID
         if (query.next()) {
@@ -375,7 +589,7 @@ QJsonObject DataBaseMagr::AddGroup(const int &userId, const QString &name)
         strQuery.append(name);
         strQuery.append("'");
 
-        query = QSqlQuery(strQuery);
+        query = QSqlQuery(strQuery, Database());
         // 查询最高ID
         if (query.next()) {
             nGroupId = query.value(0).toInt();
@@ -393,53 +607,51 @@ QJsonObject DataBaseMagr::AddGroup(const int &userId, const QString &name)
     }
 #else
     // 先查询是否有该群组
-    QString strQuery = "SELECT [groupId] FROM GROUPINFO ";
-    strQuery.append("WHERE name='");
-    strQuery.append(name);
-    strQuery.append("';");
-
     int nGroupId = -1;
     int nCode    = -1;
     QString strHead = "5.bmp";
 
-    QSqlQuery query(strQuery);
+    QSqlQuery query = Prepare("SELECT [groupId] FROM GROUPINFO WHERE name=?;");
+    query.bindValue(0, name);
+    bool bFound = Exec(query) && query.next();
+    if (bFound) nGroupId = query.value(0).toInt();
+    query.finish();
 
     // 查询到有该用户组
-    if (query.next())
+    if (bFound)
     {
         // 查询到有该群组，再判断该用户是否已经加入该群组
-        nGroupId = query.value(0).toInt();
-        strQuery = QString("SELECT [userId] FROM GROUPINFO WHERE groupId=");
-        strQuery.append(QString::number(nGroupId));
-        strQuery.append("");
+        query = Prepare("SELECT [userId] FROM GROUPINFO WHERE groupId=?;");
+        query.bindValue(0, nGroupId);
+        bool bJoined = Exec(query) && query.next();
+        query.finish();
 
-        query = QSqlQuery(strQuery);
         // 查询到已经添加到该群组
-        if (query.next()) {
+        if (bJoined) {
             nCode = -2;
         }
         else
         {
-            // 查询数据库
-            query = QSqlQuery("SELECT [id] FROM GROUPINFO ORDER BY id DESC;");
-            int nIndex = 0;
             // 查询最高ID
-            if (query.next()) {
+            int nIndex = 0;
+            query = Prepare("SELECT [id] FROM GROUPINFO ORDER BY id DESC LIMIT 1;");
+            if (Exec(query) && query.next()) {
                 nIndex = query.value(0).toInt();
             }
+            query.finish();
 
             nIndex   += 1;
 
             // 根据新ID重新创建用户
-            query.prepare("INSERT INTO GROUPINFO (id, groupId, name, userId, identity) "
-                          "VALUES (?, ?, ?, ?, ?);");
+            query = Prepare("INSERT INTO GROUPINFO (id, groupId, name, userId, identity) "
+                            "VALUES (?, ?, ?, ?, ?);");
             query.bindValue(0, nIndex);
             query.bindValue(1, nGroupId);
             query.bindValue(2, name);
             query.bindValue(3, userId);
             query.bindValue(4, 3);
             // 执行插入
-            query.exec();
+            Exec(query);
         }
     }
 #endif
@@ -465,52 +677,46 @@ QJsonObject DataBaseMagr::AddGroup(const int &userId, const QString &name)
 QJsonObject DataBaseMagr::CreateGroup(const int &userId, const QString &name)
 {
     //查询群组是否存在
-    QString strQuery = "SELECT [id],[groupId],[head] FROM GROUPINFO ";
-    strQuery.append("WHERE name='");
-    strQuery.append(name);
-    strQuery.append("' AND userId=");
-    strQuery.append(QString::number(userId));
-
     int nIndex = -1;
     int nGroupId = -1;
     QString strHead = "1.bmp";
 
-    QSqlQuery query(strQuery);
+    QSqlQuery query = Prepare("SELECT [id],[groupId],[head] FROM GROUPINFO WHERE name=? AND userId=?;");
+    query.bindValue(0, name);
+    query.bindValue(1, userId);
+    bool bFound = Exec(query) && query.next();
     // 查询用户是否在群组中
-    if (query.next()) {
-        nIndex   = query.value("id").toInt();
-        nGroupId = query.value("groupId").toInt();
-        strHead  = query.value("head").toString();
+    if (bFound) {
+        nIndex   = query.value(0).toInt();
+        nGroupId = query.value(1).toInt();
+        strHead  = query.value(2).toString();
     }
-    else {
-        //GROUPINFO
-        //1.
-        //2.
-        // 查询数据库
-        query = QSqlQuery("SELECT [id] FROM GROUPINFO ORDER BY id DESC;");
-        nIndex = 0;
+    query.finish();
+
+    if (!bFound) {
         // 查询最高ID
-        if (query.next()) {
-            nIndex = query.value("id").toInt();
+        nIndex = 0;
+        query = Prepare("SELECT [id] FROM GROUPINFO ORDER BY id DESC LIMIT 1;");
+        if (Exec(query) && query.next()) {
+            nIndex = query.value(0).toInt();
         }
+        query.finish();
 
         // 再查询该ID下面的群组
         nGroupId = 0;
-        strQuery = QString("SELECT [groupId] FROM GROUPINFO WHERE userId=");
-        strQuery.append(QString::number(userId));
-        strQuery.append(" ORDER BY groupId DESC");
-        query = QSqlQuery(strQuery);
-        // 查询最高ID
-        if (query.next()) {
-            nGroupId = query.value("groupId").toInt();
+        query = Prepare("SELECT [groupId] FROM GROUPINFO WHERE userId=? ORDER BY groupId DESC LIMIT 1;");
+        query.bindValue(0, userId);
+        if (Exec(query) && query.next()) {
+            nGroupId = query.value(0).toInt();
         }
+        query.finish();
 
         nIndex   += 1;
         nGroupId += 1;
 
         // 根据新ID重新创建用户
-        query.prepare("INSERT INTO GROUPINFO (id, groupId, name, head, userId, identity) "
-                      "VALUES (?, ?, ?, ?, ?, ?);");
+        query = Prepare("INSERT INTO GROUPINFO (id, groupId, name, head, userId, identity) "
+                        "VALUES (?, ?, ?, ?, ?, ?);");
         query.bindValue(0, nIndex);
         query.bindValue(1, nGroupId);
         query.bindValue(2, name);
@@ -518,7 +724,7 @@ QJsonObject DataBaseMagr::CreateGroup(const int &userId, const QString &name)
         query.bindValue(4, userId);
         query.bindValue(5, 1);
 
-        query.exec();
+        Exec(query);
     }
 
     // 构建 Json 对象
@@ -538,48 +744,60 @@ QJsonObject DataBaseMagr::CreateGroup(const int &userId, const QString &name)
  */
 QJsonArray DataBaseMagr::GetGroupUsers(const int &groupId)
 {
-    QString strQuery = ("SELECT [id],[name] FROM USERINFO WHERE ");
-    strQuery.append(" id=(SELECT [id] FROM GROUPINFO WHERE groupId=");
-    strQuery.append(QString::number(groupId));
-    strQuery.append(") AND status=");
-    strQuery.append(QString::number(OffLine));
-
-    strQuery = "SELECT [userId] FROM GROUPINFO WHERE groupId=";
-    strQuery.append(QString::number(groupId));
-
     QJsonArray jsonArr;
-    QSqlQuery query(strQuery);
     jsonArr.append(groupId);
-    // 查询
-    while (query.next()) {
-        int nId = query.value(0).toInt();
-        strQuery = "SELECT [name],[head],[status] FROM USERINFO WHERE id=";
-        strQuery.append(QString::number(nId));
 
-        QSqlQuery queryUser(strQuery);
-        if (queryUser.next()) {
+    // 成员和资料一条语句查出
+    QSqlQuery query = Prepare("SELECT G.[userId], U.[name], U.[head] FROM GROUPINFO G "
+                              "INNER JOIN USERINFO U ON U.id = G.userId WHERE G.groupId=?;");
+    query.bindValue(0, groupId);
+    if (Exec(query)) {
+        while (query.next()) {
+            int nId = query.value(0).toInt();
             QJsonObject jsonObj;
             jsonObj.insert("id", nId);
-            jsonObj.insert("name", queryUser.value(0).toString());
-            jsonObj.insert("head", queryUser.value(1).toString());
-            jsonObj.insert("status", queryUser.value(2).toInt());
+            jsonObj.insert("name", query.value(1).toString());
+            jsonObj.insert("head", query.value(2).toString());
+            jsonObj.insert("status", PresenceMagr::Instance()->GetStatus(nId));
             jsonArr.append(jsonObj);
         }
     }
+    query.finish();
 
     return jsonArr;
 }
 
+/**
+ * @brief DataBaseMagr::GetGroupMemberIds
+ * 获取群组成员id
+ * @param groupId
+ * @return
+ */
+QVector<int> DataBaseMagr::GetGroupMemberIds(const int &groupId)
+{
+    QVector<int> members;
+
+    QSqlQuery query = Prepare("SELECT [userId] FROM GROUPINFO WHERE groupId=?;");
+    query.bindValue(0, groupId);
+    if (Exec(query)) {
+        while (query.next()) {
+            members.append(query.value(0).toInt());
+        }
+    }
+    query.finish();
+
+    return members;
+}
+
 /**
  * @brief DataBaseMagr::ChangeAllUserStatus
  */
 void DataBaseMagr::ChangeAllUserStatus()
 {
-    QSqlQuery query("SELECT * FROM USERINFO ORDER BY id;");
-    while (query.next()) {
-        // 更新为下线状态
-        UpdateUserStatus(query.value(0).toInt(), OffLine);
-    }
+    // 一条语句全部置为下线
+    QSqlQuery query = Prepare("UPDATE USERINFO SET status=?;");
+    query.bindValue(0, OffLine);
+    Exec(query);
 }
 
 /**
@@ -590,16 +808,15 @@ void DataBaseMagr::ChangeAllUserStatus()
  */
 QString DataBaseMagr::GetUserName(const int &id) const
 {
-    QString strQuery = "SELECT [name] FROM USERINFO ";
-    strQuery.append("WHERE id=");
-    strQuery.append(QString::number(id));
-
-    QSqlQuery query(strQuery);
-    if (query.next()) {
-        return query.value(0).toString();
+    QString strName = "";
+    QSqlQuery query = Prepare("SELECT [name] FROM USERINFO WHERE id=?;");
+    query.bindValue(0, id);
+    if (Exec(query) && query.next()) {
+        strName = query.value(0).toString();
     }
+    query.finish();
 
-    return "";
+    return strName;
 }
 
 /**
@@ -610,16 +827,15 @@ QString DataBaseMagr::GetUserName(const int &id) const
  */
 QString DataBaseMagr::GetUserHead(const int &id) const
 {
-    QString strQuery = "SELECT [head] FROM USERINFO ";
-    strQuery.append("WHERE id=");
-    strQuery.append(QString::number(id));
-
-    QSqlQuery query(strQuery);
-    if (query.next()) {
-        return query.value(0).toString();
+    QString strHead = "1.bmp";
+    QSqlQuery query = Prepare("SELECT [head] FROM USERINFO WHERE id=?;");
+    query.bindValue(0, id);
+    if (Exec(query) && query.next()) {
+        strHead = query.value(0).toString();
     }
+    query.finish();
 
-    return "1.bmp";
+    return strHead;
 }
 
 /**
@@ -630,25 +846,23 @@ QString DataBaseMagr::GetUserHead(const int &id) const
  */
 QJsonObject DataBaseMagr::GetUserInfo(const int &id) const
 {
-    QString strQuery = "SELECT * FROM USERINFO ";
-    strQuery.append("WHERE id=");
-    strQuery.append(QString::number(id));
-
     QJsonObject jsonObj;
     int nCode = -1;
     // 查询数据库
-    QSqlQuery query(strQuery);
+    QSqlQuery query = Prepare("SELECT [id],[name],[head],[status],[lasttime] FROM USERINFO WHERE id=?;");
+    query.bindValue(0, id);
     // 构建用户的所有信息,不包括密码
-    if (query.next()) {
-        jsonObj.insert("id", query.value("id").toInt());
-        jsonObj.insert("name", query.value("name").toString());
-        jsonObj.insert("head", query.value("head").toString());
-        jsonObj.insert("status", query.value("status").toInt());
-        jsonObj.insert("groupId", query.value("status").toInt());
-        jsonObj.insert("lasttime", query.value("lasttime").toString());
+    if (Exec(query) && query.next()) {
+        jsonObj.insert("id", query.value(0).toInt());
+        jsonObj.insert("name", query.value(1).toString());
+        jsonObj.insert("head", query.value(2).toString());
+        jsonObj.insert("status", PresenceMagr::Instance()->GetStatus(id));
+        jsonObj.insert("groupId", query.value(3).toInt());
+        jsonObj.insert("lasttime", query.value(4).toString());
         // 结果代码
         nCode = 0;
     }
+    query.finish();
 
     jsonObj.insert("code", nCode);
 
@@ -657,24 +871,24 @@ QJsonObject DataBaseMagr::GetUserInfo(const int &id) const
 
 void DataBaseMagr::QueryAll()
 {
-    QSqlQuery query("SELECT * FROM USERINFO ORDER BY id;");
-    qDebug() << "query users";
+    QSqlQuery query("SELECT * FROM USERINFO ORDER BY id;", Database());
+    LOG_DEBUG(LogDb) << "query users";
     while (query.next()) {
-        qDebug() << query.value(0).toInt() << query.value(1).toString()
+        LOG_DEBUG(LogDb) << query.value(0).toInt() << query.value(1).toString()
                  << query.value(2).toString() << query.value(3).toString()
                  << query.value(4).toString() << query.value(5).toString();
     }
-    qDebug() << "query group";
-    query = QSqlQuery("SELECT * FROM GROUPINFO ORDER BY id;");
+    LOG_DEBUG(LogDb) << "query group";
+    query = QSqlQuery("SELECT * FROM GROUPINFO ORDER BY id;", Database());
     while (query.next()) {
-        qDebug() << query.value(0).toInt() << query.value(1).toInt()
+        LOG_DEBUG(LogDb) << query.value(0).toInt() << query.value(1).toInt()
                  << query.value(2).toString() << query.value(3).toString()
                  << query.value(4).toInt() << query.value(5).toInt();
     }
 
-    query = QSqlQuery("SELECT * FROM USERHEAD ORDER BY id;");
+    query = QSqlQuery("SELECT * FROM USERHEAD ORDER BY id;", Database());
     while (query.next()) {
-        qDebug() << query.value(0).toInt()
+        LOG_DEBUG(LogDb) << query.value(0).toInt()
                  << query.value(1).toString() << query.value(2).toString().length()
                  << query.value(2).toString().length();
     }
@@ -686,46 +900,50 @@ void DataBaseMagr::QueryAll()
  */
 int DataBaseMagr::AddOfflineMsg(const int &fromId, const int &toId, const int &type, const QString &msg, const int &msgId)
 {
-    QSqlQuery query;
-    query.prepare("INSERT INTO MSGQUEUE (fromId, toId, type, msg, ts, msgId) VALUES (?, ?, ?, ?, ?, ?);");
+    QSqlQuery query = Prepare("INSERT INTO MSGQUEUE (fromId, toId, type, msg, ts, msgId) VALUES (?, ?, ?, ?, ?, ?);");
     query.bindValue(0, fromId);
     query.bindValue(1, toId);
     query.bindValue(2, type);
     query.bindValue(3, msg);
     query.bindValue(4, DATE_TME_FORMAT);
     query.bindValue(5, msgId);
-    bool ok = query.exec();
-    if (!ok) return -1;
+    if (!Exec(query)) return -1;
+    Metrics::Add(MetOfflineQueued);
+    Metrics::GaugeAdd(MetOfflineDepth, 1);
 
-    QSqlQuery lastIdQuery("SELECT last_insert_rowid();");
-    if (lastIdQuery.next()) {
-        return lastIdQuery.value(0).toInt();
-    }
-    return -1;
+    // 自增主键由驱动直接返回，不需要再查询 last_insert_rowid()
+    QVariant rowId = query.lastInsertId();
+    return rowId.isValid() ? rowId.toInt() : -1;
 }
 
 /**
  * @brief DataBaseMagr::GetOfflineMsgs
  */
-QVector<QJsonObject> DataBaseMagr::GetOfflineMsgs(const int &toId) const
+QVector<QJsonObject> DataBaseMagr::GetOfflineMsgs(const int &toId, const int &afterId, const int &limit) const
 {
     QVector<QJsonObject> result;
-    QString strQuery = "SELECT id, fromId, toId, type, msg, ts, msgId FROM MSGQUEUE WHERE toId=";
-    strQuery.append(QString::number(toId));
-    strQuery.append(" ORDER BY id ASC;");
 
-    QSqlQuery query(strQuery);
-    while (query.next()) {
-        QJsonObject obj;
-        obj.insert("id", query.value(0).toInt());
-        obj.insert("from", query.value(1).toInt());
-        obj.insert("to", query.value(2).toInt());
-        obj.insert("type", query.value(3).toInt());
-        obj.insert("msg", query.value(4).toString());
-        obj.insert("ts", query.value(5).toString());
-        obj.insert("msgId", query.value(6).toInt());
-        result.append(obj);
+    // (toId, id) 索引上的范围扫描
+    QSqlQuery query = Prepare("SELECT id, fromId, toId, type, msg, ts, msgId FROM MSGQUEUE "
+                              "WHERE toId=? AND id>? ORDER BY id ASC LIMIT ?;");
+    query.bindValue(0, toId);
+    query.bindValue(1, afterId);
+    query.bindValue(2, limit);
+    if (Exec(query)) {
+        while (query.next()) {
+            QJsonObject obj;
+            obj.insert("id", query.value(0).toInt());
+            obj.insert("from", query.value(1).toInt());
+            obj.insert("to", query.value(2).toInt());
+            obj.insert("type", query.value(3).toInt());
+            obj.insert("msg", query.value(4).toString());
+            obj.insert("ts", query.value(5).toString());
+            obj.insert("msgId", query.value(6).toInt());
+            result.append(obj);
+        }
     }
+    query.finish();
+
     return result;
 }
 
@@ -734,8 +952,242 @@ QVector<QJsonObject> DataBaseMagr::GetOfflineMsgs(const int &toId) const
  */
 void DataBaseMagr::DeleteOfflineMsg(const int &msgRowId)
 {
-    QString strSql = "DELETE FROM MSGQUEUE WHERE id=";
-    strSql.append(QString::number(msgRowId));
-    QSqlQuery query(strSql);
-    query.exec();
+    QSqlQuery query = Prepare("DELETE FROM MSGQUEUE WHERE id=?;");
+    query.bindValue(0, msgRowId);
+    if (Exec(query)) Metrics::GaugeAdd(MetOfflineDepth, -query.numRowsAffected());
+}
+
+/**
+ * @brief DataBaseMagr::DeleteOfflineMsgs
+ * 客户端确认到 upToId 为止的消息，一条范围删除
+ * @param toId
+ * @param upToId
+ * @return
+ */
+int DataBaseMagr::DeleteOfflineMsgs(const int &toId, const int &upToId)
+{
+    QSqlDatabase db = Database();
+    db.transaction();
+
+    QSqlQuery query = Prepare("DELETE FROM MSGQUEUE WHERE toId=? AND id<=?;");
+    query.bindValue(0, toId);
+    query.bindValue(1, upToId);
+    int nRows = Exec(query) ? query.numRowsAffected() : 0;
+
+    if (!db.commit()) {
+        db.rollback();
+        return 0;
+    }
+
+    Metrics::GaugeAdd(MetOfflineDepth, -nRows);
+    return nRows;
+}
+
+/**
+ * @brief DataBaseMagr::HasFileBlob
+ * 摘要相同但大小不同时视为不存在；按主键 (owner, name) 只查该用户的文件名
+ * @param sha
+ * @param size
+ * @param owner
+ * @return
+ */
+bool DataBaseMagr::HasFileBlob(const QString &sha, const quint64 &size, const int &owner) const
+{
+    bool bExists = false;
+    QSqlQuery query = Prepare("SELECT size FROM FILEBLOB WHERE sha=? AND "
+                              "EXISTS (SELECT 1 FROM FILENAME WHERE owner=? AND sha=FILEBLOB.sha);");
+    query.bindValue(0, sha);
+    query.bindValue(1, owner);
+    if (Exec(query) && query.next()) {
+        bExists = (query.value(0).toULongLong() == size);
+    }
+    query.finish();
+
+    return bExists;
+}
+
+/**
+ * @brief DataBaseMagr::GetFileBlob
+ * 私聊下载时窗口id 就是上传者，同名文件互不覆盖；群聊取最近上传的一个
+ * @param owner
+ * @param name
+ * @return
+ */
+QString DataBaseMagr::GetFileBlob(const int &owner, const QString &name) const
+{
+    QString strSha = "";
+    QSqlQuery query = Prepare("SELECT sha FROM FILENAME WHERE name=? ORDER BY (owner=?) DESC, ts DESC LIMIT 1;");
+    query.bindValue(0, name);
+    query.bindValue(1, owner);
+    if (Exec(query) && query.next()) {
+        strSha = query.value(0).toString();
+    }
+    query.finish();
+
+    return strSha;
+}
+
+/**
+ * @brief DataBaseMagr::LinkFileBlob
+ * 内容不存在时新增，引用数加一；同名文件原来指向的内容引用数减一，减到 0 时删除
+ * @param owner 上传者
+ * @param name
+ * @param sha
+ * @param size
+ * @param released 不再被引用的内容摘要，没有时为空
+ * @return
+ */
+bool DataBaseMagr::LinkFileBlob(const int &owner, const QString &name, const QString &sha, const quint64 &size, QString &released)
+{
+    released.clear();
+
+    QSqlDatabase db = Database();
+    db.transaction();
+
+    QString strOld = "";
+    QSqlQuery query = Prepare("SELECT sha FROM FILENAME WHERE owner=? AND name=?;");
+    query.bindValue(0, owner);
+    query.bindValue(1, name);
+    bool bOk = Exec(query);
+    if (bOk && query.next()) strOld = query.value(0).toString();
+    query.finish();
+
+    // 同一个人再次上传相同内容，只更新时间
+    if (bOk && strOld != sha) {
+        query = Prepare("INSERT OR IGNORE INTO FILEBLOB (sha, size, refs) VALUES (?, ?, 0);");
+        query.bindValue(0, sha);
+        query.bindValue(1, size);
+        bOk = Exec(query);
+
+        query = Prepare("UPDATE FILEBLOB SET refs=refs+1 WHERE sha=?;");
+        query.bindValue(0, sha);
+        bOk = bOk && Exec(query);
+    }
+
+    query = Prepare("INSERT OR REPLACE INTO FILENAME (owner, name, sha, ts) VALUES (?, ?, ?, ?);");
+    query.bindValue(0, owner);
+    query.bindValue(1, name);
+    query.bindValue(2, sha);
+    query.bindValue(3, DATE_TME_FORMAT);
+    bOk = bOk && Exec(query);
+
+    if (bOk && !strOld.isEmpty() && strOld != sha) {
+        query = Prepare("UPDATE FILEBLOB SET refs=refs-1 WHERE sha=?;");
+        query.bindValue(0, strOld);
+        bOk = Exec(query);
+
+        query = Prepare("DELETE FROM FILEBLOB WHERE sha=? AND refs<=0;");
+        query.bindValue(0, strOld);
+        bOk = bOk && Exec(query);
+        if (bOk && query.numRowsAffected() > 0) released = strOld;
+    }
+
+    if (!bOk || !db.commit()) {
+        db.rollback();
+        released.clear();
+        return false;
+    }
+
+    return true;
+}
+
+/**
+ * @brief DataBaseMagr::Prepare
+ * QSqlQuery 的拷贝共享同一个预编译语句，调用方绑定参数后用 Exec 执行，
+ * 读取完结果要 finish()，避免语句一直持有读锁
+ * @param strSql
+ * @return
+ */
+QSqlQuery DataBaseMagr::Prepare(const QString &strSql) const
+{
+    if (!m_statements.hasLocalData()) {
+        m_statements.setLocalData(new QHash<QString, QSqlQuery>());
+    }
+
+    QHash<QString, QSqlQuery> *statements = m_statements.localData();
+    QHash<QString, QSqlQuery>::iterator it = statements->find(strSql);
+    if (it != statements->end()) return it.value();
+
+    QSqlQuery query(Database());
+    if (!query.prepare(strSql)) {
+        // 准备失败不缓存，下次重试
+        LOG_WARN(LogDb) << "prepare failed" << strSql << query.lastError().text();
+        return query;
+    }
+
+    statements->insert(strSql, query);
+    return query;
+}
+
+/**
+ * @brief DataBaseMagr::Exec
+ * @param query
+ * @return
+ */
+bool DataBaseMagr::Exec(QSqlQuery &query) const
+{
+    QElapsedTimer timer;
+    timer.start();
+    bool bOk = query.exec();
+    qint64 nUs = timer.nsecsElapsed() / 1000;
+    Metrics::Observe(MetDbQuery, nUs);
+
+    if (!bOk) LOG_WARN(LogDb) << "exec failed" << query.lastQuery() << query.lastError().text();
+
+    QMutexLocker locker(&m_statMutex);
+    StatementStat &stat = m_stats[query.lastQuery()];
+    stat.count   += 1;
+    stat.totalUs += nUs;
+
+    return bOk;
+}
+
+/**
+ * @brief DataBaseMagr::ClearStatements
+ */
+void DataBaseMagr::ClearStatements() const
+{
+    if (m_statements.hasLocalData()) m_statements.setLocalData(NULL);
+}
+
+/**
+ * @brief DataBaseMagr::GetStatementStats
+ * 按累计耗时从大到小
+ * @return
+ */
+QJsonArray DataBaseMagr::GetStatementStats() const
+{
+    QList<QPair<qint64, QJsonObject> > items;
+    {
+        QMutexLocker locker(&m_statMutex);
+        QHash<QString, StatementStat>::const_iterator it = m_stats.constBegin();
+        for (; it != m_stats.constEnd(); ++it) {
+            QJsonObject jsonObj;
+            jsonObj.insert("sql", it.key());
+            jsonObj.insert("count", double(it.value().count));
+            jsonObj.insert("totalUs", double(it.value().totalUs));
+            items.append(qMakePair(it.value().totalUs, jsonObj));
+        }
+    }
+
+    std::sort(items.begin(), items.end(),
+              [](const QPair<qint64, QJsonObject> &a, const QPair<qint64, QJsonObject> &b) {
+        return a.first > b.first;
+    });
+
+    QJsonArray jsonArr;
+    for (int i = 0; i < items.size(); i++) jsonArr.append(items.at(i).second);
+    return jsonArr;
+}
+
+void DataBaseMagr::DumpStatementStats() const
+{
+    QJsonArray jsonArr = GetStatementStats();
+    LOG_INFO(LogDb) << "statement stats" << jsonArr.size();
+    for (int i = 0; i < jsonArr.size(); i++) {
+        QJsonObject jsonObj = jsonArr.at(i).toObject();
+        LOG_INFO(LogDb) << qint64(jsonObj.value("count").toDouble())
+                 << qint64(jsonObj.value("totalUs").toDouble()) << "us"
+                 << jsonObj.value("sql").toString();
+    }
 }
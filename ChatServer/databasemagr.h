@@ -5,6 +5,10 @@
 #include <QSqlDatabase>
 #include <QSqlQuery>
 #include <QMutex>
+#include <QHash>
+#include <QVector>
+#include <QThreadStorage>
+#include <QJsonArray>
 
 /////////////////////////////////////////////////////////////////
 /// \brief The DataBaseMagr class
@@ -19,6 +23,11 @@ public:
     bool OpenDb(const QString &dataName);
     void CloseDb();
 
+    // 当前线程使用的数据库连接，工作线程各自持有独立连接
+    QSqlDatabase Database() const;
+    // 工作线程退出前释放自己的连接
+    void ReleaseDatabase();
+
     // 单实例
     static DataBaseMagr *Instance()
     {
@@ -36,6 +45,8 @@ public:
 
     // 更新用户状态/上下线
     void UpdateUserStatus(const int &id, const quint8 &status);
+    // 批量写入最后在线时间（毫秒时间戳），一个事务完成
+    void UpdateUserLastTimes(const QHash<int, qint64> &lastTimes);
     void UpdateUserHead(const int &id, const QString &strHead);
 
     void TestHeadPic(const int &id, const QString &name, const QString &strHead);
@@ -59,8 +70,10 @@ public:
     QJsonObject CreateGroup(const int &userId, const QString &name);
     // 查询当前群组下面的好友
     QJsonArray  GetGroupUsers(const int &groupId);
+    // 查询群组成员id，一条查询
+    QVector<int> GetGroupMemberIds(const int &groupId);
 
-    // 服务器启动的时候更新下所以人员的状态，可以不要
+    // 服务器启动的时候更新下所以人员的状态，在线状态以 PresenceMagr 为准
     void ChangeAllUserStatus();
 
     // 查询当前id的名字
@@ -71,10 +84,25 @@ public:
     // 离线消息队列
     // 插入离线私聊消息，返回新消息id（>=1），失败返回-1
     int AddOfflineMsg(const int &fromId, const int &toId, const int &type, const QString &msg, const int &msgId);
-    // 获取某用户的所有离线消息（私聊），每条记录对象包含：from、to、type、msg、id、ts
-    QVector<QJsonObject> GetOfflineMsgs(const int &toId) const;
+    // 获取某用户 id 大于 afterId 的离线消息（私聊），最多 limit 条（-1 不限），
+    // 每条记录对象包含：from、to、type、msg、id、ts、msgId
+    QVector<QJsonObject> GetOfflineMsgs(const int &toId, const int &afterId = 0, const int &limit = -1) const;
     // 删除指定离线消息（按id）
     void DeleteOfflineMsg(const int &msgRowId);
+    // 删除某用户 id 不大于 upToId 的离线消息，一个事务，返回删除条数
+    int DeleteOfflineMsgs(const int &toId, const int &upToId);
+
+    // 文件内容存储：内容按 SHA-256（十六进制）记录引用数，(上传者, 文件名) 指向内容
+    // 内容存在、大小一致，且 owner 有文件名指向它
+    bool HasFileBlob(const QString &sha, const quint64 &size, const int &owner) const;
+    // 优先取该上传者的同名文件，没有时取最近上传的同名文件，找不到返回空
+    QString GetFileBlob(const int &owner, const QString &name) const;
+    // 文件名指向新内容，一个事务；原来指向的内容不再被引用时从表中删除并通过 released 返回
+    bool LinkFileBlob(const int &owner, const QString &name, const QString &sha, const quint64 &size, QString &released);
+
+    // 预编译语句统计：每条语句的执行次数与累计耗时（微秒）
+    QJsonArray GetStatementStats() const;
+    void DumpStatementStats() const;
 signals:
 
 public slots:
@@ -83,6 +111,42 @@ private:
     static DataBaseMagr *self;
 
     QSqlDatabase userdb;
+    QString      m_strDataName;
+
+    struct StatementStat {
+        quint64 count;
+        qint64  totalUs;
+    };
+
+    // 当前线程连接上已经准备好的语句，按 SQL 文本索引
+    mutable QThreadStorage < QHash<QString, QSqlQuery> * >  m_statements;
+    mutable QMutex                                          m_statMutex;
+    mutable QHash < QString, StatementStat >                m_stats;
+
+    // 数据库结构迁移
+    struct Migration {
+        int         version;
+        const char  *name;
+        bool (DataBaseMagr::*func)(QSqlDatabase &db);
+    };
+    static const Migration s_migrations[];
+
+    bool Migrate();
+    bool MigrateBaseTables(QSqlDatabase &db);
+    bool MigrateQueueMsgId(QSqlDatabase &db);
+    bool MigrateIndexes(QSqlDatabase &db);
+    bool MigrateWal(QSqlDatabase &db);
+    bool MigrateFileBlobs(QSqlDatabase &db);
+
+    // 每个连接打开后的设置
+    void ApplyPragmas(QSqlDatabase db) const;
+
+    // 取出缓存的预编译语句，第一次使用时在当前连接上准备
+    QSqlQuery Prepare(const QString &strSql) const;
+    // 执行并记录次数和耗时
+    bool Exec(QSqlQuery &query) const;
+    // 连接关闭前释放当前线程缓存的语句
+    void ClearStatements() const;
 
     void QueryAll();
 };
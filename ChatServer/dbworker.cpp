@@ -0,0 +1,271 @@
+#include "dbworker.h"
+#include "databasemagr.h"
+#include "metrics.h"
+
+#include <QThread>
+#include <QTimer>
+#include <QCoreApplication>
+#include <QDebug>
+
+DbWorker *DbWorker::self = NULL;
+
+DbWorker::DbWorker(QObject *parent) :
+    QObject(parent),
+    m_thread(NULL),
+    m_flushTimer(NULL)
+{
+}
+
+/**
+ * @brief DbWorker::Start
+ * 启动数据库线程
+ */
+void DbWorker::Start()
+{
+    QMutexLocker locker(&m_mutex);
+    if (NULL != m_thread) return;
+
+    m_thread = new QThread();
+    m_thread->setObjectName("DbWorker");
+    this->moveToThread(m_thread);
+    m_thread->start();
+}
+
+/**
+ * @brief DbWorker::Stop
+ * 阻塞等待队列执行完毕，之后提交的任务在调用线程同步执行
+ */
+void DbWorker::Stop()
+{
+    QThread *thread = NULL;
+    {
+        QMutexLocker locker(&m_mutex);
+        thread = m_thread;
+    }
+
+    if (NULL == thread) return;
+
+    QMetaObject::invokeMethod(this, "SltStop", Qt::BlockingQueuedConnection);
+    thread->quit();
+    thread->wait();
+    delete thread;
+
+    // 线程退出后又产生的合并写入
+    CommitWriteBehind();
+}
+
+bool DbWorker::IsRunning() const
+{
+    QMutexLocker locker(&m_mutex);
+    return (NULL != m_thread);
+}
+
+/**
+ * @brief DbWorker::Post
+ * 不关心结果的写入
+ * @param userId
+ * @param task
+ */
+void DbWorker::Post(const int &userId, const DbTask &task)
+{
+    TaskItem item;
+    item.userId = userId;
+    item.task   = task;
+    item.reply  = NULL;
+
+    Enqueue(item);
+}
+
+/**
+ * @brief DbWorker::Post
+ * 回调运行在 receiver 所在线程；receiver 在任务完成前被销毁则不回调
+ * @param userId
+ * @param task
+ * @param receiver
+ * @param callback
+ */
+void DbWorker::Post(const int &userId, const DbTask &task, QObject *receiver, const DbCallback &callback)
+{
+    TaskItem item;
+    item.userId = userId;
+    item.task   = task;
+    item.reply  = NULL;
+
+    if (NULL != receiver && callback) {
+        item.reply = new DbReply();
+        connect(item.reply, &DbReply::signalFinished, receiver, callback, Qt::QueuedConnection);
+    }
+
+    Enqueue(item);
+}
+
+/**
+ * @brief DbWorker::DeferLastSeen
+ * @param id
+ * @param ts
+ */
+void DbWorker::DeferLastSeen(const int &id, const qint64 &ts)
+{
+    if (id <= 0) return;
+
+    QMutexLocker locker(&m_mutex);
+    m_lastSeen.insert(id, ts);
+}
+
+/**
+ * @brief DbWorker::StartWriteBehind
+ * @param interval
+ */
+void DbWorker::StartWriteBehind(const int &interval)
+{
+    if (IsRunning()) {
+        QMetaObject::invokeMethod(this, "SltStartTimer", Qt::QueuedConnection, Q_ARG(int, interval));
+    } else {
+        SltStartTimer(interval);
+    }
+}
+
+void DbWorker::FlushWriteBehind()
+{
+    if (IsRunning()) {
+        QMetaObject::invokeMethod(this, "SltFlushTimeout", Qt::QueuedConnection);
+    } else {
+        CommitWriteBehind();
+    }
+}
+
+int DbWorker::PendingCount() const
+{
+    QMutexLocker locker(&m_mutex);
+    return m_tasks.size();
+}
+
+/**
+ * @brief DbWorker::Enqueue
+ * 队列由空变为非空时唤醒一次数据库线程；线程未启动时在调用线程同步执行
+ * @param item
+ */
+void DbWorker::Enqueue(TaskItem item)
+{
+    item.timer.start();
+
+    bool bWakeup = false;
+    {
+        QMutexLocker locker(&m_mutex);
+        if (NULL != m_thread) {
+            if (NULL != item.reply) item.reply->moveToThread(m_thread);
+            bWakeup = m_tasks.isEmpty();
+            m_tasks.enqueue(item);
+        } else {
+            locker.unlock();
+            RunTask(item);
+            return;
+        }
+    }
+
+    if (bWakeup) QMetaObject::invokeMethod(this, "SltDrainTasks", Qt::QueuedConnection);
+}
+
+/**
+ * @brief DbWorker::RunTask
+ * 该用户有未提交的合并写入时先提交，保证读到自己的写入
+ * @param item
+ */
+void DbWorker::RunTask(const TaskItem &item)
+{
+    if (item.userId > 0) CommitWriteBehind(item.userId);
+
+    QVariant result;
+    if (item.task) result = item.task();
+    Metrics::Observe(MetDbTask, item.timer.nsecsElapsed() / 1000);
+
+    if (NULL != item.reply) {
+        Q_EMIT item.reply->signalFinished(result);
+        delete item.reply;
+    }
+}
+
+/**
+ * @brief DbWorker::CommitWriteBehind
+ * 取出全部待写数据，一个事务提交
+ * @param userId
+ */
+void DbWorker::CommitWriteBehind(const int &userId)
+{
+    QHash<int, qint64> lastSeen;
+    {
+        QMutexLocker locker(&m_mutex);
+        if (userId > 0 && !m_lastSeen.contains(userId)) return;
+        lastSeen.swap(m_lastSeen);
+    }
+
+    if (lastSeen.isEmpty()) return;
+
+    DataBaseMagr::Instance()->UpdateUserLastTimes(lastSeen);
+}
+
+/**
+ * @brief DbWorker::SltDrainTasks
+ * 每次取一个任务执行，执行期间新提交的任务排在后面
+ */
+void DbWorker::SltDrainTasks()
+{
+    forever {
+        TaskItem item;
+        {
+            QMutexLocker locker(&m_mutex);
+            if (m_tasks.isEmpty()) return;
+            item = m_tasks.dequeue();
+        }
+
+        RunTask(item);
+    }
+}
+
+void DbWorker::SltStartTimer(int interval)
+{
+    if (NULL == m_flushTimer) {
+        m_flushTimer = new QTimer(this);
+        connect(m_flushTimer, SIGNAL(timeout()), this, SLOT(SltFlushTimeout()));
+    }
+
+    m_flushTimer->start(qMax(interval, 100));
+}
+
+void DbWorker::SltFlushTimeout()
+{
+    CommitWriteBehind();
+}
+
+/**
+ * @brief DbWorker::SltStop
+ * 在数据库线程中执行：清空队列、提交合并写入、释放连接，
+ * 最后把对象移回主线程
+ */
+void DbWorker::SltStop()
+{
+    if (NULL != m_flushTimer) {
+        delete m_flushTimer;
+        m_flushTimer = NULL;
+    }
+
+    forever {
+        TaskItem item;
+        {
+            QMutexLocker locker(&m_mutex);
+            if (m_tasks.isEmpty()) {
+                // 之后提交的任务同步执行
+                m_thread = NULL;
+                break;
+            }
+            item = m_tasks.dequeue();
+        }
+
+        RunTask(item);
+    }
+
+    CommitWriteBehind();
+    DataBaseMagr::Instance()->ReleaseDatabase();
+
+    this->moveToThread(QCoreApplication::instance()->thread());
+}
@@ -0,0 +1,111 @@
+#ifndef DBWORKER_H
+#define DBWORKER_H
+
+#include <QObject>
+#include <QMutex>
+#include <QQueue>
+#include <QHash>
+#include <QVariant>
+#include <QElapsedTimer>
+
+#include <functional>
+
+class QThread;
+class QTimer;
+
+// 在数据库线程执行的任务，返回值通过回调送回调用方线程
+typedef std::function<QVariant ()>                  DbTask;
+typedef std::function<void (const QVariant &)>      DbCallback;
+
+/////////////////////////////////////////////////////////////////
+/// \brief The DbReply class
+/// 单个任务的结果通知，回调以 QueuedConnection 连接到接收对象，
+/// 接收对象销毁后连接自动断开，结果被丢弃
+class DbReply : public QObject
+{
+    Q_OBJECT
+public:
+    explicit DbReply(QObject *parent = 0) : QObject(parent) {}
+
+signals:
+    void signalFinished(const QVariant &result);
+};
+
+/////////////////////////////////////////////////////////////////
+/// \brief The DbWorker class
+/// 数据库工作线程：独立的 QThread 和数据库连接，任务按提交顺序串行执行，
+/// 同一用户先写后读总能读到自己的写入。
+/// 最后在线时间等非关键写入先合并在内存中，定时一个事务批量提交
+class DbWorker : public QObject
+{
+    Q_OBJECT
+public:
+    // 单实例
+    static DbWorker *Instance()
+    {
+        static QMutex mutex;
+        if (NULL == self) {
+            QMutexLocker locker(&mutex);
+
+            if (!self) {
+                self = new DbWorker();
+            }
+        }
+
+        return self;
+    }
+
+    // 启动数据库线程，需要在主线程、OpenDb 之后调用
+    void Start();
+    // 执行完已提交的任务，提交合并写入，退出线程
+    void Stop();
+    bool IsRunning() const;
+
+    // 提交任务，userId 用于保证该用户的合并写入先于任务落库
+    void Post(const int &userId, const DbTask &task);
+    // 提交任务，完成后在 receiver 所在线程调用 callback
+    void Post(const int &userId, const DbTask &task, QObject *receiver, const DbCallback &callback);
+
+    // 合并写入：同一用户只保留最后一次
+    void DeferLastSeen(const int &id, const qint64 &ts);
+    // 合并写入的提交周期（毫秒）
+    void StartWriteBehind(const int &interval);
+    // 尽快提交合并写入
+    void FlushWriteBehind();
+
+    // 队列中等待执行的任务数
+    int PendingCount() const;
+
+private:
+    explicit DbWorker(QObject *parent = 0);
+
+    static DbWorker *self;
+
+    struct TaskItem {
+        int         userId;
+        DbTask      task;
+        DbReply     *reply;
+        // 提交时开始计时，统计含排队等待的耗时
+        QElapsedTimer   timer;
+    };
+
+    QThread                 *m_thread;
+    QTimer                  *m_flushTimer;
+
+    mutable QMutex          m_mutex;
+    QQueue < TaskItem >     m_tasks;
+    QHash < int, qint64 >   m_lastSeen;
+
+    void Enqueue(TaskItem item);
+    void RunTask(const TaskItem &item);
+    // 在数据库线程提交合并写入，userId > 0 时只在该用户有待写数据时提交
+    void CommitWriteBehind(const int &userId = 0);
+
+private slots:
+    void SltDrainTasks();
+    void SltStartTimer(int interval);
+    void SltFlushTimeout();
+    void SltStop();
+};
+
+#endif // DBWORKER_H
@@ -0,0 +1,135 @@
+#include "filerelay.h"
+#include "clientsocket.h"
+
+#include <QTimer>
+
+FileRelay *FileRelay::self = NULL;
+
+FileRelay::FileRelay() :
+    m_nDetachSeq(0)
+{
+}
+
+/**
+ * @brief FileRelay::Begin
+ * 续传时上传方重连，等待中的下载从新的进度继续
+ */
+void FileRelay::Begin(const QString &target, const quint64 &id, const quint64 &size, const quint64 &verified, const QString &partPath)
+{
+    RelayUpload upload;
+    upload.id = id;
+    upload.size = size;
+    upload.verified = verified;
+    upload.partPath = partPath;
+    m_uploads.insert(target, upload);
+    m_detached.remove(id);
+
+    Notify(id, partPath, qint64(verified));
+}
+
+void FileRelay::Progress(const QString &target, const quint64 &id, const quint64 &verified)
+{
+    QHash<QString, RelayUpload>::iterator it = m_uploads.find(target);
+    if (it == m_uploads.end() || it->id != id) return;
+
+    it->verified = verified;
+    Notify(id, it->partPath, qint64(verified));
+}
+
+/**
+ * @brief FileRelay::Commit
+ * 数据与 .part 中的相同，下载方改读完成后的文件，不必重新开始
+ */
+void FileRelay::Commit(const QString &target, const quint64 &id, const QString &path)
+{
+    QHash<QString, RelayUpload>::iterator it = m_uploads.find(target);
+    if (it == m_uploads.end() || it->id != id) return;
+
+    qint64 nSize = qint64(it->size);
+    m_uploads.erase(it);
+    Notify(id, path, nSize);
+    m_watchers.remove(id);
+}
+
+void FileRelay::End(const QString &target, const quint64 &id, const bool &bFailed)
+{
+    QHash<QString, RelayUpload>::iterator it = m_uploads.find(target);
+    if (it == m_uploads.end() || it->id != id) return;
+
+    m_uploads.erase(it);
+    if (!bFailed) {
+        // 上传方放弃重试时连接已断开，无法发来 Error，等待中的下载在宽限期后失败
+        if (!m_watchers.contains(id)) return;
+
+        quint64 nSeq = ++m_nDetachSeq;
+        m_detached.insert(id, nSeq);
+        QTimer::singleShot(FILE_RELAY_GRACE_MS, [this, id, nSeq]() {
+            Expire(id, nSeq);
+        });
+        return;
+    }
+
+    Notify(id, QString(), -1);
+    m_watchers.remove(id);
+}
+
+/**
+ * @brief FileRelay::Expire
+ * 断线的上传方在宽限期内没有续传
+ * @param id
+ * @param seq
+ */
+void FileRelay::Expire(const quint64 &id, const quint64 &seq)
+{
+    QHash<quint64, quint64>::iterator it = m_detached.find(id);
+    if (it == m_detached.end() || it.value() != seq) return;
+
+    m_detached.erase(it);
+    Notify(id, QString(), -1);
+    m_watchers.remove(id);
+}
+
+bool FileRelay::Find(const QString &target, RelayUpload &upload) const
+{
+    QHash<QString, RelayUpload>::const_iterator it = m_uploads.constFind(target);
+    if (it == m_uploads.constEnd()) return false;
+
+    upload = it.value();
+    return true;
+}
+
+void FileRelay::Watch(const quint64 &id, ClientFileSocket *client)
+{
+    QList< QPointer<ClientFileSocket> > &watchers = m_watchers[id];
+    foreach (const QPointer<ClientFileSocket> &watcher, watchers) {
+        if (watcher.data() == client) return;
+    }
+
+    watchers.append(QPointer<ClientFileSocket>(client));
+}
+
+/**
+ * @brief FileRelay::Notify
+ * 顺便去掉已释放的连接
+ * @param id
+ * @param path 下载方读取的文件
+ * @param avail 可以下发的字节数，-1 表示上传失败
+ */
+void FileRelay::Notify(const quint64 &id, const QString &path, const qint64 &avail)
+{
+    QHash<quint64, QList< QPointer<ClientFileSocket> > >::iterator it = m_watchers.find(id);
+    if (it == m_watchers.end()) return;
+
+    // RelayUpdate 中可能再调用 Watch，先取出副本
+    QList< QPointer<ClientFileSocket> > watchers = it.value();
+    QList< QPointer<ClientFileSocket> > alive;
+    foreach (const QPointer<ClientFileSocket> &watcher, watchers) {
+        if (watcher.isNull()) continue;
+        alive.append(watcher);
+    }
+    m_watchers.insert(id, alive);
+
+    foreach (const QPointer<ClientFileSocket> &watcher, alive) {
+        if (!watcher.isNull()) watcher->RelayUpdate(id, path, avail);
+    }
+}
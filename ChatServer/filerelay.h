@@ -0,0 +1,76 @@
+#ifndef FILERELAY_H
+#define FILERELAY_H
+
+#include <QString>
+#include <QHash>
+#include <QList>
+#include <QPointer>
+#include <QMutex>
+
+class ClientFileSocket;
+
+// 上传方断线后等它重连续传的时间，超过客户端的重试总时长（约 30 秒），之后等待中的下载失败
+#define FILE_RELAY_GRACE_MS     60000
+
+// 上传中的一个文件
+struct RelayUpload {
+    quint64     id;
+    quint64     size;
+    quint64     verified;   // 已校验写入 .part 的字节数
+    QString     partPath;
+};
+
+/////////////////////////////////////////////////////////////////
+/// \brief The FileRelay class
+/// 边传边下：记录文件服务器上正在上传的文件，下载请求到达时文件还没传完，
+/// 就从 .part 中读已校验的部分下发，追上上传进度后暂停，等上传方下一块校验通过再继续；
+/// 上传完成改名后改读完成的文件。只在文件服务器线程使用，不加锁
+class FileRelay
+{
+public:
+    // 单实例
+    static FileRelay *Instance()
+    {
+        static QMutex mutex;
+        if (NULL == self) {
+            QMutexLocker locker(&mutex);
+
+            if (!self) {
+                self = new FileRelay();
+            }
+        }
+
+        return self;
+    }
+
+    // 上传方：开始或续传、每块校验通过、完成改名、放弃
+    void Begin(const QString &target, const quint64 &id, const quint64 &size, const quint64 &verified, const QString &partPath);
+    void Progress(const QString &target, const quint64 &id, const quint64 &verified);
+    // path 为完成后的文件（移入内容存储时不再是 target）
+    void Commit(const QString &target, const quint64 &id, const QString &path);
+    // bFailed 为 false 表示连接中断，上传方可能重连续传，等待中的下载继续等，
+    // 超过 FILE_RELAY_GRACE_MS 没有续传则按失败通知
+    void End(const QString &target, const quint64 &id, const bool &bFailed);
+
+    // 下载方：目标文件是否正在上传
+    bool Find(const QString &target, RelayUpload &upload) const;
+    // 上传有进展、完成或失败时调用 client->RelayUpdate
+    void Watch(const quint64 &id, ClientFileSocket *client);
+
+private:
+    FileRelay();
+
+    static FileRelay *self;
+
+    void Notify(const quint64 &id, const QString &path, const qint64 &avail);
+    void Expire(const quint64 &id, const quint64 &seq);
+
+    QHash<QString, RelayUpload> m_uploads;
+    // 上传方断线、等待续传的传输，值为断线序号，重连后再断线时旧的定时不再生效
+    QHash<quint64, quint64>     m_detached;
+    quint64                     m_nDetachSeq;
+    // 连接可能在等待期间被释放，用 QPointer 跳过
+    QHash<quint64, QList< QPointer<ClientFileSocket> > > m_watchers;
+};
+
+#endif // FILERELAY_H
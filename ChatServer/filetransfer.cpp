@@ -0,0 +1,589 @@
+#include "filetransfer.h"
+#include "framecodec.h"
+
+#include <QtEndian>
+#include <QCryptographicHash>
+#include <QFileInfo>
+#include <QDateTime>
+#include <QDir>
+
+#include <string.h>
+
+// 校验记录文件头：魔数、块大小、文件大小、完成后目标文件的修改时间（未完成时为 0）
+#define CRC_FILE_MAGIC          "QCRC"
+#define CRC_FILE_HEAD_SIZE      24
+
+// 帧负载中 op 之后的定长部分
+#define FILE_OFFER_FIXED        (1 + 8 + 8 + 4)
+#define FILE_OFFER_SHA_FIXED    (FILE_OFFER_FIXED + FILE_SHA_SIZE)
+#define FILE_RESUME_SIZE        (1 + 8 + 8)
+#define FILE_CHUNK_FIXED        (1 + 8 + 8 + 4)
+#define FILE_DONE_SIZE          (1 + 8)
+#define FILE_ERROR_SIZE         (1 + 8 + 4)
+
+// CRC32C 查表，按 8 字节一组计算（slicing-by-8），第一次使用时生成
+struct Crc32cTable {
+    quint32 t[8][256];
+
+    Crc32cTable()
+    {
+        for (quint32 i = 0; i < 256; i++) {
+            quint32 crc = i;
+            for (int k = 0; k < 8; k++) {
+                crc = (crc & 1) ? ((crc >> 1) ^ 0x82F63B78) : (crc >> 1);
+            }
+            t[0][i] = crc;
+        }
+
+        for (quint32 i = 0; i < 256; i++) {
+            for (int k = 1; k < 8; k++) {
+                t[k][i] = (t[k - 1][i] >> 8) ^ t[0][t[k - 1][i] & 0xff];
+            }
+        }
+    }
+};
+
+/**
+ * @brief FileTransfer::Crc32c
+ * 按字节组装 32 位值，与平台字节序、对齐无关
+ * @param data
+ * @param len
+ * @param crc 上一段的结果，第一段为 0
+ * @return
+ */
+quint32 FileTransfer::Crc32c(const char *data, qint64 len, quint32 crc)
+{
+    static const Crc32cTable table;
+    const quint32 (*t)[256] = table.t;
+    const uchar *p = reinterpret_cast<const uchar *>(data);
+
+    crc = ~crc;
+    while (len >= 8) {
+        quint32 lo = crc ^ (quint32(p[0]) | (quint32(p[1]) << 8) | (quint32(p[2]) << 16) | (quint32(p[3]) << 24));
+        quint32 hi = quint32(p[4]) | (quint32(p[5]) << 8) | (quint32(p[6]) << 16) | (quint32(p[7]) << 24);
+        crc = t[7][lo & 0xff] ^ t[6][(lo >> 8) & 0xff] ^ t[5][(lo >> 16) & 0xff] ^ t[4][lo >> 24] ^
+              t[3][hi & 0xff] ^ t[2][(hi >> 8) & 0xff] ^ t[1][(hi >> 16) & 0xff] ^ t[0][hi >> 24];
+        p += 8;
+        len -= 8;
+    }
+
+    while (len-- > 0) {
+        crc = t[0][(crc ^ *p++) & 0xff] ^ (crc >> 8);
+    }
+
+    return ~crc;
+}
+
+/**
+ * @brief FileTransfer::TransferId
+ * 不用 qHash：它每个进程的种子不同，重启后无法对上未完成文件
+ * @param name
+ * @param size
+ * @param mtimeMs
+ * @param chunkSize
+ * @return
+ */
+quint64 FileTransfer::TransferId(const QString &name, const quint64 &size, const qint64 &mtimeMs, const quint32 &chunkSize)
+{
+    uchar fixed[20];
+    qToBigEndian<quint64>(size, fixed);
+    qToBigEndian<qint64>(mtimeMs, fixed + 8);
+    qToBigEndian<quint32>(chunkSize, fixed + 16);
+
+    QCryptographicHash hash(QCryptographicHash::Sha1);
+    hash.addData(name.toUtf8());
+    hash.addData(reinterpret_cast<const char *>(fixed), sizeof(fixed));
+
+    return qFromBigEndian<quint64>(reinterpret_cast<const uchar *>(hash.result().constData()));
+}
+
+QByteArray FileTransfer::PackHello(const qint32 &userId, const qint32 &winId)
+{
+    QByteArray hello(FILE_V2_MAGIC, 4);
+    hello.resize(FILE_V2_HELLO_SIZE);
+    qToBigEndian<qint32>(userId, reinterpret_cast<uchar *>(hello.data() + 4));
+    qToBigEndian<qint32>(winId, reinterpret_cast<uchar *>(hello.data() + 8));
+    return hello;
+}
+
+/**
+ * @brief FileTransfer::IsHelloV2
+ * 旧版握手是 8 字节的用户id、窗口id，id 不会大到以 "QIF2" 开头
+ * @param head 连接上收到的前 4 个字节
+ * @return
+ */
+bool FileTransfer::IsHelloV2(const QByteArray &head)
+{
+    return (head.size() >= 4 && 0 == memcmp(head.constData(), FILE_V2_MAGIC, 4));
+}
+
+QByteArray FileTransfer::PackOffer(const quint64 &id, const quint64 &size, const quint32 &chunkSize, const QString &name,
+                                   const QByteArray &sha)
+{
+    bool bSha = (FILE_SHA_SIZE == sha.size());
+    QByteArray utf8 = name.toUtf8();
+    QByteArray payload(FILE_OFFER_FIXED, 0);
+    uchar *p = reinterpret_cast<uchar *>(payload.data());
+    p[0] = bSha ? FileOfferSha : FileOffer;
+    qToBigEndian<quint64>(id, p + 1);
+    qToBigEndian<quint64>(size, p + 9);
+    qToBigEndian<quint32>(chunkSize, p + 17);
+    if (bSha) payload.append(sha);
+    payload.append(utf8);
+    return FrameCodec::Pack(payload);
+}
+
+QByteArray FileTransfer::PackResume(const quint64 &id, const quint64 &offset)
+{
+    QByteArray payload(FILE_RESUME_SIZE, 0);
+    uchar *p = reinterpret_cast<uchar *>(payload.data());
+    p[0] = FileResume;
+    qToBigEndian<quint64>(id, p + 1);
+    qToBigEndian<quint64>(offset, p + 9);
+    return FrameCodec::Pack(payload);
+}
+
+QByteArray FileTransfer::PackChunk(const quint64 &id, const quint64 &offset, const QByteArray &data)
+{
+    QByteArray frame = PackChunkHead(id, offset, quint32(data.size()), Crc32c(data.constData(), data.size()));
+    frame.append(data);
+    return frame;
+}
+
+QByteArray FileTransfer::PackChunkHead(const quint64 &id, const quint64 &offset, const quint32 &len, const quint32 &crc)
+{
+    QByteArray head(FILE_CHUNK_HEAD_SIZE, 0);
+    uchar *p = reinterpret_cast<uchar *>(head.data());
+    qToBigEndian<quint32>(quint32(FILE_CHUNK_FIXED) + len, p);
+    p[4] = FileChunk;
+    qToBigEndian<quint64>(id, p + 5);
+    qToBigEndian<quint64>(offset, p + 13);
+    qToBigEndian<quint32>(crc, p + 21);
+    return head;
+}
+
+QByteArray FileTransfer::PackDone(const quint64 &id)
+{
+    QByteArray payload(FILE_DONE_SIZE, 0);
+    uchar *p = reinterpret_cast<uchar *>(payload.data());
+    p[0] = FileDone;
+    qToBigEndian<quint64>(id, p + 1);
+    return FrameCodec::Pack(payload);
+}
+
+QByteArray FileTransfer::PackError(const quint64 &id, const quint32 &code)
+{
+    QByteArray payload(FILE_ERROR_SIZE, 0);
+    uchar *p = reinterpret_cast<uchar *>(payload.data());
+    p[0] = FileError;
+    qToBigEndian<quint64>(id, p + 1);
+    qToBigEndian<quint32>(code, p + 9);
+    return FrameCodec::Pack(payload);
+}
+
+/**
+ * @brief FileTransfer::Parse
+ * 长度不足或类型未知时返回 false
+ * @param payload
+ * @param frame
+ * @return
+ */
+bool FileTransfer::Parse(const QByteArray &payload, FileFrame &frame)
+{
+    if (payload.size() < FILE_DONE_SIZE) return false;
+
+    const uchar *p = reinterpret_cast<const uchar *>(payload.constData());
+    frame.op = p[0];
+    frame.id = qFromBigEndian<quint64>(p + 1);
+
+    switch (frame.op) {
+    case FileOffer:
+    case FileOfferSha:
+    {
+        int nFixed = (FileOfferSha == frame.op) ? FILE_OFFER_SHA_FIXED : FILE_OFFER_FIXED;
+        if (payload.size() < nFixed) return false;
+        frame.size = qFromBigEndian<quint64>(p + 9);
+        frame.chunkSize = qFromBigEndian<quint32>(p + 17);
+        frame.sha = payload.mid(FILE_OFFER_FIXED, nFixed - FILE_OFFER_FIXED);
+        frame.name = QString::fromUtf8(payload.constData() + nFixed, payload.size() - nFixed);
+        frame.op = FileOffer;
+        return (frame.chunkSize > 0 && frame.chunkSize <= quint32(FILE_CHUNK_SIZE));
+    }
+    case FileResume:
+        if (payload.size() < FILE_RESUME_SIZE) return false;
+        frame.offset = qFromBigEndian<quint64>(p + 9);
+        return true;
+    case FileChunk:
+        if (payload.size() < FILE_CHUNK_FIXED) return false;
+        frame.offset = qFromBigEndian<quint64>(p + 9);
+        frame.crc = qFromBigEndian<quint32>(p + 17);
+        frame.data = payload.mid(FILE_CHUNK_FIXED);
+        return true;
+    case FileDone:
+        return true;
+    case FileError:
+        if (payload.size() < FILE_ERROR_SIZE) return false;
+        frame.code = qFromBigEndian<quint32>(p + 9);
+        return true;
+    default:
+        return false;
+    }
+}
+
+///////////////////////////////////////////////////////////////
+///////////////////////////////////////////////////////////////
+PartFile::PartFile() :
+    m_nId(0),
+    m_nSize(0),
+    m_nChunkSize(FILE_CHUNK_SIZE),
+    m_nVerified(0),
+    m_bKeepCrc(false),
+    m_bHashed(false),
+    m_nFailures(0),
+    m_hash(QCryptographicHash::Sha256)
+{
+}
+
+PartFile::~PartFile()
+{
+    Close();
+}
+
+QString PartFile::CrcPath(const QString &target)
+{
+    QFileInfo info(target);
+    return info.path() + "/." + info.fileName() + ".crc";
+}
+
+/**
+ * @brief PartFile::Open
+ * 已有同一个 id 的未完成文件时，从按块取整的长度继续；
+ * 记录了块校验时再与校验条数取较小值，多出来的未校验部分截掉
+ * @param target 完成后的文件名
+ * @param id
+ * @param size
+ * @param chunkSize
+ * @param bKeepCrc 是否记录每块的 crc
+ * @return
+ */
+qint64 PartFile::Open(const QString &target, const quint64 &id, const quint64 &size, const quint32 &chunkSize, const bool &bKeepCrc)
+{
+    Close();
+
+    m_strTarget = target;
+    m_nId = id;
+    m_nSize = size;
+    m_nChunkSize = chunkSize;
+    m_bKeepCrc = bKeepCrc;
+    m_nFailures = 0;
+
+    QString strPart = QString("%1.%2.part").arg(target).arg(id, 16, 16, QChar('0'));
+    m_file.setFileName(strPart);
+    if (!m_file.open(QFile::ReadWrite)) return -1;
+
+    quint64 nVerified = qMin(size, quint64(m_file.size()) / chunkSize * chunkSize);
+
+    if (m_bKeepCrc) {
+        m_crcFile.setFileName(strPart + ".crc");
+        if (!m_crcFile.open(QFile::ReadWrite)) {
+            Close();
+            return -1;
+        }
+
+        uchar head[CRC_FILE_HEAD_SIZE];
+        bool bValid = (CRC_FILE_HEAD_SIZE == m_crcFile.read(reinterpret_cast<char *>(head), CRC_FILE_HEAD_SIZE)) &&
+                (0 == memcmp(head, CRC_FILE_MAGIC, 4)) &&
+                (qFromBigEndian<quint32>(head + 4) == chunkSize) &&
+                (qFromBigEndian<quint64>(head + 8) == size);
+
+        if (!bValid) {
+            memcpy(head, CRC_FILE_MAGIC, 4);
+            qToBigEndian<quint32>(chunkSize, head + 4);
+            qToBigEndian<quint64>(size, head + 8);
+            qToBigEndian<qint64>(0, head + 16);
+            m_crcFile.resize(0);
+            m_crcFile.seek(0);
+            m_crcFile.write(reinterpret_cast<const char *>(head), CRC_FILE_HEAD_SIZE);
+        }
+
+        quint64 nCount = quint64(m_crcFile.size() - CRC_FILE_HEAD_SIZE) / 4;
+        nVerified = qMin(nVerified, nCount * chunkSize);
+
+        nCount = (nVerified + chunkSize - 1) / chunkSize;
+        m_crcFile.resize(qint64(CRC_FILE_HEAD_SIZE + nCount * 4));
+        m_crcFile.seek(m_crcFile.size());
+    }
+
+    if (!m_file.resize(qint64(nVerified)) || !m_file.seek(qint64(nVerified))) {
+        Close();
+        return -1;
+    }
+
+    // 摘要随写入逐块累加；续传时不重读已有部分（文件服务器单线程，会阻塞所有传输），
+    // 这次上传没有摘要，完成后不移入内容存储
+    m_hash.reset();
+    m_bHashed = m_bKeepCrc && (0 == nVerified);
+
+    m_nVerified = nVerified;
+    return qint64(nVerified);
+}
+
+/**
+ * @brief PartFile::Write
+ * 只接受紧接在已校验位置后的一块，长度必须是整块或文件剩余部分；
+ * 同一位置连续校验失败超过 FILE_CRC_RETRY 次时返回 PartGiveUp
+ * @param offset
+ * @param crc
+ * @param data
+ * @return E_PART_RESULT
+ */
+int PartFile::Write(const quint64 &offset, const quint32 &crc, const QByteArray &data)
+{
+    if (!m_file.isOpen()) return PartIoError;
+    if (offset != m_nVerified) return PartStale;
+
+    quint64 nExpect = qMin(quint64(m_nChunkSize), m_nSize - m_nVerified);
+    if (quint64(data.size()) != nExpect ||
+            FileTransfer::Crc32c(data.constData(), data.size()) != crc) {
+        return (++m_nFailures > FILE_CRC_RETRY) ? PartGiveUp : PartBadCrc;
+    }
+
+    // 边传边下时其他连接会读 .part，写入后立即刷出
+    if (m_file.write(data) != data.size() || !m_file.flush()) return PartIoError;
+
+    if (m_bKeepCrc) {
+        uchar value[4];
+        qToBigEndian<quint32>(crc, value);
+        if (4 != m_crcFile.write(reinterpret_cast<const char *>(value), 4)) return PartIoError;
+    }
+    if (m_bHashed) m_hash.addData(data);
+
+    m_nVerified += nExpect;
+    m_nFailures = 0;
+    return PartOk;
+}
+
+/**
+ * @brief PartFile::Commit
+ * 先改名数据文件，再写入修改时间并改名校验记录；
+ * 中间中断时校验记录对不上修改时间，发送方会退回到读文件计算校验
+ * @return
+ */
+bool PartFile::Commit()
+{
+    if (!IsComplete()) return false;
+
+    QString strPart = m_file.fileName();
+    m_file.close();
+
+    QString strCrc = CrcPath(m_strTarget);
+    QFile::remove(strCrc);
+    QFile::remove(m_strTarget);
+    if (!QFile::rename(strPart, m_strTarget)) {
+        Close();
+        return false;
+    }
+
+    if (m_bKeepCrc) {
+        uchar mtime[8];
+        qToBigEndian<qint64>(QFileInfo(m_strTarget).lastModified().toMSecsSinceEpoch(), mtime);
+        m_crcFile.seek(16);
+        m_crcFile.write(reinterpret_cast<const char *>(mtime), 8);
+
+        QString strPartCrc = m_crcFile.fileName();
+        m_crcFile.close();
+        QFile::rename(strPartCrc, strCrc);
+    }
+
+    return true;
+}
+
+void PartFile::Close()
+{
+    if (m_file.isOpen()) m_file.close();
+    if (m_crcFile.isOpen()) m_crcFile.close();
+}
+
+bool PartFile::IsOpen() const
+{
+    return m_file.isOpen();
+}
+
+bool PartFile::IsComplete() const
+{
+    return (m_file.isOpen() && m_nVerified >= m_nSize);
+}
+
+quint64 PartFile::Id() const
+{
+    return m_nId;
+}
+
+quint64 PartFile::Size() const
+{
+    return m_nSize;
+}
+
+quint64 PartFile::Verified() const
+{
+    return m_nVerified;
+}
+
+QString PartFile::Target() const
+{
+    return m_strTarget;
+}
+
+QString PartFile::PartPath() const
+{
+    return m_file.fileName();
+}
+
+QByteArray PartFile::Sha256() const
+{
+    if (!m_bHashed || m_nVerified < m_nSize) return QByteArray();
+    return m_hash.result();
+}
+
+/**
+ * @brief PartFile::LoadCrcs
+ * @param target
+ * @param chunkSize
+ * @param crcs
+ * @return
+ */
+bool PartFile::LoadCrcs(const QString &target, const quint32 &chunkSize, QVector<quint32> &crcs)
+{
+    QFileInfo info(target);
+    QFile file(CrcPath(target));
+    if (!info.exists() || !file.open(QFile::ReadOnly)) return false;
+
+    QByteArray all = file.readAll();
+    if (all.size() < CRC_FILE_HEAD_SIZE) return false;
+
+    const uchar *p = reinterpret_cast<const uchar *>(all.constData());
+    quint64 nSize = quint64(info.size());
+    quint64 nCount = (nSize + chunkSize - 1) / chunkSize;
+    if (0 != memcmp(p, CRC_FILE_MAGIC, 4) ||
+            qFromBigEndian<quint32>(p + 4) != chunkSize ||
+            qFromBigEndian<quint64>(p + 8) != nSize ||
+            qFromBigEndian<qint64>(p + 16) != info.lastModified().toMSecsSinceEpoch() ||
+            quint64(all.size()) != CRC_FILE_HEAD_SIZE + nCount * 4) {
+        return false;
+    }
+
+    crcs.resize(int(nCount));
+    for (int i = 0; i < int(nCount); i++) {
+        crcs[i] = qFromBigEndian<quint32>(p + CRC_FILE_HEAD_SIZE + i * 4);
+    }
+
+    return true;
+}
+
+/**
+ * @brief PartFile::PurgeStale
+ * 对方不再续传的未完成文件不会自动消失，定期按修改时间清理
+ * @param dir
+ * @param days
+ * @return 删除的文件数
+ */
+int PartFile::PurgeStale(const QString &dir, const int &days)
+{
+    QDateTime expire = QDateTime::currentDateTime().addDays(-days);
+    QFileInfoList parts = QDir(dir).entryInfoList(QStringList() << "*.part" << "*.part.crc", QDir::Files | QDir::Hidden);
+
+    int nRemoved = 0;
+    foreach (QFileInfo info, parts) {
+        if (info.lastModified() < expire && QFile::remove(info.absoluteFilePath())) nRemoved++;
+    }
+
+    return nRemoved;
+}
+
+///////////////////////////////////////////////////////////////
+///////////////////////////////////////////////////////////////
+SendScheduler::SendScheduler()
+{
+}
+
+SendScheduler::~SendScheduler()
+{
+    Clear();
+}
+
+void SendScheduler::Add(FileSendTask *task)
+{
+    if (task->size <= FILE_SMALL_SIZE) {
+        m_small.append(task);
+    } else {
+        m_bulk.append(task);
+    }
+}
+
+FileSendTask *SendScheduler::Find(const quint64 &id) const
+{
+    foreach (FileSendTask *task, m_small + m_bulk) {
+        if (task->id == id) return task;
+    }
+
+    return NULL;
+}
+
+void SendScheduler::Remove(const quint64 &id)
+{
+    FileSendTask *task = Find(id);
+    if (NULL == task) return;
+
+    m_small.removeOne(task);
+    m_bulk.removeOne(task);
+    delete task;
+}
+
+void SendScheduler::Clear()
+{
+    qDeleteAll(m_small);
+    qDeleteAll(m_bulk);
+    m_small.clear();
+    m_bulk.clear();
+}
+
+int SendScheduler::Count() const
+{
+    return m_small.size() + m_bulk.size();
+}
+
+QList<FileSendTask *> SendScheduler::Tasks() const
+{
+    return m_small + m_bulk;
+}
+
+/**
+ * @brief SendScheduler::Next
+ * 检查过的任务都移到队尾，下次从下一个开始
+ * @return
+ */
+FileSendTask *SendScheduler::Next()
+{
+    QList<FileSendTask *> *levels[2] = { &m_small, &m_bulk };
+
+    for (int l = 0; l < 2; l++) {
+        QList<FileSendTask *> &tasks = *levels[l];
+        for (int i = 0; i < tasks.size(); i++) {
+            FileSendTask *task = tasks.takeFirst();
+            tasks.append(task);
+
+            if (task->rewind >= 0) {
+                task->offset = task->rewind;
+                task->rewind = -1;
+            }
+
+            if (task->offset < 0 || quint64(task->offset) >= task->size) continue;
+
+            // 只发整块，块尾不能超过可发送的位置
+            quint64 nEnd = qMin(quint64(task->offset) + FILE_CHUNK_SIZE, task->size);
+            if (nEnd <= task->avail) return task;
+        }
+    }
+
+    return NULL;
+}
@@ -0,0 +1,195 @@
+#ifndef FILETRANSFER_H
+#define FILETRANSFER_H
+
+#include <QByteArray>
+#include <QString>
+#include <QFile>
+#include <QVector>
+#include <QList>
+#include <QCryptographicHash>
+
+// v2 连接握手：4 字节魔数 + qint32 用户id + qint32 窗口id（大端）
+#define FILE_V2_MAGIC           "QIF2"
+#define FILE_V2_HELLO_SIZE      12
+// 固定块大小，每块单独校验
+#define FILE_CHUNK_SIZE         (256 * 1024)
+// 块帧头：长度(4) + op(1) + 传输id(8) + 偏移(8) + crc(4)
+#define FILE_CHUNK_HEAD_SIZE    25
+// 单帧上限：一块数据加帧头，留出余量
+#define FILE_FRAME_MAX          (FILE_CHUNK_SIZE + 1024)
+// 发送方在 socket 缓冲中最多积压的字节数
+#define FILE_SEND_WINDOW        (4 * FILE_CHUNK_SIZE)
+// 同一位置连续校验失败的次数上限，超过后放弃本次传输
+#define FILE_CRC_RETRY          3
+// 不超过该大小的文件（头像、图片）优先发送
+#define FILE_SMALL_SIZE         (1024 * 1024)
+// 每个连接每个方向同时进行的传输数上限
+#define FILE_MAX_TRANSFERS      16
+// 内容摘要（SHA-256）的字节数
+#define FILE_SHA_SIZE           32
+
+// v2 帧类型，每帧负载的第一个字节
+typedef enum {
+    FileOffer = 1,      // 发送方 -> 接收方：id、总大小、块大小、文件名
+    FileResume,         // 接收方 -> 发送方：id、从哪个偏移开始发（续传、校验失败后回退）
+    FileChunk,          // 发送方 -> 接收方：id、偏移、crc32c、数据
+    FileDone,           // 接收方 -> 发送方：id，文件已校验完整并落盘
+    FileError,          // 任一方：id、错误码，本次传输放弃
+    FileOfferSha,       // 同 Offer，文件名前带内容 SHA-256，接收方已有同样内容时直接回复 Done
+} E_FILE_OP;
+
+typedef enum {
+    FileErrIo = 1,      // 打开或写文件失败
+    FileErrChecksum,    // 校验连续失败
+    FileErrProtocol,    // 帧内容不合法
+    FileErrBusy,        // 同时进行的传输过多
+} E_FILE_ERROR;
+
+// 解析后的一帧，只有对应类型用到的字段有效
+struct FileFrame {
+    quint8      op;
+    quint64     id;
+    quint64     offset;     // Resume、Chunk
+    quint64     size;       // Offer
+    quint32     chunkSize;  // Offer
+    quint32     crc;        // Chunk
+    quint32     code;       // Error
+    QString     name;       // Offer
+    QByteArray  sha;        // Offer，带摘要时为 32 字节，否则为空
+    QByteArray  data;       // Chunk
+};
+
+/////////////////////////////////////////////////////////////////
+/// \brief The FileTransfer class
+/// 文件传输 v2 的编解码：连接后先发 v2 握手，之后双向都是 FrameCodec 长度前缀帧，
+/// 负载为 [op][字段...]，整数大端。客户端与服务器各有一份相同的副本
+class FileTransfer
+{
+public:
+    // CRC32C（Castagnoli），软件查表实现，可分段累加
+    static quint32 Crc32c(const char *data, qint64 len, quint32 crc = 0);
+
+    // 传输id 由文件名、大小、修改时间、块大小决定，两端重启后同一文件得到同一个id
+    static quint64 TransferId(const QString &name, const quint64 &size, const qint64 &mtimeMs, const quint32 &chunkSize);
+
+    static QByteArray PackHello(const qint32 &userId, const qint32 &winId);
+    static bool IsHelloV2(const QByteArray &head);
+
+    // 以下都返回带长度头的完整帧，可以直接写入 socket
+    // sha 为 32 字节时打包成 FileOfferSha
+    static QByteArray PackOffer(const quint64 &id, const quint64 &size, const quint32 &chunkSize, const QString &name,
+                                const QByteArray &sha = QByteArray());
+    static QByteArray PackResume(const quint64 &id, const quint64 &offset);
+    static QByteArray PackChunk(const quint64 &id, const quint64 &offset, const QByteArray &data);
+    // 只有块帧头，后面紧跟 len 字节数据（sendfile 发送数据时使用）
+    static QByteArray PackChunkHead(const quint64 &id, const quint64 &offset, const quint32 &len, const quint32 &crc);
+    static QByteArray PackDone(const quint64 &id);
+    static QByteArray PackError(const quint64 &id, const quint32 &code);
+
+    // 解析 FrameCodec 取出的负载，FileOfferSha 解析后 op 为 FileOffer、sha 有效
+    static bool Parse(const QByteArray &payload, FileFrame &frame);
+};
+
+// PartFile::Write 的结果
+typedef enum {
+    PartOk = 0,         // 校验通过并写入
+    PartStale,          // 不是期望的偏移（回退前已在途的块），忽略
+    PartBadCrc,         // 校验失败，需要让发送方从 Verified() 重发
+    PartGiveUp,         // 同一位置连续校验失败超过 FILE_CRC_RETRY 次
+    PartIoError,        // 写文件失败
+} E_PART_RESULT;
+
+/////////////////////////////////////////////////////////////////
+/// \brief The PartFile class
+/// 接收方的未完成文件：数据写在 "文件名.<id>.part"，只有校验通过的块才追加，
+/// 所以重启后按块大小取整的文件长度就是已校验的位置。
+/// 需要时同时记录每块的 crc（"文件名.<id>.part.crc"），完成后改名为 ".文件名.crc"，
+/// 发送方据此不必再读一遍文件计算校验，可以直接用 sendfile。
+/// 记录块校验时同时累加整个文件的 SHA-256，完成后作为内容地址
+class PartFile
+{
+public:
+    PartFile();
+    ~PartFile();
+
+    // 打开或续传，返回已校验的偏移，失败返回 -1
+    qint64 Open(const QString &target, const quint64 &id, const quint64 &size, const quint32 &chunkSize, const bool &bKeepCrc);
+    int Write(const quint64 &offset, const quint32 &crc, const QByteArray &data);
+    // 全部写完后关闭并改为目标文件名
+    bool Commit();
+    // 中断时关闭，保留未完成文件供下次续传
+    void Close();
+
+    bool IsOpen() const;
+    bool IsComplete() const;
+    quint64 Id() const;
+    quint64 Size() const;
+    quint64 Verified() const;
+    QString Target() const;
+    // 数据文件 "文件名.<id>.part"
+    QString PartPath() const;
+    // 全部写完后整个文件的 SHA-256（只在记录块校验、且从头开始接收时有效，续传的为空）
+    QByteArray Sha256() const;
+
+    // 读取目标文件的块校验记录，文件大小或修改时间对不上时返回 false
+    static bool LoadCrcs(const QString &target, const quint32 &chunkSize, QVector<quint32> &crcs);
+    // 删除目录中超过 days 天未修改的未完成文件
+    static int PurgeStale(const QString &dir, const int &days);
+    // 目标文件的块校验记录 ".文件名.crc"
+    static QString CrcPath(const QString &target);
+
+private:
+    QFile       m_file;
+    QFile       m_crcFile;
+    QString     m_strTarget;
+    quint64     m_nId;
+    quint64     m_nSize;
+    quint32     m_nChunkSize;
+    quint64     m_nVerified;
+    bool        m_bKeepCrc;
+    // 从 0 开始接收，摘要覆盖整个文件
+    bool        m_bHashed;
+    int         m_nFailures;
+    QCryptographicHash m_hash;
+};
+
+// 发送中的一个文件
+struct FileSendTask {
+    quint64     id;
+    QString     path;
+    QFile       file;
+    quint64     size;
+    qint64      offset;     // 下一块的偏移，-1 表示在等接收方回复 Resume
+    quint64     avail;      // 可以发送的字节数，转发还在上传的文件时随上传增长
+    qint64      rewind;     // 接收方要求回退的偏移，-1 表示没有
+    QVector<quint32> crcs;  // 块校验记录（服务器），有效时块数据可以用 sendfile
+};
+
+/////////////////////////////////////////////////////////////////
+/// \brief The SendScheduler class
+/// 一个连接上同时发送的多个文件，每次取一块：
+/// 小文件（不超过 FILE_SMALL_SIZE）优先，同一级内按块轮转，大文件不会独占连接
+class SendScheduler
+{
+public:
+    SendScheduler();
+    ~SendScheduler();
+
+    // 接管 task，由调度器负责释放
+    void Add(FileSendTask *task);
+    FileSendTask *Find(const quint64 &id) const;
+    // 移除并释放
+    void Remove(const quint64 &id);
+    void Clear();
+    int Count() const;
+    QList<FileSendTask *> Tasks() const;
+
+    // 下一块该发哪个文件，回退在这里生效；都在等 Resume、等上传或已发完时返回 NULL
+    FileSendTask *Next();
+
+private:
+    QList<FileSendTask *> m_small;
+    QList<FileSendTask *> m_bulk;
+};
+
+#endif // FILETRANSFER_H
@@ -0,0 +1,129 @@
+#include "framecodec.h"
+
+#include <QtEndian>
+#include <string.h>
+
+FrameCodec::FrameCodec(int maxFrameSize) :
+    m_nOffset(0),
+    m_nMaxFrameSize(maxFrameSize),
+    m_bError(false),
+    m_nLegacy(-1)
+{
+}
+
+void FrameCodec::SetMaxFrameSize(int maxFrameSize)
+{
+    m_nMaxFrameSize = maxFrameSize > 0 ? maxFrameSize : FRAME_MAX_SIZE_DEFAULT;
+}
+
+int FrameCodec::GetMaxFrameSize() const
+{
+    return m_nMaxFrameSize;
+}
+
+/**
+ * @brief FrameCodec::Append
+ * 追加数据，已消费的部分在这里统一回收，避免每取一帧都移动缓冲区
+ * @param data
+ */
+void FrameCodec::Append(const QByteArray &data)
+{
+    if (data.isEmpty()) return;
+
+    if (-1 == m_nLegacy) {
+        m_nLegacy = ('{' == data.at(0)) ? 1 : 0;
+    }
+
+    if (m_nOffset > 0) {
+        m_buffer.remove(0, m_nOffset);
+        m_nOffset = 0;
+    }
+
+    if (m_buffer.isEmpty()) {
+        m_buffer = data;
+    } else {
+        m_buffer.append(data);
+    }
+}
+
+/**
+ * @brief FrameCodec::TakeFrame
+ * 取出一个完整帧
+ * @param frame
+ * @return
+ */
+bool FrameCodec::TakeFrame(QByteArray &frame)
+{
+    if (m_bError) return false;
+
+    int nAvailable = m_buffer.size() - m_nOffset;
+
+    // 旧版连接：每次读取的数据整体作为一条 JSON
+    if (1 == m_nLegacy) {
+        if (nAvailable <= 0) return false;
+        frame = m_buffer.mid(m_nOffset);
+        m_buffer.clear();
+        m_nOffset = 0;
+        return true;
+    }
+
+    if (nAvailable < FRAME_HEADER_SIZE) return false;
+
+    const uchar *header = reinterpret_cast<const uchar *>(m_buffer.constData() + m_nOffset);
+    quint32 nLength = qFromBigEndian<quint32>(header);
+    if (nLength > quint32(m_nMaxFrameSize)) {
+        m_bError = true;
+        return false;
+    }
+
+    if (nAvailable < int(FRAME_HEADER_SIZE + nLength)) return false;
+
+    frame = m_buffer.mid(m_nOffset + FRAME_HEADER_SIZE, int(nLength));
+    m_nOffset += FRAME_HEADER_SIZE + int(nLength);
+
+    // 缓冲区全部消费完，直接清空
+    if (m_nOffset >= m_buffer.size()) {
+        m_buffer.clear();
+        m_nOffset = 0;
+    }
+
+    return true;
+}
+
+bool FrameCodec::HasError() const
+{
+    return m_bError;
+}
+
+bool FrameCodec::IsLegacy() const
+{
+    return (1 == m_nLegacy);
+}
+
+int FrameCodec::PendingBytes() const
+{
+    return m_buffer.size() - m_nOffset;
+}
+
+void FrameCodec::Reset()
+{
+    m_buffer.clear();
+    m_nOffset = 0;
+    m_bError = false;
+    m_nLegacy = -1;
+}
+
+/**
+ * @brief FrameCodec::Pack
+ * 加上长度头
+ * @param payload
+ * @return
+ */
+QByteArray FrameCodec::Pack(const QByteArray &payload)
+{
+    QByteArray frame;
+    frame.resize(FRAME_HEADER_SIZE + payload.size());
+    qToBigEndian<quint32>(quint32(payload.size()), reinterpret_cast<uchar *>(frame.data()));
+    memcpy(frame.data() + FRAME_HEADER_SIZE, payload.constData(), size_t(payload.size()));
+    return frame;
+}
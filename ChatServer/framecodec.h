@@ -0,0 +1,49 @@
+#ifndef FRAMECODEC_H
+#define FRAMECODEC_H
+
+#include <QByteArray>
+
+// 帧头长度：4 字节大端无符号长度
+#define FRAME_HEADER_SIZE       4
+// 默认单帧最大长度 8MB
+#define FRAME_MAX_SIZE_DEFAULT  (8 * 1024 * 1024)
+
+/////////////////////////////////////////////////////////////////
+/// \brief The FrameCodec class
+/// 长度前缀帧编解码：[quint32 长度(大端)][负载]
+/// 每个连接持有一个实例，增量追加读取到的数据，一次可取出任意多个完整帧。
+/// 兼容旧客户端：连接上的第一个字节为 '{' 时视为未分帧的 JSON 连接。
+class FrameCodec
+{
+public:
+    explicit FrameCodec(int maxFrameSize = FRAME_MAX_SIZE_DEFAULT);
+
+    void SetMaxFrameSize(int maxFrameSize);
+    int GetMaxFrameSize() const;
+
+    // 追加从 socket 读取的数据
+    void Append(const QByteArray &data);
+    // 取出一个完整帧，缓冲区中没有完整帧时返回 false
+    bool TakeFrame(QByteArray &frame);
+
+    // 帧长度非法（超过上限），连接应当断开
+    bool HasError() const;
+    // 旧版未分帧连接
+    bool IsLegacy() const;
+    // 缓冲区中尚未处理的字节数
+    int PendingBytes() const;
+
+    void Reset();
+
+    // 封装一帧数据
+    static QByteArray Pack(const QByteArray &payload);
+private:
+    QByteArray  m_buffer;
+    int         m_nOffset;
+    int         m_nMaxFrameSize;
+    bool        m_bError;
+    // -1 未确定，0 分帧，1 旧版 JSON
+    int         m_nLegacy;
+};
+
+#endif // FRAMECODEC_H
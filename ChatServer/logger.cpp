@@ -0,0 +1,347 @@
+#include "logger.h"
+
+#include <QThread>
+#include <QFile>
+#include <QFileInfo>
+#include <QDateTime>
+#include <QStringList>
+
+#include <stdio.h>
+
+// 环形缓冲区容量，必须是 2 的幂
+#define LOG_RING_SIZE       8192
+// 缓冲区为空时后台线程的等待间隔
+#define LOG_IDLE_MS         50
+// 单次写文件的最大批量
+#define LOG_BATCH_BYTES     (64 * 1024)
+
+Logger *Logger::self = NULL;
+QAtomicInt Logger::s_levels[LogModuleCount] = {
+    LogInfo, LogInfo, LogInfo, LogInfo, LogInfo
+};
+
+static const char *s_levelNames[] = { "DEBUG", "INFO", "WARN", "ERROR", "OFF" };
+static const char *s_moduleNames[] = { "sys", "net", "msg", "db", "file" };
+
+/////////////////////////////////////////////////////////////////
+/// \brief The LogFlushThread class
+/// 日志写入线程，只负责跑 Logger::FlushLoop
+class LogFlushThread : public QThread
+{
+public:
+    explicit LogFlushThread(Logger *logger) : m_logger(logger) {}
+
+protected:
+    void run()
+    {
+        m_logger->FlushLoop();
+    }
+
+private:
+    Logger *m_logger;
+};
+
+/**
+ * @brief LogMessageHandler
+ * 未改写的 qDebug/qWarning 也进入异步日志，归入 sys 模块
+ */
+static void LogMessageHandler(QtMsgType type, const QMessageLogContext &context, const QString &msg)
+{
+    int level = LogDebug;
+    switch (type) {
+    case QtDebugMsg:    level = LogDebug; break;
+    case QtInfoMsg:     level = LogInfo; break;
+    case QtWarningMsg:  level = LogWarn; break;
+    default:            level = LogError; break;
+    }
+
+    if (!Logger::IsEnabled(LogSys, level)) return;
+    Logger::Instance()->Push(LogSys, level, context.file, context.line, msg);
+}
+
+static int ParseLevel(const QString &strLevel, const int &defLevel)
+{
+    for (int i = LogDebug; i <= LogOff; i++) {
+        if (0 == strLevel.compare(QLatin1String(s_levelNames[i]), Qt::CaseInsensitive)) return i;
+    }
+
+    return defLevel;
+}
+
+Logger::Logger() :
+    m_nMask(LOG_RING_SIZE - 1),
+    m_nEnqueuePos(0),
+    m_nDequeuePos(0),
+    m_nDropped(0),
+    m_thread(NULL),
+    m_bStop(0),
+    m_file(NULL),
+    m_nMaxBytes(0),
+    m_nMaxFiles(0),
+    m_bConsole(true)
+{
+    m_cells = new Cell[LOG_RING_SIZE];
+    for (quint32 i = 0; i < LOG_RING_SIZE; i++) {
+        m_cells[i].seq.store(i);
+    }
+}
+
+Logger::~Logger()
+{
+    Stop();
+    delete [] m_cells;
+}
+
+/**
+ * @brief Logger::Configure
+ * 先把所有模块设为默认级别，再按 "模块=级别" 逐项覆盖，无法识别的项忽略
+ * @param strDefault
+ * @param strModules
+ */
+void Logger::Configure(const QString &strDefault, const QString &strModules)
+{
+    int defLevel = ParseLevel(strDefault.trimmed(), LogInfo);
+    for (int i = 0; i < LogModuleCount; i++) {
+        SetLevel(i, defLevel);
+    }
+
+#if (QT_VERSION >= QT_VERSION_CHECK(5,14,0))
+    QStringList items = strModules.split(',', Qt::SkipEmptyParts);
+#else
+    QStringList items = strModules.split(',', QString::SkipEmptyParts);
+#endif
+    foreach (QString item, items) {
+        QStringList pair = item.split('=');
+        if (2 != pair.size()) continue;
+
+        QString strModule = pair.at(0).trimmed();
+        for (int i = 0; i < LogModuleCount; i++) {
+            if (0 == strModule.compare(QLatin1String(s_moduleNames[i]), Qt::CaseInsensitive)) {
+                SetLevel(i, ParseLevel(pair.at(1).trimmed(), defLevel));
+                break;
+            }
+        }
+    }
+}
+
+void Logger::SetLevel(const int &module, const int &level)
+{
+    if (module < 0 || module >= LogModuleCount) return;
+    s_levels[module].store(qBound(int(LogDebug), level, int(LogOff)));
+}
+
+/**
+ * @brief Logger::Start
+ * 打开日志文件并启动写入线程，之后 qDebug 的输出也由写入线程处理
+ * @param strFile     日志文件，滚动后为 strFile.1 ... strFile.N
+ * @param maxBytes    单个文件上限，0 表示不滚动
+ * @param maxFiles    保留的历史文件数
+ * @param bConsole    同时输出到 stderr
+ */
+void Logger::Start(const QString &strFile, const qint64 &maxBytes, const int &maxFiles, const bool &bConsole)
+{
+    if (NULL != m_thread) return;
+
+    m_strFile = strFile;
+    m_nMaxBytes = maxBytes;
+    m_nMaxFiles = qMax(1, maxFiles);
+    m_bConsole = bConsole;
+
+    if (!m_strFile.isEmpty()) {
+        m_file = new QFile(m_strFile);
+        if (!m_file->open(QIODevice::WriteOnly | QIODevice::Append)) {
+            fprintf(stderr, "open log file failed: %s\n", qPrintable(m_strFile));
+            delete m_file;
+            m_file = NULL;
+        }
+    }
+
+    m_bStop.store(0);
+    m_thread = new LogFlushThread(this);
+    m_thread->start(QThread::LowPriority);
+
+    qInstallMessageHandler(LogMessageHandler);
+}
+
+/**
+ * @brief Logger::Stop
+ * 恢复默认的 qDebug 输出，等待写入线程写完缓冲区中的日志
+ */
+void Logger::Stop()
+{
+    if (NULL == m_thread) return;
+
+    qInstallMessageHandler(0);
+
+    m_bStop.store(1);
+    m_thread->wait();
+    delete m_thread;
+    m_thread = NULL;
+
+    if (NULL != m_file) {
+        m_file->close();
+        delete m_file;
+        m_file = NULL;
+    }
+}
+
+/**
+ * @brief Logger::Push
+ * 多个线程可以同时调用：抢占一个写入位置后填入记录，再发布序号给写入线程。
+ * 缓冲区满时直接丢弃，不等待
+ */
+void Logger::Push(const int &module, const int &level, const char *file, const int &line, const QString &text)
+{
+    Cell *cell = NULL;
+    quint32 pos = m_nEnqueuePos.load();
+    forever {
+        cell = &m_cells[pos & m_nMask];
+        quint32 seq = cell->seq.loadAcquire();
+        qint32 diff = qint32(seq - pos);
+        if (0 == diff) {
+            if (m_nEnqueuePos.testAndSetRelaxed(pos, pos + 1, pos)) break;
+        } else if (diff < 0) {
+            m_nDropped.fetchAndAddRelaxed(1);
+            return;
+        } else {
+            pos = m_nEnqueuePos.load();
+        }
+    }
+
+    cell->rec.ts = QDateTime::currentMSecsSinceEpoch();
+    cell->rec.module = module;
+    cell->rec.level = level;
+    cell->rec.file = file;
+    cell->rec.line = line;
+    cell->rec.text = text;
+    cell->seq.storeRelease(pos + 1);
+}
+
+int Logger::DroppedCount() const
+{
+    return m_nDropped.load();
+}
+
+/**
+ * @brief Logger::Pop
+ * 只在写入线程调用；取出后把格位序号推进一圈，交还给生产者
+ */
+bool Logger::Pop(Record &rec)
+{
+    Cell *cell = &m_cells[m_nDequeuePos & m_nMask];
+    quint32 seq = cell->seq.loadAcquire();
+    if (qint32(seq - (m_nDequeuePos + 1)) < 0) return false;
+
+    rec = cell->rec;
+    // 文本在写入线程释放，生产者覆盖时不再触发释放
+    cell->rec.text = QString();
+    cell->seq.storeRelease(m_nDequeuePos + m_nMask + 1);
+    m_nDequeuePos++;
+    return true;
+}
+
+/**
+ * @brief Logger::FlushLoop
+ * 批量取出记录并写文件，缓冲区为空时休眠；退出前写完剩余记录
+ */
+void Logger::FlushLoop()
+{
+    Record rec;
+    QByteArray buffer;
+    int nLastDropped = 0;
+
+    forever {
+        bool bStop = m_bStop.load();
+
+        while (Pop(rec)) {
+            buffer.append(Format(rec));
+            if (buffer.size() >= LOG_BATCH_BYTES) break;
+        }
+
+        int nDropped = m_nDropped.load();
+        if (nDropped != nLastDropped) {
+            buffer.append(QString("%1 WARN  [sys] log ring full, dropped %2\n")
+                          .arg(QDateTime::currentDateTime().toString("yyyy-MM-dd hh:mm:ss.zzz"))
+                          .arg(nDropped - nLastDropped).toUtf8());
+            nLastDropped = nDropped;
+        }
+
+        if (buffer.isEmpty()) {
+            if (bStop) break;
+            QThread::msleep(LOG_IDLE_MS);
+            continue;
+        }
+
+        if (NULL != m_file) {
+            m_file->write(buffer);
+            m_file->flush();
+            if (m_nMaxBytes > 0 && m_file->size() >= m_nMaxBytes) Rotate();
+        }
+
+        if (m_bConsole) {
+            fwrite(buffer.constData(), 1, buffer.size(), stderr);
+        }
+
+        buffer.clear();
+    }
+}
+
+/**
+ * @brief Logger::Rotate
+ * server.log -> server.log.1 -> ... -> server.log.N，最旧的删除
+ */
+void Logger::Rotate()
+{
+    m_file->close();
+
+    QFile::remove(QString("%1.%2").arg(m_strFile).arg(m_nMaxFiles));
+    for (int i = m_nMaxFiles - 1; i >= 1; i--) {
+        QFile::rename(QString("%1.%2").arg(m_strFile).arg(i), QString("%1.%2").arg(m_strFile).arg(i + 1));
+    }
+    QFile::rename(m_strFile, m_strFile + ".1");
+
+    if (!m_file->open(QIODevice::WriteOnly | QIODevice::Append)) {
+        fprintf(stderr, "reopen log file failed: %s\n", qPrintable(m_strFile));
+        delete m_file;
+        m_file = NULL;
+    }
+}
+
+/**
+ * @brief Logger::Format
+ * 时间 级别 [模块] 内容 (文件:行)
+ */
+QByteArray Logger::Format(const Record &rec) const
+{
+    QString strLine = QString("%1 %2 [%3] %4")
+            .arg(QDateTime::fromMSecsSinceEpoch(rec.ts).toString("yyyy-MM-dd hh:mm:ss.zzz"))
+            .arg(QLatin1String(s_levelNames[rec.level]), -5)
+            .arg(QLatin1String(s_moduleNames[rec.module]))
+            .arg(rec.text);
+
+    if (NULL != rec.file) {
+        strLine += QString(" (%1:%2)").arg(QFileInfo(QString::fromLatin1(rec.file)).fileName()).arg(rec.line);
+    }
+
+    strLine += '\n';
+    return strLine.toUtf8();
+}
+
+LogLine::LogLine(const int &module, const int &level, const char *file, const int &line) :
+    m_nModule(module),
+    m_nLevel(level),
+    m_file(file),
+    m_nLine(line)
+{
+    m_debug = new QDebug(&m_text);
+}
+
+/**
+ * @brief LogLine::~LogLine
+ * QDebug 析构时才把内容写进 m_text，先释放再提交
+ */
+LogLine::~LogLine()
+{
+    delete m_debug;
+    Logger::Instance()->Push(m_nModule, m_nLevel, m_file, m_nLine, m_text);
+}
@@ -0,0 +1,149 @@
+#ifndef LOGGER_H
+#define LOGGER_H
+
+#include <QString>
+#include <QMutex>
+#include <QAtomicInt>
+#include <QDebug>
+
+class QThread;
+class QFile;
+
+// 日志级别
+typedef enum {
+    LogDebug = 0,
+    LogInfo,
+    LogWarn,
+    LogError,
+    LogOff,
+} E_LOG_LEVEL;
+
+// 日志模块，各模块级别单独配置
+typedef enum {
+    LogSys = 0,     // 启动、配置、未改写的 qDebug
+    LogNet,         // 连接、收发
+    LogMsg,         // 消息处理
+    LogDb,          // 数据库
+    LogFile,        // 文件传输
+    LogModuleCount,
+} E_LOG_MODULE;
+
+/////////////////////////////////////////////////////////////////
+/// \brief The Logger class
+/// 异步日志：调用线程只把一条记录放入无锁环形缓冲区（多生产者单消费者），
+/// 时间格式化、写文件、按大小滚动都在后台线程完成；缓冲区满时丢弃并计数，不阻塞调用方。
+/// 级别判断是一次原子读，LOG_xxx 宏在级别关闭时不求值 << 后面的参数
+class Logger
+{
+public:
+    // 单实例
+    static Logger *Instance()
+    {
+        static QMutex mutex;
+        if (NULL == self) {
+            QMutexLocker locker(&mutex);
+
+            if (!self) {
+                self = new Logger();
+            }
+        }
+
+        return self;
+    }
+
+    static inline bool IsEnabled(const int &module, const int &level)
+    {
+        return level >= s_levels[module].load();
+    }
+
+    // 设置级别：strDefault 为所有模块的默认级别，strModules 形如 "net=debug,db=warn"
+    static void Configure(const QString &strDefault, const QString &strModules);
+    static void SetLevel(const int &module, const int &level);
+
+    // 启动后台写入线程，接管 qDebug/qWarning 输出
+    void Start(const QString &strFile, const qint64 &maxBytes, const int &maxFiles, const bool &bConsole);
+    // 写完缓冲区中的日志后退出后台线程
+    void Stop();
+
+    // 放入一条日志，缓冲区满时丢弃
+    void Push(const int &module, const int &level, const char *file, const int &line, const QString &text);
+    // 因缓冲区满丢弃的条数
+    int DroppedCount() const;
+
+private:
+    Logger();
+    ~Logger();
+
+    static Logger *self;
+    static QAtomicInt s_levels[LogModuleCount];
+
+    struct Record {
+        qint64      ts;
+        int         module;
+        int         level;
+        const char  *file;
+        int         line;
+        QString     text;
+    };
+
+    struct Cell {
+        QAtomicInteger<quint32> seq;
+        Record                  rec;
+    };
+
+    // 环形缓冲区，容量为 2 的幂
+    Cell                    *m_cells;
+    quint32                 m_nMask;
+    QAtomicInteger<quint32> m_nEnqueuePos;
+    // 只在后台线程访问
+    quint32                 m_nDequeuePos;
+    QAtomicInt              m_nDropped;
+
+    QThread                 *m_thread;
+    QAtomicInt              m_bStop;
+
+    // 以下只在后台线程访问
+    QFile                   *m_file;
+    QString                 m_strFile;
+    qint64                  m_nMaxBytes;
+    int                     m_nMaxFiles;
+    bool                    m_bConsole;
+
+    bool Pop(Record &rec);
+    void FlushLoop();
+    void Rotate();
+    QByteArray Format(const Record &rec) const;
+
+    friend class LogFlushThread;
+};
+
+/////////////////////////////////////////////////////////////////
+/// \brief The LogLine class
+/// 一条日志的格式化缓冲，析构时放入 Logger；只有级别开启时才会构造
+class LogLine
+{
+public:
+    LogLine(const int &module, const int &level, const char *file, const int &line);
+    ~LogLine();
+
+    QDebug &Stream() { return *m_debug; }
+
+private:
+    int         m_nModule;
+    int         m_nLevel;
+    const char  *m_file;
+    int         m_nLine;
+    QString     m_text;
+    QDebug      *m_debug;
+};
+
+// 用法：LOG_INFO(LogNet) << "connected" << id;
+#define LOG_AT(module, level) \
+    if (!Logger::IsEnabled(module, level)) {} else LogLine(module, level, __FILE__, __LINE__).Stream()
+
+#define LOG_DEBUG(module)   LOG_AT(module, LogDebug)
+#define LOG_INFO(module)    LOG_AT(module, LogInfo)
+#define LOG_WARN(module)    LOG_AT(module, LogWarn)
+#define LOG_ERROR(module)   LOG_AT(module, LogError)
+
+#endif // LOGGER_H
@@ -1,9 +1,10 @@
 #include "mainwindow.h"
 #include "myapp.h"
-#include "databasemagr.h"
+#include "serverbootstrap.h"
 
 #include <QApplication>
 #include <QFile>
+#include <QElapsedTimer>
 #include <QJsonArray>
 #include <QJsonObject>
 #include <QJsonDocument>
@@ -14,6 +15,9 @@
 
 int main(int argc, char *argv[])
 {
+    QElapsedTimer timer;
+    timer.start();
+
     QApplication a(argc, argv);
     MyApp::InitApp(a.applicationDirPath());
 
@@ -22,11 +26,19 @@ int main(int argc, char *argv[])
     a.setStyleSheet(qss.readAll());
     qss.close();
 
-    // 加载数据库
-    DataBaseMagr::Instance()->OpenDb(MyApp::m_strDatabasePath + "info.db");
+    // 服务与界面分开，界面只是可选的管理前端（无界面运行见 ChatServerd.pro）
+    ServerBootstrap server;
+    server.Start();
+
+    int nRet = 0;
+    {
+        MainWindow w(&server);
+        w.show();
+        ServerBootstrap::ReportStartup("gui", timer.elapsed());
 
-    MainWindow w;
-    w.show();
+        nRet = a.exec();
+    }
 
-    return a.exec();
+    server.Stop();
+    return nRet;
 }
@@ -0,0 +1,79 @@
+#include "serverbootstrap.h"
+#include "myapp.h"
+
+#include <QCoreApplication>
+#include <QElapsedTimer>
+#include <QDebug>
+
+#ifdef Q_OS_UNIX
+#include <QSocketNotifier>
+#include <signal.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <string.h>
+
+static int s_signalFd[2] = { -1, -1 };
+
+// 信号处理函数中只写管道，退出在事件循环中完成
+static void QuitSignalHandler(int)
+{
+    char ch = 1;
+    ssize_t ret = ::write(s_signalFd[0], &ch, sizeof(ch));
+    Q_UNUSED(ret);
+}
+
+/**
+ * @brief WatchQuitSignals
+ * SIGINT/SIGTERM 时正常退出事件循环，保证连接关闭和数据库写入完成
+ * @param app
+ */
+static void WatchQuitSignals(QCoreApplication *app)
+{
+    if (0 != ::socketpair(AF_UNIX, SOCK_STREAM, 0, s_signalFd)) return;
+
+    QSocketNotifier *notifier = new QSocketNotifier(s_signalFd[1], QSocketNotifier::Read, app);
+    QObject::connect(notifier, &QSocketNotifier::activated, app, [notifier](int) {
+        notifier->setEnabled(false);
+        char ch;
+        ssize_t ret = ::read(s_signalFd[1], &ch, sizeof(ch));
+        Q_UNUSED(ret);
+        QCoreApplication::quit();
+    });
+
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = QuitSignalHandler;
+    sigemptyset(&action.sa_mask);
+    action.sa_flags = SA_RESTART;
+    sigaction(SIGINT, &action, NULL);
+    sigaction(SIGTERM, &action, NULL);
+}
+#endif
+
+/**
+ * 无界面的服务进程，只加载 QtCore/QtNetwork/QtSql，端口等配置来自 config.ini
+ */
+int main(int argc, char *argv[])
+{
+    QElapsedTimer timer;
+    timer.start();
+
+    QCoreApplication a(argc, argv);
+    MyApp::InitApp(a.applicationDirPath());
+
+    ServerBootstrap server;
+    if (!server.Start()) {
+        qDebug() << "server start failed";
+        return 1;
+    }
+
+#ifdef Q_OS_UNIX
+    WatchQuitSignals(&a);
+#endif
+
+    ServerBootstrap::ReportStartup("daemon", timer.elapsed());
+
+    int nRet = a.exec();
+    server.Stop();
+    return nRet;
+}
@@ -1,11 +1,12 @@
 #include "mainwindow.h"
 #include "ui_mainwindow.h"
 #include "databasemagr.h"
+#include "dbworker.h"
 #include "myapp.h"
 #include "global.h"
 #include "unit.h"
 
-#include "tcpserver.h"
+#include "serverbootstrap.h"
 
 #include <QApplication>
 #include <QMenu>
@@ -22,9 +23,10 @@
 
 #include <QDebug>
 
-MainWindow::MainWindow(QWidget *parent) :
+MainWindow::MainWindow(ServerBootstrap *server, QWidget *parent) :
     CustomMoveWidget(parent),
-    ui(new Ui::MainWindow)
+    ui(new Ui::MainWindow),
+    m_server(server)
 {
     ui->setupUi(this);
 
@@ -127,14 +129,13 @@ void MainWindow::on_btnQuit_clicked()
 // 初始化网络
 void MainWindow::InitNetwork()
 {
-    tcpMsgServer = new TcpMsgServer(this);
-    bool bOk = tcpMsgServer->StartListen(60100);
     ui->textBrowser->setText(tr("服务器通知消息:"));
-    ui->textBrowser->append(bOk ? tr("消息服务器监听成功,端口: 60100") : tr("消息服务器监听失败"));
-
-    tcpFileServer = new TcpFileServer(this);
-    bOk = tcpFileServer->StartListen(60101);
-    ui->textBrowser->append(bOk ? tr("文件服务器监听成功,端口: 60101") : tr("文件服务器监听失败"));
+    ui->textBrowser->append(m_server->IsMsgListening()
+                            ? tr("消息服务器监听成功,端口: %1").arg(MyApp::m_nMsgPort)
+                            : tr("消息服务器监听失败"));
+    ui->textBrowser->append(m_server->IsFileListening()
+                            ? tr("文件服务器监听成功,端口: %1").arg(MyApp::m_nFilePort)
+                            : tr("文件服务器监听失败"));
 
     systemTrayIcon = new QSystemTrayIcon(this);
     systemTrayIcon->setIcon(QIcon(":/resource/images/ic_app.png"));
@@ -151,9 +152,7 @@ void MainWindow::InitNetwork()
     connect(systemTrayIcon, SIGNAL(activated(QSystemTrayIcon::ActivationReason)),this, SLOT(SltTrayIcoClicked(QSystemTrayIcon::ActivationReason)));
     connect(m_trayMenu, SIGNAL(triggered(QAction*)), this, SLOT(SltTrayIconMenuClicked(QAction*)));
 
-    connect(tcpMsgServer, SIGNAL(signalDownloadFile(QJsonValue)), tcpFileServer, SLOT(SltClientDownloadFile(QJsonValue)));
-    connect(tcpMsgServer, SIGNAL(signalUserStatus(QString)), this, SLOT(ShowUserStatus(QString)));
-    connect(tcpFileServer, SIGNAL(signalUserStatus(QString)), this, SLOT(ShowUserStatus(QString)));
+    connect(m_server, SIGNAL(signalUserStatus(QString)), this, SLOT(ShowUserStatus(QString)));
 }
 
 /**
@@ -232,8 +231,12 @@ void MainWindow::on_btnDataUdo_clicked()
             CMessageBox::Infomation(this, tr("提示"), tr("删除文件错误，还原终止！"));
         }
 
-        // 重新打开数据库
+        // 重新打开数据库，数据库线程的连接在下一个任务时重建
         DataBaseMagr::Instance()->OpenDb(MyApp::m_strDatabasePath + "info.db");
+        DbWorker::Instance()->Post(0, []() -> QVariant {
+            DataBaseMagr::Instance()->ReleaseDatabase();
+            return QVariant();
+        });
     }
 }
 
@@ -281,8 +284,8 @@ void MainWindow::SltTrayIcoClicked(QSystemTrayIcon::ActivationReason reason)
 void MainWindow::SltTrayIconMenuClicked(QAction *action)
 {
     if ("退出" == action->text()) {
-        tcpMsgServer->CloseListen();
-        tcpFileServer->CloseListen();
+        m_server->MsgServer()->CloseListen();
+        m_server->FileServer()->CloseListen();
         qApp->quit();
     }
     else if ("显示主面板" == action->text()) {
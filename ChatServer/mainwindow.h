@@ -8,8 +8,7 @@
 #include <QSystemTrayIcon>
 #include <QStandardItemModel>
 
-class TcpMsgServer;
-class TcpFileServer;
+class ServerBootstrap;
 
 namespace Ui {
 class MainWindow;
@@ -20,7 +19,7 @@ class MainWindow : public CustomMoveWidget
     Q_OBJECT
 
 public:
-    explicit MainWindow(QWidget *parent = 0);
+    explicit MainWindow(ServerBootstrap *server, QWidget *parent = 0);
     ~MainWindow();
 
 protected:
@@ -52,9 +51,8 @@ private:
     QButtonGroup *m_buttonGroup;
     QStandardItemModel *m_model;
 
-    // 服务配置
-    TcpMsgServer *tcpMsgServer;
-    TcpFileServer *tcpFileServer;
+    // 服务，由 main 创建和关闭
+    ServerBootstrap *m_server;
 
     // 系统菜单
     QSystemTrayIcon *systemTrayIcon;
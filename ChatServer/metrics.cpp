@@ -0,0 +1,235 @@
+#include "metrics.h"
+#include "logger.h"
+
+#include <QTcpServer>
+#include <QTcpSocket>
+#include <QHostAddress>
+
+// 请求头最大长度，超过直接断开
+#define METRIC_MAX_REQUEST  8192
+
+QAtomicInteger<qint64> Metrics::s_counters[MetCounterCount];
+QAtomicInteger<qint64> Metrics::s_gauges[MetGaugeCount];
+QAtomicInteger<qint64> Metrics::s_msgIn[256];
+QAtomicInteger<qint64> Metrics::s_msgOut[256];
+QAtomicInteger<qint64> Metrics::s_msgThrottled[256];
+Metrics::Histogram Metrics::s_histograms[MetHistogramCount];
+
+// 桶上界（微秒）
+static const qint64 s_bucketUs[METRIC_BUCKETS] = {
+    50, 100, 250, 500, 1000, 2500, 5000, 10000, 25000, 50000, 100000, 1000000, 2500000, 5000000
+};
+
+// 与 E_METRIC_COUNTER 顺序一致
+static const char *s_counterNames[MetCounterCount][2] = {
+    { "chat_connections_accepted_total",        "Message connections accepted" },
+    { "chat_connections_closed_total",          "Message connections closed" },
+    { "chat_bytes_received_total",              "Bytes received on message connections" },
+    { "chat_bytes_sent_total",                  "Bytes sent on message connections" },
+    { "chat_frames_sent_total",                 "Frames queued for sending" },
+    { "chat_frames_dropped_total",              "Frames dropped while congested" },
+    { "chat_messages_malformed_total",          "Messages dropped by decode or validation" },
+    { "chat_offline_queued_total",              "Messages stored in the offline queue" },
+    { "chat_file_connections_accepted_total",   "File connections accepted" },
+    { "chat_file_bytes_received_total",         "Bytes received by the file server" },
+    { "chat_file_bytes_sent_total",             "Bytes sent by the file server" },
+    { "chat_files_received_total",              "Files received" },
+    { "chat_files_sent_total",                  "Files sent" },
+    { "chat_file_sendfile_bytes_total",         "File bytes sent with sendfile" },
+    { "chat_file_resumed_bytes_total",          "File bytes skipped because the receiver already had them" },
+    { "chat_file_chunk_crc_errors_total",       "File chunks that failed the checksum and were resent" },
+    { "chat_file_dedup_skips_total",            "Uploads completed at once because the server already held the content" },
+    { "chat_file_dedup_bytes_total",            "Upload bytes skipped by content deduplication" },
+    { "chat_idle_reaped_total",                 "Connections closed after the idle timeout" },
+    { "chat_idle_probes_total",                 "Liveness pings sent by the server" },
+    { "chat_logins_rejected_total",             "Logins rejected by admission control" },
+    { "chat_read_turns_deferred_total",         "Read turns that hit the budget and were rescheduled" },
+};
+
+// 与 E_METRIC_GAUGE 顺序一致
+static const char *s_gaugeNames[MetGaugeCount][2] = {
+    { "chat_connections",                       "Open message connections" },
+    { "chat_file_connections",                  "Open file connections" },
+    { "chat_offline_queue_depth",               "Messages waiting in the offline queue" },
+};
+
+// 与 E_METRIC_HISTOGRAM 顺序一致
+static const char *s_histogramNames[MetHistogramCount][2] = {
+    { "chat_db_query_seconds",                  "SQL statement execution time" },
+    { "chat_db_task_seconds",                   "Database thread task time including queue wait" },
+    { "chat_msg_dwell_seconds",                 "Private message time from receive to recipient write" },
+    { "chat_msg_ack_dwell_seconds",             "Private message time from receive to ack" },
+    { "chat_msg_send_to_ack_seconds",           "Private message time from client ts to ack (clock skew applies)" },
+};
+
+/**
+ * @brief Metrics::Observe
+ * 只加对应的一个桶，输出时再累加
+ * @param histogram
+ * @param us
+ */
+void Metrics::Observe(const int &histogram, const qint64 &us)
+{
+    Histogram &hist = s_histograms[histogram];
+
+    int i = 0;
+    while (i < METRIC_BUCKETS && us > s_bucketUs[i]) i++;
+
+    hist.buckets[i].fetchAndAddRelaxed(1);
+    hist.sumUs.fetchAndAddRelaxed(us);
+    hist.count.fetchAndAddRelaxed(1);
+}
+
+void Metrics::AppendGauge(QByteArray &out, const char *name, const char *help, const qint64 &value)
+{
+    out.append("# HELP ").append(name).append(' ').append(help).append('\n');
+    out.append("# TYPE ").append(name).append(" gauge\n");
+    out.append(name).append(' ').append(QByteArray::number(value)).append('\n');
+}
+
+void Metrics::AppendUserGauge(QByteArray &out, const char *name, const char *help, const QList<QPair<int, qint64> > &values)
+{
+    out.append("# HELP ").append(name).append(' ').append(help).append('\n');
+    out.append("# TYPE ").append(name).append(" gauge\n");
+    for (int i = 0; i < values.size(); i++) {
+        out.append(name).append("{user=\"").append(QByteArray::number(values.at(i).first))
+                .append("\"} ").append(QByteArray::number(values.at(i).second)).append('\n');
+    }
+}
+
+/**
+ * @brief Metrics::Render
+ * Prometheus 文本格式（0.0.4），各值分别读取，不保证同一时刻的快照
+ * @return
+ */
+QByteArray Metrics::Render()
+{
+    QByteArray out;
+    out.reserve(8192);
+
+    for (int i = 0; i < MetCounterCount; i++) {
+        out.append("# HELP ").append(s_counterNames[i][0]).append(' ').append(s_counterNames[i][1]).append('\n');
+        out.append("# TYPE ").append(s_counterNames[i][0]).append(" counter\n");
+        out.append(s_counterNames[i][0]).append(' ').append(QByteArray::number(s_counters[i].load())).append('\n');
+    }
+
+    for (int i = 0; i < MetGaugeCount; i++) {
+        AppendGauge(out, s_gaugeNames[i][0], s_gaugeNames[i][1], s_gauges[i].load());
+    }
+
+    // 按消息类型，只输出出现过的类型
+    const char *msgNames[3][2] = {
+        { "chat_messages_received_total",  "Messages received by type" },
+        { "chat_messages_sent_total",      "Messages sent by type" },
+        { "chat_messages_throttled_total", "Requests rejected by rate limiting by type" },
+    };
+    QAtomicInteger<qint64> *msgCounts[3] = { s_msgIn, s_msgOut, s_msgThrottled };
+    for (int n = 0; n < 3; n++) {
+        out.append("# HELP ").append(msgNames[n][0]).append(' ').append(msgNames[n][1]).append('\n');
+        out.append("# TYPE ").append(msgNames[n][0]).append(" counter\n");
+        for (int type = 0; type < 256; type++) {
+            qint64 value = msgCounts[n][type].load();
+            if (0 == value) continue;
+            out.append(msgNames[n][0]).append("{type=\"").append(QByteArray::number(type))
+                    .append("\"} ").append(QByteArray::number(value)).append('\n');
+        }
+    }
+
+    for (int h = 0; h < MetHistogramCount; h++) {
+        const Histogram &hist = s_histograms[h];
+        const char *name = s_histogramNames[h][0];
+        out.append("# HELP ").append(name).append(' ').append(s_histogramNames[h][1]).append('\n');
+        out.append("# TYPE ").append(name).append(" histogram\n");
+
+        qint64 cumulative = 0;
+        for (int i = 0; i <= METRIC_BUCKETS; i++) {
+            cumulative += hist.buckets[i].load();
+            QByteArray le = (i < METRIC_BUCKETS) ? QByteArray::number(double(s_bucketUs[i]) / 1000000, 'g', 6) : "+Inf";
+            out.append(name).append("_bucket{le=\"").append(le).append("\"} ")
+                    .append(QByteArray::number(cumulative)).append('\n');
+        }
+        out.append(name).append("_sum ").append(QByteArray::number(double(hist.sumUs.load()) / 1000000, 'f', 6)).append('\n');
+        out.append(name).append("_count ").append(QByteArray::number(hist.count.load())).append('\n');
+    }
+
+    return out;
+}
+
+MetricsServer::MetricsServer(QObject *parent) :
+    QObject(parent)
+{
+    m_tcpServer = new QTcpServer(this);
+    connect(m_tcpServer, SIGNAL(newConnection()), this, SLOT(SltNewConnection()));
+}
+
+MetricsServer::~MetricsServer()
+{
+    m_tcpServer->close();
+}
+
+/**
+ * @brief MetricsServer::StartListen
+ * 只绑定回环地址，不对外暴露
+ * @param port
+ * @return
+ */
+bool MetricsServer::StartListen(const int &port)
+{
+    return m_tcpServer->listen(QHostAddress::LocalHost, port);
+}
+
+void MetricsServer::SetCollector(const MetricsCollector &collector)
+{
+    m_collector = collector;
+}
+
+void MetricsServer::SltNewConnection()
+{
+    while (m_tcpServer->hasPendingConnections()) {
+        QTcpSocket *tcpSocket = m_tcpServer->nextPendingConnection();
+        connect(tcpSocket, SIGNAL(readyRead()), this, SLOT(SltReadyRead()));
+        connect(tcpSocket, SIGNAL(disconnected()), tcpSocket, SLOT(deleteLater()));
+    }
+}
+
+/**
+ * @brief MetricsServer::SltReadyRead
+ * 读到完整请求头后回复并关闭连接（HTTP/1.0，不支持长连接）
+ */
+void MetricsServer::SltReadyRead()
+{
+    QTcpSocket *tcpSocket = qobject_cast<QTcpSocket *>(sender());
+    if (NULL == tcpSocket) return;
+
+    QByteArray request = tcpSocket->peek(METRIC_MAX_REQUEST);
+    if (!request.contains("\r\n\r\n") && !request.contains("\n\n")) {
+        if (request.size() >= METRIC_MAX_REQUEST) tcpSocket->abort();
+        return;
+    }
+    tcpSocket->readAll();
+
+    QList<QByteArray> line = request.left(request.indexOf('\n')).trimmed().split(' ');
+    QByteArray path = line.size() > 1 ? line.at(1) : QByteArray();
+    bool bGet = !line.isEmpty() && "GET" == line.at(0);
+
+    QByteArray status;
+    QByteArray body;
+    if (bGet && ("/metrics" == path || path.startsWith("/metrics?"))) {
+        status = "200 OK";
+        body = Metrics::Render();
+        if (m_collector) m_collector(body);
+    } else {
+        status = "404 Not Found";
+        body = "not found\n";
+    }
+
+    QByteArray reply;
+    reply.append("HTTP/1.0 ").append(status).append("\r\n");
+    reply.append("Content-Type: text/plain; version=0.0.4; charset=utf-8\r\n");
+    reply.append("Content-Length: ").append(QByteArray::number(body.size())).append("\r\n");
+    reply.append("Connection: close\r\n\r\n");
+    reply.append(body);
+
+    tcpSocket->write(reply);
+    tcpSocket->disconnectFromHost();
+}
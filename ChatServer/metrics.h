@@ -0,0 +1,151 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <QObject>
+#include <QAtomicInteger>
+#include <QByteArray>
+#include <QList>
+#include <QPair>
+
+#include <functional>
+
+class QTcpServer;
+
+// 计数器，只增不减
+typedef enum {
+    MetConnAccepted = 0,    // 消息连接建立
+    MetConnClosed,          // 消息连接断开
+    MetBytesIn,             // 消息连接收到的字节
+    MetBytesOut,            // 消息连接发出的字节
+    MetFramesOut,           // 写入发送队列的帧
+    MetFramesDropped,       // 拥塞时丢弃的帧
+    MetMalformed,           // 解码或校验失败的消息
+    MetOfflineQueued,       // 存入离线队列的消息
+    MetFileConnAccepted,    // 文件连接建立
+    MetFileBytesIn,         // 文件服务器收到的字节
+    MetFileBytesOut,        // 文件服务器发出的字节
+    MetFilesRecv,           // 接收完成的文件
+    MetFilesSent,           // 发送完成的文件
+    MetFileSendfileBytes,   // 其中经 sendfile 发送的字节
+    MetFileResumedBytes,    // 续传时接收方已有、不再重发的字节
+    MetFileChunkCrcErrors,  // 校验失败、要求重发的文件块
+    MetFileDedupSkips,      // 服务器已有相同内容、直接完成的上传
+    MetFileDedupBytes,      // 其中不必再上传的字节
+    MetIdleReaped,          // 超时无数据被关闭的连接
+    MetIdleProbes,          // 服务器发出的存活探测
+    MetLoginRejected,       // 登录准入拒绝（并发登录或全局登录速率超限）
+    MetReadDeferred,        // 读预算用完、剩余数据推迟到下一轮的次数
+    MetCounterCount,
+} E_METRIC_COUNTER;
+
+// 当前值
+typedef enum {
+    MetConnections = 0,     // 当前消息连接数
+    MetFileConnections,     // 当前文件连接数
+    MetOfflineDepth,        // 离线队列中的消息数
+    MetGaugeCount,
+} E_METRIC_GAUGE;
+
+// 耗时分布，单位微秒
+typedef enum {
+    MetDbQuery = 0,         // 单条 SQL 执行耗时
+    MetDbTask,              // 数据库线程单个任务耗时（含等待）
+    MetMsgDwell,            // 私聊消息从收到到写给接收者
+    MetMsgAckDwell,         // 私聊消息从收到到回复 Ack
+    MetMsgSendToAck,        // 客户端 ts 到回复 Ack（两端时钟，受时钟偏差影响）
+    MetHistogramCount,
+} E_METRIC_HISTOGRAM;
+
+// 直方图桶数（不含 +Inf）
+#define METRIC_BUCKETS      14
+
+/////////////////////////////////////////////////////////////////
+/// \brief The Metrics class
+/// 服务器指标：固定编号的计数器、当前值、直方图，以及按消息类型的收发计数。
+/// 更新只是一次 relaxed 原子加，任意线程都可以调用；
+/// Render 在抓取时读出全部值，生成 Prometheus 文本格式
+class Metrics
+{
+public:
+    static inline void Add(const int &counter, const qint64 &value = 1)
+    {
+        s_counters[counter].fetchAndAddRelaxed(value);
+    }
+
+    static inline void GaugeAdd(const int &gauge, const qint64 &value)
+    {
+        s_gauges[gauge].fetchAndAddRelaxed(value);
+    }
+
+    static inline void GaugeSet(const int &gauge, const qint64 &value)
+    {
+        s_gauges[gauge].store(value);
+    }
+
+    static inline void MsgIn(const quint8 &type)
+    {
+        s_msgIn[type].fetchAndAddRelaxed(1);
+    }
+
+    static inline void MsgOut(const quint8 &type)
+    {
+        s_msgOut[type].fetchAndAddRelaxed(1);
+    }
+
+    // 被限流拒绝的请求
+    static inline void MsgThrottled(const quint8 &type)
+    {
+        s_msgThrottled[type].fetchAndAddRelaxed(1);
+    }
+
+    // 记录一次耗时（微秒）
+    static void Observe(const int &histogram, const qint64 &us);
+
+    // 生成全部指标的文本
+    static QByteArray Render();
+    // 追加一项抓取时才计算的当前值
+    static void AppendGauge(QByteArray &out, const char *name, const char *help, const qint64 &value);
+    // 按用户的当前值，values 为 (用户id, 值)，带 user 标签
+    static void AppendUserGauge(QByteArray &out, const char *name, const char *help, const QList<QPair<int, qint64> > &values);
+
+private:
+    static QAtomicInteger<qint64> s_counters[MetCounterCount];
+    static QAtomicInteger<qint64> s_gauges[MetGaugeCount];
+    static QAtomicInteger<qint64> s_msgIn[256];
+    static QAtomicInteger<qint64> s_msgOut[256];
+    static QAtomicInteger<qint64> s_msgThrottled[256];
+
+    struct Histogram {
+        QAtomicInteger<qint64> buckets[METRIC_BUCKETS + 1];
+        QAtomicInteger<qint64> sumUs;
+        QAtomicInteger<qint64> count;
+    };
+    static Histogram s_histograms[MetHistogramCount];
+};
+
+// 抓取时补充的指标，如各模块的队列长度
+typedef std::function<void (QByteArray &)>  MetricsCollector;
+
+/////////////////////////////////////////////////////////////////
+/// \brief The MetricsServer class
+/// 只监听 127.0.0.1 的 HTTP 抓取端口，GET /metrics 返回指标文本，其他路径 404
+class MetricsServer : public QObject
+{
+    Q_OBJECT
+public:
+    explicit MetricsServer(QObject *parent = 0);
+    ~MetricsServer();
+
+    bool StartListen(const int &port);
+    void SetCollector(const MetricsCollector &collector);
+
+private:
+    QTcpServer          *m_tcpServer;
+    MetricsCollector    m_collector;
+
+private slots:
+    void SltNewConnection();
+    void SltReadyRead();
+};
+
+#endif // METRICS_H
@@ -0,0 +1,371 @@
+#include "msgcodec.h"
+
+#include <QJsonDocument>
+#include <QJsonArray>
+#include <QCborValue>
+#include <QCborStreamWriter>
+#include <QCborStreamReader>
+#include <QtEndian>
+#include <QtNumeric>
+#include <string.h>
+
+// CBOR 解码时允许的嵌套层数，超过视为非法负载
+#define CBOR_MAX_DEPTH      32
+
+/**
+ * @brief WriteCbor
+ * 按 QCborValue::fromJsonValue 的规则写出：整数值的 double 写成整数，其余原样
+ * @param writer
+ * @param value
+ */
+static void WriteCbor(QCborStreamWriter &writer, const QJsonValue &value)
+{
+    switch (value.type()) {
+    case QJsonValue::Bool:
+        writer.append(value.toBool());
+        break;
+    case QJsonValue::Double:
+    {
+        double dValue = value.toDouble();
+        // 2^53 以内的整数可以由 double 精确表示；先判断范围再转换，NaN、无穷大和超出 qint64 的值转换是未定义行为
+        if (qIsFinite(dValue) && qAbs(dValue) <= 9007199254740992.0 && double(qint64(dValue)) == dValue) {
+            writer.append(qint64(dValue));
+        } else {
+            writer.append(dValue);
+        }
+        break;
+    }
+    case QJsonValue::String:
+        writer.append(value.toString());
+        break;
+    case QJsonValue::Array:
+    {
+        const QJsonArray array = value.toArray();
+        writer.startArray(quint64(array.size()));
+        for (int i = 0; i < array.size(); i++) {
+            WriteCbor(writer, array.at(i));
+        }
+        writer.endArray();
+        break;
+    }
+    case QJsonValue::Object:
+    {
+        const QJsonObject obj = value.toObject();
+        writer.startMap(quint64(obj.size()));
+        for (QJsonObject::const_iterator it = obj.constBegin(); it != obj.constEnd(); ++it) {
+            writer.append(it.key());
+            WriteCbor(writer, it.value());
+        }
+        writer.endMap();
+        break;
+    }
+    default:
+        writer.append(nullptr);
+        break;
+    }
+}
+
+static bool ReadCborString(QCborStreamReader &reader, QString &str)
+{
+    str.clear();
+    QCborStreamReader::StringResult<QString> result = reader.readString();
+    while (QCborStreamReader::Ok == result.status) {
+        str += result.data;
+        result = reader.readString();
+    }
+
+    return (QCborStreamReader::EndOfString == result.status);
+}
+
+/**
+ * @brief ReadCbor
+ * 读出一个值直接构造 QJsonValue；字节串、标签等协议中不会出现的类型视为非法
+ * @param reader
+ * @param value
+ * @param depth
+ * @return
+ */
+static bool ReadCbor(QCborStreamReader &reader, QJsonValue &value, const int &depth)
+{
+    if (depth > CBOR_MAX_DEPTH) return false;
+
+    switch (reader.type()) {
+    case QCborStreamReader::UnsignedInteger:
+    case QCborStreamReader::NegativeInteger:
+        value = QJsonValue(reader.toInteger());
+        return reader.next();
+    case QCborStreamReader::Float16:
+        value = QJsonValue(double(float(reader.toFloat16())));
+        return reader.next();
+    case QCborStreamReader::Float:
+        value = QJsonValue(double(reader.toFloat()));
+        return reader.next();
+    case QCborStreamReader::Double:
+        value = QJsonValue(reader.toDouble());
+        return reader.next();
+    case QCborStreamReader::SimpleType:
+        switch (reader.toSimpleType()) {
+        case QCborSimpleType::False:
+            value = QJsonValue(false);
+            break;
+        case QCborSimpleType::True:
+            value = QJsonValue(true);
+            break;
+        default:
+            value = QJsonValue(QJsonValue::Null);
+            break;
+        }
+        return reader.next();
+    case QCborStreamReader::String:
+    {
+        QString str;
+        if (!ReadCborString(reader, str)) return false;
+        value = QJsonValue(str);
+        return true;
+    }
+    case QCborStreamReader::Array:
+    {
+        QJsonArray array;
+        if (!reader.enterContainer()) return false;
+        while (reader.hasNext()) {
+            QJsonValue item;
+            if (!ReadCbor(reader, item, depth + 1)) return false;
+            array.append(item);
+        }
+        if (QCborError::NoError != reader.lastError().c || !reader.leaveContainer()) return false;
+        value = QJsonValue(array);
+        return true;
+    }
+    case QCborStreamReader::Map:
+    {
+        QJsonObject obj;
+        if (!reader.enterContainer()) return false;
+        while (reader.hasNext()) {
+            QString key;
+            QJsonValue item;
+            if (QCborStreamReader::String != reader.type() || !ReadCborString(reader, key) ||
+                    !ReadCbor(reader, item, depth + 1)) return false;
+            obj.insert(key, item);
+        }
+        if (QCborError::NoError != reader.lastError().c || !reader.leaveContainer()) return false;
+        value = QJsonValue(obj);
+        return true;
+    }
+    default:
+        return false;
+    }
+}
+
+static bool ReadCbor(const QByteArray &data, QJsonValue &value)
+{
+    QCborStreamReader reader(data);
+    return ReadCbor(reader, value, 0) && (QCborError::NoError == reader.lastError().c);
+}
+
+/**
+ * @brief MsgCodec::Encode
+ * CBOR 编码时整数按整数类型写入，好友列表、群成员等数组比 JSON 文本小得多；
+ * 与 JSON 一样只遍历一次 data 直接写出字节
+ * @param type
+ * @param from
+ * @param data
+ * @param format
+ * @return
+ */
+QByteArray MsgCodec::Encode(const quint8 &type, const int &from, const QJsonValue &data, const E_FORMAT &format)
+{
+    if (Cbor == format) {
+        QByteArray payload;
+        QCborStreamWriter writer(&payload);
+        writer.startMap(3);
+        writer.append(QLatin1String("type"));
+        writer.append(qint64(type));
+        writer.append(QLatin1String("from"));
+        writer.append(qint64(from));
+        writer.append(QLatin1String("data"));
+        WriteCbor(writer, data);
+        writer.endMap();
+
+        return payload;
+    }
+
+    // 构建 Json 对象
+    QJsonObject json;
+    json.insert("type", type);
+    json.insert("from", from);
+    json.insert("data", data);
+
+    // 构建 Json 文档
+    QJsonDocument document;
+    document.setObject(json);
+
+    return document.toJson(QJsonDocument::Compact);
+}
+
+/**
+ * @brief MsgCodec::Encode
+ * @param type
+ * @param from
+ * @param data 协议结构的 EncodeCbor()
+ * @return
+ */
+QByteArray MsgCodec::Encode(const quint8 &type, const int &from, const QCborMap &data)
+{
+    QByteArray payload;
+    QCborStreamWriter writer(&payload);
+    writer.startMap(3);
+    writer.append(QLatin1String("type"));
+    writer.append(qint64(type));
+    writer.append(QLatin1String("from"));
+    writer.append(qint64(from));
+    writer.append(QLatin1String("data"));
+    data.toCborValue().toCbor(writer);
+    writer.endMap();
+
+    return payload;
+}
+
+/**
+ * @brief MsgCodec::Decode
+ * @param payload
+ * @param envelope
+ * @return
+ */
+bool MsgCodec::Decode(const QByteArray &payload, QJsonObject &envelope)
+{
+    if (payload.isEmpty()) return false;
+
+    if (Cbor == Detect(payload)) {
+        QJsonValue value;
+        if (!ReadCbor(payload, value) || !value.isObject()) return false;
+
+        envelope = value.toObject();
+        return true;
+    }
+
+    QJsonParseError jsonError;
+    // 转化为 JSON 文档
+    QJsonDocument doucment = QJsonDocument::fromJson(payload, &jsonError);
+    // 解析未发生错误，且 JSON 文档为对象
+    if (doucment.isNull() || (jsonError.error != QJsonParseError::NoError) || !doucment.isObject()) return false;
+
+    envelope = doucment.object();
+    return true;
+}
+
+/**
+ * @brief MsgCodec::Decode
+ * 只用于 CBOR 负载
+ * @param payload
+ * @param envelope
+ * @return
+ */
+bool MsgCodec::Decode(const QByteArray &payload, QCborMap &envelope)
+{
+    if (Cbor != Detect(payload)) return false;
+
+    QCborParserError cborError;
+    QCborValue value = QCborValue::fromCbor(payload, &cborError);
+    if (QCborError::NoError != cborError.error || !value.isMap()) return false;
+
+    envelope = value.toMap();
+    return true;
+}
+
+MsgCodec::E_FORMAT MsgCodec::Detect(const QByteArray &payload)
+{
+    return (!payload.isEmpty() && '{' == payload.at(0)) ? Json : Cbor;
+}
+
+/**
+ * @brief MsgCodec::EncodeData
+ * @param data
+ * @param format
+ * @return
+ */
+QByteArray MsgCodec::EncodeData(const QJsonValue &data, const E_FORMAT &format)
+{
+    if (Cbor == format) {
+        QByteArray body;
+        QCborStreamWriter writer(&body);
+        WriteCbor(writer, data);
+        return body;
+    }
+
+    // 转发的消息体都是对象
+    return QJsonDocument(data.toObject()).toJson(QJsonDocument::Compact);
+}
+
+/**
+ * @brief MsgCodec::DecodeData
+ * @param body
+ * @param data
+ * @return
+ */
+bool MsgCodec::DecodeData(const QByteArray &body, QJsonValue &data)
+{
+    if (body.isEmpty()) return false;
+
+    if (Cbor == Detect(body)) return ReadCbor(body, data);
+
+    QJsonParseError jsonError;
+    QJsonDocument doucment = QJsonDocument::fromJson(body, &jsonError);
+    if (doucment.isNull() || (jsonError.error != QJsonParseError::NoError) || !doucment.isObject()) return false;
+
+    data = doucment.object();
+    return true;
+}
+
+bool MsgCodec::IsRelay(const QByteArray &payload)
+{
+    return (payload.size() >= RELAY_HEADER_SIZE && RELAY_MARKER == quint8(payload.at(0)));
+}
+
+/**
+ * @brief MsgCodec::PackRelay
+ * @param type
+ * @param peer
+ * @param msgId
+ * @param body
+ * @return
+ */
+QByteArray MsgCodec::PackRelay(const quint8 &type, const int &peer, const int &msgId, const QByteArray &body)
+{
+    QByteArray payload(RELAY_HEADER_SIZE + body.size(), Qt::Uninitialized);
+    uchar *data = reinterpret_cast<uchar *>(payload.data());
+    data[0] = RELAY_MARKER;
+    data[1] = type;
+    qToBigEndian<qint32>(peer, data + 2);
+    qToBigEndian<qint32>(msgId, data + 6);
+    if (!body.isEmpty()) memcpy(data + RELAY_HEADER_SIZE, body.constData(), body.size());
+
+    return payload;
+}
+
+/**
+ * @brief MsgCodec::ParseRelay
+ * 只解析固定头，消息体为 payload.mid(RELAY_HEADER_SIZE)
+ * @param payload
+ * @param type
+ * @param peer
+ * @param msgId
+ * @return
+ */
+bool MsgCodec::ParseRelay(const QByteArray &payload, quint8 &type, int &peer, int &msgId)
+{
+    if (!IsRelay(payload)) return false;
+
+    const uchar *data = reinterpret_cast<const uchar *>(payload.constData());
+    type  = data[1];
+    peer  = qFromBigEndian<qint32>(data + 2);
+    msgId = qFromBigEndian<qint32>(data + 6);
+
+    return true;
+}
+
+void MsgCodec::SetRelayPeer(QByteArray &data, const int &peer, const int &offset)
+{
+    if (data.size() < offset + RELAY_HEADER_SIZE) return;
+
+    qToBigEndian<qint32>(peer, reinterpret_cast<uchar *>(data.data()) + offset + 2);
+}
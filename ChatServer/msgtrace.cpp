@@ -0,0 +1,92 @@
+#include "msgtrace.h"
+#include "metrics.h"
+#include "logger.h"
+
+#include <QElapsedTimer>
+#include <QDateTime>
+
+#include <string.h>
+
+// 同时追踪的消息数，必须是 2 的幂；被覆盖的旧记录不再计入
+#define TRACE_SLOTS     4096
+
+QMutex MsgTrace::s_mutex;
+MsgTrace::Record MsgTrace::s_records[TRACE_SLOTS];
+
+/**
+ * @brief MsgTrace::NowNs
+ * 进程内单调时钟，第一次调用时开始计时
+ * @return
+ */
+qint64 MsgTrace::NowNs()
+{
+    struct Clock {
+        QElapsedTimer timer;
+        Clock() { timer.start(); }
+    };
+
+    static const Clock clock;
+    return clock.timer.nsecsElapsed();
+}
+
+/**
+ * @brief MsgTrace::Slot
+ * 消息对应的槽位，调用方持有 s_mutex
+ */
+MsgTrace::Record &MsgTrace::Slot(const int &from, const int &msgId)
+{
+    quint32 hash = (quint32(from) * 2654435761u) ^ quint32(msgId);
+    return s_records[hash & (TRACE_SLOTS - 1)];
+}
+
+void MsgTrace::Begin(const int &from, const int &msgId, const qint64 &recvNs, const qint64 &clientTs)
+{
+    if (0 == msgId) return;
+
+    QMutexLocker locker(&s_mutex);
+    Record &record = Slot(from, msgId);
+    memset(record.points, 0, sizeof(record.points));
+    record.from = from;
+    record.msgId = msgId;
+    record.clientTs = clientTs;
+    record.points[TraceRecv] = recvNs;
+}
+
+/**
+ * @brief MsgTrace::Mark
+ * 写给接收者时记录停留时间；回复 Ack 时记录收到到 Ack、客户端 ts 到 Ack 的时间
+ * @param from
+ * @param msgId
+ * @param point
+ */
+void MsgTrace::Mark(const int &from, const int &msgId, const int &point)
+{
+    if (0 == msgId) return;
+
+    qint64 nowNs = NowNs();
+    qint64 recvNs = 0;
+    qint64 clientTs = 0;
+    {
+        QMutexLocker locker(&s_mutex);
+        Record &record = Slot(from, msgId);
+        // 槽位已被其他消息覆盖，或该点已经记录过
+        if (record.from != from || record.msgId != msgId || 0 != record.points[point]) return;
+
+        record.points[point] = nowNs;
+        recvNs = record.points[TraceRecv];
+        clientTs = record.clientTs;
+    }
+
+    qint64 nDwellUs = (nowNs - recvNs) / 1000;
+    if (TraceWritten == point) {
+        Metrics::Observe(MetMsgDwell, nDwellUs);
+        LOG_DEBUG(LogMsg) << "trace" << from << msgId << "written" << nDwellUs << "us";
+    } else if (TraceAcked == point) {
+        Metrics::Observe(MetMsgAckDwell, nDwellUs);
+        if (clientTs > 0) {
+            qint64 nSendToAckMs = QDateTime::currentMSecsSinceEpoch() - clientTs;
+            Metrics::Observe(MetMsgSendToAck, qMax(Q_INT64_C(0), nSendToAckMs) * 1000);
+        }
+        LOG_DEBUG(LogMsg) << "trace" << from << msgId << "acked" << nDwellUs << "us";
+    }
+}
@@ -0,0 +1,46 @@
+#ifndef MSGTRACE_H
+#define MSGTRACE_H
+
+#include <QtGlobal>
+#include <QMutex>
+
+// 私聊消息在服务器内经过的打点位置
+typedef enum {
+    TraceRecv = 0,      // 从 socket 读出
+    TraceRouted,        // 判断完接收者在线状态，转发或入离线队列
+    TraceWritten,       // 放入接收者的发送队列
+    TraceAcked,         // 给发送者回复 Ack
+    TracePointCount,
+} E_TRACE_POINT;
+
+/////////////////////////////////////////////////////////////////
+/// \brief The MsgTrace class
+/// 按 (发送者, msgId) 记录私聊消息在服务器内各打点的时间。
+/// 记录放在固定大小的表里按哈希覆盖，不随消息量增长；
+/// 写给接收者和回复 Ack 时计算停留时间，进入 Metrics 的直方图
+class MsgTrace
+{
+public:
+    // 单调时钟，纳秒
+    static qint64 NowNs();
+
+    // 收到消息，clientTs 为客户端填写的 ts（毫秒，可以为 0）
+    static void Begin(const int &from, const int &msgId, const qint64 &recvNs, const qint64 &clientTs);
+    // 其他打点
+    static void Mark(const int &from, const int &msgId, const int &point);
+
+private:
+    struct Record {
+        int     from;
+        int     msgId;
+        qint64  clientTs;
+        qint64  points[TracePointCount];
+    };
+
+    static QMutex   s_mutex;
+    static Record   s_records[];
+
+    static Record &Slot(const int &from, const int &msgId);
+};
+
+#endif // MSGTRACE_H
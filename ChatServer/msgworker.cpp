@@ -0,0 +1,153 @@
+#include "msgworker.h"
+#include "clientsocket.h"
+#include "tcpserver.h"
+#include "databasemagr.h"
+#include "logger.h"
+#include "myapp.h"
+#include "timingwheel.h"
+#include "readscheduler.h"
+
+#include <QDebug>
+#include <QTcpSocket>
+
+MsgWorker::MsgWorker(TcpMsgServer *server) :
+    QObject(0),
+    m_server(server),
+    m_idleWheel(NULL),
+    m_readScheduler(NULL)
+{
+}
+
+MsgWorker::~MsgWorker()
+{
+}
+
+/**
+ * @brief MsgWorker::Post
+ */
+void MsgWorker::Post(ClientSocket *client, const int &userId, const quint8 &type, const QJsonValue &json)
+{
+    MailItem item;
+    item.client = client;
+    item.userId = userId;
+    item.type   = type;
+    item.json   = json;
+
+    Enqueue(item);
+}
+
+void MsgWorker::PostFrame(ClientSocket *client, const int &userId, const QByteArray &frame, const QByteArray &cborFrame)
+{
+    MailItem item;
+    item.client     = client;
+    item.userId     = userId;
+    item.type       = 0;
+    item.frame      = frame;
+    item.cborFrame  = cborFrame;
+
+    Enqueue(item);
+}
+
+/**
+ * @brief MsgWorker::Enqueue
+ * 信箱由空变为非空时才唤醒一次目标线程，一次唤醒处理全部积压消息
+ */
+void MsgWorker::Enqueue(const MailItem &item)
+{
+    bool bWakeup = false;
+    {
+        QMutexLocker locker(&m_mutex);
+        bWakeup = m_mailbox.isEmpty();
+        m_mailbox.append(item);
+    }
+
+    if (bWakeup) QMetaObject::invokeMethod(this, "SltDrainMailbox", Qt::QueuedConnection);
+}
+
+/**
+ * @brief MsgWorker::SltAddDescriptor
+ * @param handle
+ */
+void MsgWorker::SltAddDescriptor(qintptr handle)
+{
+    QTcpSocket *tcpSocket = new QTcpSocket();
+    if (!tcpSocket->setSocketDescriptor(handle)) {
+        LOG_ERROR(LogNet) << "set socket descriptor failed" << tcpSocket->errorString();
+        delete tcpSocket;
+        return;
+    }
+
+    ClientSocket *client = new ClientSocket(this, tcpSocket);
+    tcpSocket->setParent(client);
+    m_clients.insert(client);
+
+    m_server->AttachClient(client);
+    connect(client, SIGNAL(signalDisConnected()), this, SLOT(SltClientDisConnected()));
+
+    if (MyApp::m_nIdleTimeoutSec > 0) {
+        if (NULL == m_idleWheel) m_idleWheel = new TimingWheel(1000, this);
+        client->WatchIdle(m_idleWheel);
+    }
+
+    if (MyApp::m_nReadBudget > 0) {
+        if (NULL == m_readScheduler) m_readScheduler = new ReadScheduler(MyApp::m_nReadBudget, this);
+        client->SetReadScheduler(m_readScheduler);
+    }
+}
+
+/**
+ * @brief MsgWorker::SltCloseAll
+ */
+void MsgWorker::SltCloseAll()
+{
+    QSet<ClientSocket *> clients = m_clients;
+    m_clients.clear();
+    foreach (ClientSocket *client, clients) {
+        client->Close();
+        delete client;
+    }
+
+    delete m_idleWheel;
+    m_idleWheel = NULL;
+    delete m_readScheduler;
+    m_readScheduler = NULL;
+
+    DataBaseMagr::Instance()->ReleaseDatabase();
+}
+
+/**
+ * @brief MsgWorker::SltDrainMailbox
+ * 取出信箱中的全部消息，连接仍在本线程且用户没变才发送
+ */
+void MsgWorker::SltDrainMailbox()
+{
+    QVector<MailItem> items;
+    {
+        QMutexLocker locker(&m_mutex);
+        items.swap(m_mailbox);
+    }
+
+    for (int i = 0; i < items.size(); i++) {
+        const MailItem &item = items.at(i);
+        if (!m_clients.contains(item.client)) continue;
+        if (item.client->GetUserId() != item.userId) continue;
+
+        if (!item.frame.isEmpty()) {
+            item.client->SendPacked(item.frame, item.cborFrame);
+        } else {
+            item.client->SltSendMessage(item.type, item.json);
+        }
+    }
+}
+
+/**
+ * @brief MsgWorker::SltClientDisConnected
+ * 连接断开，释放对象
+ */
+void MsgWorker::SltClientDisConnected()
+{
+    ClientSocket *client = qobject_cast<ClientSocket *>(this->sender());
+    if (NULL == client) return;
+
+    if (m_clients.remove(client)) client->deleteLater();
+}
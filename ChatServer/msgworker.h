@@ -0,0 +1,68 @@
+#ifndef MSGWORKER_H
+#define MSGWORKER_H
+
+#include <QObject>
+#include <QMutex>
+#include <QSet>
+#include <QVector>
+#include <QJsonValue>
+#include <QByteArray>
+
+class ClientSocket;
+class TcpMsgServer;
+class TimingWheel;
+class ReadScheduler;
+
+/////////////////////////////////////////////////////////////////
+/// \brief The MsgWorker class
+/// 消息服务器 I/O 工作线程，运行在独立的 QThread 事件循环中，
+/// 负责本线程内连接的读写；其他线程发来的消息通过信箱投递
+class MsgWorker : public QObject
+{
+    Q_OBJECT
+public:
+    explicit MsgWorker(TcpMsgServer *server);
+    ~MsgWorker();
+
+    // 线程安全：投递一条消息到本线程的某个连接
+    void Post(ClientSocket *client, const int &userId, const quint8 &type, const QJsonValue &json);
+    // 线程安全：投递一个已编码的帧（JSON/CBOR 两种编码，按连接选择）
+    void PostFrame(ClientSocket *client, const int &userId, const QByteArray &frame, const QByteArray &cborFrame);
+
+public slots:
+    // 在本线程中接管一个 socket 描述符
+    void SltAddDescriptor(qintptr handle);
+    // 关闭本线程的所有连接
+    void SltCloseAll();
+
+private slots:
+    void SltDrainMailbox();
+    void SltClientDisConnected();
+
+private:
+    struct MailItem {
+        ClientSocket *client;
+        int           userId;
+        quint8        type;
+        QJsonValue    json;
+        // 非空时直接发送该帧，忽略 type/json
+        QByteArray    frame;
+        QByteArray    cborFrame;
+    };
+
+    void Enqueue(const MailItem &item);
+
+    TcpMsgServer           *m_server;
+    // 本线程管理的连接，只在本线程访问
+    QSet < ClientSocket * > m_clients;
+    // 本线程连接的空闲检测，在本线程中创建
+    TimingWheel            *m_idleWheel;
+    // 本线程连接的读调度
+    ReadScheduler          *m_readScheduler;
+
+    // 信箱
+    QMutex                  m_mutex;
+    QVector < MailItem >    m_mailbox;
+};
+
+#endif // MSGWORKER_H
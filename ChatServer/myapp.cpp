@@ -1,7 +1,5 @@
 #include "myapp.h"
 
-#include <QApplication>
-#include <QDesktopWidget>
 #include <QSettings>
 #include <QFile>
 #include <QDir>
@@ -19,6 +17,8 @@ QString MyApp::m_strConfPath        = "";
 QString MyApp::m_strBackupPath      = "";
 QString MyApp::m_strRecvPath        = "";
 QString MyApp::m_strHeadPath        = "";
+QString MyApp::m_strBlobPath        = "";
+QString MyApp::m_strLogPath         = "";
 
 // 配置文件
 QString MyApp::m_strIniFile         = "config.ini";
@@ -29,6 +29,38 @@ QString MyApp::m_strPassword        = "123456";
 int     MyApp::m_nId                = -1;
 int     MyApp::m_nIdentyfi          = -1;
 
+int     MyApp::m_nMaxFrameSize      = 8 * 1024 * 1024;
+int     MyApp::m_nWorkerThreads     = 0;
+bool    MyApp::m_bPersistLastSeen   = true;
+int     MyApp::m_nLastSeenFlushMs   = 5000;
+int     MyApp::m_nOfflineBatchSize  = 200;
+int     MyApp::m_nOutboundHighWater = 4 * 1024 * 1024;
+int     MyApp::m_nOutboundLowWater  = 1024 * 1024;
+int     MyApp::m_nMsgPort           = 60100;
+int     MyApp::m_nFilePort          = 60101;
+int     MyApp::m_nMetricsPort       = 60102;
+int     MyApp::m_nIdleTimeoutSec    = 90;
+int     MyApp::m_nFileIdleTimeoutSec= 1800;
+int     MyApp::m_nReadBudget        = 64 * 1024;
+int     MyApp::m_nReadBufferSize    = 256 * 1024;
+bool    MyApp::m_bFileSendfile      = true;
+int     MyApp::m_nFilePartKeepDays  = 7;
+bool    MyApp::m_bFileRelay         = true;
+bool    MyApp::m_bFileDedup         = true;
+
+// 日志
+QString MyApp::m_strLogLevel        = "info";
+QString MyApp::m_strLogModules      = "";
+int     MyApp::m_nLogMaxFileKB      = 10240;
+int     MyApp::m_nLogMaxFiles       = 5;
+bool    MyApp::m_bLogConsole        = true;
+
+// 限流
+bool    MyApp::m_bRateLimit         = true;
+QString MyApp::m_strRateBuckets     = "";
+int     MyApp::m_nMaxPendingLogins  = 64;
+int     MyApp::m_nLoginsPerSec      = 100;
+
 // 初始化
 void MyApp::InitApp(const QString &appPath)
 {
@@ -39,6 +71,8 @@ void MyApp::InitApp(const QString &appPath)
     m_strBackupPath     = m_strDataPath + "Backup/";
     m_strRecvPath       = m_strDataPath + "RecvFiles/";
     m_strHeadPath       = m_strDataPath + "UserHeads/";
+    m_strBlobPath       = m_strRecvPath + "Blobs/";
+    m_strLogPath        = m_strDataPath + "Log/";
     m_strIniFile        = m_strConfPath + "config.ini";
 
     // 检查目录
@@ -66,6 +100,45 @@ void MyApp::CreatorSettingFile() {
         settings.setValue("User",   m_strUserName);
         settings.setValue("Passwd", m_strPassword);
         settings.endGroup();
+
+        /*服务配置*/
+        settings.beginGroup("Server");
+        settings.setValue("MaxFrameSize", m_nMaxFrameSize);
+        settings.setValue("WorkerThreads", m_nWorkerThreads);
+        settings.setValue("PersistLastSeen", m_bPersistLastSeen);
+        settings.setValue("LastSeenFlushMs", m_nLastSeenFlushMs);
+        settings.setValue("OfflineBatchSize", m_nOfflineBatchSize);
+        settings.setValue("OutboundHighWater", m_nOutboundHighWater);
+        settings.setValue("OutboundLowWater", m_nOutboundLowWater);
+        settings.setValue("MsgPort", m_nMsgPort);
+        settings.setValue("FilePort", m_nFilePort);
+        settings.setValue("MetricsPort", m_nMetricsPort);
+        settings.setValue("IdleTimeoutSec", m_nIdleTimeoutSec);
+        settings.setValue("FileIdleTimeoutSec", m_nFileIdleTimeoutSec);
+        settings.setValue("ReadBudget", m_nReadBudget);
+        settings.setValue("ReadBufferSize", m_nReadBufferSize);
+        settings.setValue("FileSendfile", m_bFileSendfile);
+        settings.setValue("FilePartKeepDays", m_nFilePartKeepDays);
+        settings.setValue("FileRelay", m_bFileRelay);
+        settings.setValue("FileDedup", m_bFileDedup);
+        settings.endGroup();
+
+        /*日志配置*/
+        settings.beginGroup("Log");
+        settings.setValue("Level", m_strLogLevel);
+        settings.setValue("Modules", m_strLogModules);
+        settings.setValue("MaxFileKB", m_nLogMaxFileKB);
+        settings.setValue("MaxFiles", m_nLogMaxFiles);
+        settings.setValue("Console", m_bLogConsole);
+        settings.endGroup();
+
+        /*限流配置*/
+        settings.beginGroup("RateLimit");
+        settings.setValue("Enabled", m_bRateLimit);
+        settings.setValue("Buckets", m_strRateBuckets);
+        settings.setValue("MaxPendingLogins", m_nMaxPendingLogins);
+        settings.setValue("LoginsPerSec", m_nLoginsPerSec);
+        settings.endGroup();
         settings.sync();
 
     }
@@ -85,6 +158,43 @@ void MyApp::ReadSettingFile()
     m_strUserName = settings.value("User", "milo").toString();
     m_strPassword = settings.value("Passwd", "123456")  .toString();
     settings.endGroup();
+
+    settings.beginGroup("Server");
+    m_nMaxFrameSize = settings.value("MaxFrameSize", 8 * 1024 * 1024).toInt();
+    m_nWorkerThreads = settings.value("WorkerThreads", 0).toInt();
+    m_bPersistLastSeen = settings.value("PersistLastSeen", true).toBool();
+    m_nLastSeenFlushMs = settings.value("LastSeenFlushMs", 5000).toInt();
+    m_nOfflineBatchSize = qMax(1, settings.value("OfflineBatchSize", 200).toInt());
+    m_nOutboundHighWater = qMax(64 * 1024, settings.value("OutboundHighWater", 4 * 1024 * 1024).toInt());
+    m_nOutboundLowWater = qBound(0, settings.value("OutboundLowWater", 1024 * 1024).toInt(), m_nOutboundHighWater);
+    m_nMsgPort = settings.value("MsgPort", 60100).toInt();
+    m_nFilePort = settings.value("FilePort", 60101).toInt();
+    m_nMetricsPort = settings.value("MetricsPort", 60102).toInt();
+    m_nIdleTimeoutSec = qMax(0, settings.value("IdleTimeoutSec", 90).toInt());
+    m_nFileIdleTimeoutSec = qMax(0, settings.value("FileIdleTimeoutSec", 1800).toInt());
+    m_nReadBudget = qMax(0, settings.value("ReadBudget", 64 * 1024).toInt());
+    m_nReadBufferSize = qMax(0, settings.value("ReadBufferSize", 256 * 1024).toInt());
+    m_bFileSendfile = settings.value("FileSendfile", true).toBool();
+    m_nFilePartKeepDays = qMax(0, settings.value("FilePartKeepDays", 7).toInt());
+    m_bFileRelay = settings.value("FileRelay", true).toBool();
+    m_bFileDedup = settings.value("FileDedup", true).toBool();
+    settings.endGroup();
+
+    settings.beginGroup("Log");
+    m_strLogLevel = settings.value("Level", "info").toString();
+    // 未加引号时 INI 中的逗号会被拆成列表，这里拼回原样
+    m_strLogModules = settings.value("Modules", "").toStringList().join(',');
+    m_nLogMaxFileKB = qMax(0, settings.value("MaxFileKB", 10240).toInt());
+    m_nLogMaxFiles = qMax(1, settings.value("MaxFiles", 5).toInt());
+    m_bLogConsole = settings.value("Console", true).toBool();
+    settings.endGroup();
+
+    settings.beginGroup("RateLimit");
+    m_bRateLimit = settings.value("Enabled", true).toBool();
+    m_strRateBuckets = settings.value("Buckets", "").toStringList().join(',');
+    m_nMaxPendingLogins = qMax(0, settings.value("MaxPendingLogins", 64).toInt());
+    m_nLoginsPerSec = qMax(0, settings.value("LoginsPerSec", 100).toInt());
+    settings.endGroup();
 }
 
 /**
@@ -161,6 +271,24 @@ void MyApp::CheckDirs()
         dir.mkdir(m_strHeadPath);
 #ifdef Q_WS_QWS
         QProcess::execute("sync");
+#endif
+    }
+
+    // 文件内容存储目录，按摘要前两位分子目录，用到时再创建
+    dir.setPath(m_strBlobPath);
+    if (!dir.exists()) {
+        dir.mkdir(m_strBlobPath);
+#ifdef Q_WS_QWS
+        QProcess::execute("sync");
+#endif
+    }
+
+    // 日志目录
+    dir.setPath(m_strLogPath);
+    if (!dir.exists()) {
+        dir.mkdir(m_strLogPath);
+#ifdef Q_WS_QWS
+        QProcess::execute("sync");
 #endif
     }
 }
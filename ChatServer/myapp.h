@@ -22,6 +22,8 @@ public:
     static QString m_strBackupPath;      // 配置目录
     static QString m_strRecvPath;        // 文件接收保存目录
     static QString m_strHeadPath;        // 用户头像保存(可存放数据库)
+    static QString m_strBlobPath;        // 按内容摘要存放的接收文件
+    static QString m_strLogPath;         // 日志目录
 
     static QString m_strIniFile;         // 配置文件
 
@@ -31,6 +33,36 @@ public:
     static int     m_nId;
     static int     m_nIdentyfi;
 
+    static int     m_nMaxFrameSize;     // 单帧消息最大长度
+    static int     m_nWorkerThreads;    // 消息服务器 I/O 工作线程数，0 表示单线程
+    static bool    m_bPersistLastSeen;  // 是否把最后在线时间写回数据库
+    static int     m_nLastSeenFlushMs;  // 最后在线时间批量写入周期
+    static int     m_nOfflineBatchSize; // 离线消息每页条数
+    static int     m_nOutboundHighWater;// 单连接待发送数据高水位（字节）
+    static int     m_nOutboundLowWater; // 单连接待发送数据低水位（字节）
+    static int     m_nMsgPort;          // 消息服务器端口
+    static int     m_nFilePort;         // 文件服务器端口
+    static int     m_nMetricsPort;      // 指标抓取端口，只监听本机，0 表示关闭
+    static int     m_nIdleTimeoutSec;   // 消息连接无数据超时（秒），0 表示不检测
+    static int     m_nFileIdleTimeoutSec;// 文件连接无数据超时（秒），0 表示不检测
+    static int     m_nReadBudget;       // 每个连接每轮最多读取的字节数，0 表示每次读完
+    static int     m_nReadBufferSize;   // 单个 socket 读缓冲上限（字节），0 表示不限
+    static bool    m_bFileSendfile;     // 文件下载正文用 sendfile（仅 Linux）
+    static int     m_nFilePartKeepDays; // 未完成的续传文件保留天数，0 表示不清理
+    static bool    m_bFileRelay;        // 文件还在上传时即可开始下载（边传边下）
+    static bool    m_bFileDedup;        // 接收的文件按内容摘要存放，相同内容只存一份、不再上传
+
+    static QString m_strLogLevel;       // 默认日志级别 debug/info/warn/error/off
+    static QString m_strLogModules;     // 按模块覆盖级别，如 net=debug,db=warn
+    static int     m_nLogMaxFileKB;     // 单个日志文件上限，超过后滚动
+    static int     m_nLogMaxFiles;      // 保留的历史日志文件数
+    static bool    m_bLogConsole;       // 同时输出到控制台
+
+    static bool    m_bRateLimit;        // 是否按连接限流
+    static QString m_strRateBuckets;    // 各类请求的速率/容量，如 chat=20/40,query=5/20
+    static int     m_nMaxPendingLogins; // 同时进行中的登录上限，0 表示不限
+    static int     m_nLoginsPerSec;     // 全局登录速率，0 表示不限
+
     //=======================函数功能部分=========================//
     // 初始化
     static void InitApp(const QString &appPath);
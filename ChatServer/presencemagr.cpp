@@ -0,0 +1,105 @@
+#include "presencemagr.h"
+#include "dbworker.h"
+#include "unit.h"
+
+#include <QDateTime>
+#include <QDebug>
+
+PresenceMagr *PresenceMagr::self = NULL;
+
+PresenceMagr::PresenceMagr(QObject *parent) :
+    QObject(parent),
+    m_bPersist(false)
+{
+}
+
+/**
+ * @brief PresenceMagr::SetOnline
+ * 检查与占用在同一把锁内完成，避免同一账号在两个线程中同时登录
+ * @param id
+ * @return
+ */
+bool PresenceMagr::SetOnline(const int &id)
+{
+    if (id <= 0) return false;
+
+    qint64 ts = QDateTime::currentMSecsSinceEpoch();
+    {
+        QWriteLocker locker(&m_lock);
+        if (m_online.contains(id)) return false;
+        m_online.insert(id, ts);
+    }
+
+    MarkDirty(id, ts);
+    return true;
+}
+
+/**
+ * @brief PresenceMagr::SetOffline
+ * @param id
+ * @return
+ */
+bool PresenceMagr::SetOffline(const int &id)
+{
+    if (id <= 0) return false;
+
+    {
+        QWriteLocker locker(&m_lock);
+        if (0 == m_online.remove(id)) return false;
+    }
+
+    MarkDirty(id, QDateTime::currentMSecsSinceEpoch());
+    return true;
+}
+
+bool PresenceMagr::IsOnline(const int &id) const
+{
+    QReadLocker locker(&m_lock);
+    return m_online.contains(id);
+}
+
+int PresenceMagr::GetStatus(const int &id) const
+{
+    return IsOnline(id) ? OnLine : OffLine;
+}
+
+QList<int> PresenceMagr::GetOnlineUsers() const
+{
+    QReadLocker locker(&m_lock);
+    return m_online.keys();
+}
+
+int PresenceMagr::GetOnlineCount() const
+{
+    QReadLocker locker(&m_lock);
+    return m_online.size();
+}
+
+/**
+ * @brief PresenceMagr::StartPersist
+ * 需要在 DbWorker::Start 之后调用
+ * @param interval
+ */
+void PresenceMagr::StartPersist(const int &interval)
+{
+    m_bPersist = true;
+    DbWorker::Instance()->StartWriteBehind(interval);
+}
+
+/**
+ * @brief PresenceMagr::Flush
+ * 同一用户多次上下线只保留最后一次时间，一个事务写入
+ */
+void PresenceMagr::Flush()
+{
+    if (!m_bPersist) return;
+
+    DbWorker::Instance()->FlushWriteBehind();
+}
+
+void PresenceMagr::MarkDirty(const int &id, const qint64 &ts)
+{
+    if (!m_bPersist) return;
+
+    DbWorker::Instance()->DeferLastSeen(id, ts);
+}
@@ -0,0 +1,64 @@
+#ifndef PRESENCEMAGR_H
+#define PRESENCEMAGR_H
+
+#include <QObject>
+#include <QHash>
+#include <QList>
+#include <QMutex>
+#include <QReadWriteLock>
+
+/////////////////////////////////////////////////////////////////
+/// \brief The PresenceMagr class
+/// 在线状态表，内存中维护，服务启动时为空。
+/// 在线判断不再查询数据库；最后在线时间可选地交给 DbWorker 合并写回 USERINFO.lasttime
+class PresenceMagr : public QObject
+{
+    Q_OBJECT
+public:
+    // 单实例
+    static PresenceMagr *Instance()
+    {
+        static QMutex mutex;
+        if (NULL == self) {
+            QMutexLocker locker(&mutex);
+
+            if (!self) {
+                self = new PresenceMagr();
+            }
+        }
+
+        return self;
+    }
+
+    // 登录占用在线状态，已经在线返回 false
+    bool SetOnline(const int &id);
+    // 下线，返回之前是否在线
+    bool SetOffline(const int &id);
+
+    bool IsOnline(const int &id) const;
+    // 返回 OnLine / OffLine
+    int GetStatus(const int &id) const;
+
+    QList<int> GetOnlineUsers() const;
+    int GetOnlineCount() const;
+
+    // 启动最后在线时间批量写入，interval 为写入周期（毫秒）
+    void StartPersist(const int &interval);
+    // 尽快写入
+    void Flush();
+
+private:
+    explicit PresenceMagr(QObject *parent = 0);
+
+    static PresenceMagr *self;
+
+    // 在线用户 -> 上线时间
+    mutable QReadWriteLock  m_lock;
+    QHash < int, qint64 >   m_online;
+
+    bool                    m_bPersist;
+
+    void MarkDirty(const int &id, const qint64 &ts);
+};
+
+#endif // PRESENCEMAGR_H
@@ -0,0 +1,387 @@
+#ifndef PROTOCOL_H
+#define PROTOCOL_H
+
+#include <QString>
+#include <QVector>
+#include <QJsonValue>
+#include <QJsonObject>
+#include <QJsonArray>
+#include <QCborValue>
+#include <QCborMap>
+#include <QCborArray>
+#include <QLatin1String>
+
+#include "unit.h"
+
+/////////////////////////////////////////////////////////////////
+/// 协议消息结构：每种 E_MSG_TYPE 的 data 对应一个结构体。
+/// 字段表用宏描述，Decode/Encode 由宏生成：
+///  - Decode 一次校验全部字段，必填字段缺失或类型不符即拒绝整条消息；
+///  - 字段按 QLatin1String 在 QJsonObject 的有序键中二分查找，不构造临时 QString 键；
+///  - CBOR 帧的 data 直接从 QCborValue 解码、编码为 QCborMap，不经过 JSON 中转。
+/// 客户端与服务器各持一份相同的副本（同 framecodec/msgcodec）
+
+// 字段读取，类型不符返回 false
+inline bool ProtoRead(const QJsonValue &val, int &out)
+{
+    if (!val.isDouble()) return false;
+    out = val.toInt();
+    return true;
+}
+
+inline bool ProtoRead(const QJsonValue &val, qint64 &out)
+{
+    if (!val.isDouble()) return false;
+    out = qint64(val.toDouble());
+    return true;
+}
+
+inline bool ProtoRead(const QJsonValue &val, bool &out)
+{
+    if (!val.isBool()) return false;
+    out = val.toBool();
+    return true;
+}
+
+inline bool ProtoRead(const QJsonValue &val, QString &out)
+{
+    if (!val.isString()) return false;
+    out = val.toString();
+    return true;
+}
+
+inline bool ProtoRead(const QJsonValue &val, QJsonArray &out)
+{
+    if (!val.isArray()) return false;
+    out = val.toArray();
+    return true;
+}
+
+inline QJsonValue ProtoValue(const int &val)           { return QJsonValue(val); }
+inline QJsonValue ProtoValue(const qint64 &val)        { return QJsonValue(val); }
+inline QJsonValue ProtoValue(const bool &val)          { return QJsonValue(val); }
+inline QJsonValue ProtoValue(const QString &val)       { return QJsonValue(val); }
+inline QJsonValue ProtoValue(const QJsonArray &val)    { return QJsonValue(val); }
+
+// CBOR 字段读取，整数也接受 double（JSON 客户端转 CBOR 时可能出现）
+inline bool ProtoRead(const QCborValue &val, int &out)
+{
+    if (val.isInteger()) {
+        out = int(val.toInteger());
+    } else if (val.isDouble()) {
+        out = int(val.toDouble());
+    } else {
+        return false;
+    }
+    return true;
+}
+
+inline bool ProtoRead(const QCborValue &val, qint64 &out)
+{
+    if (val.isInteger()) {
+        out = val.toInteger();
+    } else if (val.isDouble()) {
+        out = qint64(val.toDouble());
+    } else {
+        return false;
+    }
+    return true;
+}
+
+inline bool ProtoRead(const QCborValue &val, bool &out)
+{
+    if (!val.isBool()) return false;
+    out = val.toBool();
+    return true;
+}
+
+inline bool ProtoRead(const QCborValue &val, QString &out)
+{
+    if (!val.isString()) return false;
+    out = val.toString();
+    return true;
+}
+
+inline bool ProtoRead(const QCborValue &val, QJsonArray &out)
+{
+    if (!val.isArray()) return false;
+    out = val.toArray().toJsonArray();
+    return true;
+}
+
+inline QCborValue ProtoCbor(const int &val)            { return QCborValue(qint64(val)); }
+inline QCborValue ProtoCbor(const qint64 &val)         { return QCborValue(val); }
+inline QCborValue ProtoCbor(const bool &val)           { return QCborValue(val); }
+inline QCborValue ProtoCbor(const QString &val)        { return QCborValue(val); }
+inline QCborValue ProtoCbor(const QJsonArray &val)     { return QCborArray::fromJsonArray(val); }
+
+// 字段表的展开方式：F(类型, 字段名, 是否必填)
+#define PROTO_FIELD_DECL(type, name, required)  type name = type();
+#define PROTO_FIELD_READ(type, name, required) \
+    { \
+        QJsonObject::const_iterator it = obj.constFind(QLatin1String(#name)); \
+        if (it == obj.constEnd()) { \
+            if (required) return false; \
+        } else if (!ProtoRead(it.value(), name)) { \
+            return false; \
+        } \
+    }
+#define PROTO_FIELD_WRITE(type, name, required)  obj.insert(QLatin1String(#name), ProtoValue(name));
+#define PROTO_FIELD_READ_CBOR(type, name, required) \
+    { \
+        QCborMap::const_iterator it = map.constFind(QLatin1String(#name)); \
+        if (it == map.constEnd()) { \
+            if (required) return false; \
+        } else if (!ProtoRead(it.value(), name)) { \
+            return false; \
+        } \
+    }
+#define PROTO_FIELD_WRITE_CBOR(type, name, required)  map.insert(QLatin1String(#name), ProtoCbor(name));
+
+// 生成结构体：字段、Decode（data 必须是对象/映射）、Encode、EncodeCbor
+#define PROTO_STRUCT(Name, FIELDS) \
+    struct Name { \
+        FIELDS(PROTO_FIELD_DECL) \
+        bool Decode(const QJsonValue &dataVal) { \
+            if (!dataVal.isObject()) return false; \
+            const QJsonObject obj = dataVal.toObject(); \
+            FIELDS(PROTO_FIELD_READ) \
+            return true; \
+        } \
+        bool Decode(const QCborValue &dataVal) { \
+            if (!dataVal.isMap()) return false; \
+            const QCborMap map = dataVal.toMap(); \
+            FIELDS(PROTO_FIELD_READ_CBOR) \
+            return true; \
+        } \
+        QJsonObject Encode() const { \
+            QJsonObject obj; \
+            FIELDS(PROTO_FIELD_WRITE) \
+            return obj; \
+        } \
+        QCborMap EncodeCbor() const { \
+            QCborMap map; \
+            FIELDS(PROTO_FIELD_WRITE_CBOR) \
+            return map; \
+        } \
+    };
+
+// Register/Login 请求与应答
+#define PROTO_REGISTER_MSG(F) \
+    F(QString,      name,       true) \
+    F(QString,      passwd,     true)
+PROTO_STRUCT(RegisterMsg, PROTO_REGISTER_MSG)
+
+#define PROTO_REGISTER_REPLY(F) \
+    F(int,          id,         true) \
+    F(QString,      name,       false)
+PROTO_STRUCT(RegisterReply, PROTO_REGISTER_REPLY)
+
+#define PROTO_LOGIN_MSG(F) \
+    F(QString,      name,       true) \
+    F(QString,      passwd,     true) \
+    F(int,          version,    false) \
+    F(QJsonArray,   caps,       false)
+PROTO_STRUCT(LoginMsg, PROTO_LOGIN_MSG)
+
+#define PROTO_LOGIN_REPLY(F) \
+    F(int,          id,         true) \
+    F(int,          code,       true) \
+    F(QString,      msg,        false) \
+    F(QString,      head,       false) \
+    F(int,          version,    false) \
+    F(QJsonArray,   caps,       false)
+PROTO_STRUCT(LoginReply, PROTO_LOGIN_REPLY)
+
+// Logout：本人 id 与需要通知的好友，字段都可省略，保证注销总能执行
+#define PROTO_LOGOUT_MSG(F) \
+    F(int,          id,         false) \
+    F(QJsonArray,   friends,    false)
+PROTO_STRUCT(LogoutMsg, PROTO_LOGOUT_MSG)
+
+// UserOnLine/UserOffLine 通知
+#define PROTO_PRESENCE_MSG(F) \
+    F(int,          id,         true) \
+    F(QString,      text,       false)
+PROTO_STRUCT(PresenceMsg, PROTO_PRESENCE_MSG)
+
+// UpdateHeadPic
+#define PROTO_UPDATE_HEAD_MSG(F) \
+    F(int,          id,         true) \
+    F(QString,      head,       true) \
+    F(QJsonArray,   friends,    false)
+PROTO_STRUCT(UpdateHeadMsg, PROTO_UPDATE_HEAD_MSG)
+
+// AddFriend/AddGroup/CreateGroup：按名称操作
+#define PROTO_NAME_MSG(F) \
+    F(int,          id,         false) \
+    F(QString,      name,       true)
+PROTO_STRUCT(NameMsg, PROTO_NAME_MSG)
+
+// GetMyGroups/RefreshGroups：群组 id
+#define PROTO_ID_MSG(F) \
+    F(int,          id,         true)
+PROTO_STRUCT(IdMsgFields, PROTO_ID_MSG)
+
+// 群组 id 必须为正，否则与其他字段校验失败一样拒绝整条消息
+struct IdMsg : public IdMsgFields {
+    bool Decode(const QJsonValue &dataVal) {
+        return IdMsgFields::Decode(dataVal) && id > 0;
+    }
+    bool Decode(const QCborValue &dataVal) {
+        return IdMsgFields::Decode(dataVal) && id > 0;
+    }
+};
+
+// SendMsg/SendGroupMsg/SendFile/SendPicture/SendFace 的 data
+#define PROTO_CHAT_MSG(F) \
+    F(int,          id,         false) \
+    F(int,          to,         true) \
+    F(int,          type,       false) \
+    F(int,          msgId,      false) \
+    F(qint64,       ts,         false) \
+    F(QString,      msg,        false)
+PROTO_STRUCT(ChatMsgFields, PROTO_CHAT_MSG)
+
+// 聊天消息转发时需要保留未列出的字段（如文件大小），解码时同时保存原对象
+struct ChatMsg : public ChatMsgFields {
+    QJsonObject raw;
+
+    bool Decode(const QJsonValue &dataVal) {
+        if (!ChatMsgFields::Decode(dataVal)) return false;
+        raw = dataVal.toObject();
+        return true;
+    }
+    // 转发与离线存储仍使用 JSON 对象，只在这里转换一次
+    bool Decode(const QCborValue &dataVal) {
+        if (!ChatMsgFields::Decode(dataVal)) return false;
+        raw = dataVal.toMap().toJsonObject();
+        return true;
+    }
+};
+
+// GetFile
+#define PROTO_GET_FILE_MSG(F) \
+    F(int,          from,       true) \
+    F(int,          id,         true) \
+    F(QString,      msg,        true)
+PROTO_STRUCT(GetFileMsg, PROTO_GET_FILE_MSG)
+
+// Ack
+#define PROTO_ACK_MSG(F) \
+    F(int,          to,         true) \
+    F(int,          type,       true) \
+    F(int,          queued,     true) \
+    F(QString,      msg,        false) \
+    F(int,          msgId,      true)
+PROTO_STRUCT(AckMsg, PROTO_ACK_MSG)
+
+// Ping/Pong
+#define PROTO_PING_MSG(F) \
+    F(int,          id,         false) \
+    F(qint64,       ts,         false)
+PROTO_STRUCT(PingMsg, PROTO_PING_MSG)
+
+// OfflineMsgBatch/OfflineMsgAck
+#define PROTO_OFFLINE_BATCH_MSG(F) \
+    F(QJsonArray,   msgs,       true) \
+    F(int,          cursor,     true) \
+    F(bool,         more,       false)
+PROTO_STRUCT(OfflineBatchMsg, PROTO_OFFLINE_BATCH_MSG)
+
+#define PROTO_OFFLINE_ACK_MSG(F) \
+    F(int,          cursor,     true)
+PROTO_STRUCT(OfflineAckMsg, PROTO_OFFLINE_ACK_MSG)
+
+// Throttled：被拒绝的请求类型，私聊消息带接收者和 msgId；retry 为建议等待的毫秒数
+#define PROTO_THROTTLE_MSG(F) \
+    F(int,          type,       true) \
+    F(int,          to,         false) \
+    F(int,          msgId,      false) \
+    F(int,          retry,      true)
+PROTO_STRUCT(ThrottleMsgFields, PROTO_THROTTLE_MSG)
+
+// 好友/群组列表等查询被拒绝时带回原请求的 data，客户端等待 retry 后原样重发
+struct ThrottleMsg : public ThrottleMsgFields {
+    QJsonValue data = QJsonValue(QJsonValue::Undefined);
+
+    bool Decode(const QJsonValue &dataVal) {
+        if (!ThrottleMsgFields::Decode(dataVal)) return false;
+        data = dataVal.toObject().value(QLatin1String("data"));
+        return true;
+    }
+    bool Decode(const QCborValue &dataVal) {
+        if (!ThrottleMsgFields::Decode(dataVal)) return false;
+        QCborValue dataCbor = dataVal.toMap().value(QLatin1String("data"));
+        if (!dataCbor.isUndefined()) data = dataCbor.toJsonValue();
+        return true;
+    }
+    QJsonObject Encode() const {
+        QJsonObject obj = ThrottleMsgFields::Encode();
+        if (!data.isUndefined()) obj.insert(QLatin1String("data"), data);
+        return obj;
+    }
+    QCborMap EncodeCbor() const {
+        QCborMap map = ThrottleMsgFields::EncodeCbor();
+        if (!data.isUndefined()) map.insert(QLatin1String("data"), QCborValue::fromJsonValue(data));
+        return map;
+    }
+};
+
+/////////////////////////////////////////////////////////////////
+/// \brief The IdListMsg struct
+/// UserOnLine/GetMyFriends/RefreshFriends 请求的 data 是用户 id 数组
+struct IdListMsg {
+    QVector<int> ids;
+
+    bool Decode(const QJsonValue &dataVal) {
+        if (!dataVal.isArray()) return false;
+        const QJsonArray array = dataVal.toArray();
+        ids.reserve(array.size());
+        for (int i = 0; i < array.size(); i++) {
+            const QJsonValue val = array.at(i);
+            if (!val.isDouble()) return false;
+            ids.append(val.toInt());
+        }
+        return true;
+    }
+
+    bool Decode(const QCborValue &dataVal) {
+        if (!dataVal.isArray()) return false;
+        const QCborArray array = dataVal.toArray();
+        ids.reserve(int(array.size()));
+        for (qsizetype i = 0; i < array.size(); i++) {
+            int nId = 0;
+            if (!ProtoRead(array.at(i), nId)) return false;
+            ids.append(nId);
+        }
+        return true;
+    }
+
+    QJsonArray Encode() const {
+        QJsonArray array;
+        for (int i = 0; i < ids.size(); i++) array.append(ids.at(i));
+        return array;
+    }
+};
+
+/////////////////////////////////////////////////////////////////
+/// \brief The RawMsg struct
+/// 不关心结构、原样转交给界面的消息，只要求 data 存在
+struct RawMsg {
+    QJsonValue data;
+
+    bool Decode(const QJsonValue &dataVal) {
+        if (dataVal.isUndefined()) return false;
+        data = dataVal;
+        return true;
+    }
+    // 交给界面/转发的仍是 JSON
+    bool Decode(const QCborValue &dataVal) {
+        if (dataVal.isUndefined()) return false;
+        data = dataVal.toJsonValue();
+        return true;
+    }
+};
+
+#endif // PROTOCOL_H
@@ -0,0 +1,199 @@
+#include "ratelimit.h"
+#include "timingwheel.h"
+#include "unit.h"
+
+#include <QStringList>
+
+#include <math.h>
+
+// 与 E_RATE_CLASS 顺序一致，配置中的类别名
+static const char *s_classNames[RateClassCount] = { "chat", "group", "query", "account", "login" };
+
+bool                RateLimiter::s_bEnabled = true;
+// 默认值：速率（个/秒）、容量
+RateLimiter::Rule   RateLimiter::s_rules[RateClassCount] = {
+    { 20,   40 },
+    { 5,    10 },
+    { 5,    20 },
+    { 1,    5 },
+    { 1,    3 },
+};
+
+QAtomicInt          RateLimiter::s_pendingLogins(0);
+int                 RateLimiter::s_nMaxPendingLogins = 64;
+QMutex              RateLimiter::s_loginMutex;
+RateLimiter::Rule   RateLimiter::s_loginRule = { 100, 100 };
+RateLimiter::Bucket RateLimiter::s_loginBucket = { 100, 0, false };
+
+/**
+ * @brief RateLimiter::RateLimiter
+ * 新连接的桶都是满的
+ */
+RateLimiter::RateLimiter()
+{
+    qint64 nowMs = TimingWheel::NowMs();
+    for (int i = 0; i < RateClassCount; i++) {
+        m_buckets[i].tokens = s_rules[i].burst;
+        m_buckets[i].lastMs = nowMs;
+        m_buckets[i].bNotified = false;
+    }
+}
+
+/**
+ * @brief RateLimiter::Configure
+ * 在服务启动前调用；无法识别的项忽略，速率为 0 表示该类别不限流
+ * @param bEnabled
+ * @param strBuckets
+ */
+void RateLimiter::Configure(const bool &bEnabled, const QString &strBuckets)
+{
+    s_bEnabled = bEnabled;
+
+#if (QT_VERSION >= QT_VERSION_CHECK(5,14,0))
+    QStringList items = strBuckets.split(',', Qt::SkipEmptyParts);
+#else
+    QStringList items = strBuckets.split(',', QString::SkipEmptyParts);
+#endif
+    foreach (QString item, items) {
+        QStringList pair = item.split('=');
+        if (2 != pair.size()) continue;
+
+        QStringList values = pair.at(1).split('/');
+        bool bOk = false;
+        double perSec = values.at(0).trimmed().toDouble(&bOk);
+        if (!bOk || perSec < 0) continue;
+        double burst = (values.size() > 1) ? values.at(1).trimmed().toDouble() : 0;
+
+        QString strClass = pair.at(0).trimmed();
+        for (int i = 0; i < RateClassCount; i++) {
+            if (0 == strClass.compare(QLatin1String(s_classNames[i]), Qt::CaseInsensitive)) {
+                s_rules[i].perSec = perSec;
+                s_rules[i].burst = qMax(1.0, burst > 0 ? burst : perSec);
+                break;
+            }
+        }
+    }
+}
+
+/**
+ * @brief RateLimiter::ClassOf
+ * 客户端发给服务器的消息类型对应的类别
+ * @param type
+ * @return
+ */
+int RateLimiter::ClassOf(const quint8 &type)
+{
+    switch (type) {
+    case SendMsg:
+    case SendFile:
+    case SendPicture:
+    case SendFace:
+        return RateChat;
+    case SendGroupMsg:
+        return RateGroup;
+    case GetMyFriends:
+    case GetMyGroups:
+    case RefreshFriends:
+    case RefreshGroups:
+    case UserOnLine:
+    case GetFile:
+        return RateQuery;
+    case AddFriend:
+    case AddGroup:
+    case CreateGroup:
+    case UpdateHeadPic:
+        return RateAccount;
+    case Register:
+    case Login:
+        return RateLogin;
+    default:
+        return RateNone;
+    }
+}
+
+/**
+ * @brief RateLimiter::Take
+ * 令牌按经过的时间连续补充，不超过容量
+ */
+bool RateLimiter::Take(Bucket &bucket, const Rule &rule, const qint64 &nowMs, int &retryMs)
+{
+    if (rule.perSec <= 0) return true;
+
+    bucket.tokens = qMin(rule.burst, bucket.tokens + double(nowMs - bucket.lastMs) * rule.perSec / 1000);
+    bucket.lastMs = nowMs;
+
+    if (bucket.tokens >= 1) {
+        bucket.tokens -= 1;
+        return true;
+    }
+
+    retryMs = int(ceil((1 - bucket.tokens) * 1000 / rule.perSec));
+    return false;
+}
+
+/**
+ * @brief RateLimiter::Acquire
+ * 连续被拒绝时只有第一次返回 RateThrottled，放行一次后重新计
+ * @param type
+ * @param retryMs
+ * @return
+ */
+int RateLimiter::Acquire(const quint8 &type, int &retryMs)
+{
+    int nClass = ClassOf(type);
+    if (!s_bEnabled || RateNone == nClass) return RatePass;
+
+    Bucket &bucket = m_buckets[nClass];
+    if (Take(bucket, s_rules[nClass], TimingWheel::NowMs(), retryMs)) {
+        bucket.bNotified = false;
+        return RatePass;
+    }
+
+    if (bucket.bNotified) return RateDropped;
+    bucket.bNotified = true;
+    return RateThrottled;
+}
+
+void RateLimiter::ConfigureLogin(const int &maxPending, const int &perSec)
+{
+    QMutexLocker locker(&s_loginMutex);
+    s_nMaxPendingLogins = maxPending;
+    s_loginRule.perSec = perSec;
+    s_loginRule.burst = qMax(1, perSec);
+    s_loginBucket.tokens = s_loginRule.burst;
+    s_loginBucket.lastMs = TimingWheel::NowMs();
+}
+
+/**
+ * @brief RateLimiter::AdmitLogin
+ * 重连风暴时大量登录同时到达，超过上限的直接回复繁忙，不进入数据库队列。
+ * 放行后必须调用一次 FinishLogin
+ * @param retryMs
+ * @return
+ */
+bool RateLimiter::AdmitLogin(int &retryMs)
+{
+    int nPending = s_pendingLogins.fetchAndAddOrdered(1);
+    if (!s_bEnabled) return true;
+
+    bool bPass = (s_nMaxPendingLogins <= 0 || nPending < s_nMaxPendingLogins);
+    if (bPass) {
+        QMutexLocker locker(&s_loginMutex);
+        bPass = Take(s_loginBucket, s_loginRule, TimingWheel::NowMs(), retryMs);
+    } else {
+        retryMs = 1000;
+    }
+
+    if (!bPass) s_pendingLogins.deref();
+    return bPass;
+}
+
+void RateLimiter::FinishLogin()
+{
+    s_pendingLogins.deref();
+}
+
+int RateLimiter::PendingLogins()
+{
+    return s_pendingLogins.load();
+}
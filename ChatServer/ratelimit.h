@@ -0,0 +1,77 @@
+#ifndef RATELIMIT_H
+#define RATELIMIT_H
+
+#include <QString>
+#include <QMutex>
+#include <QAtomicInt>
+
+// 限流的请求类别，每类一个令牌桶
+typedef enum {
+    RateChat = 0,       // 私聊、表情、文件/图片消息
+    RateGroup,          // 群聊，按成员扇出
+    RateQuery,          // 好友/群组列表、上线通知、下载文件，每次都访问数据库或文件
+    RateAccount,        // 加好友、加群、建群、改头像等写数据库的请求
+    RateLogin,          // 登录、注册
+    RateClassCount,
+    RateNone = RateClassCount,  // 不限流（心跳、Ack、离线确认等）
+} E_RATE_CLASS;
+
+// 取令牌的结果
+typedef enum {
+    RatePass = 0,       // 放行
+    RateThrottled,      // 拒绝，本轮第一次，需要回复客户端
+    RateDropped,        // 拒绝，已经回复过，静默丢弃
+} E_RATE_RESULT;
+
+/////////////////////////////////////////////////////////////////
+/// \brief The RateLimiter class
+/// 连接级令牌桶：每个连接每个请求类别一个桶，按配置速率补充，容量即突发上限。
+/// 同一用户同时只有一个连接（PresenceMagr 保证），所以登录后即按用户限流。
+/// 只在连接所在线程使用，不加锁；配置和登录准入是全局的，可在任意线程调用
+class RateLimiter
+{
+public:
+    RateLimiter();
+
+    // 按 "类别=速率/容量" 覆盖默认值，如 chat=20/40,query=2/10；速率可以是小数
+    static void Configure(const bool &bEnabled, const QString &strBuckets);
+    static int ClassOf(const quint8 &type);
+
+    // 消息分发前调用，retryMs 为补足一个令牌需要等待的时间
+    int Acquire(const quint8 &type, int &retryMs);
+
+    // 登录准入：同时进行中的登录数与全局登录速率，两者都满足才放行
+    static void ConfigureLogin(const int &maxPending, const int &perSec);
+    static bool AdmitLogin(int &retryMs);
+    // 登录校验结束（成功、失败或连接中途断开）时调用一次
+    static void FinishLogin();
+    static int PendingLogins();
+
+private:
+    struct Bucket {
+        double  tokens;
+        qint64  lastMs;
+        bool    bNotified;
+    };
+
+    struct Rule {
+        double  perSec;
+        double  burst;
+    };
+
+    Bucket  m_buckets[RateClassCount];
+
+    static bool         s_bEnabled;
+    static Rule         s_rules[RateClassCount];
+
+    static QAtomicInt   s_pendingLogins;
+    static int          s_nMaxPendingLogins;
+    static QMutex       s_loginMutex;
+    static Rule         s_loginRule;
+    static Bucket       s_loginBucket;
+
+    // 按经过的时间补充后取一个令牌
+    static bool Take(Bucket &bucket, const Rule &rule, const qint64 &nowMs, int &retryMs);
+};
+
+#endif // RATELIMIT_H
@@ -0,0 +1,52 @@
+#include "readscheduler.h"
+#include "clientsocket.h"
+
+ReadScheduler::ReadScheduler(const int &budgetBytes, QObject *parent) :
+    QObject(parent),
+    m_nBudgetBytes(budgetBytes),
+    m_bTurnPending(false)
+{
+}
+
+int ReadScheduler::BudgetBytes() const
+{
+    return m_nBudgetBytes;
+}
+
+int ReadScheduler::BudgetFrames() const
+{
+    return READ_TURN_FRAMES;
+}
+
+/**
+ * @brief ReadScheduler::Schedule
+ * 队列由空变为非空时投递一次 SltRunTurn
+ * @param client
+ */
+void ReadScheduler::Schedule(ClientSocket *client)
+{
+    m_ready.append(QPointer<ClientSocket>(client));
+
+    if (!m_bTurnPending) {
+        m_bTurnPending = true;
+        QMetaObject::invokeMethod(this, "SltRunTurn", Qt::QueuedConnection);
+    }
+}
+
+/**
+ * @brief ReadScheduler::SltRunTurn
+ * 只处理本轮开始时已在队列中的连接，仍有剩余的重新排到队尾，下一轮再处理
+ */
+void ReadScheduler::SltRunTurn()
+{
+    m_bTurnPending = false;
+
+    int nCount = m_ready.size();
+    for (int i = 0; i < nCount && !m_ready.isEmpty(); i++) {
+        QPointer<ClientSocket> client = m_ready.takeFirst();
+        if (client.isNull()) continue;
+
+        // 预算用完时会再调用 Schedule 排到队尾
+        client->ReadTurn();
+    }
+}
@@ -0,0 +1,41 @@
+#ifndef READSCHEDULER_H
+#define READSCHEDULER_H
+
+#include <QObject>
+#include <QList>
+#include <QPointer>
+
+class ClientSocket;
+
+// 每个连接每轮最多处理的帧数
+#define READ_TURN_FRAMES    64
+
+/////////////////////////////////////////////////////////////////
+/// \brief The ReadScheduler class
+/// 读调度：readyRead 中每个连接只处理一轮预算（字节数、帧数），
+/// 没处理完的连接排入就绪队列，之后每次事件循环依次给每个连接一轮，
+/// 两轮之间其他 socket 的读写、定时器照常执行，大流量的连接不会独占线程。
+/// 每个 I/O 线程一个，只在所在线程使用
+class ReadScheduler : public QObject
+{
+    Q_OBJECT
+public:
+    explicit ReadScheduler(const int &budgetBytes, QObject *parent = 0);
+
+    int BudgetBytes() const;
+    int BudgetFrames() const;
+
+    // 连接还有未处理的数据，排到队尾
+    void Schedule(ClientSocket *client);
+
+private:
+    int     m_nBudgetBytes;
+    // 连接可能在排队期间被释放，用 QPointer 跳过
+    QList < QPointer<ClientSocket> > m_ready;
+    bool    m_bTurnPending;
+
+private slots:
+    void SltRunTurn();
+};
+
+#endif // READSCHEDULER_H
@@ -0,0 +1,48 @@
+# 服务核心：网络、数据库、消息路由，只依赖 QtCore/QtNetwork/QtSql
+# 带管理界面的 ChatServer.pro 与无界面的 ChatServerd.pro 共用
+
+INCLUDEPATH += $$PWD
+
+SOURCES += \
+    $$PWD/myapp.cpp \
+    $$PWD/databasemagr.cpp \
+    $$PWD/clientsocket.cpp \
+    $$PWD/tcpserver.cpp \
+    $$PWD/msgworker.cpp \
+    $$PWD/presencemagr.cpp \
+    $$PWD/framecodec.cpp \
+    $$PWD/msgcodec.cpp \
+    $$PWD/dbworker.cpp \
+    $$PWD/serverbootstrap.cpp \
+    $$PWD/logger.cpp \
+    $$PWD/metrics.cpp \
+    $$PWD/msgtrace.cpp \
+    $$PWD/timingwheel.cpp \
+    $$PWD/ratelimit.cpp \
+    $$PWD/readscheduler.cpp \
+    $$PWD/filetransfer.cpp \
+    $$PWD/filerelay.cpp \
+    $$PWD/blobstore.cpp
+
+HEADERS += \
+    $$PWD/myapp.h \
+    $$PWD/databasemagr.h \
+    $$PWD/clientsocket.h \
+    $$PWD/tcpserver.h \
+    $$PWD/msgworker.h \
+    $$PWD/presencemagr.h \
+    $$PWD/framecodec.h \
+    $$PWD/msgcodec.h \
+    $$PWD/protocol.h \
+    $$PWD/dbworker.h \
+    $$PWD/serverbootstrap.h \
+    $$PWD/logger.h \
+    $$PWD/metrics.h \
+    $$PWD/msgtrace.h \
+    $$PWD/timingwheel.h \
+    $$PWD/ratelimit.h \
+    $$PWD/readscheduler.h \
+    $$PWD/filetransfer.h \
+    $$PWD/filerelay.h \
+    $$PWD/blobstore.h \
+    $$PWD/unit.h
@@ -0,0 +1,194 @@
+#include "serverbootstrap.h"
+#include "tcpserver.h"
+#include "databasemagr.h"
+#include "dbworker.h"
+#include "presencemagr.h"
+#include "myapp.h"
+#include "logger.h"
+#include "metrics.h"
+#include "ratelimit.h"
+#include "filetransfer.h"
+
+#include <QFile>
+#include <QDebug>
+
+#include <algorithm>
+
+// 指标中按用户输出发送队列的人数（积压最多的），避免在线人数多时输出过大
+#define METRICS_TOP_QUEUES  20
+
+ServerBootstrap::ServerBootstrap(QObject *parent) :
+    QObject(parent),
+    m_msgServer(NULL),
+    m_fileServer(NULL),
+    m_metricsServer(NULL),
+    m_bMsgListening(false),
+    m_bFileListening(false)
+{
+}
+
+ServerBootstrap::~ServerBootstrap()
+{
+    Stop();
+}
+
+/**
+ * @brief ServerBootstrap::Start
+ * @return
+ */
+bool ServerBootstrap::Start()
+{
+    if (NULL != m_msgServer) return (m_bMsgListening && m_bFileListening);
+
+    // 日志最先启动，后面的输出都经过写入线程
+    Logger::Configure(MyApp::m_strLogLevel, MyApp::m_strLogModules);
+    Logger::Instance()->Start(MyApp::m_strLogPath + "server.log",
+                              qint64(MyApp::m_nLogMaxFileKB) * 1024, MyApp::m_nLogMaxFiles, MyApp::m_bLogConsole);
+
+    // 加载数据库
+    if (!DataBaseMagr::Instance()->OpenDb(MyApp::m_strDatabasePath + "info.db")) {
+        LOG_ERROR(LogDb) << "open database failed" << MyApp::m_strDatabasePath;
+    }
+
+    // 连接相关的数据库读写都在数据库线程中执行
+    DbWorker::Instance()->Start();
+
+    // 在线状态只在内存中维护，最后在线时间按配置批量写回
+    if (MyApp::m_bPersistLastSeen) {
+        PresenceMagr::Instance()->StartPersist(MyApp::m_nLastSeenFlushMs);
+    }
+
+    // 限流配置在接受连接之前设置，运行中不再修改
+    RateLimiter::Configure(MyApp::m_bRateLimit, MyApp::m_strRateBuckets);
+    RateLimiter::ConfigureLogin(MyApp::m_nMaxPendingLogins, MyApp::m_nLoginsPerSec);
+
+    m_msgServer = new TcpMsgServer(this);
+    m_bMsgListening = m_msgServer->StartListen(MyApp::m_nMsgPort);
+    LOG_INFO(LogNet) << "msg server listen" << MyApp::m_nMsgPort << m_bMsgListening;
+
+    // 对方不再续传的未完成文件，启动时按修改时间清理
+    if (MyApp::m_nFilePartKeepDays > 0) {
+        int nRemoved = PartFile::PurgeStale(MyApp::m_strRecvPath, MyApp::m_nFilePartKeepDays) +
+                PartFile::PurgeStale(MyApp::m_strHeadPath, MyApp::m_nFilePartKeepDays);
+        if (nRemoved > 0) LOG_INFO(LogFile) << "purge stale part files" << nRemoved;
+    }
+
+    m_fileServer = new TcpFileServer(this);
+    m_bFileListening = m_fileServer->StartListen(MyApp::m_nFilePort);
+    LOG_INFO(LogNet) << "file server listen" << MyApp::m_nFilePort << m_bFileListening;
+
+    // 指标抓取端口，只监听本机；失败不影响服务
+    if (MyApp::m_nMetricsPort > 0) {
+        m_metricsServer = new MetricsServer(this);
+        m_metricsServer->SetCollector([this](QByteArray &out) {
+            // 积压或丢过帧的用户按积压字节数排序，取前 METRICS_TOP_QUEUES 个
+            qint64 nQueued = 0;
+            QList< QPair<int, QueueStat> > busy;
+            QHash<int, QueueStat> stats = m_msgServer->GetQueueStats();
+            QHash<int, QueueStat>::const_iterator it = stats.constBegin();
+            for (; it != stats.constEnd(); ++it) {
+                nQueued += it.value().depth;
+                if (it.value().depth > 0 || it.value().dropped > 0) busy.append(qMakePair(it.key(), it.value()));
+            }
+            std::sort(busy.begin(), busy.end(),
+                      [](const QPair<int, QueueStat> &a, const QPair<int, QueueStat> &b) {
+                return a.second.depth != b.second.depth ? a.second.depth > b.second.depth :
+                                                          a.second.dropped > b.second.dropped;
+            });
+
+            QList< QPair<int, qint64> > userDepths;
+            QList< QPair<int, qint64> > userDropped;
+            for (int i = 0; i < busy.size() && i < METRICS_TOP_QUEUES; i++) {
+                userDepths.append(qMakePair(busy.at(i).first, qint64(busy.at(i).second.depth)));
+                userDropped.append(qMakePair(busy.at(i).first, qint64(busy.at(i).second.dropped)));
+            }
+
+            Metrics::AppendGauge(out, "chat_online_users", "Users online", PresenceMagr::Instance()->GetOnlineCount());
+            Metrics::AppendGauge(out, "chat_outbound_queued_bytes", "Bytes waiting in outbound queues", nQueued);
+            Metrics::AppendUserGauge(out, "chat_user_outbound_queued_bytes",
+                                     "Bytes waiting in the outbound queue of the most backlogged users", userDepths);
+            Metrics::AppendUserGauge(out, "chat_user_outbound_dropped_frames",
+                                     "Frames dropped under congestion on the current connection of the most backlogged users", userDropped);
+            Metrics::AppendGauge(out, "chat_db_pending_tasks", "Tasks waiting for the database thread", DbWorker::Instance()->PendingCount());
+            Metrics::AppendGauge(out, "chat_logins_pending", "Logins waiting for database verification", RateLimiter::PendingLogins());
+        });
+        bool bOk = m_metricsServer->StartListen(MyApp::m_nMetricsPort);
+        LOG_INFO(LogNet) << "metrics listen 127.0.0.1" << MyApp::m_nMetricsPort << bOk;
+    }
+
+    connect(m_msgServer, SIGNAL(signalDownloadFile(QJsonValue)), m_fileServer, SLOT(SltClientDownloadFile(QJsonValue)));
+    connect(m_msgServer, SIGNAL(signalUserStatus(QString)), this, SIGNAL(signalUserStatus(QString)));
+    connect(m_fileServer, SIGNAL(signalUserStatus(QString)), this, SIGNAL(signalUserStatus(QString)));
+
+    return (m_bMsgListening && m_bFileListening);
+}
+
+/**
+ * @brief ServerBootstrap::Stop
+ */
+void ServerBootstrap::Stop()
+{
+    if (NULL == m_msgServer) return;
+
+    delete m_metricsServer;
+    m_metricsServer = NULL;
+    delete m_msgServer;
+    m_msgServer = NULL;
+    delete m_fileServer;
+    m_fileServer = NULL;
+    m_bMsgListening = false;
+    m_bFileListening = false;
+
+    // 连接全部关闭后，执行完剩余的数据库任务并提交合并写入
+    DbWorker::Instance()->Stop();
+    DataBaseMagr::Instance()->DumpStatementStats();
+
+    // 写完剩余日志
+    Logger::Instance()->Stop();
+}
+
+TcpMsgServer *ServerBootstrap::MsgServer() const
+{
+    return m_msgServer;
+}
+
+TcpFileServer *ServerBootstrap::FileServer() const
+{
+    return m_fileServer;
+}
+
+bool ServerBootstrap::IsMsgListening() const
+{
+    return m_bMsgListening;
+}
+
+bool ServerBootstrap::IsFileListening() const
+{
+    return m_bFileListening;
+}
+
+/**
+ * @brief ServerBootstrap::ResidentMemoryKB
+ * Linux 下读取 /proc/self/status 的 VmRSS
+ * @return
+ */
+qint64 ServerBootstrap::ResidentMemoryKB()
+{
+#ifdef Q_OS_LINUX
+    QFile file("/proc/self/status");
+    if (!file.open(QIODevice::ReadOnly | QIODevice::Text)) return -1;
+
+    while (!file.atEnd()) {
+        QByteArray line = file.readLine();
+        if (line.startsWith("VmRSS:")) {
+            return line.mid(6).trimmed().split(' ').first().toLongLong();
+        }
+    }
+#endif
+    return -1;
+}
+
+void ServerBootstrap::ReportStartup(const QString &mode, const qint64 &elapsedMs)
+{
+    LOG_INFO(LogSys) << "startup" << mode << elapsedMs << "ms" << "rss" << ResidentMemoryKB() << "KB";
+}
@@ -0,0 +1,48 @@
+#ifndef SERVERBOOTSTRAP_H
+#define SERVERBOOTSTRAP_H
+
+#include <QObject>
+
+class TcpMsgServer;
+class TcpFileServer;
+class MetricsServer;
+
+/////////////////////////////////////////////////////////////////
+/// \brief The ServerBootstrap class
+/// 服务启动与关闭：打开数据库、启动数据库线程、按配置端口启动消息和文件服务器。
+/// 只依赖 QtCore/QtNetwork/QtSql，后台守护进程和带管理界面的程序共用
+class ServerBootstrap : public QObject
+{
+    Q_OBJECT
+public:
+    explicit ServerBootstrap(QObject *parent = 0);
+    ~ServerBootstrap();
+
+    // 任意一个服务监听失败返回 false
+    bool Start();
+    // 先关闭所有连接，再执行完剩余的数据库任务
+    void Stop();
+
+    TcpMsgServer *MsgServer() const;
+    TcpFileServer *FileServer() const;
+
+    bool IsMsgListening() const;
+    bool IsFileListening() const;
+
+    // 当前进程常驻内存（KB），不支持的平台返回 -1
+    static qint64 ResidentMemoryKB();
+    // 输出启动耗时与常驻内存
+    static void ReportStartup(const QString &mode, const qint64 &elapsedMs);
+
+signals:
+    void signalUserStatus(const QString &text);
+
+private:
+    TcpMsgServer    *m_msgServer;
+    TcpFileServer   *m_fileServer;
+    MetricsServer   *m_metricsServer;
+    bool            m_bMsgListening;
+    bool            m_bFileListening;
+};
+
+#endif // SERVERBOOTSTRAP_H
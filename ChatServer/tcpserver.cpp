@@ -1,10 +1,45 @@
 #include "tcpserver.h"
 #include "clientsocket.h"
+#include "msgworker.h"
 #include "unit.h"
+#include "myapp.h"
 #include "databasemagr.h"
+#include "logger.h"
+#include "timingwheel.h"
+#include "readscheduler.h"
 
 #include <QHostAddress>
 
+///////////////////////////////////////////////////////////////////////////////
+/// \brief TcpListener::TcpListener
+/// \param parent
+///
+TcpListener::TcpListener(QObject *parent) :
+    QTcpServer(parent),
+    m_bDispatch(false)
+{
+}
+
+void TcpListener::SetDispatchDescriptor(bool bDispatch)
+{
+    m_bDispatch = bDispatch;
+}
+
+/**
+ * @brief TcpListener::incomingConnection
+ * 多线程模式下直接把描述符发出去，由工作线程创建 socket
+ * @param handle
+ */
+void TcpListener::incomingConnection(qintptr handle)
+{
+    if (m_bDispatch) {
+        Q_EMIT signalNewDescriptor(handle);
+        return;
+    }
+
+    QTcpServer::incomingConnection(handle);
+}
+
 ///////////////////////////////////////////////////////////////////////////////
 /// \brief TcpMsgServer::TcpMsgServer
 /// \param parent
@@ -12,7 +47,7 @@
 TcpServer::TcpServer(QObject *parent) :
     QObject(parent)
 {
-    m_tcpServer = new QTcpServer(this);
+    m_tcpServer = new TcpListener(this);
 
     connect(m_tcpServer, SIGNAL(newConnection()), this, SLOT(SltNewConnection()));
 }
@@ -48,87 +83,287 @@ void TcpServer::CloseListen()
 ///////////////////////////////////////////////////////////////////////////////
 /// \brief TcpMsgServer::TcpMsgServer
 /// \param parent
-///
+/// 配置了工作线程数（[Server] WorkerThreads > 0）时，连接按轮询分配到各工作线程，
+/// 否则所有连接都在当前线程处理
 TcpMsgServer::TcpMsgServer(QObject *parent) :
-    TcpServer(parent)
+    TcpServer(parent),
+    m_nNextWorker(0),
+    m_idleWheel(NULL),
+    m_readScheduler(NULL)
 {
+    if (MyApp::m_nWorkerThreads > 0) {
+        StartWorkers(MyApp::m_nWorkerThreads);
+    }
 }
 
 TcpMsgServer::~TcpMsgServer()
 {
-    qDebug() << "tcp server close";
-    foreach (ClientSocket *client, m_clients) {
-        m_clients.removeOne(client);
-        client->Close();
+    LOG_INFO(LogNet) << "tcp server close";
+    StopWorkers();
+
+    QList<ClientEntry> clients;
+    {
+        QWriteLocker locker(&m_lock);
+        clients = m_clients.values();
+        m_clients.clear();
+    }
+    foreach (const ClientEntry &entry, clients) {
+        entry.client->Close();
+    }
+}
+
+/**
+ * @brief TcpMsgServer::StartWorkers
+ * 启动 I/O 工作线程，每个线程一个事件循环
+ * @param count
+ */
+void TcpMsgServer::StartWorkers(int count)
+{
+    qRegisterMetaType<qintptr>("qintptr");
+
+    for (int i = 0; i < count; i++) {
+        QThread *thread = new QThread(this);
+        MsgWorker *worker = new MsgWorker(this);
+        worker->moveToThread(thread);
+        thread->start();
+
+        m_threads.push_back(thread);
+        m_workers.push_back(worker);
+    }
+
+    m_tcpServer->SetDispatchDescriptor(true);
+    connect(m_tcpServer, SIGNAL(signalNewDescriptor(qintptr)), this, SLOT(SltNewDescriptor(qintptr)));
+    LOG_INFO(LogSys) << "msg server worker threads" << count;
+}
+
+/**
+ * @brief TcpMsgServer::StopWorkers
+ * 关闭工作线程上的连接并退出线程
+ */
+void TcpMsgServer::StopWorkers()
+{
+    for (int i = 0; i < m_workers.size(); i++) {
+        QMetaObject::invokeMethod(m_workers.at(i), "SltCloseAll", Qt::BlockingQueuedConnection);
+        m_threads.at(i)->quit();
+        m_threads.at(i)->wait();
+        delete m_workers.at(i);
     }
+
+    m_workers.clear();
+    m_threads.clear();
 }
 
 // 有新的客户端连接进来
 void TcpMsgServer::SltNewConnection()
 {
     ClientSocket *client = new ClientSocket(this, m_tcpServer->nextPendingConnection());
-    connect(client, SIGNAL(signalConnected()), this, SLOT(SltConnected()));
-    connect(client, SIGNAL(signalDisConnected()), this, SLOT(SltDisConnected()));
+    AttachClient(client);
+    // 先下线再释放，工作线程模式由 MsgWorker 释放
+    connect(client, SIGNAL(signalDisConnected()), client, SLOT(deleteLater()));
+
+    if (MyApp::m_nIdleTimeoutSec > 0) {
+        if (NULL == m_idleWheel) m_idleWheel = new TimingWheel(1000, this);
+        client->WatchIdle(m_idleWheel);
+    }
+
+    if (MyApp::m_nReadBudget > 0) {
+        if (NULL == m_readScheduler) m_readScheduler = new ReadScheduler(MyApp::m_nReadBudget, this);
+        client->SetReadScheduler(m_readScheduler);
+    }
+}
+
+/**
+ * @brief TcpMsgServer::SltNewDescriptor
+ * 多线程模式，轮询分配给工作线程
+ * @param handle
+ */
+void TcpMsgServer::SltNewDescriptor(qintptr handle)
+{
+    if (m_workers.isEmpty()) return;
+
+    MsgWorker *worker = m_workers.at(m_nNextWorker);
+    m_nNextWorker = (m_nNextWorker + 1) % m_workers.size();
+
+    QMetaObject::invokeMethod(worker, "SltAddDescriptor", Qt::QueuedConnection, Q_ARG(qintptr, handle));
+}
+
+/**
+ * @brief TcpMsgServer::GetQueueStats
+ * 各在线用户发送队列的积压字节数与丢帧数，用于观察慢客户端
+ * @return
+ */
+QHash<int, QueueStat> TcpMsgServer::GetQueueStats() const
+{
+    QHash<int, QueueStat> stats;
+
+    QReadLocker locker(&m_lock);
+    QHash<int, ClientEntry>::const_iterator it = m_clients.constBegin();
+    for (; it != m_clients.constEnd(); ++it) {
+        QueueStat stat;
+        stat.depth = it.value().client->GetQueueDepth();
+        stat.dropped = it.value().client->GetDroppedCount();
+        stats.insert(it.key(), stat);
+    }
+
+    return stats;
+}
+
+/**
+ * @brief TcpMsgServer::AttachClient
+ * 在连接所在线程中调用，所有信号都直连，路由在发送方线程完成
+ * @param client
+ */
+void TcpMsgServer::AttachClient(ClientSocket *client)
+{
+    // 直连时 sender() 在跨线程场景下不可用，这里直接捕获 client
+    connect(client, &ClientSocket::signalConnected, this, [this, client]() {
+        ClientLogin(client);
+    }, Qt::DirectConnection);
+    connect(client, &ClientSocket::signalDisConnected, this, [this, client]() {
+        ClientLogout(client);
+    }, Qt::DirectConnection);
+
+    connect(client, SIGNAL(signalMsgToClient(quint8,int,QJsonValue)),
+            this, SLOT(SltMsgToClient(quint8,int,QJsonValue)), Qt::DirectConnection);
+    connect(client, SIGNAL(signalFrameToClients(QVector<int>,QByteArray,QByteArray)),
+            this, SLOT(SltFrameToClients(QVector<int>,QByteArray,QByteArray)), Qt::DirectConnection);
+    connect(client, SIGNAL(signalDownloadFile(QJsonValue)), this, SIGNAL(signalDownloadFile(QJsonValue)), Qt::DirectConnection);
 }
 
 /**
  * @brief TcpMsgServer::SltConnected
- * 通过验证后，才可以加入容器进行管理
  */
 void TcpMsgServer::SltConnected()
 {
-    ClientSocket *client = (ClientSocket *)this->sender();
+    ClientLogin(qobject_cast<ClientSocket *>(this->sender()));
+}
+
+/**
+ * @brief TcpMsgServer::SltDisConnected
+ */
+void TcpMsgServer::SltDisConnected()
+{
+    ClientLogout(qobject_cast<ClientSocket *>(this->sender()));
+}
+
+/**
+ * @brief TcpMsgServer::ClientLogin
+ * 通过验证后，才可以加入容器进行管理
+ * @param client
+ */
+void TcpMsgServer::ClientLogin(ClientSocket *client)
+{
     if (NULL == client) return;
 
-    connect(client, SIGNAL(signalMsgToClient(quint8,int,QJsonValue)),
-            this, SLOT(SltMsgToClient(quint8,int,QJsonValue)));
-    connect(client, SIGNAL(signalDownloadFile(QJsonValue)), this, SIGNAL(signalDownloadFile(QJsonValue)));
+    ClientEntry entry;
+    entry.client = client;
+    entry.worker = qobject_cast<MsgWorker *>(client->parent());
+
+    {
+        QWriteLocker locker(&m_lock);
+        m_clients.insert(client->GetUserId(), entry);
+    }
 
-    Q_EMIT signalUserStatus(QString("用户 [%1] 上线").arg(DataBaseMagr::Instance()->GetUserName(client->GetUserId())));
-    m_clients.push_back(client);
+    Q_EMIT signalUserStatus(QString("用户 [%1] 上线").arg(client->GetUserName()));
 }
 
 /**
- * @brief TcpMsgServer::SltDisConnected
+ * @brief TcpMsgServer::ClientLogout
  * 有客户端下线
+ * @param client
  */
-void TcpMsgServer::SltDisConnected()
+void TcpMsgServer::ClientLogout(ClientSocket *client)
 {
-    ClientSocket *client = (ClientSocket *)this->sender();
     if (NULL == client) return;
 
-    for (int i = 0; i < m_clients.size(); i++) {
-        if (client == m_clients.at(i))
+    // 同一个用户可能已经用新连接登录，只移除自己
+    int nId = client->GetUserId();
+    bool bRemoved = false;
+    {
+        QWriteLocker locker(&m_lock);
+        if (m_clients.contains(nId) && m_clients.value(nId).client == client)
         {
-            m_clients.remove(i);
-            Q_EMIT signalUserStatus(QString("用户 [%1] 下线").arg(DataBaseMagr::Instance()->GetUserName(client->GetUserId())));
-            return;
+            m_clients.remove(nId);
+            bRemoved = true;
         }
     }
 
-    disconnect(client, SIGNAL(signalConnected()), this, SLOT(SltConnected()));
-    disconnect(client, SIGNAL(signalDisConnected()), this, SLOT(SltDisConnected()));
-    disconnect(client, SIGNAL(signalMsgToClient(quint8,int,QJsonValue)),
-               this, SLOT(SltMsgToClient(quint8,int,QJsonValue)));
-    disconnect(client, SIGNAL(signalDownloadFile(QJsonValue)), this, SIGNAL(signalDownloadFile(QJsonValue)));
+    if (bRemoved) {
+        Q_EMIT signalUserStatus(QString("用户 [%1] 下线").arg(client->GetUserName()));
+    }
+}
+
+/**
+ * @brief TcpMsgServer::DeliverMessage
+ * 目标连接在当前线程直接发送，否则投递到目标线程的信箱
+ * 跨线程时不解引用 client，由目标线程确认其仍然有效
+ */
+void TcpMsgServer::DeliverMessage(const ClientEntry &entry, const int &id, const quint8 &type, const QJsonValue &json)
+{
+    if (NULL == entry.worker || entry.worker->thread() == QThread::currentThread()) {
+        entry.client->SltSendMessage(type, json);
+        return;
+    }
+
+    entry.worker->Post(entry.client, id, type, json);
+}
+
+/**
+ * @brief TcpMsgServer::DeliverFrame
+ * 投递已编码的帧
+ */
+void TcpMsgServer::DeliverFrame(const ClientEntry &entry, const int &id, const QByteArray &frame, const QByteArray &cborFrame)
+{
+    if (NULL == entry.worker || entry.worker->thread() == QThread::currentThread()) {
+        entry.client->SendPacked(frame, cborFrame);
+        return;
+    }
+
+    entry.worker->PostFrame(entry.client, id, frame, cborFrame);
 }
 
 /**
  * @brief TcpMsgServer::SltMsgToClient
- * 消息转发控制
+ * 消息转发控制，在发送方所在线程执行
  * @param userId
  * @param msg
  */
 void TcpMsgServer::SltMsgToClient(const quint8 &type, const int &id, const QJsonValue &json)
 {
     // 查找要发送过去的id
-    for (int i = 0; i < m_clients.size(); i++) {
-        if (id == m_clients.at(i)->GetUserId())
-        {
-            m_clients.at(i)->SltSendMessage(type, json);
-            return;
+    ClientEntry entry;
+    {
+        QReadLocker locker(&m_lock);
+        QHash<int, ClientEntry>::const_iterator it = m_clients.constFind(id);
+        if (it == m_clients.constEnd()) return;
+        entry = it.value();
+    }
+
+    DeliverMessage(entry, id, type, json);
+}
+
+/**
+ * @brief TcpMsgServer::SltFrameToClients
+ * 同一帧发给多个用户，一次加锁查出所有在线目标，每个目标只是一次引用计数
+ * @param ids
+ * @param frame
+ * @param cborFrame
+ */
+void TcpMsgServer::SltFrameToClients(const QVector<int> &ids, const QByteArray &frame, const QByteArray &cborFrame)
+{
+    QVector<QPair<int, ClientEntry> > targets;
+    targets.reserve(ids.size());
+    {
+        QReadLocker locker(&m_lock);
+        for (int i = 0; i < ids.size(); i++) {
+            QHash<int, ClientEntry>::const_iterator it = m_clients.constFind(ids.at(i));
+            if (it != m_clients.constEnd()) targets.append(qMakePair(ids.at(i), it.value()));
         }
     }
+
+    for (int i = 0; i < targets.size(); i++) {
+        DeliverFrame(targets.at(i).second, targets.at(i).first, frame, cborFrame);
+    }
 }
 
 /**
@@ -138,14 +373,7 @@ void TcpMsgServer::SltMsgToClient(const quint8 &type, const int &id, const QJson
  */
 void TcpMsgServer::SltTransFileToClient(const int &userId, const QJsonValue &json)
 {
-    // 查找要发送过去的id
-    for (int i = 0; i < m_clients.size(); i++) {
-        if (userId == m_clients.at(i)->GetUserId())
-        {
-            m_clients.at(i)->SltSendMessage(SendFile, json);
-            return;
-        }
-    }
+    SltMsgToClient(SendFile, userId, json);
 }
 
 
@@ -155,24 +383,37 @@ void TcpMsgServer::SltTransFileToClient(const int &userId, const QJsonValue &jso
 /// 文件中转服务器，客户端先把待转发的文件发送到服务器，服务器接受完成后，通知
 /// 其他客户端来下载
 TcpFileServer::TcpFileServer(QObject *parent) :
-    TcpServer(parent)
+    TcpServer(parent),
+    m_idleWheel(NULL)
 {
+    if (MyApp::m_nFileIdleTimeoutSec > 0) m_idleWheel = new TimingWheel(1000, this);
 }
 
 TcpFileServer::~TcpFileServer()
 {
-    qDebug() << "tcp server close";
-    foreach (ClientFileSocket *client, m_clients) {
-        m_clients.removeOne(client);
+    LOG_INFO(LogNet) << "tcp server close";
+    QList<ClientFileSocket *> clients = m_clients.values();
+    m_clients.clear();
+    foreach (ClientFileSocket *client, clients) {
         client->Close();
     }
 }
 
+/**
+ * @brief MakeKey
+ * 文件连接以 (用户id, 窗口id) 唯一确定
+ */
+static inline quint64 MakeKey(const qint32 &userId, const qint32 &winId)
+{
+    return (quint64(quint32(userId)) << 32) | quint32(winId);
+}
+
 void TcpFileServer::SltNewConnection()
 {
     ClientFileSocket *client = new ClientFileSocket(this, m_tcpServer->nextPendingConnection());
     connect(client, SIGNAL(signalConnected()), this, SLOT(SltConnected()));
     connect(client, SIGNAL(signalDisConnected()), this, SLOT(SltDisConnected()));
+    client->WatchIdle(m_idleWheel);
 }
 
 /**
@@ -184,7 +425,7 @@ void TcpFileServer::SltConnected()
     ClientFileSocket *client = (ClientFileSocket *)this->sender();
     if (NULL == client) return;
 
-    m_clients.push_back(client);
+    m_clients.insert(MakeKey(client->GetUserId(), client->GetWindowId()), client);
 }
 
 /**
@@ -195,16 +436,12 @@ void TcpFileServer::SltDisConnected()
     ClientFileSocket *client = (ClientFileSocket *)this->sender();
     if (NULL == client) return;
 
-    for (int i = 0; i < m_clients.size(); i++) {
-        if (client == m_clients.at(i))
-        {
-            m_clients.remove(i);
-            return;
-        }
-    }
+    quint64 key = MakeKey(client->GetUserId(), client->GetWindowId());
+    if (m_clients.value(key) == client) m_clients.remove(key);
 
     disconnect(client, SIGNAL(signalConnected()), this, SLOT(SltConnected()));
     disconnect(client, SIGNAL(signalDisConnected()), this, SLOT(SltDisConnected()));
+    client->deleteLater();
 }
 
 /**
@@ -219,14 +456,9 @@ void TcpFileServer::SltClientDownloadFile(const QJsonValue &json)
         qint32 nId = jsonObj.value("from").toInt();
         qint32 nWid = jsonObj.value("id").toInt();;
         QString fileName = jsonObj.value("msg").toString();
-        qDebug() << "get file" << jsonObj << m_clients.size();
-        for (int i = 0; i < m_clients.size(); i++) {
-            if (m_clients.at(i)->CheckUserId(nId, nWid))
-            {
-                m_clients.at(i)->StartTransferFile(fileName);
-                return;
-            }
-        }
+        LOG_DEBUG(LogFile) << "get file" << jsonObj << m_clients.size();
+
+        ClientFileSocket *client = m_clients.value(MakeKey(nId, nWid), NULL);
+        if (NULL != client) client->StartTransferFile(fileName);
     }
 }
-
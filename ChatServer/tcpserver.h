@@ -5,10 +5,41 @@
 #include <QTcpServer>
 #include <QTcpSocket>
 #include <QList>
+#include <QHash>
 #include <QVector>
+#include <QThread>
+#include <QReadWriteLock>
 
 #include "clientsocket.h"
 
+class MsgWorker;
+class TimingWheel;
+
+// 一个在线用户的发送队列状态
+struct QueueStat {
+    int     depth;      // 待发送字节数
+    int     dropped;    // 本次连接拥塞时丢弃的帧数
+};
+class ReadScheduler;
+
+//////////////////////////////////////////////////////////////////////
+/// \brief The TcpListener class
+/// 监听socket，多线程模式下不在监听线程创建 QTcpSocket，
+/// 而是把 socket 描述符交给工作线程
+class TcpListener : public QTcpServer {
+    Q_OBJECT
+public:
+    explicit TcpListener(QObject *parent = 0);
+
+    void SetDispatchDescriptor(bool bDispatch);
+signals:
+    void signalNewDescriptor(qintptr handle);
+protected:
+    void incomingConnection(qintptr handle) Q_DECL_OVERRIDE;
+private:
+    bool m_bDispatch;
+};
+
 //////////////////////////////////////////////////////////////////////
 /// \brief The TcpServer class
 /// 服务器管理类
@@ -23,7 +54,7 @@ public:
 signals:
     void signalUserStatus(const QString &text);
 protected:
-    QTcpServer *m_tcpServer;
+    TcpListener *m_tcpServer;
 
 public slots:
 
@@ -44,20 +75,51 @@ public:
     explicit TcpMsgServer(QObject *parent = 0);
     ~TcpMsgServer();
 
+    // 接管一个客户端连接（监听线程或工作线程中调用）
+    void AttachClient(ClientSocket *client);
+    // 各在线用户的待发送字节数与丢帧数
+    QHash<int, QueueStat> GetQueueStats() const;
+
 signals:
     void signalDownloadFile(const QJsonValue &json);
 
 private:
-    // 客户端管理
-    QVector < ClientSocket * > m_clients;
+    struct ClientEntry {
+        ClientSocket *client;
+        // 所在工作线程，单线程模式为 NULL
+        MsgWorker    *worker;
+    };
+
+    // 客户端管理，按用户id索引，路由时直接查表
+    // 多线程模式下各工作线程都会读写，需要加锁
+    QHash < int, ClientEntry > m_clients;
+    mutable QReadWriteLock m_lock;
+
+    // I/O 工作线程
+    QVector < QThread * >   m_threads;
+    QVector < MsgWorker * > m_workers;
+    int                     m_nNextWorker;
+    // 单线程模式的空闲检测，工作线程各自有一个
+    TimingWheel            *m_idleWheel;
+    ReadScheduler          *m_readScheduler;
+
+    void StartWorkers(int count);
+    void StopWorkers();
+    void ClientLogin(ClientSocket *client);
+    void ClientLogout(ClientSocket *client);
+    // 投递消息：同线程直接发送，跨线程放入目标线程的信箱
+    void DeliverMessage(const ClientEntry &entry, const int &id, const quint8 &type, const QJsonValue &json);
+    void DeliverFrame(const ClientEntry &entry, const int &id, const QByteArray &frame, const QByteArray &cborFrame);
 public slots:
     void SltTransFileToClient(const int &userId, const QJsonValue &json);
 
 private slots:
     void SltNewConnection();
+    void SltNewDescriptor(qintptr handle);
     void SltConnected();
     void SltDisConnected();
     void SltMsgToClient(const quint8 &type, const int &id, const QJsonValue &json);
+    void SltFrameToClients(const QVector<int> &ids, const QByteArray &frame, const QByteArray &cborFrame);
 };
 
 ////////////////////////////////////////////////////////////////
@@ -71,8 +133,9 @@ public :
 signals:
     void signalRecvFinished(int id, const QJsonValue &json);
 private:
-    // 客户端管理
-    QVector < ClientFileSocket * > m_clients;
+    // 客户端管理，按 (用户id, 窗口id) 索引
+    QHash < quint64, ClientFileSocket * > m_clients;
+    TimingWheel *m_idleWheel;
 
 private slots:
     void SltNewConnection();
@@ -0,0 +1,166 @@
+#include "timingwheel.h"
+
+#include <QTimer>
+
+WheelNode::WheelNode() :
+    m_prev(NULL),
+    m_next(NULL),
+    m_nExpire(0)
+{
+}
+
+WheelNode::~WheelNode()
+{
+    Unlink();
+}
+
+bool WheelNode::IsArmed() const
+{
+    return NULL != m_next;
+}
+
+void WheelNode::Unlink()
+{
+    if (NULL == m_next) return;
+
+    m_prev->m_next = m_next;
+    m_next->m_prev = m_prev;
+    m_prev = NULL;
+    m_next = NULL;
+}
+
+TimingWheel::TimingWheel(const int &tickMs, QObject *parent) :
+    QObject(parent),
+    m_nTickMs(qMax(1, tickMs)),
+    m_nTick(0)
+{
+    for (int i = 0; i < WHEEL_SLOTS; i++) {
+        m_level0[i].m_prev = m_level0[i].m_next = &m_level0[i];
+        m_level1[i].m_prev = m_level1[i].m_next = &m_level1[i];
+    }
+
+    m_clock.start();
+
+    m_timer = new QTimer(this);
+    m_timer->setInterval(m_nTickMs);
+    connect(m_timer, SIGNAL(timeout()), this, SLOT(SltTick()));
+    m_timer->start();
+}
+
+/**
+ * @brief TimingWheel::~TimingWheel
+ * 摘除所有定时器，之后节点析构不再访问本对象
+ */
+TimingWheel::~TimingWheel()
+{
+    WheelNode *levels[2] = { m_level0, m_level1 };
+    for (int n = 0; n < 2; n++) {
+        for (int i = 0; i < WHEEL_SLOTS; i++) {
+            WheelNode *head = &levels[n][i];
+            while (head->m_next != head) head->m_next->Unlink();
+            head->m_prev = head->m_next = NULL;
+        }
+    }
+}
+
+qint64 TimingWheel::NowMs()
+{
+    struct Clock {
+        QElapsedTimer timer;
+        Clock() { timer.start(); }
+    };
+
+    static const Clock clock;
+    return clock.timer.elapsed();
+}
+
+/**
+ * @brief TimingWheel::Arm
+ * 不足一个节拍按一个节拍算
+ * @param node
+ * @param delayMs
+ */
+void TimingWheel::Arm(WheelNode *node, const qint64 &delayMs)
+{
+    node->Unlink();
+
+    qint64 nTicks = qMax(Q_INT64_C(1), (delayMs + m_nTickMs - 1) / m_nTickMs);
+    node->m_nExpire = m_nTick + nTicks;
+    Place(node);
+}
+
+void TimingWheel::Link(WheelNode *head, WheelNode *node)
+{
+    node->m_prev = head->m_prev;
+    node->m_next = head;
+    head->m_prev->m_next = node;
+    head->m_prev = node;
+}
+
+/**
+ * @brief TimingWheel::Place
+ * 64 个节拍内放第一层，否则放第二层；超出两层范围的按上限
+ * @param node
+ */
+void TimingWheel::Place(WheelNode *node)
+{
+    qint64 nDelta = node->m_nExpire - m_nTick;
+    if (nDelta < WHEEL_SLOTS) {
+        Link(&m_level0[node->m_nExpire & WHEEL_MASK], node);
+        return;
+    }
+
+    if (nDelta >= WHEEL_SLOTS * WHEEL_SLOTS) node->m_nExpire = m_nTick + WHEEL_SLOTS * WHEEL_SLOTS - 1;
+    Link(&m_level1[(node->m_nExpire >> WHEEL_BITS) & WHEEL_MASK], node);
+}
+
+/**
+ * @brief TimingWheel::Advance
+ * 前进一个节拍：先把第二层到期的槽下放，再执行第一层当前槽。
+ * 当前槽先整体移到临时链表，回调中布置或取消其他定时器都是安全的
+ */
+void TimingWheel::Advance()
+{
+    m_nTick++;
+    int nIndex = int(m_nTick & WHEEL_MASK);
+
+    if (0 == nIndex) {
+        WheelNode *head = &m_level1[(m_nTick >> WHEEL_BITS) & WHEEL_MASK];
+        while (head->m_next != head) {
+            WheelNode *node = head->m_next;
+            node->Unlink();
+            Place(node);
+        }
+    }
+
+    WheelNode expired;
+    expired.m_prev = expired.m_next = &expired;
+    WheelNode *head = &m_level0[nIndex];
+    while (head->m_next != head) {
+        WheelNode *node = head->m_next;
+        node->Unlink();
+        Link(&expired, node);
+    }
+
+    while (expired.m_next != &expired) {
+        WheelNode *node = expired.m_next;
+        node->Unlink();
+        if (node->m_nExpire > m_nTick) {
+            Place(node);
+        } else if (node->callback) {
+            node->callback();
+        }
+    }
+
+    expired.m_prev = expired.m_next = NULL;
+}
+
+/**
+ * @brief TimingWheel::SltTick
+ * 按实际经过的时间追赶节拍，事件循环被阻塞后不会少算
+ */
+void TimingWheel::SltTick()
+{
+    qint64 nTarget = m_clock.elapsed() / m_nTickMs;
+    while (m_nTick < nTarget) Advance();
+}
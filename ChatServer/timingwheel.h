@@ -0,0 +1,80 @@
+#ifndef TIMINGWHEEL_H
+#define TIMINGWHEEL_H
+
+#include <QObject>
+#include <QElapsedTimer>
+
+#include <functional>
+
+class QTimer;
+
+// 每层槽数，必须是 2 的幂
+#define WHEEL_BITS      6
+#define WHEEL_SLOTS     (1 << WHEEL_BITS)
+#define WHEEL_MASK      (WHEEL_SLOTS - 1)
+
+/////////////////////////////////////////////////////////////////
+/// \brief The WheelNode class
+/// 时间轮上的一个定时器，嵌在所属对象中，不单独分配内存。
+/// 析构时自动从时间轮上摘除
+class WheelNode
+{
+public:
+    WheelNode();
+    ~WheelNode();
+
+    bool IsArmed() const;
+    // 从所在的槽中摘除，O(1)
+    void Unlink();
+
+    // 到期回调，在时间轮所在线程调用
+    std::function<void ()>  callback;
+
+private:
+    friend class TimingWheel;
+
+    WheelNode   *m_prev;
+    WheelNode   *m_next;
+    qint64      m_nExpire;
+};
+
+/////////////////////////////////////////////////////////////////
+/// \brief The TimingWheel class
+/// 两层时间轮：第一层 64 个槽、每槽一个节拍，第二层 64 个槽、每槽 64 个节拍，
+/// 默认节拍 1 秒时可以定时到约 68 分钟，更长的按上限处理。
+/// 布置、重新布置、取消都是链表操作 O(1)；每个节拍只处理当前槽，
+/// 第一层转完一圈时把第二层的一个槽下放到第一层。
+/// 只能在所在线程使用，每个 I/O 线程一个
+class TimingWheel : public QObject
+{
+    Q_OBJECT
+public:
+    explicit TimingWheel(const int &tickMs = 1000, QObject *parent = 0);
+    ~TimingWheel();
+
+    // delayMs 后调用 node->callback，已布置的先摘除
+    void Arm(WheelNode *node, const qint64 &delayMs);
+
+    // 进程内单调时钟（毫秒），记录连接最后活动时间用
+    static qint64 NowMs();
+
+private:
+    QTimer          *m_timer;
+    QElapsedTimer   m_clock;
+    int             m_nTickMs;
+    // 已处理到的节拍
+    qint64          m_nTick;
+
+    // 各槽是带哨兵的双向循环链表
+    WheelNode       m_level0[WHEEL_SLOTS];
+    WheelNode       m_level1[WHEEL_SLOTS];
+
+    void Place(WheelNode *node);
+    void Advance();
+    static void Link(WheelNode *head, WheelNode *node);
+
+private slots:
+    void SltTick();
+};
+
+#endif // TIMINGWHEEL_H
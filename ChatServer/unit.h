@@ -10,8 +10,8 @@
 #include <QJsonDocument>
 #include <QJsonValue>
 
-#define MY_VERSION          0x01000001
-#define MY_VERSION_STR      "1.0.0.1"
+#define MY_VERSION          0x01000002
+#define MY_VERSION_STR      "1.0.0.2"
 
 // 版本检测
 #define VERSION_CHECK(a,b,c,d)  ((a << 24) | (b << 16) | (c << 8) | d)
@@ -156,9 +156,20 @@ typedef enum {
     Ping               = 0x70,
     Pong               = 0x71,
     Ack                = 0x72,     // 服务器端确认（入队/已转发）
+    OfflineMsgBatch    = 0x73,     // 离线消息分页推送
+    OfflineMsgAck,                 // 客户端确认已收到的离线消息（游标）
+    Throttled,                     // 请求超过限流被拒绝
 
 } E_MSG_TYPE;
 
+// 登录时客户端声明的能力（Login data.caps）
+#define CAP_OFFLINE_BATCH   "offline-batch"
+// 支持 CBOR 编码的消息信封，双方版本都不低于 CBOR_MIN_VERSION 时启用
+#define CAP_CBOR            "cbor"
+#define CBOR_MIN_VERSION    0x01000002
+// 私聊消息使用转发帧（固定头 + 原样转发的消息体）
+#define CAP_RELAY           "relay"
+
 typedef enum {
     ConnectedHost = 0x01,
     DisConnectedHost,
@@ -174,6 +185,8 @@ typedef enum {
 
     AddFriendOk,
     AddFriendFailed,
+
+    LoginBusy,          // 服务器繁忙，稍后重试
 } E_STATUS;
 
 #endif // UNIT